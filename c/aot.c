@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+#include "object.h"
+#include "vm.h"
+
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+// Lists the script and every function nested in it: the script first, then
+// each function constant in the order it appears in the pool, depth first.
+// The emitter and the generated program both number functions this way
+static void collectFunctions(FunctionList *list, ObjFunction *function) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction *, list->functions, oldCapacity,
+                                 list->capacity);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+// FNV-1a over the bytecode of every function in the list. The C code jumps
+// into that bytecode by offset, so the generated program checks it compiled
+// the script to exactly the same bytes
+static uint32_t hashCode(FunctionList *list) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < list->count; i++) {
+    Chunk *chunk = &list->functions[i]->chunk;
+    for (int offset = 0; offset < chunk->count; offset++) {
+      hash ^= chunk->code[offset];
+      hash *= 16777619;
+    }
+  }
+  return hash;
+}
+
+// Writes text out as a C string constant called name, one line of Lox per line
+// of C
+static void emitString(const char *name, const char *text, FILE *out) {
+  fprintf(out, "static const char %s[] =\n    \"", name);
+  for (const char *c = text; *c != '\0'; c++) {
+    switch (*c) {
+    case '\n':
+      fprintf(out, "\\n\"\n    \"");
+      break;
+    case '"':
+    case '\\':
+      fprintf(out, "\\%c", *c);
+      break;
+    default:
+      if (*c >= ' ' && *c <= '~') {
+        fputc(*c, out);
+      } else {
+        // Always three digits, so a digit after it can't be read as part of
+        // the escape
+        fprintf(out, "\\%03o", (unsigned char)*c);
+      }
+      break;
+    }
+  }
+  fprintf(out, "\";\n\n");
+}
+
+static void emitInstruction(Chunk *chunk, int offset, FILE *out) {
+  uint8_t *code = &chunk->code[offset];
+  int next = offset + instructionLength(chunk, offset);
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    fprintf(out, "push(constants[%d]);", code[1]);
+    break;
+  case OP_CONSTANT_LONG:
+    fprintf(out, "push(constants[%d]);",
+            code[1] | code[2] << 8 | code[3] << 16);
+    break;
+  case OP_NIL:
+    fprintf(out, "push(NIL_VAL);");
+    break;
+  case OP_TRUE:
+    fprintf(out, "push(BOOL_VAL(true));");
+    break;
+  case OP_FALSE:
+    fprintf(out, "push(BOOL_VAL(false));");
+    break;
+  case OP_POP:
+    fprintf(out, "vm.stackTop--;");
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "push(frame->slots[%d]);", code[1]);
+    break;
+  case OP_SET_LOCAL:
+    fprintf(out, "frame->slots[%d] = vm.stackTop[-1];", code[1]);
+    break;
+  case OP_GET_GLOBAL:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitGetGlobal, %d);", next, code[1]);
+    break;
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitDefineGlobal, %d);", next, code[1]);
+    break;
+  case OP_SET_GLOBAL:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitSetGlobal, %d);", next, code[1]);
+    break;
+  case OP_GET_UPVALUE:
+    fprintf(out, "push(*frame->closure->upvalues[%d]->location);", code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out, "*frame->closure->upvalues[%d]->location = vm.stackTop[-1];",
+            code[1]);
+    break;
+  case OP_EQUAL:
+    fprintf(out, "AOT_EQUAL();");
+    break;
+  case OP_GREATER:
+    fprintf(out, "AOT_BINARY(%d, BOOL_VAL, >, jitNumbersExpected);", next);
+    break;
+  case OP_LESS:
+    fprintf(out, "AOT_BINARY(%d, BOOL_VAL, <, jitNumbersExpected);", next);
+    break;
+  case OP_ADD:
+    fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, +, jitAdd);", next);
+    break;
+  case OP_SUBTRACT:
+    fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, -, jitNumbersExpected);", next);
+    break;
+  case OP_MULTIPLY:
+    fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, *, jitNumbersExpected);", next);
+    break;
+  case OP_DIVIDE:
+    fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, /, jitNumbersExpected);", next);
+    break;
+  case OP_NOT:
+    fprintf(out, "vm.stackTop[-1] = BOOL_VAL(AOT_FALSEY(vm.stackTop[-1]));");
+    break;
+  case OP_NEGATE:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitNegate, 0);", next);
+    break;
+  case OP_PRINT:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitPrint, 0);", next);
+    break;
+  case OP_JUMP:
+    fprintf(out, "goto offset%d;", next + (code[1] << 8 | code[2]));
+    break;
+  case OP_JUMP_IF_FALSE:
+    fprintf(out, "if (AOT_FALSEY(vm.stackTop[-1])) goto offset%d;",
+            next + (code[1] << 8 | code[2]));
+    break;
+  case OP_LOOP:
+    fprintf(out, "goto offset%d;", next - (code[1] << 8 | code[2]));
+    break;
+  case OP_CALL:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitCall, %d);", next, code[1]);
+    break;
+  case OP_CLOSE_UPVALUE:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitCloseUpvalue, 0);", next);
+    break;
+  case OP_RETURN:
+    fprintf(out, "AOT_SLOW_PATH(%d, jitReturn, 0);", next);
+    break;
+  default:
+    // Closures, classes, properties, tail calls: the interpreter takes over
+    fprintf(out, "AOT_EXIT(%d);", offset);
+    break;
+  }
+}
+
+static void emitFunction(ObjFunction *function, int index, FILE *out) {
+  Chunk *chunk = &function->chunk;
+
+  // Jump targets get labels, and they (and the start) are where the
+  // interpreter may enter the function
+  bool *isTarget = ALLOCATE(bool, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    isTarget[i] = i == 0;
+  }
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+        instruction == OP_LOOP) {
+      int distance = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+      isTarget[instruction == OP_LOOP ? offset + 3 - distance
+                                      : offset + 3 + distance] = true;
+    }
+  }
+
+  fprintf(out, "// %s\n", function->name != NULL ? function->name->chars
+                                                  : "<script>");
+  fprintf(out, "static int function%d(CallFrame *frame) {\n", index);
+  fprintf(out, "  uint8_t *code = frame->closure->function->chunk.code;\n");
+  fprintf(out, "  Value *constants = "
+               "frame->closure->function->chunk.constants.values;\n");
+  fprintf(out, "  (void)constants;\n\n");
+
+  fprintf(out, "  switch (frame->ip - code) {\n");
+  for (int offset = 0; offset < chunk->count; offset++) {
+    if (isTarget[offset]) {
+      fprintf(out, "  case %d:\n    goto offset%d;\n", offset, offset);
+    }
+  }
+  fprintf(out, "  default:\n    return JIT_EXIT;\n  }\n\n");
+
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isTarget[offset])
+      fprintf(out, "offset%d:\n", offset);
+    fprintf(out, "  ");
+    emitInstruction(chunk, offset, out);
+    fprintf(out, "\n");
+  }
+
+  // Every function ends with OP_RETURN, this just keeps the C compiler happy
+  fprintf(out, "  return JIT_ERROR;\n}\n\n");
+  FREE_ARRAY(bool, isTarget, chunk->count);
+}
+
+void emitC(ObjFunction *script, const char *path, const char *source,
+           FILE *out) {
+  // Nothing else refers to the script, keep it safe from the collector
+  push(OBJ_VAL(script));
+
+  FunctionList list;
+  list.functions = NULL;
+  list.count = 0;
+  list.capacity = 0;
+  collectFunctions(&list, script);
+
+  fprintf(out, "// Generated by clox --emit-c. See c/aot.h for how to build "
+               "it.\n\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+  emitString("path", path, out);
+  emitString("source", source, out);
+
+  for (int i = 0; i < list.count; i++) {
+    emitFunction(list.functions[i], i, out);
+  }
+
+  fprintf(out, "static AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    fprintf(out, "    function%d,\n", i);
+  }
+  fprintf(out, "};\n\n");
+  fprintf(out,
+          "int main() {\n"
+          "  return runAot(path, source, %d, %uu, functions, %d);\n"
+          "}\n",
+          vm.optimizeLevel, hashCode(&list), list.count);
+
+  FREE_ARRAY(ObjFunction *, list.functions, list.capacity);
+  pop();
+}
+
+// The generated program's main(). Returns the exit code
+int runAot(const char *path, const char *source, int optimizeLevel,
+           uint32_t codeHash, AotFunction *functions, int count) {
+  initVM();
+
+  // The bytecode has to come out exactly as it did for the clox that generated
+  // us, down to the peephole pass, since the C code jumps into it by offset
+  vm.optimizeLevel = optimizeLevel;
+  ObjFunction *script = loadProgram(path, source);
+  if (script == NULL)
+    return 65;
+
+  push(OBJ_VAL(script));
+  FunctionList list;
+  list.functions = NULL;
+  list.count = 0;
+  list.capacity = 0;
+  collectFunctions(&list, script);
+
+  // Can only happen if the runtime we're linked against compiles the script
+  // differently from the clox that generated us
+  if (list.count != count || hashCode(&list) != codeHash) {
+    fprintf(stderr, "Compiled code doesn't match the script.\n");
+    exit(70);
+  }
+
+  for (int i = 0; i < count; i++) {
+    list.functions[i]->aot = functions[i];
+  }
+  FREE_ARRAY(ObjFunction *, list.functions, list.capacity);
+  pop();
+
+  InterpretResult result = runScript(script);
+  freeVM();
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
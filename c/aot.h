@@ -0,0 +1,75 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// "clox --emit-c out.c script.lox" compiles the script as usual and then
+// writes every function's bytecode out as a C function. The result is a
+// complete program: build it together with the clox sources minus main.c,
+//
+//   cc -O3 -Ic out.c $(ls c/*.c | grep -v main.c) -o script
+//
+// and it runs the script with each function executing as compiled C.
+//
+// The script's source is embedded in the program, and at startup it's run
+// through the ordinary compiler once more, at the same -O level. That gives us
+// the same functions, constants and line numbers the C code was generated
+// from, and a bytecode body the interpreter can take over with wherever the C
+// code has to bail out (closures, classes, properties), exactly as it does for
+// JIT-compiled code. The compiled functions speak the JIT's protocol: they're
+// entered at frame->ip and return a JitStatus.
+//
+// The script's path is embedded too, and the program loads it the way clox
+// runs a file, so its imports are found next to where the script was. Only the
+// script itself is compiled to C. The modules it imports are read from disk
+// when the program starts and run as bytecode.
+
+void emitC(ObjFunction *script, const char *path, const char *source,
+           FILE *out);
+int runAot(const char *path, const char *source, int optimizeLevel,
+           uint32_t codeHash, AotFunction *functions, int count);
+
+// The generated code is written in terms of these. next is the bytecode
+// offset after the current instruction, where frame->ip points for error
+// reporting while a slow path runs
+#define AOT_SLOW_PATH(next, helper, operand)                                   \
+  do {                                                                         \
+    frame->ip = code + (next);                                                 \
+    JitStatus status = helper(frame, operand);                                 \
+    if (status != JIT_CONTINUE)                                                \
+      return status;                                                           \
+  } while (false)
+
+#define AOT_BINARY(next, valueType, op, slowPath)                              \
+  do {                                                                         \
+    Value *top = vm.stackTop;                                                  \
+    if (IS_NUMBER(top[-2]) && IS_NUMBER(top[-1])) {                            \
+      top[-2] = valueType(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1]));           \
+      vm.stackTop--;                                                           \
+    } else {                                                                   \
+      AOT_SLOW_PATH(next, slowPath, 0);                                        \
+    }                                                                          \
+  } while (false)
+
+#define AOT_EQUAL()                                                            \
+  do {                                                                         \
+    vm.stackTop--;                                                             \
+    vm.stackTop[-1] = BOOL_VAL(valuesEqual(vm.stackTop[-1], vm.stackTop[0]));  \
+  } while (false)
+
+#define AOT_FALSEY(value)                                                      \
+  (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#define AOT_EXIT(offset)                                                       \
+  do {                                                                         \
+    frame->ip = code + (offset);                                               \
+    return JIT_EXIT;                                                           \
+  } while (false)
+
+#endif
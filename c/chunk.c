@@ -1,8 +1,10 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void initChunk(Chunk *chunk) {
   chunk->count = 0;
@@ -11,28 +13,42 @@ void initChunk(Chunk *chunk) {
   chunk->lineCount = 0;
   chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
+  chunk->block = NULL;
+  chunk->blockSize = 0;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
-  freeValueArray(&chunk->constants);
+  if (chunk->block != NULL) {
+    reallocate(chunk->block, chunk->blockSize, 0);
+  } else {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    freeValueArray(&chunk->constants);
+  }
   initChunk(chunk);
 }
 
-void writeChunk(Chunk *chunk, uint8_t byte, int line) {
-  if (chunk->capacity < chunk->count + 1) {
-    int oldCapacity = chunk->capacity;
-    chunk->capacity = GROW_CAPACITY(oldCapacity);
-    chunk->code =
-        GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    // Don't grow line array here...
-  }
+// Makes room for count more bytes of code. Growing in one step, to at least
+// double, means a run of writes checks the capacity once
+static void reserveCode(Chunk *chunk, int count) {
+  if (chunk->capacity >= chunk->count + count)
+    return;
 
-  chunk->code[chunk->count] = byte;
-  chunk->count++;
+  int oldCapacity = chunk->capacity;
+  chunk->capacity = GROW_CAPACITY(oldCapacity);
+  if (chunk->capacity < chunk->count + count) {
+    chunk->capacity = chunk->count + count;
+  }
+  chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+}
 
+// Records that the bytes from offset on are on the given line
+static void addLine(Chunk *chunk, int offset, int line) {
   // See if we're still on the same line.
   if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
     return;
@@ -47,10 +63,86 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   }
 
   LineStart *lineStart = &chunk->lines[chunk->lineCount++];
-  lineStart->offset = chunk->count - 1;
+  lineStart->offset = offset;
   lineStart->line = line;
 }
 
+void writeChunk(Chunk *chunk, uint8_t byte, int line) {
+  reserveCode(chunk, 1);
+  chunk->code[chunk->count] = byte;
+  addLine(chunk, chunk->count, line);
+  chunk->count++;
+}
+
+// Appends a whole instruction at once. All of its bytes are on the same line,
+// so it takes a single line table check however long it is
+void writeBytes(Chunk *chunk, const uint8_t *bytes, int count, int line) {
+  reserveCode(chunk, count);
+  memcpy(&chunk->code[chunk->count], bytes, count);
+  addLine(chunk, chunk->count, line);
+  chunk->count += count;
+}
+
+void reserveChunk(Chunk *chunk, int capacity) {
+  if (chunk->capacity < capacity) {
+    chunk->code =
+        GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, capacity);
+    chunk->capacity = capacity;
+  }
+}
+
+#define CACHE_LINE 64
+#define ALIGN_UP(size, alignment)                                              \
+  (((size) + (alignment)-1) & ~(size_t)((alignment)-1))
+
+// Packs a finished chunk into a single block, without the slack growing the
+// arrays left: the code first, since the VM reads it the most, then the
+// constants and inline caches it reads along with it, and the line table,
+// which is only for errors, last. The block starts on a cache line
+void freezeChunk(Chunk *chunk) {
+  size_t codeSize = ALIGN_UP((size_t)chunk->count, 16);
+  size_t constantsSize = sizeof(Value) * chunk->constants.count;
+  size_t cachesSize = ALIGN_UP(sizeof(InlineCache) * chunk->cacheCount, 16);
+  size_t linesSize = sizeof(LineStart) * chunk->lineCount;
+
+  // Allocating can set off a collection, which still sees the old arrays
+  size_t blockSize =
+      CACHE_LINE - 1 + codeSize + constantsSize + cachesSize + linesSize;
+  void *block = reallocate(NULL, 0, blockSize);
+  uint8_t *next = (uint8_t *)ALIGN_UP((uintptr_t)block, CACHE_LINE);
+
+  uint8_t *code = next;
+  memcpy(code, chunk->code, chunk->count);
+  next += codeSize;
+  Value *constants = (Value *)next;
+  if (constantsSize > 0)
+    memcpy(constants, chunk->constants.values, constantsSize);
+  next += constantsSize;
+  InlineCache *caches = (InlineCache *)next;
+  if (chunk->cacheCount > 0)
+    memcpy(caches, chunk->caches, sizeof(InlineCache) * chunk->cacheCount);
+  next += cachesSize;
+  LineStart *lines = (LineStart *)next;
+  if (linesSize > 0)
+    memcpy(lines, chunk->lines, linesSize);
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+  FREE_ARRAY(Value, chunk->constants.values, chunk->constants.capacity);
+
+  chunk->code = code;
+  chunk->capacity = chunk->count;
+  chunk->constants.values = constants;
+  chunk->constants.capacity = chunk->constants.count;
+  chunk->caches = caches;
+  chunk->cacheCapacity = chunk->cacheCount;
+  chunk->lines = lines;
+  chunk->lineCapacity = chunk->lineCount;
+  chunk->block = block;
+  chunk->blockSize = blockSize;
+}
+
 int getLine(Chunk *chunk, int instrIndex) {
   int start = 0;
   int end = chunk->lineCount - 1;
@@ -72,17 +164,86 @@ int getLine(Chunk *chunk, int instrIndex) {
 void writeConstant(Chunk *chunk, Value value, int line) {
   int index = addConstant(chunk, value);
   if (index < 256) {
-    writeChunk(chunk, OP_CONSTANT, line);
-    writeChunk(chunk, (uint8_t)index, line);
+    uint8_t bytes[] = {OP_CONSTANT, (uint8_t)index};
+    writeBytes(chunk, bytes, 2, line);
   } else {
-    writeChunk(chunk, OP_CONSTANT_LONG, line);
-    writeChunk(chunk, (uint8_t)(index & 0xff), line);
-    writeChunk(chunk, (uint8_t)((index >> 8) & 0xff), line);
-    writeChunk(chunk, (uint8_t)((index >> 16) & 0xff), line);
+    uint8_t bytes[] = {OP_CONSTANT_LONG, (uint8_t)(index & 0xff),
+                       (uint8_t)((index >> 8) & 0xff),
+                       (uint8_t)((index >> 16) & 0xff)};
+    writeBytes(chunk, bytes, 4, line);
   }
 }
 
 int addConstant(Chunk *chunk, Value value) {
+  // The value may be the only reference to a freshly allocated object, and
+  // growing the constant array can trigger a collection. Except on a private
+  // heap, where the VM's stack isn't ours to touch
+  if (privateHeap != NULL) {
+    writeValueArray(&chunk->constants, value);
+    return chunk->constants.count - 1;
+  }
+
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
 }
+
+// Number of bytes the instruction at offset takes up, operands included
+int instructionLength(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_IMPORT:
+  case OP_BUILD_LIST:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return 4;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return 5;
+  case OP_CLOSURE: {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + function->upvalueCount * 2;
+  }
+  default:
+    return 1;
+  }
+}
+
+int addInlineCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  cache->shape = NULL;
+  cache->next = NULL;
+  cache->klass = NULL;
+  cache->method = NULL;
+  cache->slot = -1;
+  return chunk->cacheCount++;
+}
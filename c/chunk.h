@@ -11,9 +11,16 @@ typedef enum {
   OP_TRUE,
   OP_FALSE,
   OP_POP,
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
   OP_GET_GLOBAL,
   OP_DEFINE_GLOBAL,
   OP_SET_GLOBAL,
+  OP_GET_UPVALUE,
+  OP_SET_UPVALUE,
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  OP_GET_SUPER,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -24,7 +31,25 @@ typedef enum {
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
-  OP_RETURN
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_LOOP,
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_INVOKE,
+  OP_SUPER_INVOKE,
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
+  OP_CLOSURE,
+  OP_CLOSE_UPVALUE,
+  OP_RETURN,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  OP_IMPORT,
+  OP_BUILD_LIST,
+  OP_INDEX_GET,
+  OP_INDEX_SET
 } OpCode;
 
 // Each of these marks the beginning of a new source line in the code, and the
@@ -36,6 +61,20 @@ typedef struct {
   int line;
 } LineStart;
 
+// Per-site inline cache for OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE.
+// Each site remembers the instance shape it saw last and what it found for it:
+// either the index of a field, or (slot == -1) the method found on klass. Set
+// sites also remember the shape the instance ends up with afterwards, which is
+// a different one when the store adds a new field. The cache is monomorphic
+// and a miss just overwrites it.
+typedef struct {
+  struct ObjShape *shape;
+  struct ObjShape *next;
+  struct ObjClass *klass;
+  struct ObjClosure *method;
+  int slot;
+} InlineCache;
+
 // Dynamic Array of Bytes
 // Cache-friendly, dense storage
 // Constant-time indexed element lookup
@@ -49,13 +88,28 @@ typedef struct {
   int lineCount;
   int lineCapacity;
   LineStart *lines;
+
+  // Property instructions refer to their cache by a two-byte index
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches;
+
+  // Once the chunk is frozen, all of the arrays above live in this one block,
+  // and nothing more can be written to it
+  void *block;
+  size_t blockSize;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeBytes(Chunk *chunk, const uint8_t *bytes, int count, int line);
+void reserveChunk(Chunk *chunk, int capacity);
+void freezeChunk(Chunk *chunk);
 void writeConstant(Chunk *chunk, Value value, int line);
 int getLine(Chunk *chunk, int instrIndex);
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
 
 #endif // !clox_chunk_h
@@ -5,7 +5,25 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// Uncomment to dump each compiled chunk / trace every instruction as it runs
+// #define DEBUG_PRINT_CODE
+// #define DEBUG_TRACE_EXECUTION
+
+// Uncomment to run the collector before every allocation (to shake out GC bugs)
+// and to log what it is doing
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// Modules are compiled on several threads at once, so the compiler's and
+// scanner's globals are per thread
+#if defined(__cplusplus)
+#define THREAD_LOCAL thread_local
+#elif defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
 #endif // !clox_common_h
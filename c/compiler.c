@@ -1,10 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "module.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -22,6 +26,14 @@ typedef struct {
 
   // Helps avoid error cascades
   bool panicMode;
+
+  // The file being compiled, which imports are relative to. NULL for code
+  // that doesn't come from a file
+  const char *path;
+
+  // Errors in an imported module name it, since the line alone would send the
+  // user looking in the script they ran
+  bool imported;
 } Parser;
 
 // Lox Precedence Levels from lowest to highest
@@ -56,10 +68,61 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-Parser parser;
-Chunk *compilingChunk;
+// A local variable lives in a stack slot. Locals are stored in the order they
+// are declared, so a local's index in this array is also its slot in the
+// function's stack window at runtime
+typedef struct {
+  Token name;
+  // Scope depth of the block the local was declared in, or -1 while it is
+  // declared but its initializer hasn't finished
+  int depth;
+  // Whether some closure captured it, in which case it must be closed over
+  // instead of simply popped when its scope ends
+  bool isCaptured;
+} Local;
 
-static Chunk *currentChunk() { return compilingChunk; }
+typedef struct {
+  uint8_t index;
+  bool isLocal;
+} Upvalue;
+
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
+  TYPE_SCRIPT
+} FunctionType;
+
+// Per-function compiler state. Compilers for nested functions form a stack
+// linked through enclosing, innermost on top
+typedef struct Compiler {
+  struct Compiler *enclosing;
+  ObjFunction *function;
+  FunctionType type;
+
+  Local locals[UINT8_COUNT];
+  int localCount;
+  Upvalue upvalues[UINT8_COUNT];
+  int scopeDepth;
+
+  // Offset of the most recently emitted OP_CALL, OP_INVOKE or
+  // OP_SUPER_INVOKE, so a return statement can tell whether its value comes
+  // straight from a call
+  int lastCall;
+} Compiler;
+
+// Tracks the class body we're in, if any, for "this" and "super"
+typedef struct ClassCompiler {
+  struct ClassCompiler *enclosing;
+  bool hasSuperclass;
+} ClassCompiler;
+
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler *current = NULL;
+THREAD_LOCAL ClassCompiler *currentClass = NULL;
+THREAD_LOCAL CompileStats compileStats;
+
+static Chunk *currentChunk() { return &current->function->chunk; }
 
 static void errorAt(Token *token, const char *message) {
   // While panic mode flag is set, we simply suppress any other errors that get
@@ -67,7 +130,11 @@ static void errorAt(Token *token, const char *message) {
   if (parser.panicMode)
     return;
   parser.panicMode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+  if (parser.imported) {
+    fprintf(stderr, "[%s line %d] Error", parser.path, token->line);
+  } else {
+    fprintf(stderr, "[line %d] Error", token->line);
+  }
 
   if (token->type == TOKEN_EOF) {
     fprintf(stderr, " at end");
@@ -92,6 +159,7 @@ static void advance() {
 
   for (;;) {
     parser.current = scanToken();
+    compileStats.tokens++;
     if (parser.current.type != TOKEN_ERROR)
       break;
 
@@ -134,26 +202,46 @@ static void emitByte(uint8_t byte) {
 
 // Convenience function for writing an opcode followed by a one-byte operand
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+  uint8_t bytes[] = {byte1, byte2};
+  writeBytes(currentChunk(), bytes, 2, parser.previous.line);
 }
 
-static void emitReturn() {
-  emitByte(OP_RETURN);
-#ifdef DEBUG_PRINT_CODE
+// Jumps backward to loopStart. The offset is relative to the instruction
+// after the operand, so it also has to skip over the whole OP_LOOP
+static void emitLoop(int loopStart) {
+  int offset = currentChunk()->count - loopStart + 3;
+  if (offset > UINT16_MAX)
+    error("Loop body too large.");
 
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), "code");
+  uint8_t bytes[] = {OP_LOOP, (uint8_t)((offset >> 8) & 0xff),
+                     (uint8_t)(offset & 0xff)};
+  writeBytes(currentChunk(), bytes, 3, parser.previous.line);
+}
+
+// Emits a jump with a placeholder offset and returns where that operand is so
+// patchJump() can fill it in once we know how far to go
+static int emitJump(uint8_t instruction) {
+  uint8_t bytes[] = {instruction, 0xff, 0xff};
+  writeBytes(currentChunk(), bytes, 3, parser.previous.line);
+  return currentChunk()->count - 2;
+}
+
+static void emitReturn() {
+  // An initializer always returns the instance, which lives in slot zero
+  if (current->type == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
   }
 
-#endif
+  emitByte(OP_RETURN);
 }
 
 static uint8_t makeConstant(Value value) {
   // TODO: handle OP_CONSTANT_LONG
   int constant = addConstant(currentChunk(), value);
   if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk");
+    error("Too many constants in one chunk.");
     return 0;
   }
 
@@ -164,13 +252,123 @@ static void emitConstant(Value value) {
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
-static void endCompiler() { emitReturn(); }
+// Every property instruction gets a fresh inline cache, named by a two-byte
+// operand
+static void emitCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+    return;
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void patchJump(int offset) {
+  // -2 to adjust for the bytecode for the jump offset itself.
+  int jump = currentChunk()->count - offset - 2;
+
+  if (jump > UINT16_MAX) {
+    error("Too much code to jump over.");
+  }
+
+  currentChunk()->code[offset] = (jump >> 8) & 0xff;
+  currentChunk()->code[offset + 1] = jump & 0xff;
+}
+
+static void initCompiler(Compiler *compiler, FunctionType type) {
+  compiler->enclosing = current;
+  compiler->function = NULL;
+  compiler->type = type;
+  compiler->localCount = 0;
+  compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->function = newFunction();
+  current = compiler;
+
+  // Rather than growing the code array from nothing a few bytes at a time,
+  // start it at the size the functions compiled so far averaged
+  if (compileStats.functions > 0) {
+    reserveChunk(&compiler->function->chunk,
+                 compileStats.bytes / compileStats.functions);
+  }
+
+  if (type != TYPE_SCRIPT && parser.previous.type == TOKEN_IDENTIFIER) {
+    current->function->name =
+        copyString(parser.previous.start, parser.previous.length);
+  }
+
+  // Slot zero is claimed by the VM. It holds the function being called or,
+  // in methods, the receiver, which is why it's named "this" there
+  Local *local = &current->locals[current->localCount++];
+  local->depth = 0;
+  local->isCaptured = false;
+  if (type != TYPE_FUNCTION) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = "";
+    local->name.length = 0;
+  }
+}
+
+static ObjFunction *endCompiler() {
+  emitReturn();
+  ObjFunction *function = current->function;
+  if (vm.optimizeLevel > 0 && !parser.hadError) {
+    compileStats.removed += optimizeChunk(&function->chunk);
+  }
+  compileStats.functions++;
+  compileStats.bytes += function->chunk.count;
+  compileStats.constants += function->chunk.constants.count;
+
+  // Functions the translation can't handle just keep running on the stack VM
+  if (vm.useRegisters && !parser.hadError) {
+    compileRegisters(function);
+  }
+  freezeChunk(&function->chunk);
+
+#ifdef DEBUG_PRINT_CODE
+  if (!parser.hadError) {
+    disassembleChunk(currentChunk(), function->name != NULL
+                                         ? function->name->chars
+                                         : "<script>");
+    if (function->registers != NULL) {
+      disassembleRegisters(function, function->name != NULL
+                                                    ? function->name->chars
+                                                    : "<script>");
+    }
+  }
+#endif
+
+  current = current->enclosing;
+  return function;
+}
+
+static void beginScope() { current->scopeDepth++; }
+
+// Discard the block's locals, closing any that were captured
+static void endScope() {
+  current->scopeDepth--;
+
+  while (current->localCount > 0 &&
+         current->locals[current->localCount - 1].depth >
+             current->scopeDepth) {
+    if (current->locals[current->localCount - 1].isCaptured) {
+      emitByte(OP_CLOSE_UPVALUE);
+    } else {
+      emitByte(OP_POP);
+    }
+    current->localCount--;
+  }
+}
 
 // Forward declarations to handle the fact that our grammar is mutually
 // recursive
 static void expression();
 static void statement();
 static void declaration();
+static void lambda(bool canAssign);
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
@@ -178,15 +376,156 @@ static uint8_t identifierConstant(Token *name) {
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static bool identifiersEqual(Token *a, Token *b) {
+  if (a->length != b->length)
+    return false;
+  return memcmp(a->start, b->start, a->length) == 0;
+}
+
+// Walk the locals backwards so inner declarations shadow outer ones. Returns
+// the slot, or -1 if it isn't a local of this function
+static int resolveLocal(Compiler *compiler, Token *name) {
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1) {
+        error("Can't read local variable in its own initializer.");
+      }
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+  int upvalueCount = compiler->function->upvalueCount;
+
+  // A closure that references the same variable many times only captures it
+  // once
+  for (int i = 0; i < upvalueCount; i++) {
+    Upvalue *upvalue = &compiler->upvalues[i];
+    if (upvalue->index == index && upvalue->isLocal == isLocal) {
+      return i;
+    }
+  }
+
+  if (upvalueCount == UINT8_COUNT) {
+    error("Too many closure variables in function.");
+    return 0;
+  }
+
+  compiler->upvalues[upvalueCount].isLocal = isLocal;
+  compiler->upvalues[upvalueCount].index = index;
+  return compiler->function->upvalueCount++;
+}
+
+// Looks for the variable in each enclosing function in turn. Every function
+// in between ends up with an upvalue of its own, so at runtime each closure
+// only ever has to look one level out
+static int resolveUpvalue(Compiler *compiler, Token *name) {
+  if (compiler->enclosing == NULL)
+    return -1;
+
+  int local = resolveLocal(compiler->enclosing, name);
+  if (local != -1) {
+    compiler->enclosing->locals[local].isCaptured = true;
+    return addUpvalue(compiler, (uint8_t)local, true);
+  }
+
+  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  if (upvalue != -1) {
+    return addUpvalue(compiler, (uint8_t)upvalue, false);
+  }
+
+  return -1;
+}
+
+static void addLocal(Token name) {
+  if (current->localCount == UINT8_COUNT) {
+    error("Too many local variables in function.");
+    return;
+  }
+
+  Local *local = &current->locals[current->localCount++];
+  local->name = name;
+  local->depth = -1;
+  local->isCaptured = false;
+}
+
+// Globals are late bound, so only locals get declared
+static void declareVariable() {
+  if (current->scopeDepth == 0)
+    return;
+
+  Token *name = &parser.previous;
+  for (int i = current->localCount - 1; i >= 0; i--) {
+    Local *local = &current->locals[i];
+    if (local->depth != -1 && local->depth < current->scopeDepth) {
+      break;
+    }
+
+    if (identifiersEqual(name, &local->name)) {
+      error("Already a variable with this name in this scope.");
+    }
+  }
+
+  addLocal(*name);
+}
+
 static uint8_t parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
+
+  declareVariable();
+  if (current->scopeDepth > 0)
+    return 0;
+
   return identifierConstant(&parser.previous);
 }
 
+static void markInitialized() {
+  if (current->scopeDepth == 0)
+    return;
+  current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+// A local's value is already sitting in the right stack slot, so defining it
+// just means making it visible
 static void defineVariable(uint8_t global) {
+  if (current->scopeDepth > 0) {
+    markInitialized();
+    return;
+  }
+
   emitBytes(OP_DEFINE_GLOBAL, global);
 }
 
+static uint8_t argumentList() {
+  uint8_t argCount = 0;
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      expression();
+      if (argCount == 255) {
+        error("Can't have more than 255 arguments.");
+      }
+      argCount++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  return argCount;
+}
+
+// Short circuits: if the left operand is falsey it's the result, and the right
+// operand is skipped
+static void and_(bool canAssign) {
+  int endJump = emitJump(OP_JUMP_IF_FALSE);
+
+  emitByte(OP_POP);
+  parsePrecedence(PREC_AND);
+
+  patchJump(endJump);
+}
+
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
   ParseRule *rule = getRule(operatorType);
@@ -231,6 +570,65 @@ static void binary(bool canAssign) {
   }
 }
 
+static void call(bool canAssign) {
+  uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
+  emitBytes(OP_CALL, argCount);
+}
+
+// A list literal: the elements are pushed in order and gathered up at the end
+static void list(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      // Allow a trailing comma
+      if (check(TOKEN_RIGHT_BRACKET))
+        break;
+      expression();
+      if (count == 255) {
+        error("Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(OP_BUILD_LIST, (uint8_t)count);
+}
+
+static void subscript(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
+  }
+}
+
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitBytes(OP_SET_PROPERTY, name);
+    emitCache();
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    // A method call compiles to a single instruction instead of a property get
+    // followed by a call
+    uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
+    emitBytes(OP_INVOKE, name);
+    emitByte(argCount);
+    emitCache();
+  } else {
+    emitBytes(OP_GET_PROPERTY, name);
+    emitCache();
+  }
+}
+
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
   case TOKEN_FALSE:
@@ -262,8 +660,49 @@ static void grouping(bool canAssign) {
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+static void or_(bool canAssign) {
+  int elseJump = emitJump(OP_JUMP_IF_FALSE);
+  int endJump = emitJump(OP_JUMP);
+
+  patchJump(elseJump);
+  emitByte(OP_POP);
+
+  parsePrecedence(PREC_OR);
+  patchJump(endJump);
+}
+
+// A number literal is digits with an optional fractional part. With at most
+// 15 digits, the digits read as an integer fit exactly in a double, and so
+// does any power of ten up to 10^22. Dividing one by the other is then a single
+// correctly rounded operation, giving exactly what strtod() would. Only longer
+// literals need the real thing
+static double parseNumber(const char *start, int length) {
+  static const double powersOfTen[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+  uint64_t digits = 0;
+  int digitCount = 0;
+  int fractionDigits = 0;
+  bool inFraction = false;
+  for (int i = 0; i < length; i++) {
+    if (start[i] == '.') {
+      inFraction = true;
+      continue;
+    }
+
+    if (++digitCount > 15)
+      return strtod(start, NULL);
+    digits = digits * 10 + (uint64_t)(start[i] - '0');
+    if (inFraction)
+      fractionDigits++;
+  }
+
+  return (double)digits / powersOfTen[fractionDigits];
+}
+
 static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
+  double value = parseNumber(parser.previous.start, parser.previous.length);
   emitConstant(NUMBER_VAL(value));
 }
 
@@ -273,13 +712,25 @@ static void string(bool canAssign) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t arg = identifierConstant(&name);
+  uint8_t getOp, setOp;
+  int arg = resolveLocal(current, &name);
+  if (arg != -1) {
+    getOp = OP_GET_LOCAL;
+    setOp = OP_SET_LOCAL;
+  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+    getOp = OP_GET_UPVALUE;
+    setOp = OP_SET_UPVALUE;
+  } else {
+    arg = identifierConstant(&name);
+    getOp = OP_GET_GLOBAL;
+    setOp = OP_SET_GLOBAL;
+  }
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_GLOBAL, arg);
+    emitBytes(setOp, (uint8_t)arg);
   } else {
-    emitBytes(OP_GET_GLOBAL, arg);
+    emitBytes(getOp, (uint8_t)arg);
   }
 }
 
@@ -287,6 +738,46 @@ static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
+static Token syntheticToken(const char *text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  return token;
+}
+
+static void super_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+  } else if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    current->lastCall = currentChunk()->count;
+    emitBytes(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_GET_SUPER, name);
+  }
+}
+
+static void this_(bool canAssign) {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return;
+  }
+
+  variable(false);
+}
+
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
 
@@ -307,12 +798,14 @@ static void unary(bool canAssign) {
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-    [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
@@ -329,19 +822,20 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_AND] = {NULL, NULL, PREC_NONE},
+    [TOKEN_AND] = {NULL, and_, PREC_AND},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
-    [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
+    [TOKEN_FUN] = {lambda, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
+    [TOKEN_IMPORT] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_OR] = {NULL, NULL, PREC_NONE},
+    [TOKEN_OR] = {NULL, or_, PREC_OR},
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-    [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-    [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+    [TOKEN_THIS] = {this_, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -392,12 +886,141 @@ static void parsePrecedence(Precedence precedence) {
     ParseFn infixRule = getRule(parser.previous.type)->infix;
     infixRule(canAssign);
   }
+
+  // If nothing consumed the '=', the left-hand side wasn't something we can
+  // assign to
+  if (canAssign && match(TOKEN_EQUAL)) {
+    error("Invalid assignment target.");
+  }
 }
 
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
 static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
+static void block() {
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    declaration();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// Compiles the parameter list and body into a new function object, then
+// emits the code to wrap it in a closure at runtime
+static void function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      current->function->arity++;
+      if (current->function->arity > 255) {
+        errorAtCurrent("Can't have more than 255 parameters.");
+      }
+      uint8_t constant = parseVariable("Expect parameter name.");
+      defineVariable(constant);
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block();
+
+  // No endScope() needed, the whole stack window goes away on return
+  ObjFunction *function = endCompiler();
+  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+
+  for (int i = 0; i < function->upvalueCount; i++) {
+    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(compiler.upvalues[i].index);
+  }
+}
+
+// Anonymous functions, as in jlox: fun (a, b) { ... } in expression position.
+// A named declaration can't appear where an expression is expected
+static void lambda(bool canAssign) {
+  if (!check(TOKEN_LEFT_PAREN)) {
+    error("Expect expression.");
+    return;
+  }
+
+  function(TYPE_FUNCTION);
+}
+
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(&parser.previous);
+
+  FunctionType type = TYPE_METHOD;
+  if (parser.previous.length == 4 &&
+      memcmp(parser.previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+
+  function(type);
+  emitBytes(OP_METHOD, constant);
+}
+
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitBytes(OP_CLASS, nameConstant);
+  defineVariable(nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = currentClass;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+
+    if (identifiersEqual(&className, &parser.previous)) {
+      error("A class can't inherit from itself.");
+    }
+
+    // The superclass is stored in a local named "super" in a scope around the
+    // methods, so each method closure captures it like any other variable
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  // Load the class back onto the stack so the methods can be bound to it
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    method();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (classCompiler.hasSuperclass) {
+    endScope();
+  }
+
+  currentClass = currentClass->enclosing;
+}
+
+static void funDeclaration() {
+  uint8_t global = parseVariable("Expect function name.");
+  // A function may refer to itself in its own body, so it's initialized as
+  // soon as it's declared
+  markInitialized();
+  function(TYPE_FUNCTION);
+  defineVariable(global);
+}
+
 static void varDeclaration() {
   uint8_t global = parseVariable("Expect variable name.");
 
@@ -417,12 +1040,153 @@ static void expressionStatement() {
   emitByte(OP_POP);
 }
 
+static void forStatement() {
+  beginScope();
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(TOKEN_SEMICOLON)) {
+    // No initializer.
+  } else if (match(TOKEN_VAR)) {
+    varDeclaration();
+  } else {
+    expressionStatement();
+  }
+
+  int loopStart = currentChunk()->count;
+  int exitJump = -1;
+  if (!match(TOKEN_SEMICOLON)) {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    // Jump out of the loop if the condition is false.
+    exitJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP); // Condition.
+  }
+
+  // The increment clause comes before the body in the source but runs after
+  // it, so jump over it now and loop back to it at the end of the body
+  if (!match(TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(OP_JUMP);
+    int incrementStart = currentChunk()->count;
+    expression();
+    emitByte(OP_POP);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    emitLoop(loopStart);
+    loopStart = incrementStart;
+    patchJump(bodyJump);
+  }
+
+  statement();
+  emitLoop(loopStart);
+
+  if (exitJump != -1) {
+    patchJump(exitJump);
+    emitByte(OP_POP); // Condition.
+  }
+
+  endScope();
+}
+
+static void ifStatement() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int thenJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  statement();
+
+  int elseJump = emitJump(OP_JUMP);
+
+  patchJump(thenJump);
+  emitByte(OP_POP);
+
+  if (match(TOKEN_ELSE))
+    statement();
+  patchJump(elseJump);
+}
+
 static void printStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after value.");
   emitByte(OP_PRINT);
 }
 
+// The path is resolved here, against the importing file's directory, so at
+// runtime the VM only ever sees the path the module is cached under. The module
+// leaves nothing on the stack, OP_IMPORT pushes a value just to be consistent
+// with calls
+static void importStatement() {
+  consume(TOKEN_STRING, "Expect module path after 'import'.");
+  char *path = resolveImport(parser.path, parser.previous.start + 1,
+                             parser.previous.length - 2);
+  uint8_t constant =
+      makeConstant(OBJ_VAL(copyString(path, (int)strlen(path))));
+  free(path);
+
+  consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+  emitBytes(OP_IMPORT, constant);
+  emitByte(OP_POP);
+}
+
+static void returnStatement() {
+  if (current->type == TYPE_SCRIPT) {
+    error("Can't return from top-level code.");
+  }
+
+  if (match(TOKEN_SEMICOLON)) {
+    emitReturn();
+  } else {
+    if (current->type == TYPE_INITIALIZER) {
+      error("Can't return a value from an initializer.");
+    }
+
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // "return f(...)": nothing is left to do in this function once the call
+    // finishes, so the callee can take over our frame instead of pushing a new
+    // one. The same goes for "return this.m(...)" and "return super.m(...)".
+    // The OP_RETURN is still needed for jumps that land after the call, as in
+    // "return a or f();"
+    Chunk *chunk = currentChunk();
+    if (current->lastCall != -1 &&
+        current->lastCall + instructionLength(chunk, current->lastCall) ==
+            chunk->count) {
+      uint8_t *instruction = &chunk->code[current->lastCall];
+      switch (*instruction) {
+      case OP_CALL:
+        *instruction = OP_TAIL_CALL;
+        break;
+      case OP_INVOKE:
+        *instruction = OP_TAIL_INVOKE;
+        break;
+      case OP_SUPER_INVOKE:
+        *instruction = OP_TAIL_SUPER_INVOKE;
+        break;
+      default:
+        break; // unreachable
+      }
+    }
+    emitByte(OP_RETURN);
+  }
+}
+
+static void whileStatement() {
+  int loopStart = currentChunk()->count;
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int exitJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  statement();
+  emitLoop(loopStart);
+
+  patchJump(exitJump);
+  emitByte(OP_POP);
+}
+
 static void synchronize() {
   parser.panicMode = false;
 
@@ -435,6 +1199,7 @@ static void synchronize() {
     case TOKEN_VAR:
     case TOKEN_FOR:
     case TOKEN_IF:
+    case TOKEN_IMPORT:
     case TOKEN_WHILE:
     case TOKEN_PRINT:
     case TOKEN_RETURN:
@@ -448,7 +1213,11 @@ static void synchronize() {
 }
 
 static void declaration() {
-  if (match(TOKEN_VAR)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
+    funDeclaration();
+  } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else {
     statement();
@@ -462,6 +1231,20 @@ static void declaration() {
 static void statement() {
   if (match(TOKEN_PRINT)) {
     printStatement();
+  } else if (match(TOKEN_FOR)) {
+    forStatement();
+  } else if (match(TOKEN_IF)) {
+    ifStatement();
+  } else if (match(TOKEN_IMPORT)) {
+    importStatement();
+  } else if (match(TOKEN_RETURN)) {
+    returnStatement();
+  } else if (match(TOKEN_WHILE)) {
+    whileStatement();
+  } else if (match(TOKEN_LEFT_BRACE)) {
+    beginScope();
+    block();
+    endScope();
   } else {
     expressionStatement();
   }
@@ -476,14 +1259,42 @@ Generally languages two separate passes -
 
 SInce Lox is a small, dynamically typed language, we utilize a single-pass
 */
-bool compile(const char *source, Chunk *chunk) {
+ObjFunction *compile(const char *source) {
+  return compileModule(source, NULL, false);
+}
+
+ObjFunction *compileModule(const char *source, const char *path,
+                           bool imported) {
+  compileStats.tokens = 0;
+  compileStats.functions = 0;
+  compileStats.bytes = 0;
+  compileStats.constants = 0;
+  compileStats.removed = 0;
+
   initScanner(source);
-  compilingChunk = chunk;
+  Compiler compiler;
+  initCompiler(&compiler, TYPE_SCRIPT);
+
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.path = path;
+  parser.imported = imported && path != NULL;
 
   advance();
   while (!match(TOKEN_EOF)) {
     declaration();
   }
-  endCompiler();
-  return !parser.hadError;
+
+  ObjFunction *function = endCompiler();
+  return parser.hadError ? NULL : function;
+}
+
+// The functions being compiled aren't reachable from anything the VM knows
+// about yet, so the collector asks us for them
+void markCompilerRoots() {
+  Compiler *compiler = current;
+  while (compiler != NULL) {
+    markObject((Obj *)compiler->function);
+    compiler = compiler->enclosing;
+  }
 }
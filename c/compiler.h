@@ -4,6 +4,23 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+// Totals for everything the last call to compile() went through
+typedef struct {
+  int tokens;
+  int functions;
+  int bytes;
+  int constants;
+  // Instructions the peephole pass removed
+  int removed;
+} CompileStats;
+
+extern THREAD_LOCAL CompileStats compileStats;
+
+ObjFunction *compile(const char *source);
+// Compiles the contents of the file at path, which its imports are resolved
+// against. Errors in an imported module are reported with its path
+ObjFunction *compileModule(const char *source, const char *path,
+                           bool imported);
+void markCompilerRoots();
 
 #endif
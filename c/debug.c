@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "debug.h"
+#include "object.h"
 #include "value.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
@@ -26,6 +27,40 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
+static int byteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 2;
+}
+
+static int jumpInstruction(const char *name, int sign, Chunk *chunk,
+                           int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+  jump |= chunk->code[offset + 2];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+// Property instructions: name constant followed by a two-byte cache index
+static int cacheInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+static int invokeInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int longConstantInstruction(const char *name, Chunk *chunk, int offset) {
   uint32_t constant = chunk->code[offset + 1] | (chunk->code[offset + 2]) << 8 |
                       (chunk->code[offset + 3] << 16);
@@ -60,12 +95,26 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_FALSE", offset);
   case OP_POP:
     return simpleInstruction("OP_POP", offset);
+  case OP_GET_LOCAL:
+    return byteInstruction("OP_GET_LOCAL", chunk, offset);
+  case OP_SET_LOCAL:
+    return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
     return constantInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
     return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
     return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+  case OP_GET_UPVALUE:
+    return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+  case OP_SET_UPVALUE:
+    return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_GET_PROPERTY:
+    return cacheInstruction("OP_GET_PROPERTY", chunk, offset);
+  case OP_SET_PROPERTY:
+    return cacheInstruction("OP_SET_PROPERTY", chunk, offset);
+  case OP_GET_SUPER:
+    return constantInstruction("OP_GET_SUPER", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -86,10 +135,162 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_NEGATE", offset);
   case OP_PRINT:
     return simpleInstruction("OP_PRINT", offset);
+  case OP_JUMP:
+    return jumpInstruction("OP_JUMP", 1, chunk, offset);
+  case OP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_LOOP:
+    return jumpInstruction("OP_LOOP", -1, chunk, offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_INVOKE:
+    // Same operands as OP_SUPER_INVOKE plus the cache index
+    invokeInstruction("OP_INVOKE", chunk, offset);
+    return offset + 5;
+  case OP_SUPER_INVOKE:
+    return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_INVOKE:
+    invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+    return offset + 5;
+  case OP_TAIL_SUPER_INVOKE:
+    return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+  case OP_CLOSURE: {
+    offset++;
+    uint8_t constant = chunk->code[offset++];
+    printf("%-16s %4d ", "OP_CLOSURE", constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+      int isLocal = chunk->code[offset++];
+      int index = chunk->code[offset++];
+      printf("%04d      |                     %s %d\n", offset - 2,
+             isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+  }
+  case OP_CLOSE_UPVALUE:
+    return simpleInstruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
+  case OP_CLASS:
+    return constantInstruction("OP_CLASS", chunk, offset);
+  case OP_INHERIT:
+    return simpleInstruction("OP_INHERIT", offset);
+  case OP_METHOD:
+    return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_IMPORT:
+    return constantInstruction("OP_IMPORT", chunk, offset);
+  case OP_BUILD_LIST:
+    return byteInstruction("OP_BUILD_LIST", chunk, offset);
+  case OP_INDEX_GET:
+    return simpleInstruction("OP_INDEX_GET", offset);
+  case OP_INDEX_SET:
+    return simpleInstruction("OP_INDEX_SET", offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
   }
 }
+
+// Prints an RK operand as a register, or as a constant along with its value
+static void rkOperand(ObjFunction *function, uint16_t operand) {
+  if (IS_RK_CONSTANT(operand)) {
+    printf(" k%d '", RK_INDEX(operand));
+    printValue(function->chunk.constants.values[RK_INDEX(operand)]);
+    printf("'");
+  } else {
+    printf(" r%d", operand);
+  }
+}
+
+static void binaryRegInstruction(const char *name, ObjFunction *function,
+                                 RegInstruction *instruction) {
+  printf("%-16s r%d", name, instruction->a);
+  rkOperand(function, instruction->b);
+  rkOperand(function, instruction->c);
+}
+
+void disassembleRegisters(ObjFunction *function, const char *name) {
+  printf("== %s (%d registers) ==\n", name, function->registers->frameSize);
+
+  for (int index = 0; index < function->registers->count; index++) {
+    disassembleRegInstruction(function, index);
+  }
+}
+
+void disassembleRegInstruction(ObjFunction *function, int index) {
+  RegChunk *chunk = function->registers;
+  RegInstruction *instruction = &chunk->code[index];
+  printf("%04d %4d ", index,
+         getLine(&function->chunk, chunk->sourceOffsets[index]));
+
+  switch (instruction->op) {
+  case ROP_MOVE:
+    printf("%-16s r%d", "ROP_MOVE", instruction->a);
+    rkOperand(function, instruction->b);
+    break;
+  case ROP_GET_GLOBAL:
+    printf("%-16s r%d", "ROP_GET_GLOBAL", instruction->a);
+    rkOperand(function, instruction->b | RK_CONSTANT);
+    break;
+  case ROP_SET_GLOBAL:
+  case ROP_DEFINE_GLOBAL:
+    printf("%-16s", instruction->op == ROP_SET_GLOBAL ? "ROP_SET_GLOBAL"
+                                                      : "ROP_DEFINE_GLOBAL");
+    rkOperand(function, instruction->b | RK_CONSTANT);
+    rkOperand(function, instruction->c);
+    break;
+  case ROP_EQUAL:
+    binaryRegInstruction("ROP_EQUAL", function, instruction);
+    break;
+  case ROP_GREATER:
+    binaryRegInstruction("ROP_GREATER", function, instruction);
+    break;
+  case ROP_LESS:
+    binaryRegInstruction("ROP_LESS", function, instruction);
+    break;
+  case ROP_ADD:
+    binaryRegInstruction("ROP_ADD", function, instruction);
+    break;
+  case ROP_SUBTRACT:
+    binaryRegInstruction("ROP_SUBTRACT", function, instruction);
+    break;
+  case ROP_MULTIPLY:
+    binaryRegInstruction("ROP_MULTIPLY", function, instruction);
+    break;
+  case ROP_DIVIDE:
+    binaryRegInstruction("ROP_DIVIDE", function, instruction);
+    break;
+  case ROP_NOT:
+  case ROP_NEGATE:
+    printf("%-16s r%d", instruction->op == ROP_NOT ? "ROP_NOT" : "ROP_NEGATE",
+           instruction->a);
+    rkOperand(function, instruction->b);
+    break;
+  case ROP_PRINT:
+  case ROP_RETURN:
+    printf("%-16s", instruction->op == ROP_PRINT ? "ROP_PRINT" : "ROP_RETURN");
+    rkOperand(function, instruction->b);
+    break;
+  case ROP_JUMP:
+    printf("%-16s -> %d", "ROP_JUMP", instruction->c);
+    break;
+  case ROP_JUMP_IF_FALSE:
+    printf("%-16s", "ROP_JUMP_IF_FALSE");
+    rkOperand(function, instruction->b);
+    printf(" -> %d", instruction->c);
+    break;
+  case ROP_CALL:
+    printf("%-16s r%d (%d args)", "ROP_CALL", instruction->a, instruction->b);
+    break;
+  default:
+    printf("Unknown register opcode %d", instruction->op);
+    break;
+  }
+  printf("\n");
+}
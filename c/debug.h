@@ -2,8 +2,11 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void disassembleRegisters(ObjFunction *function, const char *name);
+void disassembleRegInstruction(ObjFunction *function, int index);
 
 #endif
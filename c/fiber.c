@@ -0,0 +1,629 @@
+// For MAP_ANONYMOUS, kill() and nanosleep() under -std=c99. g++ defines it
+// for us
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef CLOX_FIBERS
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+// Everything a fiber owns besides the object itself, in a single block
+typedef struct {
+  // The block's start and size, which is more than this struct when there's a
+  // C stack below it
+  void *base;
+  size_t size;
+#ifdef CLOX_FIBERS
+  // Where the fiber's registers are kept while it's switched out
+  ucontext_t context;
+#endif
+  CallFrame frames[FRAMES_MAX];
+  Value stack[STACK_MAX];
+} FiberMemory;
+
+// The fiber the script runs on, which uses the process's own C stack
+static ObjFiber *mainFiber = NULL;
+
+// Fibers that can run, first come first served
+static ObjFiber *readyHead = NULL;
+static ObjFiber *readyTail = NULL;
+
+// Sleeping fibers, the one that wakes up soonest first. Fibers mostly go to
+// sleep for the same time, so the last one is where a new one usually goes
+static ObjFiber *sleeping = NULL;
+static ObjFiber *sleepingTail = NULL;
+
+// Fibers parked until epoll says their file descriptor is ready
+static ObjFiber *waiting = NULL;
+
+// A fiber that has run to the end. Its stacks can't be unmapped while it's
+// still running on them, so the next fiber to run does it
+static ObjFiber *finished = NULL;
+
+// Set when a fiber hits a runtime error, for the main fiber to see when it
+// takes over
+static bool failed = false;
+
+#ifdef CLOX_FIBERS
+static int pollFd = -1;
+
+// Memory of finished fibers, kept for the next ones so spawning doesn't have
+// to map and fault in fresh pages every time
+#define MAX_SPARE_FIBERS 64
+static FiberMemory *spareMemory[MAX_SPARE_FIBERS];
+static int spareCount = 0;
+
+static void fiberMain();
+#endif
+
+#ifdef CLOX_FIBERS
+// Points the fiber's context at fiberMain() on its own C stack. GCC treats
+// getcontext() like setjmp(), and warns that anything live across it could be
+// clobbered if it returned twice. It never does here, since makecontext()
+// replaces the saved context, but the parameters are volatile to keep the
+// warning, and -Werror, quiet at every optimization level
+static void makeFiberContext(FiberMemory *volatile memory,
+                             char *volatile stack) {
+  getcontext(&memory->context);
+  memory->context.uc_stack.ss_sp = stack;
+  memory->context.uc_stack.ss_size = FIBER_C_STACK;
+  memory->context.uc_link = NULL;
+  makecontext(&memory->context, fiberMain, 0);
+}
+#endif
+
+void allocateFiberMemory(ObjFiber *fiber) {
+#ifdef CLOX_FIBERS
+  // Every fiber but the main one runs C code on a stack of its own. It goes
+  // below the rest, with an inaccessible page underneath to catch overflows
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t cStack = IS_NIL(fiber->callee) ? 0 : page + FIBER_C_STACK;
+  FiberMemory *memory;
+  char *base;
+  size_t size;
+
+  if (cStack > 0 && spareCount > 0) {
+    memory = spareMemory[--spareCount];
+    base = (char *)memory->base;
+    size = memory->size;
+  } else {
+    size = cStack + (sizeof(FiberMemory) + page - 1) / page * page;
+    base = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+      exit(1);
+    if (cStack > 0)
+      mprotect(base, page, PROT_NONE);
+    memory = (FiberMemory *)(base + cStack);
+  }
+#else
+  size_t size = sizeof(FiberMemory);
+  char *base = (char *)malloc(size);
+  if (base == NULL)
+    exit(1);
+  FiberMemory *memory = (FiberMemory *)base;
+#endif
+
+  memory->base = base;
+  memory->size = size;
+  // Not allocated through reallocate(), but it should still count towards
+  // the next collection
+  vm.bytesAllocated += size;
+
+  fiber->memory = memory;
+  fiber->frames = memory->frames;
+  fiber->frameCount = 0;
+  fiber->stack = memory->stack;
+  fiber->stackTop = memory->stack;
+
+#ifdef CLOX_FIBERS
+  if (cStack > 0)
+    makeFiberContext(memory, base + page);
+#endif
+}
+
+void freeFiberMemory(ObjFiber *fiber) {
+  FiberMemory *memory = (FiberMemory *)fiber->memory;
+  if (memory == NULL)
+    return;
+
+  vm.bytesAllocated -= memory->size;
+#ifdef CLOX_FIBERS
+  // Only blocks with a C stack are worth keeping, there's one main fiber
+  if (memory->base != (void *)memory && spareCount < MAX_SPARE_FIBERS) {
+    spareMemory[spareCount++] = memory;
+  } else {
+    munmap(memory->base, memory->size);
+  }
+#else
+  free(memory->base);
+#endif
+
+  fiber->memory = NULL;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->openUpvalues = NULL;
+}
+
+// Hands the VM over to fiber, first putting away the state of the one that's
+// running
+static void enterFiber(ObjFiber *fiber) {
+  ObjFiber *current = vm.fiber;
+  if (current != NULL) {
+    current->frameCount = vm.frameCount;
+    current->stackTop = vm.stackTop;
+    current->openUpvalues = vm.openUpvalues;
+  }
+
+  vm.fiber = fiber;
+  vm.frames = fiber->frames;
+  vm.frameCount = fiber->frameCount;
+  vm.stack = fiber->stack;
+  vm.stackTop = fiber->stackTop;
+  vm.openUpvalues = fiber->openUpvalues;
+  fiber->state = FIBER_RUNNING;
+}
+
+#ifdef CLOX_FIBERS
+static void releaseFinished() {
+  if (finished != NULL) {
+    freeFiberMemory(finished);
+    finished = NULL;
+  }
+}
+
+static void schedule(ObjFiber *fiber) {
+  fiber->state = FIBER_READY;
+  fiber->next = NULL;
+  if (readyTail != NULL) {
+    readyTail->next = fiber;
+  } else {
+    readyHead = fiber;
+  }
+  readyTail = fiber;
+}
+
+static double now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int epollFd() {
+  if (pollFd == -1)
+    pollFd = epoll_create1(EPOLL_CLOEXEC);
+  return pollFd;
+}
+
+// Blocks until some parked fiber can go on, and queues every one that can.
+// False if there's nothing that could ever wake one
+static bool waitForEvents() {
+  if (sleeping == NULL && waiting == NULL)
+    return false;
+
+  int timeout = -1;
+  if (sleeping != NULL) {
+    // Rounded up, so we don't wake just before it's time and spin
+    double delay = sleeping->wakeAt - now();
+    timeout = delay <= 0 ? 0 : (int)(delay * 1000) + 1;
+  }
+
+  struct epoll_event events[64];
+  int count = epoll_wait(epollFd(), events, 64, timeout);
+  if (count > 0) {
+    // Flag the fibers first, the waiting list runs through the same next
+    // field the ready queue does
+    for (int i = 0; i < count; i++) {
+      ((ObjFiber *)events[i].data.ptr)->state = FIBER_READY;
+    }
+
+    ObjFiber **link = &waiting;
+    while (*link != NULL) {
+      ObjFiber *fiber = *link;
+      if (fiber->state == FIBER_READY) {
+        *link = fiber->next;
+        schedule(fiber);
+      } else {
+        link = &fiber->next;
+      }
+    }
+  }
+
+  double time = now();
+  while (sleeping != NULL && sleeping->wakeAt <= time) {
+    ObjFiber *fiber = sleeping;
+    sleeping = fiber->next;
+    schedule(fiber);
+  }
+  if (sleeping == NULL)
+    sleepingTail = NULL;
+  return true;
+}
+
+// The fiber to run next, waiting for one if need be. NULL if every fiber is
+// parked for good
+static ObjFiber *nextFiber() {
+  while (readyHead == NULL) {
+    if (!waitForEvents())
+      return NULL;
+  }
+
+  ObjFiber *fiber = readyHead;
+  readyHead = fiber->next;
+  if (readyHead == NULL)
+    readyTail = NULL;
+  fiber->next = NULL;
+  return fiber;
+}
+
+static ucontext_t *contextOf(ObjFiber *fiber) {
+  return &((FiberMemory *)fiber->memory)->context;
+}
+
+// Switches to fiber. Returns once something switches back to the one that's
+// running now
+static void switchTo(ObjFiber *fiber) {
+  ucontext_t *from = contextOf(vm.fiber);
+  enterFiber(fiber);
+  swapcontext(from, contextOf(fiber));
+  releaseFinished();
+}
+
+// Parks the running fiber, which whoever is meant to wake it already knows
+// about, and runs the others until it's woken. False if the program failed in
+// the meantime, or nothing is ever going to wake it
+static bool suspendFiber() {
+  ObjFiber *next = nextFiber();
+  if (next == NULL) {
+    nativeError("Deadlock, every fiber is waiting.");
+    return false;
+  }
+
+  if (next != vm.fiber) {
+    switchTo(next);
+  } else {
+    next->state = FIBER_RUNNING;
+  }
+
+  if (failed) {
+    // The error has been reported, the main fiber just has to return it
+    failed = false;
+    vm.nativeFailed = true;
+    return false;
+  }
+  return true;
+}
+
+// Where every fiber but the main one starts. It never returns: when the
+// fiber's done, it switches to another for good
+static void fiberMain() {
+  releaseFinished();
+
+  ObjFiber *fiber = vm.fiber;
+  ObjFiber *next = NULL;
+  if (runFunction(fiber->callee) == INTERPRET_OK) {
+    fiber->result = vm.stackTop[-1];
+    while (fiber->waiters != NULL) {
+      ObjFiber *waiter = fiber->waiters;
+      fiber->waiters = waiter->next;
+      schedule(waiter);
+    }
+
+    next = nextFiber();
+    if (next == NULL) {
+      fprintf(stderr, "Deadlock, every fiber is waiting.\n");
+    }
+  }
+
+  vm.stackTop = vm.stack;
+  fiber->state = FIBER_DONE;
+  finished = fiber;
+
+  // After a runtime error the main fiber gives up on whatever it was waiting
+  // for, and the program ends with the error
+  if (next == NULL) {
+    failed = true;
+    resetFibers();
+    next = mainFiber;
+  }
+
+  enterFiber(next);
+  setcontext(contextOf(next));
+}
+
+// Parks the running fiber until there's something to read on fd. False if the
+// program failed in the meantime
+static bool waitReadable(int fd) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = vm.fiber;
+  if (epoll_ctl(epollFd(), EPOLL_CTL_ADD, fd, &event) == -1) {
+    // Not something epoll can watch, so wait for it with everything else on
+    // hold. Regular files end up here, but they always poll as ready, so it's
+    // the read() after this that blocks, and only for as long as the disk
+    // takes
+    struct pollfd pollFd = {fd, POLLIN, 0};
+    poll(&pollFd, 1, -1);
+    return true;
+  }
+
+  vm.fiber->state = FIBER_WAITING;
+  vm.fiber->next = waiting;
+  waiting = vm.fiber;
+  bool resumed = suspendFiber();
+
+  // After a failure the epoll instance is gone, and this with it
+  if (pollFd != -1)
+    epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, NULL);
+  return resumed;
+}
+#endif
+
+// Reads what's left of fd into a string. Whenever there's nothing to read
+// yet, other fibers get to run. NULL if it can't be read, or the program fails
+// in the meantime
+static ObjString *readAll(int fd) {
+#ifdef CLOX_FIBERS
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *buffer = (char *)malloc(capacity);
+  if (buffer == NULL)
+    exit(1);
+
+  for (;;) {
+    if (length == capacity) {
+      capacity *= 2;
+      buffer = (char *)realloc(buffer, capacity);
+      if (buffer == NULL)
+        exit(1);
+    }
+
+    ssize_t bytesRead = read(fd, buffer + length, capacity - length);
+    if (bytesRead > 0) {
+      length += (size_t)bytesRead;
+    } else if (bytesRead == 0) {
+      break;
+#ifdef CLOX_FIBERS
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!waitReadable(fd)) {
+        free(buffer);
+        return NULL;
+      }
+#endif
+    } else if (errno != EINTR) {
+      free(buffer);
+      return NULL;
+    }
+  }
+
+  ObjString *string = copyString(buffer, (int)length);
+  free(buffer);
+  return string;
+}
+
+static Value spawnNative(int argCount, Value *args) {
+  ObjFiber *fiber = newFiber(args[0]);
+
+#ifdef CLOX_FIBERS
+  schedule(fiber);
+#else
+  // Nothing can be switched out halfway, so the fiber runs right here. Its
+  // value stack is still its own
+  ObjFiber *current = vm.fiber;
+  enterFiber(fiber);
+  bool succeeded = runFunction(fiber->callee) == INTERPRET_OK;
+  if (succeeded)
+    fiber->result = vm.stackTop[-1];
+  fiber->state = FIBER_DONE;
+
+  enterFiber(current);
+  freeFiberMemory(fiber);
+  vm.nativeFailed = !succeeded;
+#endif
+
+  return OBJ_VAL(fiber);
+}
+
+static Value awaitNative(int argCount, Value *args) {
+  if (!IS_FIBER(args[0])) {
+    nativeError("Can only await a fiber.");
+    return NIL_VAL;
+  }
+
+  ObjFiber *fiber = AS_FIBER(args[0]);
+#ifdef CLOX_FIBERS
+  if (fiber->state != FIBER_DONE) {
+    vm.fiber->state = FIBER_WAITING;
+    vm.fiber->next = fiber->waiters;
+    fiber->waiters = vm.fiber;
+    if (!suspendFiber())
+      return NIL_VAL;
+  }
+#endif
+  return fiber->result;
+}
+
+static Value yieldNative(int argCount, Value *args) {
+#ifdef CLOX_FIBERS
+  schedule(vm.fiber);
+  suspendFiber();
+#endif
+  return NIL_VAL;
+}
+
+static Value sleepNative(int argCount, Value *args) {
+  if (!IS_NUMBER(args[0])) {
+    nativeError("Sleep duration must be a number.");
+    return NIL_VAL;
+  }
+  double seconds = AS_NUMBER(args[0]);
+
+#ifdef CLOX_FIBERS
+  // After the sleepers that wake at the same time, so they go in order
+  ObjFiber *fiber = vm.fiber;
+  fiber->wakeAt = now() + seconds;
+  ObjFiber **link = &sleeping;
+  if (sleepingTail != NULL && sleepingTail->wakeAt <= fiber->wakeAt) {
+    link = &sleepingTail->next;
+  } else {
+    while (*link != NULL && (*link)->wakeAt <= fiber->wakeAt) {
+      link = &(*link)->next;
+    }
+  }
+  fiber->state = FIBER_WAITING;
+  fiber->next = *link;
+  *link = fiber;
+  if (fiber->next == NULL)
+    sleepingTail = fiber;
+
+  suspendFiber();
+#else
+  if (seconds > 0) {
+    struct timespec delay;
+    delay.tv_sec = (time_t)seconds;
+    delay.tv_nsec = (long)((seconds - (double)delay.tv_sec) * 1e9);
+    nanosleep(&delay, NULL);
+  }
+#endif
+  return NIL_VAL;
+}
+
+static Value readFileNative(int argCount, Value *args) {
+  if (!IS_STRING(args[0])) {
+    nativeError("Path must be a string.");
+    return NIL_VAL;
+  }
+
+  int fd = open(AS_CSTRING(args[0]), O_RDONLY);
+  if (fd == -1)
+    return NIL_VAL;
+
+  ObjString *contents = readAll(fd);
+  close(fd);
+  return contents != NULL ? OBJ_VAL(contents) : NIL_VAL;
+}
+
+static Value execNative(int argCount, Value *args) {
+  if (!IS_STRING(args[0])) {
+    nativeError("Command must be a string.");
+    return NIL_VAL;
+  }
+
+  int fds[2];
+  if (pipe(fds) == -1)
+    return NIL_VAL;
+  // Otherwise the next command we start inherits the write end, and we don't
+  // see the end of this one's output until that one's done too
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return NIL_VAL;
+  }
+
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", AS_CSTRING(args[0]), (char *)NULL);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  ObjString *output = readAll(fds[0]);
+  close(fds[0]);
+
+#ifdef CLOX_FIBERS
+  // The program is ending, don't wait for the command to finish too
+  if (output == NULL && vm.nativeFailed)
+    kill(pid, SIGKILL);
+#endif
+  waitpid(pid, NULL, 0);
+  return output != NULL ? OBJ_VAL(output) : NIL_VAL;
+}
+
+void initFibers() {
+  readyHead = NULL;
+  readyTail = NULL;
+  sleeping = NULL;
+  sleepingTail = NULL;
+  waiting = NULL;
+  finished = NULL;
+  failed = false;
+
+  mainFiber = newFiber(NIL_VAL);
+  enterFiber(mainFiber);
+
+  defineNative("spawn", spawnNative, 1);
+  defineNative("await", awaitNative, 1);
+  defineNative("yield", yieldNative, 0);
+  defineNative("sleep", sleepNative, 1);
+  defineNative("readFile", readFileNative, 1);
+  defineNative("exec", execNative, 1);
+}
+
+void freeFibers() {
+  resetFibers();
+  mainFiber = NULL;
+  finished = NULL;
+
+#ifdef CLOX_FIBERS
+  while (spareCount > 0) {
+    FiberMemory *memory = spareMemory[--spareCount];
+    munmap(memory->base, memory->size);
+  }
+#endif
+}
+
+// Forgets every fiber that's waiting to run. It's how a runtime error ends
+// them all
+void resetFibers() {
+  readyHead = NULL;
+  readyTail = NULL;
+  sleeping = NULL;
+  sleepingTail = NULL;
+  waiting = NULL;
+
+#ifdef CLOX_FIBERS
+  // Closing it drops every registration at once
+  if (pollFd != -1) {
+    close(pollFd);
+    pollFd = -1;
+  }
+#endif
+}
+
+void markFiberRoots() {
+  markObject((Obj *)mainFiber);
+  markObject((Obj *)finished);
+
+  // Marking a fiber marks the next one in its list, so this is every queue
+  markObject((Obj *)readyHead);
+  markObject((Obj *)sleeping);
+  markObject((Obj *)waiting);
+}
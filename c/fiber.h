@@ -0,0 +1,47 @@
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include "object.h"
+
+// Fibers switch C stacks with ucontext and park on I/O with epoll, both of
+// which we only rely on under Linux. Elsewhere spawn() runs its function to
+// completion right away, and the natives that would park a fiber just block
+#ifdef __linux__
+#define CLOX_FIBERS
+#endif
+
+// Room for the C code a fiber runs: the interpreter loop, natives, and the
+// compiler if it imports something. Like the value stack, its pages are only
+// committed once they're touched
+#define FIBER_C_STACK (256 * 1024)
+
+// Fibers are scheduled cooperatively, one at a time, by the VM. The script
+// runs on the main fiber, and these natives manage the rest:
+//
+//   spawn(fn)         Makes a fiber that will call fn, and queues it to run.
+//   await(fiber)      Parks the caller until the fiber is done, and returns
+//                     what fn returned.
+//   yield()           Lets every other fiber that's ready run first.
+//   sleep(seconds)    Parks the caller for a while.
+//   readFile(path)    The file's contents, or nil if it can't be read.
+//   exec(command)     Runs a shell command, and returns what it wrote to
+//                     standard output.
+//
+// While a fiber waits on a pipe or socket, or sleeps, the others run. Once
+// none of them can, the VM blocks in epoll_wait() until one can again. Regular
+// files are the exception: epoll can't watch them, so readFile() on one is a
+// plain blocking read, and every other fiber waits until it's done.
+//
+// A fiber that never gets to park runs as long as it likes: the main fiber
+// has to await, yield or wait on something before any other one starts. When
+// the script ends, fibers that haven't finished are abandoned, and a runtime
+// error in any fiber ends the whole program.
+
+void initFibers();
+void freeFibers();
+void resetFibers();
+void markFiberRoots();
+void allocateFiberMemory(ObjFiber *fiber);
+void freeFiberMemory(ObjFiber *fiber);
+
+#endif
@@ -0,0 +1,1210 @@
+// For mmap() under -std=c99. g++ defines it for us
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "register.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC "CLOXIMG"
+#define IMAGE_VERSION 2
+
+// Something that differs between builds of clox, to refuse images from
+// another one
+#define BUILD_FINGERPRINT ((uint64_t)((uintptr_t)freeVM - (uintptr_t)initVM))
+
+// Objects are written out grouped by type, in this order, so that the first
+// loading pass always finds what it needs to create an object already made:
+// a closure's function, a bound method's closure, an instance's class
+static int typeRank(ObjType type) {
+  switch (type) {
+  case OBJ_STRING:
+    return 0;
+  case OBJ_FUNCTION:
+    return 1;
+  case OBJ_NATIVE:
+    return 2;
+  case OBJ_SHAPE:
+    return 3;
+  case OBJ_CLASS:
+    return 4;
+  case OBJ_CLOSURE:
+    return 5;
+  case OBJ_UPVALUE:
+    return 6;
+  case OBJ_BOUND_METHOD:
+    return 7;
+  case OBJ_INSTANCE:
+    return 8;
+  case OBJ_LIST:
+    return 9;
+  case OBJ_MAP:
+    return 10;
+  default:
+    return 11;
+  }
+}
+
+// Saving only reads the heap, and everything it needs for itself lives
+// outside it, so it can't set off a collection
+
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+static void putBytes(Buffer *buffer, const void *data, size_t size) {
+  if (buffer->count + size > buffer->capacity) {
+    size_t capacity = buffer->capacity < 1024 ? 1024 : buffer->capacity;
+    while (capacity < buffer->count + size) {
+      capacity *= 2;
+    }
+    buffer->bytes = (uint8_t *)realloc(buffer->bytes, capacity);
+    if (buffer->bytes == NULL)
+      exit(1);
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->bytes + buffer->count, data, size);
+  buffer->count += size;
+}
+
+static void writeU8(Buffer *buffer, uint8_t value) {
+  putBytes(buffer, &value, sizeof(value));
+}
+
+static void writeU32(Buffer *buffer, uint32_t value) {
+  putBytes(buffer, &value, sizeof(value));
+}
+
+// Every object the image holds, in the order they were found, and a hash
+// table from each one to its number
+typedef struct {
+  Obj *object;
+  uint32_t id;
+} ObjectEntry;
+
+typedef struct {
+  Obj **objects;
+  int count;
+  int capacity;
+  ObjectEntry *entries;
+  int entryCapacity;
+  // Set on finding something that can't be saved
+  bool failed;
+} ObjectSet;
+
+static uint32_t hashPointer(Obj *object) {
+  uint64_t bits = (uint64_t)(uintptr_t)object;
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static ObjectEntry *findEntry(ObjectEntry *entries, int capacity,
+                              Obj *object) {
+  uint32_t index = hashPointer(object) & (capacity - 1);
+  for (;;) {
+    ObjectEntry *entry = &entries[index];
+    if (entry->object == object || entry->object == NULL)
+      return entry;
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void addObject(ObjectSet *set, Obj *object) {
+  if (object == NULL)
+    return;
+
+  if (set->count + 1 > set->entryCapacity / 2) {
+    int capacity = set->entryCapacity < 64 ? 64 : set->entryCapacity * 2;
+    ObjectEntry *entries =
+        (ObjectEntry *)calloc((size_t)capacity, sizeof(ObjectEntry));
+    if (entries == NULL)
+      exit(1);
+    for (int i = 0; i < set->entryCapacity; i++) {
+      if (set->entries[i].object != NULL)
+        *findEntry(entries, capacity, set->entries[i].object) =
+            set->entries[i];
+    }
+    free(set->entries);
+    set->entries = entries;
+    set->entryCapacity = capacity;
+  }
+
+  ObjectEntry *entry = findEntry(set->entries, set->entryCapacity, object);
+  if (entry->object != NULL)
+    return;
+  entry->object = object;
+  entry->id = 0;
+
+  if (object->type == OBJ_FIBER) {
+    fprintf(stderr, "Can't save a fiber in an image.\n");
+    set->failed = true;
+  }
+
+  if (set->count + 1 > set->capacity) {
+    set->capacity = GROW_CAPACITY(set->capacity);
+    set->objects =
+        (Obj **)realloc(set->objects, sizeof(Obj *) * set->capacity);
+    if (set->objects == NULL)
+      exit(1);
+  }
+  set->objects[set->count++] = object;
+}
+
+static void addValue(ObjectSet *set, Value value) {
+  if (IS_OBJ(value))
+    addObject(set, AS_OBJ(value));
+}
+
+static void addTable(ObjectSet *set, Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      addObject(set, (Obj *)entry->key);
+      addValue(set, entry->value);
+    }
+  }
+}
+
+static bool isLiveKey(Value key) { return !IS_OBJ(key) || AS_OBJ(key) != NULL; }
+
+// Adds everything the object refers to, the way the collector traces it
+static void addReferences(ObjectSet *set, Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    addValue(set, bound->receiver);
+    addObject(set, (Obj *)bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    addObject(set, (Obj *)klass->name);
+    addObject(set, (Obj *)klass->initializer);
+    addTable(set, &klass->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    addObject(set, (Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      addObject(set, (Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    addObject(set, (Obj *)function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++) {
+      addValue(set, function->chunk.constants.values[i]);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    addObject(set, (Obj *)instance->klass);
+    addObject(set, (Obj *)instance->shape);
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      addValue(set, instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_LIST: {
+    ValueArray *items = &((ObjList *)object)->items;
+    for (int i = 0; i < items->count; i++) {
+      addValue(set, items->values[i]);
+    }
+    break;
+  }
+  case OBJ_MAP: {
+    ValueTable *table = &((ObjMap *)object)->table;
+    for (int i = 0; i < table->capacity; i++) {
+      if (isLiveKey(table->entries[i].key)) {
+        addValue(set, table->entries[i].key);
+        addValue(set, table->entries[i].value);
+      }
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    addTable(set, &shape->slots);
+    addTable(set, &shape->transitions);
+    break;
+  }
+  case OBJ_UPVALUE:
+    addValue(set, *((ObjUpvalue *)object)->location);
+    break;
+  case OBJ_FIBER:
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+static ObjectSet *sortSet;
+
+// By type, and in the order they were found within a type
+static int compareObjects(const void *a, const void *b) {
+  Obj *objectA = *(Obj *const *)a;
+  Obj *objectB = *(Obj *const *)b;
+  int rankA = typeRank(objectA->type);
+  int rankB = typeRank(objectB->type);
+  if (rankA != rankB)
+    return rankA - rankB;
+
+  uint32_t foundA =
+      findEntry(sortSet->entries, sortSet->entryCapacity, objectA)->id;
+  uint32_t foundB =
+      findEntry(sortSet->entries, sortSet->entryCapacity, objectB)->id;
+  return foundA < foundB ? -1 : foundA > foundB;
+}
+
+static void writeReference(Buffer *buffer, ObjectSet *set, Obj *object) {
+  if (object == NULL) {
+    writeU32(buffer, 0);
+  } else {
+    writeU32(buffer, findEntry(set->entries, set->entryCapacity, object)->id);
+  }
+}
+
+static void writeValue(Buffer *buffer, ObjectSet *set, Value value) {
+  writeU8(buffer, (uint8_t)value.type);
+  switch (value.type) {
+  case VAL_BOOL:
+    writeU8(buffer, AS_BOOL(value) ? 1 : 0);
+    break;
+  case VAL_NIL:
+    break;
+  case VAL_NUMBER: {
+    double number = AS_NUMBER(value);
+    putBytes(buffer, &number, sizeof(number));
+    break;
+  }
+  case VAL_OBJ:
+    writeReference(buffer, set, AS_OBJ(value));
+    break;
+  }
+}
+
+static void writeTable(Buffer *buffer, ObjectSet *set, Table *table) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL)
+      count++;
+  }
+
+  writeU32(buffer, count);
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      writeReference(buffer, set, (Obj *)entry->key);
+      writeValue(buffer, set, entry->value);
+    }
+  }
+}
+
+// What the first loading pass needs to create the object comes first, then
+// everything the second fills in
+static void writeObject(Buffer *buffer, ObjectSet *set, Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    writeReference(buffer, set, (Obj *)bound->method);
+    writeValue(buffer, set, bound->receiver);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    writeU32(buffer, (uint32_t)klass->fieldCapacity);
+    writeReference(buffer, set, (Obj *)klass->name);
+    writeReference(buffer, set, (Obj *)klass->initializer);
+    writeTable(buffer, set, &klass->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    writeReference(buffer, set, (Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      writeReference(buffer, set, (Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    Chunk *chunk = &function->chunk;
+    writeU32(buffer, (uint32_t)function->arity);
+    writeU32(buffer, (uint32_t)function->upvalueCount);
+    writeReference(buffer, set, (Obj *)function->name);
+
+    writeU32(buffer, (uint32_t)chunk->count);
+    putBytes(buffer, chunk->code, (size_t)chunk->count);
+    writeU32(buffer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+      writeValue(buffer, set, chunk->constants.values[i]);
+    }
+    writeU32(buffer, (uint32_t)chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++) {
+      writeU32(buffer, (uint32_t)chunk->lines[i].offset);
+      writeU32(buffer, (uint32_t)chunk->lines[i].line);
+    }
+    writeU32(buffer, (uint32_t)chunk->cacheCount);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    writeReference(buffer, set, (Obj *)instance->klass);
+    writeReference(buffer, set, (Obj *)instance->shape);
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      writeValue(buffer, set, instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_LIST: {
+    ValueArray *items = &((ObjList *)object)->items;
+    writeU32(buffer, (uint32_t)items->count);
+    for (int i = 0; i < items->count; i++) {
+      writeValue(buffer, set, items->values[i]);
+    }
+    break;
+  }
+  case OBJ_MAP: {
+    ValueTable *table = &((ObjMap *)object)->table;
+    uint32_t count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+      if (isLiveKey(table->entries[i].key))
+        count++;
+    }
+    writeU32(buffer, count);
+    for (int i = 0; i < table->capacity; i++) {
+      if (isLiveKey(table->entries[i].key)) {
+        writeValue(buffer, set, table->entries[i].key);
+        writeValue(buffer, set, table->entries[i].value);
+      }
+    }
+    break;
+  }
+  case OBJ_NATIVE: {
+    ObjNative *native = (ObjNative *)object;
+    uint64_t offset =
+        (uint64_t)((uintptr_t)native->function - (uintptr_t)initVM);
+    putBytes(buffer, &offset, sizeof(offset));
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    writeU8(buffer, shape == vm.rootShape ? 1 : 0);
+    writeU32(buffer, (uint32_t)shape->fieldCount);
+    writeTable(buffer, set, &shape->slots);
+    writeTable(buffer, set, &shape->transitions);
+    break;
+  }
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    writeU32(buffer, (uint32_t)string->length);
+    putBytes(buffer, string->chars, (size_t)string->length);
+    break;
+  }
+  case OBJ_UPVALUE:
+    writeValue(buffer, set, *((ObjUpvalue *)object)->location);
+    break;
+  case OBJ_FIBER:
+    break;
+  }
+}
+
+// FNV-1a over everything in the image after its checksum, so a file that was
+// damaged on the way is turned away before anything in it is used
+static uint64_t checksum(const uint8_t *bytes, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Writes the whole image for the objects in set into buffer
+static void writeImage(Buffer *buffer, ObjectSet *set) {
+  // Number the objects in the order they'll be written. Until then, each
+  // entry's id is where it was found, for a stable sort
+  for (int i = 0; i < set->count; i++) {
+    findEntry(set->entries, set->entryCapacity, set->objects[i])->id =
+        (uint32_t)i;
+  }
+  sortSet = set;
+  qsort(set->objects, (size_t)set->count, sizeof(Obj *), compareObjects);
+  for (int i = 0; i < set->count; i++) {
+    findEntry(set->entries, set->entryCapacity, set->objects[i])->id =
+        (uint32_t)i + 1;
+  }
+
+  putBytes(buffer, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  writeU32(buffer, IMAGE_VERSION);
+  uint64_t fingerprint = BUILD_FINGERPRINT;
+  putBytes(buffer, &fingerprint, sizeof(fingerprint));
+  size_t checksumAt = buffer->count;
+  uint64_t sum = 0;
+  putBytes(buffer, &sum, sizeof(sum));
+  writeU32(buffer, (uint32_t)set->count);
+
+  // Each object is its type and the size of the rest, so the first pass can
+  // skip what it doesn't need yet
+  for (int i = 0; i < set->count; i++) {
+    writeU8(buffer, (uint8_t)set->objects[i]->type);
+    size_t sizeAt = buffer->count;
+    writeU32(buffer, 0);
+    writeObject(buffer, set, set->objects[i]);
+    uint32_t size = (uint32_t)(buffer->count - sizeAt - sizeof(uint32_t));
+    memcpy(buffer->bytes + sizeAt, &size, sizeof(size));
+  }
+
+  writeTable(buffer, set, &vm.globals);
+  writeTable(buffer, set, &vm.modules);
+  writeReference(buffer, set, (Obj *)vm.rootShape);
+
+  size_t bodyAt = checksumAt + sizeof(sum);
+  sum = checksum(buffer->bytes + bodyAt, buffer->count - bodyAt);
+  memcpy(buffer->bytes + checksumAt, &sum, sizeof(sum));
+}
+
+bool saveImage(const char *path) {
+  ObjectSet set;
+  memset(&set, 0, sizeof(set));
+
+  addTable(&set, &vm.globals);
+  addTable(&set, &vm.modules);
+  addObject(&set, (Obj *)vm.rootShape);
+  for (int i = 0; i < set.count; i++) {
+    addReferences(&set, set.objects[i]);
+  }
+
+  bool saved = false;
+  Buffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  if (!set.failed) {
+    writeImage(&buffer, &set);
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", path);
+    } else {
+      saved = fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+      saved &= fclose(file) == 0;
+      if (!saved)
+        fprintf(stderr, "Could not write file \"%s\".\n", path);
+    }
+  }
+
+  free(buffer.bytes);
+  free(set.objects);
+  free(set.entries);
+  return saved;
+}
+
+// Loading reads the mapped file through one of these, which stops at the end
+// of what it was given instead of running off it
+typedef struct {
+  const uint8_t *current;
+  const uint8_t *end;
+  bool failed;
+} Reader;
+
+static void readBytes(Reader *reader, void *data, size_t size) {
+  if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+    reader->failed = true;
+    memset(data, 0, size);
+    return;
+  }
+
+  memcpy(data, reader->current, size);
+  reader->current += size;
+}
+
+static uint8_t readU8(Reader *reader) {
+  uint8_t value;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+static uint32_t readU32(Reader *reader) {
+  uint32_t value;
+  readBytes(reader, &value, sizeof(value));
+  return value;
+}
+
+// Every object loaded so far by number, with 0 for NULL. The collector marks
+// them all until loading is done
+static Obj **loaded = NULL;
+static uint32_t loadedCount = 0;
+
+void markImageRoots() {
+  for (uint32_t i = 1; i < loadedCount; i++) {
+    markObject(loaded[i]);
+  }
+}
+
+// A reference to an object that has been created already and has the type
+// asked for. Any other reference, or NULL where that's not allowed, means the
+// image is corrupt
+static Obj *readReference(Reader *reader, ObjType type, bool nullable) {
+  uint32_t id = readU32(reader);
+  if (id == 0 && nullable)
+    return NULL;
+
+  if (id == 0 || id >= loadedCount || loaded[id] == NULL ||
+      loaded[id]->type != type) {
+    reader->failed = true;
+    return NULL;
+  }
+  return loaded[id];
+}
+
+static Value readValue(Reader *reader) {
+  switch (readU8(reader)) {
+  case VAL_BOOL:
+    return BOOL_VAL(readU8(reader) != 0);
+  case VAL_NIL:
+    return NIL_VAL;
+  case VAL_NUMBER: {
+    double number;
+    readBytes(reader, &number, sizeof(number));
+    return NUMBER_VAL(number);
+  }
+  case VAL_OBJ: {
+    uint32_t id = readU32(reader);
+    if (id == 0 || id >= loadedCount || loaded[id] == NULL)
+      break;
+    return OBJ_VAL(loaded[id]);
+  }
+  }
+
+  reader->failed = true;
+  return NIL_VAL;
+}
+
+static void readTable(Reader *reader, Table *table) {
+  uint32_t count = readU32(reader);
+  for (uint32_t i = 0; i < count && !reader->failed; i++) {
+    ObjString *key = (ObjString *)readReference(reader, OBJ_STRING, false);
+    Value value = readValue(reader);
+    if (!reader->failed)
+      tableSet(table, key, value);
+  }
+}
+
+// The natives the VM has defined, which image natives are matched against
+typedef struct {
+  ObjNative **natives;
+  int count;
+} NativeList;
+
+// The first pass: makes the object, as empty as the collector can safely
+// look at, from what comes first in its record
+static Obj *createObject(Reader *reader, ObjType type, NativeList *natives) {
+  switch (type) {
+  case OBJ_BOUND_METHOD: {
+    ObjClosure *method =
+        (ObjClosure *)readReference(reader, OBJ_CLOSURE, false);
+    return reader->failed ? NULL : (Obj *)newBoundMethod(NIL_VAL, method);
+  }
+  case OBJ_CLASS: {
+    uint32_t fieldCapacity = readU32(reader);
+    if (reader->failed || fieldCapacity > INT32_MAX)
+      return NULL;
+    ObjClass *klass = newClass(NULL);
+    klass->fieldCapacity = (int)fieldCapacity;
+    return (Obj *)klass;
+  }
+  case OBJ_CLOSURE: {
+    ObjFunction *function =
+        (ObjFunction *)readReference(reader, OBJ_FUNCTION, false);
+    return reader->failed ? NULL : (Obj *)newClosure(function);
+  }
+  case OBJ_FUNCTION: {
+    uint32_t arity = readU32(reader);
+    uint32_t upvalueCount = readU32(reader);
+    if (reader->failed || arity > 255 || upvalueCount > UINT8_COUNT)
+      return NULL;
+    ObjFunction *function = newFunction();
+    function->arity = (int)arity;
+    function->upvalueCount = (int)upvalueCount;
+    return (Obj *)function;
+  }
+  case OBJ_INSTANCE: {
+    ObjClass *klass = (ObjClass *)readReference(reader, OBJ_CLASS, false);
+    return reader->failed ? NULL : (Obj *)newInstance(klass);
+  }
+  case OBJ_LIST:
+    return (Obj *)newList();
+  case OBJ_MAP:
+    return (Obj *)newMap();
+  case OBJ_NATIVE: {
+    uint64_t offset;
+    readBytes(reader, &offset, sizeof(offset));
+    for (int i = 0; i < natives->count && !reader->failed; i++) {
+      uint64_t nativeOffset = (uint64_t)(
+          (uintptr_t)natives->natives[i]->function - (uintptr_t)initVM);
+      if (nativeOffset == offset)
+        return (Obj *)natives->natives[i];
+    }
+    return NULL;
+  }
+  case OBJ_SHAPE: {
+    bool isRoot = readU8(reader) != 0;
+    uint32_t fieldCount = readU32(reader);
+    if (reader->failed || fieldCount > INT32_MAX || (isRoot && fieldCount > 0))
+      return NULL;
+    if (isRoot)
+      return (Obj *)vm.rootShape;
+    ObjShape *shape = newShape();
+    shape->fieldCount = (int)fieldCount;
+    return (Obj *)shape;
+  }
+  case OBJ_STRING: {
+    uint32_t length = readU32(reader);
+    if (reader->failed || length > INT32_MAX ||
+        (size_t)(reader->end - reader->current) < length)
+      return NULL;
+    ObjString *string = copyString((const char *)reader->current, (int)length);
+    reader->current += length;
+    return (Obj *)string;
+  }
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = newUpvalue(NULL);
+    upvalue->location = &upvalue->closed;
+    return (Obj *)upvalue;
+  }
+  default:
+    return NULL;
+  }
+}
+
+// Whether the constant at index exists and is the type of object the VM will
+// take it for without looking
+static bool isConstant(Chunk *chunk, int index, ObjType type) {
+  return index < chunk->constants.count &&
+         IS_OBJ(chunk->constants.values[index]) &&
+         OBJ_TYPE(chunk->constants.values[index]) == type;
+}
+
+static int readOperand16(uint8_t *code) { return code[0] << 8 | code[1]; }
+
+// The operands the VM trusts without checking, checked once here: constants
+// and their types, inline caches, upvalues, and the pairs after OP_CLOSURE.
+// Sets *length to the instruction's length, or returns false if it's
+// unknown, runs off the end or has an operand out of range
+static bool checkOperands(ObjFunction *function, int offset, int *length) {
+  Chunk *chunk = &function->chunk;
+  uint8_t *code = &chunk->code[offset];
+  int left = chunk->count - offset;
+
+  if (code[0] > OP_INDEX_SET)
+    return false;
+  // The length of OP_CLOSURE comes from its function, so that's checked first
+  if (code[0] == OP_CLOSURE &&
+      (left < 2 || !isConstant(chunk, code[1], OBJ_FUNCTION)))
+    return false;
+  *length = instructionLength(chunk, offset);
+  if (*length > left)
+    return false;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    return code[1] < chunk->constants.count;
+  case OP_CONSTANT_LONG:
+    return (code[1] | code[2] << 8 | code[3] << 16) < chunk->constants.count;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_SUPER:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_IMPORT:
+    return isConstant(chunk, code[1], OBJ_STRING);
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+    return isConstant(chunk, code[1], OBJ_STRING) &&
+           readOperand16(code + 2) < chunk->cacheCount;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    return isConstant(chunk, code[1], OBJ_STRING) &&
+           readOperand16(code + 3) < chunk->cacheCount;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    return code[1] < function->upvalueCount;
+  case OP_CLOSURE:
+    // Locals are checked against the stack depth later
+    for (int i = 2; i < *length; i += 2) {
+      bool isLocal = code[i] == 1;
+      if (code[i] > 1 || (!isLocal && code[i + 1] >= function->upvalueCount))
+        return false;
+    }
+    return true;
+  default:
+    return true;
+  }
+}
+
+// How many values the instruction takes off the stack, and how many it puts
+// back. A call's callee and arguments make way for its result
+static void stackUse(uint8_t *code, int *pops, int *pushes) {
+  *pops = 0;
+  *pushes = 1;
+  switch (code[0]) {
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+    *pops = 1;
+    *pushes = 0;
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_UPVALUE:
+  case OP_GET_PROPERTY:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_JUMP_IF_FALSE:
+    *pops = 1;
+    break;
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_INHERIT:
+  case OP_METHOD:
+  case OP_INDEX_GET:
+    *pops = 2;
+    break;
+  case OP_INDEX_SET:
+    *pops = 3;
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    *pushes = 0;
+    break;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    *pops = code[1] + 1;
+    break;
+  case OP_INVOKE:
+  case OP_TAIL_INVOKE:
+    *pops = code[2] + 1;
+    break;
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    *pops = code[2] + 2;
+    break;
+  case OP_BUILD_LIST:
+    *pops = code[1];
+    break;
+  default:
+    break;
+  }
+}
+
+// An image's bytecode is checked before any of it can run, since the VM
+// assumes it's the way the compiler left it. Besides each instruction's own
+// operands, that means every jump landing on an instruction, and every path
+// into an instruction agreeing on the stack depth, the same walk the register
+// translator makes. With that known, no instruction takes more values than
+// the frame has, and every local slot it names is there
+static bool checkCode(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int count = chunk->count;
+  if (count == 0)
+    return false;
+
+  // The depth before each instruction, -1 until a path reaches it, and -2 in
+  // the middle of one
+  int *depths = (int *)malloc(sizeof(int) * count);
+  int *pending = (int *)malloc(sizeof(int) * count);
+  if (depths == NULL || pending == NULL)
+    exit(1);
+
+  bool valid = true;
+  for (int offset = 0; offset < count && valid;) {
+    int length = 1;
+    valid = checkOperands(function, offset, &length);
+    depths[offset] = -1;
+    for (int i = 1; i < length && valid; i++) {
+      depths[offset + i] = -2;
+    }
+    offset += length;
+  }
+
+  int pendingCount = 0;
+  if (valid) {
+    depths[0] = function->arity + 1;
+    pending[pendingCount++] = 0;
+  }
+
+  while (pendingCount > 0 && valid) {
+    int offset = pending[--pendingCount];
+    uint8_t *code = &chunk->code[offset];
+    int depth = depths[offset];
+
+    int pops, pushes;
+    stackUse(code, &pops, &pushes);
+    valid = pops <= depth;
+    if ((code[0] == OP_GET_LOCAL || code[0] == OP_SET_LOCAL) &&
+        code[1] >= depth)
+      valid = false;
+    int after = depth - pops + pushes;
+    if (code[0] == OP_CLOSURE) {
+      // A local function can capture itself, in the slot the closure goes in
+      int length = instructionLength(chunk, offset);
+      for (int i = 2; i < length; i += 2) {
+        if (code[i] == 1 && code[i + 1] >= after)
+          valid = false;
+      }
+    }
+
+    int successors[2];
+    int successorCount = 0;
+    switch (code[0]) {
+    case OP_RETURN:
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      successors[successorCount++] = offset + 3 + readOperand16(code + 1);
+      if (code[0] == OP_JUMP_IF_FALSE)
+        successors[successorCount++] = offset + 3;
+      break;
+    case OP_LOOP:
+      successors[successorCount++] = offset + 3 - readOperand16(code + 1);
+      break;
+    default:
+      successors[successorCount++] =
+          offset + instructionLength(chunk, offset);
+      break;
+    }
+
+    for (int i = 0; i < successorCount && valid; i++) {
+      int next = successors[i];
+      if (next < 0 || next >= count || depths[next] == -2) {
+        valid = false;
+      } else if (depths[next] == -1) {
+        depths[next] = after;
+        pending[pendingCount++] = next;
+      } else if (depths[next] != after) {
+        valid = false;
+      }
+    }
+  }
+
+  free(depths);
+  free(pending);
+  return valid;
+}
+
+// Rebuilds a function's chunk the way the compiler leaves it: frozen, and
+// translated for the register VM if that's in use
+static void fillFunction(Reader *reader, ObjFunction *function) {
+  function->name = (ObjString *)readReference(reader, OBJ_STRING, true);
+
+  uint32_t count = readU32(reader);
+  if (reader->failed || count > INT32_MAX ||
+      (size_t)(reader->end - reader->current) < count) {
+    reader->failed = true;
+    return;
+  }
+  const uint8_t *code = reader->current;
+  reader->current += count;
+
+  Chunk *chunk = &function->chunk;
+  uint32_t constantCount = readU32(reader);
+  for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+    Value value = readValue(reader);
+    if (!reader->failed)
+      addConstant(chunk, value);
+  }
+
+  // Each run of code on one line is written with that line
+  reserveChunk(chunk, (int)count);
+  uint32_t lineCount = readU32(reader);
+  uint32_t offset = 0;
+  int line = 0;
+  for (uint32_t i = 0; i <= lineCount && !reader->failed; i++) {
+    uint32_t next = count;
+    int nextLine = 0;
+    if (i < lineCount) {
+      next = readU32(reader);
+      nextLine = (int)readU32(reader);
+    }
+    if (next < offset || next > count || (i == 0 && next != 0 && count > 0)) {
+      reader->failed = true;
+      return;
+    }
+    if (next > offset)
+      writeBytes(chunk, code + offset, (int)(next - offset), line);
+    offset = next;
+    line = nextLine;
+  }
+
+  uint32_t cacheCount = readU32(reader);
+  if (reader->failed || cacheCount > count) {
+    reader->failed = true;
+    return;
+  }
+  for (uint32_t i = 0; i < cacheCount; i++) {
+    addInlineCache(chunk);
+  }
+
+  if (!checkCode(function)) {
+    reader->failed = true;
+    return;
+  }
+
+  if (vm.useRegisters)
+    compileRegisters(function);
+  freezeChunk(chunk);
+}
+
+// Instances trust their shape for where each field is, and a new field goes
+// right after the last, so every slot has to be one of the shape's fields and
+// every transition has to add exactly one. The shape a transition leads to
+// may not be filled in yet, but its field count came with the first pass
+static bool checkShape(ObjShape *shape) {
+  for (int i = 0; i < shape->slots.capacity; i++) {
+    Entry *entry = &shape->slots.entries[i];
+    if (entry->key == NULL)
+      continue;
+    if (!IS_NUMBER(entry->value))
+      return false;
+    double slot = AS_NUMBER(entry->value);
+    // Written so NaN fails too
+    if (!(slot >= 0 && slot < shape->fieldCount) || slot != (int)slot)
+      return false;
+  }
+
+  for (int i = 0; i < shape->transitions.capacity; i++) {
+    Entry *entry = &shape->transitions.entries[i];
+    if (entry->key == NULL)
+      continue;
+    if (!IS_OBJ(entry->value) || OBJ_TYPE(entry->value) != OBJ_SHAPE ||
+        ((ObjShape *)AS_OBJ(entry->value))->fieldCount !=
+            shape->fieldCount + 1)
+      return false;
+  }
+  return true;
+}
+
+// The second pass: fills in the rest of the record, now that every object it
+// can refer to exists
+static void fillObject(Reader *reader, Obj *object) {
+  switch (object->type) {
+  case OBJ_BOUND_METHOD:
+    ((ObjBoundMethod *)object)->receiver = readValue(reader);
+    break;
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    klass->name = (ObjString *)readReference(reader, OBJ_STRING, false);
+    klass->initializer =
+        (ObjClosure *)readReference(reader, OBJ_CLOSURE, true);
+    readTable(reader, &klass->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      closure->upvalues[i] =
+          (ObjUpvalue *)readReference(reader, OBJ_UPVALUE, false);
+    }
+    break;
+  }
+  case OBJ_FUNCTION:
+    fillFunction(reader, (ObjFunction *)object);
+    break;
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    ObjShape *shape = (ObjShape *)readReference(reader, OBJ_SHAPE, false);
+    if (reader->failed)
+      break;
+    instanceSetShape(instance, shape);
+    for (int i = 0; i < shape->fieldCount; i++) {
+      instance->fields[i] = readValue(reader);
+    }
+    break;
+  }
+  case OBJ_LIST: {
+    ObjList *list = (ObjList *)object;
+    uint32_t count = readU32(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+      Value value = readValue(reader);
+      writeValueArray(&list->items, value);
+    }
+    break;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)object;
+    uint32_t count = readU32(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; i++) {
+      Value key = readValue(reader);
+      Value value = readValue(reader);
+      if (!reader->failed)
+        valueTableSet(&map->table, key, value);
+    }
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    readTable(reader, &shape->slots);
+    readTable(reader, &shape->transitions);
+    if (!reader->failed && !checkShape(shape))
+      reader->failed = true;
+    break;
+  }
+  case OBJ_UPVALUE:
+    ((ObjUpvalue *)object)->closed = readValue(reader);
+    break;
+  case OBJ_FIBER:
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+static bool loadObjects(Reader *reader) {
+  char magic[sizeof(IMAGE_MAGIC)];
+  readBytes(reader, magic, sizeof(magic));
+  uint32_t version = readU32(reader);
+  uint64_t fingerprint;
+  readBytes(reader, &fingerprint, sizeof(fingerprint));
+  if (reader->failed || memcmp(magic, IMAGE_MAGIC, sizeof(magic)) != 0 ||
+      version != IMAGE_VERSION) {
+    fprintf(stderr, "Not a clox image.\n");
+    return false;
+  }
+  if (fingerprint != BUILD_FINGERPRINT) {
+    fprintf(stderr, "The image was saved by a different build of clox.\n");
+    return false;
+  }
+  uint64_t sum;
+  readBytes(reader, &sum, sizeof(sum));
+  size_t rest = (size_t)(reader->end - reader->current);
+  if (reader->failed || sum != checksum(reader->current, rest)) {
+    fprintf(stderr, "The image is corrupt.\n");
+    return false;
+  }
+
+  uint32_t count = readU32(reader);
+  if (reader->failed || count >= INT32_MAX)
+    return false;
+
+  // Where the rest of each object's record starts and ends, for the second
+  // pass
+  const uint8_t **bodies =
+      (const uint8_t **)malloc(sizeof(uint8_t *) * 2 * ((size_t)count + 1));
+  loaded = (Obj **)calloc((size_t)count + 1, sizeof(Obj *));
+  if (bodies == NULL || loaded == NULL)
+    exit(1);
+  loadedCount = 1;
+
+  NativeList natives = {NULL, 0};
+  for (Obj *object = vm.objects; object != NULL; object = object->next) {
+    if (object->type != OBJ_NATIVE)
+      continue;
+    natives.natives = (ObjNative **)realloc(
+        natives.natives, sizeof(ObjNative *) * (natives.count + 1));
+    if (natives.natives == NULL)
+      exit(1);
+    natives.natives[natives.count++] = (ObjNative *)object;
+  }
+
+  for (uint32_t id = 1; id <= count && !reader->failed; id++) {
+    ObjType type = (ObjType)readU8(reader);
+    uint32_t size = readU32(reader);
+    if (reader->failed || (size_t)(reader->end - reader->current) < size) {
+      reader->failed = true;
+      break;
+    }
+
+    Reader record = {reader->current, reader->current + size, false};
+    loaded[id] = createObject(&record, type, &natives);
+    loadedCount = id + 1;
+    if (record.failed || loaded[id] == NULL) {
+      reader->failed = true;
+      break;
+    }
+    bodies[2 * id] = record.current;
+    bodies[2 * id + 1] = record.end;
+    reader->current += size;
+  }
+  free(natives.natives);
+
+  for (uint32_t id = 1; id <= count && !reader->failed; id++) {
+    Reader record = {bodies[2 * id], bodies[2 * id + 1], false};
+    fillObject(&record, loaded[id]);
+    reader->failed |= record.failed;
+  }
+  free(bodies);
+
+  if (!reader->failed) {
+    readTable(reader, &vm.globals);
+    readTable(reader, &vm.modules);
+    Obj *rootShape = readReference(reader, OBJ_SHAPE, true);
+    reader->failed |= rootShape != NULL && rootShape != (Obj *)vm.rootShape;
+  }
+
+  if (reader->failed)
+    fprintf(stderr, "The image is corrupt.\n");
+  return !reader->failed;
+}
+
+bool loadImage(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == -1 || info.st_size == 0) {
+    fprintf(stderr, "Not a clox image.\n");
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t)info.st_size;
+  void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bytes == MAP_FAILED) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    return false;
+  }
+
+  Reader reader = {(const uint8_t *)bytes, (const uint8_t *)bytes + size,
+                   false};
+  bool ok = loadObjects(&reader);
+
+  free(loaded);
+  loaded = NULL;
+  loadedCount = 0;
+  munmap(bytes, size);
+  return ok;
+}
@@ -0,0 +1,40 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "common.h"
+
+// "clox --save-image setup.img setup.lox" runs setup.lox and then writes out
+// what it left behind: every global, everything reachable from them, and the
+// modules it imported. "clox --image setup.img script.lox" loads that before
+// running script.lox, which starts out seeing the same globals as if
+// setup.lox had just run in front of it, without running any of it.
+//
+// An image holds objects, not addresses. Each object is numbered and a
+// reference to it is written as its number, so the file can go anywhere in
+// memory. Loading maps the file in and makes two passes over it: the first
+// allocates every object, and the second fixes up the references between
+// them. Strings are interned as they're loaded. A native is saved as where its
+// code is relative to initVM(), so an image only loads into the same build of
+// clox that saved it, which the header checks.
+//
+// An image is checked before anything in it is used. A checksum over all
+// but the header turns away one that was damaged after it was saved. The loader
+// also checks every reference and count as it reads them, and checks each
+// function's bytecode the way the compiler would have left it: operands in
+// range, jumps landing on instructions, and the stack deep enough for every
+// instruction. The checksum isn't a signature, though. Someone who crafts an
+// image and fixes up its checksum can still make code that confuses one type
+// of value for another, so only load images you'd run the script of. A bad
+// image exits with 74.
+//
+// Functions are saved as their bytecode. Inline caches start out empty, and
+// register and machine code get made the same way as for freshly compiled
+// functions. A fiber can't be saved
+bool saveImage(const char *path);
+bool loadImage(const char *path);
+
+// Objects loaded so far aren't reachable from any root until the image is
+// done loading, so the collector asks for them
+void markImageRoots();
+
+#endif
@@ -0,0 +1,494 @@
+// For MAP_ANONYMOUS under -std=c99
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef CLOX_JIT
+
+#include <sys/mman.h>
+
+/*
+ * A baseline "template" JIT. Each bytecode instruction is translated on its
+ * own into a fixed snippet of machine code, and the snippets are simply laid
+ * out one after another. There is no register allocation: the generated code
+ * works on vm.stack exactly like the interpreter does, so at every instruction
+ * boundary the VM is in the same state the interpreter would have it in. That
+ * is what makes switching between the two cheap in both directions. The
+ * interpreter can jump into the machine code at any instruction (say, at the
+ * top of a hot loop), and the machine code can hand the frame back at any
+ * instruction it has no template for.
+ *
+ * What we win is the dispatch: no decoding of opcodes and operands, no
+ * indirect jump per instruction, jumps that are plain jumps, and inline fast
+ * paths for the common case of arithmetic and comparisons on numbers. Anything
+ * less common calls back into a C slow path in vm.c.
+ *
+ * While the generated code runs, these registers are fixed:
+ *
+ *   r12  the CallFrame being executed
+ *   rbx  &vm.stackTop
+ *
+ * Both are callee-saved, so they survive calls to the slow paths. rcx and rax
+ * are scratch within a template, and nothing lives in a register across
+ * instructions.
+ *
+ * The templates assume the tagged union Value: a 4-byte type tag at offset 0,
+ * the payload at offset 8 and 16 bytes in all.
+ */
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+
+  // Offset of the shared epilogue every exit jumps to
+  int exit;
+
+  // Machine code offset of each bytecode offset, and the jumps to bytecode
+  // that hasn't been emitted yet: where their rel32 is and where they go
+  int *entries;
+  int *fixups;
+  int *fixupTargets;
+  int fixupCount;
+  int fixupCapacity;
+} Assembler;
+
+// The generated function is entered through its prologue, which then jumps to
+// the machine code for whichever instruction the frame is at
+typedef JitStatus (*JitEntry)(CallFrame *frame, uint8_t *target);
+
+static void emitByte(Assembler *a, uint8_t byte) {
+  if (a->capacity < a->count + 1) {
+    int oldCapacity = a->capacity;
+    a->capacity = GROW_CAPACITY(oldCapacity);
+    a->code = GROW_ARRAY(uint8_t, a->code, oldCapacity, a->capacity);
+  }
+
+  a->code[a->count++] = byte;
+}
+
+static void emitBytes(Assembler *a, int count, ...) {
+  va_list bytes;
+  va_start(bytes, count);
+  for (int i = 0; i < count; i++) {
+    emitByte(a, (uint8_t)va_arg(bytes, int));
+  }
+  va_end(bytes);
+}
+
+static void emit32(Assembler *a, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(a, (uint8_t)(value >> (i * 8)));
+  }
+}
+
+static void emit64(Assembler *a, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emitByte(a, (uint8_t)(value >> (i * 8)));
+  }
+}
+
+static void patch32(Assembler *a, int at, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    a->code[at + i] = (uint8_t)(value >> (i * 8));
+  }
+}
+
+// Relative jumps are measured from the end of the jump instruction. A short
+// jump's one-byte displacement is patched with patch8() once we know where it
+// lands
+static int emitShortJump(Assembler *a, uint8_t opcode) {
+  emitBytes(a, 2, opcode, 0);
+  return a->count - 1;
+}
+
+static void patch8(Assembler *a, int at) {
+  a->code[at] = (uint8_t)(a->count - (at + 1));
+}
+
+// A jump to another bytecode instruction. opcode is 0xE9 for jmp, or the
+// second byte of a two-byte jcc
+static void emitJump(Assembler *a, uint8_t opcode, int target) {
+  if (opcode == 0xE9) {
+    emitByte(a, 0xE9);
+  } else {
+    emitBytes(a, 2, 0x0F, opcode);
+  }
+
+  if (a->entries[target] != -1) {
+    emit32(a, (uint32_t)(a->entries[target] - (a->count + 4)));
+    return;
+  }
+
+  if (a->fixupCapacity < a->fixupCount + 1) {
+    int oldCapacity = a->fixupCapacity;
+    a->fixupCapacity = GROW_CAPACITY(oldCapacity);
+    a->fixups = GROW_ARRAY(int, a->fixups, oldCapacity, a->fixupCapacity);
+    a->fixupTargets =
+        GROW_ARRAY(int, a->fixupTargets, oldCapacity, a->fixupCapacity);
+  }
+
+  a->fixups[a->fixupCount] = a->count;
+  a->fixupTargets[a->fixupCount] = target;
+  a->fixupCount++;
+  emit32(a, 0);
+}
+
+// Same, but to the epilogue
+static void emitExitJump(Assembler *a, uint8_t opcode) {
+  if (opcode == 0xE9) {
+    emitByte(a, 0xE9);
+  } else {
+    emitBytes(a, 2, 0x0F, opcode);
+  }
+  emit32(a, (uint32_t)(a->exit - (a->count + 4)));
+}
+
+// mov rax, imm64
+static void loadRax(Assembler *a, uint64_t value) {
+  emitBytes(a, 2, 0x48, 0xB8);
+  emit64(a, value);
+}
+
+// mov rcx, [rbx]: rcx = vm.stackTop
+static void loadStackTop(Assembler *a) { emitBytes(a, 3, 0x48, 0x8B, 0x0B); }
+
+// add/sub qword [rbx], sizeof(Value)
+static void growStack(Assembler *a) {
+  emitBytes(a, 4, 0x48, 0x83, 0x03, (int)sizeof(Value));
+}
+
+static void shrinkStack(Assembler *a) {
+  emitBytes(a, 4, 0x48, 0x83, 0x2B, (int)sizeof(Value));
+}
+
+// mov rax, [r12 + offsetof(CallFrame, slots)]; add rax, slot * sizeof(Value)
+static void loadSlotAddress(Assembler *a, int slot) {
+  emitBytes(a, 5, 0x49, 0x8B, 0x44, 0x24, (int)offsetof(CallFrame, slots));
+  emitBytes(a, 2, 0x48, 0x05);
+  emit32(a, (uint32_t)(slot * (int)sizeof(Value)));
+}
+
+// Pushes the Value rax points at
+static void pushFromRax(Assembler *a) {
+  loadStackTop(a);
+  emitBytes(a, 4, 0xF3, 0x0F, 0x6F, 0x00); // movdqu xmm0, [rax]
+  emitBytes(a, 4, 0xF3, 0x0F, 0x7F, 0x01); // movdqu [rcx], xmm0
+  growStack(a);
+}
+
+static void pushLiteral(Assembler *a, ValueType type, int payload) {
+  loadStackTop(a);
+  emitBytes(a, 2, 0xC7, 0x01); // mov dword [rcx], type
+  emit32(a, (uint32_t)type);
+  emitBytes(a, 4, 0x48, 0xC7, 0x41, 0x08); // mov qword [rcx + 8], payload
+  emit32(a, (uint32_t)payload);
+  growStack(a);
+}
+
+// Stores the address in frame->ip, for runtime errors and for the
+// interpreter to pick up from
+static void storeIp(Assembler *a, uint8_t *ip) {
+  loadRax(a, (uint64_t)(uintptr_t)ip);
+  // mov [r12 + offsetof(CallFrame, ip)], rax
+  emitBytes(a, 5, 0x49, 0x89, 0x44, 0x24, (int)offsetof(CallFrame, ip));
+}
+
+// Calls helper(frame, operand) and leaves if it returns anything other than
+// JIT_CONTINUE. next is the instruction after the current one
+static void callHelper(Assembler *a, uint8_t *next, JitHelper helper,
+                       int operand) {
+  storeIp(a, next);
+  emitBytes(a, 3, 0x4C, 0x89, 0xE7); // mov rdi, r12
+  emitByte(a, 0xBE);                 // mov esi, operand
+  emit32(a, (uint32_t)operand);
+  loadRax(a, (uint64_t)(uintptr_t)helper);
+  emitBytes(a, 2, 0xFF, 0xD0); // call rax
+  emitBytes(a, 2, 0x85, 0xC0); // test eax, eax
+  emitExitJump(a, 0x85);       // jnz exit
+}
+
+// Hands the frame back to the interpreter, which resumes at ip
+static void sideExit(Assembler *a, uint8_t *ip) {
+  storeIp(a, ip);
+  emitByte(a, 0xB8); // mov eax, JIT_EXIT
+  emit32(a, JIT_EXIT);
+  emitExitJump(a, 0xE9);
+}
+
+// Number arithmetic and comparison inline, everything else (string
+// concatenation, type errors) in the slow path. The operands are the two
+// Values just below stackTop
+static void binary(Assembler *a, uint8_t opcode, uint8_t *next,
+                   JitHelper slowPath) {
+  loadStackTop(a);
+  emitBytes(a, 4, 0x83, 0x79, 0xE0, VAL_NUMBER); // cmp dword [rcx - 32], ..
+  int leftNotNumber = emitShortJump(a, 0x75);     // jne slow
+  emitBytes(a, 4, 0x83, 0x79, 0xF0, VAL_NUMBER); // cmp dword [rcx - 16], ..
+  int rightNotNumber = emitShortJump(a, 0x75);    // jne slow
+
+  emitBytes(a, 5, 0xF2, 0x0F, 0x10, 0x41, 0xE8); // movsd xmm0, [rcx - 24]
+  switch (opcode) {
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE: {
+    uint8_t instruction = opcode == OP_ADD        ? 0x58
+                          : opcode == OP_SUBTRACT ? 0x5C
+                          : opcode == OP_MULTIPLY ? 0x59
+                                                  : 0x5E;
+    // addsd/subsd/mulsd/divsd xmm0, [rcx - 8]
+    emitBytes(a, 5, 0xF2, 0x0F, instruction, 0x41, 0xF8);
+    emitBytes(a, 5, 0xF2, 0x0F, 0x11, 0x41, 0xE8); // movsd [rcx - 24], xmm0
+    break;
+  }
+  case OP_LESS:
+  case OP_GREATER:
+    emitBytes(a, 5, 0xF2, 0x0F, 0x10, 0x49, 0xF8); // movsd xmm1, [rcx - 8]
+    // a < b is b > a. "Above" is false when either side is NaN, as it should
+    // be
+    if (opcode == OP_LESS) {
+      emitBytes(a, 4, 0x66, 0x0F, 0x2E, 0xC8); // ucomisd xmm1, xmm0
+    } else {
+      emitBytes(a, 4, 0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+    }
+    emitBytes(a, 3, 0x0F, 0x97, 0xC0); // seta al
+    emitBytes(a, 3, 0x0F, 0xB6, 0xC0); // movzx eax, al
+    emitBytes(a, 3, 0xC7, 0x41, 0xE0); // mov dword [rcx - 32], VAL_BOOL
+    emit32(a, VAL_BOOL);
+    emitBytes(a, 4, 0x48, 0x89, 0x41, 0xE8); // mov [rcx - 24], rax
+    break;
+  }
+  shrinkStack(a);
+  int done = emitShortJump(a, 0xEB); // jmp done
+
+  patch8(a, leftNotNumber);
+  patch8(a, rightNotNumber);
+  callHelper(a, next, slowPath, 0);
+  patch8(a, done);
+}
+
+// Leaves the condition on the stack, like the interpreter
+static void jumpIfFalse(Assembler *a, int target) {
+  loadStackTop(a);
+  emitBytes(a, 3, 0x8B, 0x41, 0xF0);   // mov eax, [rcx - 16]
+  emitBytes(a, 3, 0x83, 0xF8, VAL_NIL); // cmp eax, VAL_NIL
+  emitJump(a, 0x84, target);            // je target
+  emitBytes(a, 3, 0x83, 0xF8, VAL_BOOL); // cmp eax, VAL_BOOL
+  int notBool = emitShortJump(a, 0x75);  // jne next
+  emitBytes(a, 4, 0x80, 0x79, 0xF8, 0x00); // cmp byte [rcx - 8], 0
+  emitJump(a, 0x84, target);               // je target
+  patch8(a, notBool);
+}
+
+static void translateInstruction(Assembler *a, Chunk *chunk, int offset) {
+  uint8_t *code = &chunk->code[offset];
+  uint8_t *next = code + instructionLength(chunk, offset);
+  Value *constants = chunk->constants.values;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+    loadRax(a, (uint64_t)(uintptr_t)&constants[code[1]]);
+    pushFromRax(a);
+    break;
+  case OP_CONSTANT_LONG:
+    loadRax(a, (uint64_t)(uintptr_t)&constants[code[1] | code[2] << 8 |
+                                               code[3] << 16]);
+    pushFromRax(a);
+    break;
+  case OP_NIL:
+    pushLiteral(a, VAL_NIL, 0);
+    break;
+  case OP_TRUE:
+    pushLiteral(a, VAL_BOOL, 1);
+    break;
+  case OP_FALSE:
+    pushLiteral(a, VAL_BOOL, 0);
+    break;
+  case OP_POP:
+    shrinkStack(a);
+    break;
+  case OP_GET_LOCAL:
+    loadSlotAddress(a, code[1]);
+    pushFromRax(a);
+    break;
+  case OP_SET_LOCAL:
+    loadSlotAddress(a, code[1]);
+    loadStackTop(a);
+    emitBytes(a, 5, 0xF3, 0x0F, 0x6F, 0x41, 0xF0); // movdqu xmm0, [rcx - 16]
+    emitBytes(a, 4, 0xF3, 0x0F, 0x7F, 0x00);       // movdqu [rax], xmm0
+    break;
+  case OP_GET_GLOBAL:
+    callHelper(a, next, jitGetGlobal, code[1]);
+    break;
+  case OP_DEFINE_GLOBAL:
+    callHelper(a, next, jitDefineGlobal, code[1]);
+    break;
+  case OP_SET_GLOBAL:
+    callHelper(a, next, jitSetGlobal, code[1]);
+    break;
+  case OP_GET_UPVALUE:
+    callHelper(a, next, jitGetUpvalue, code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    callHelper(a, next, jitSetUpvalue, code[1]);
+    break;
+  case OP_EQUAL:
+    callHelper(a, next, jitEqual, 0);
+    break;
+  case OP_ADD:
+    binary(a, OP_ADD, next, jitAdd);
+    break;
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_LESS:
+  case OP_GREATER:
+    binary(a, code[0], next, jitNumbersExpected);
+    break;
+  case OP_NOT:
+    callHelper(a, next, jitNot, 0);
+    break;
+  case OP_NEGATE:
+    callHelper(a, next, jitNegate, 0);
+    break;
+  case OP_PRINT:
+    callHelper(a, next, jitPrint, 0);
+    break;
+  case OP_JUMP:
+    emitJump(a, 0xE9, offset + 3 + (code[1] << 8 | code[2]));
+    break;
+  case OP_JUMP_IF_FALSE:
+    jumpIfFalse(a, offset + 3 + (code[1] << 8 | code[2]));
+    break;
+  case OP_LOOP:
+    emitJump(a, 0xE9, offset + 3 - (code[1] << 8 | code[2]));
+    break;
+  case OP_CALL:
+    callHelper(a, next, jitCall, code[1]);
+    break;
+  case OP_CLOSE_UPVALUE:
+    callHelper(a, next, jitCloseUpvalue, 0);
+    break;
+  case OP_RETURN:
+    // Always returns JIT_RETURNED, so the helper call itself leaves
+    callHelper(a, next, jitReturn, 0);
+    break;
+  default:
+    // Closures, classes, properties, tail calls: the interpreter takes over
+    sideExit(a, code);
+    break;
+  }
+}
+
+bool compileJit(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+
+  Assembler a;
+  a.code = NULL;
+  a.count = 0;
+  a.capacity = 0;
+  a.fixups = NULL;
+  a.fixupTargets = NULL;
+  a.fixupCount = 0;
+  a.fixupCapacity = 0;
+  a.entries = ALLOCATE(int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    a.entries[i] = -1;
+  }
+
+  // Prologue: save the callee-saved registers we use (r13 only keeps the stack
+  // 16-byte aligned for the calls we make), set up r12 and rbx and jump to
+  // the instruction we were asked to start at
+  emitByte(&a, 0x53);             // push rbx
+  emitBytes(&a, 2, 0x41, 0x54);   // push r12
+  emitBytes(&a, 2, 0x41, 0x55);   // push r13
+  emitBytes(&a, 3, 0x49, 0x89, 0xFC); // mov r12, rdi
+  emitBytes(&a, 2, 0x48, 0xBB);       // mov rbx, &vm.stackTop
+  emit64(&a, (uint64_t)(uintptr_t)&vm.stackTop);
+  emitBytes(&a, 2, 0xFF, 0xE6); // jmp rsi
+
+  // Epilogue, with the status already in eax
+  a.exit = a.count;
+  emitBytes(&a, 2, 0x41, 0x5D); // pop r13
+  emitBytes(&a, 2, 0x41, 0x5C); // pop r12
+  emitByte(&a, 0x5B);           // pop rbx
+  emitByte(&a, 0xC3);           // ret
+
+  for (int offset = 0; offset < chunk->count;) {
+    a.entries[offset] = a.count;
+    translateInstruction(&a, chunk, offset);
+    offset += instructionLength(chunk, offset);
+  }
+
+  for (int i = 0; i < a.fixupCount; i++) {
+    int at = a.fixups[i];
+    patch32(&a, at, (uint32_t)(a.entries[a.fixupTargets[i]] - (at + 4)));
+  }
+  FREE_ARRAY(int, a.fixups, a.fixupCapacity);
+  FREE_ARRAY(int, a.fixupTargets, a.fixupCapacity);
+
+  // Write the code while the memory is writable, then make it executable
+  // (but no longer writable)
+  uint8_t *memory = (uint8_t *)mmap(NULL, (size_t)a.count,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool mapped = memory != MAP_FAILED;
+  if (mapped) {
+    memcpy(memory, a.code, (size_t)a.count);
+    if (mprotect(memory, (size_t)a.count, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, (size_t)a.count);
+      mapped = false;
+    }
+  }
+  FREE_ARRAY(uint8_t, a.code, a.capacity);
+
+  if (!mapped) {
+    FREE_ARRAY(int, a.entries, chunk->count);
+    return false;
+  }
+
+  JitCode *jit = ALLOCATE(JitCode, 1);
+  jit->code = memory;
+  jit->size = (size_t)a.count;
+  jit->entries = a.entries;
+  jit->entryCount = chunk->count;
+  jit->runs = 0;
+  jit->sideExits = 0;
+  function->jit = jit;
+  return true;
+}
+
+JitStatus runJit(ObjFunction *function, CallFrame *frame) {
+  JitCode *jit = function->jit;
+  int offset = (int)(frame->ip - function->chunk.code);
+  if (offset >= jit->entryCount || jit->entries[offset] == -1)
+    return JIT_EXIT;
+
+  JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+  return entry(frame, jit->code + jit->entries[offset]);
+}
+
+void freeJit(JitCode *jit) {
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(int, jit->entries, jit->entryCount);
+  FREE(JitCode, jit);
+}
+
+#else
+
+bool compileJit(ObjFunction *function) { return false; }
+
+JitStatus runJit(ObjFunction *function, CallFrame *frame) { return JIT_EXIT; }
+
+void freeJit(JitCode *jit) {}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// The JIT emits x86-64 machine code for the System V calling convention and
+// gets executable memory from mmap(), so it only exists on x86-64 Linux.
+// Everywhere else compileJit() always fails and everything is interpreted
+#if defined(__x86_64__) && defined(__linux__)
+#define CLOX_JIT
+#endif
+
+// How many calls plus loop iterations a function gets in the interpreter
+// before it's compiled to machine code
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// Entering machine code only to leave again at the first instruction without
+// a template costs more than interpreting. Once a function has seen this many
+// side exits, and they're most of its runs, we stop using its machine code
+#define JIT_MAX_SIDE_EXITS 1000
+
+// What machine code returns with when it stops running a frame
+typedef enum {
+  JIT_CONTINUE, // Only between the generated code and the slow paths.
+  JIT_RETURNED, // The frame returned, its result is on the caller's stack.
+  JIT_EXIT,     // The interpreter should carry on at frame->ip.
+  JIT_ERROR,    // A runtime error has been reported.
+} JitStatus;
+
+typedef struct JitCode {
+  // Executable memory holding the function's machine code
+  uint8_t *code;
+  size_t size;
+  // For every offset in the bytecode, where its instruction starts in code, or
+  // -1 if nothing starts there. Any instruction can be entered, so the
+  // interpreter can switch over in the middle of a loop
+  int *entries;
+  int entryCount;
+
+  // How many times the code was entered, and how many of those ended with
+  // handing the frame back to the interpreter before it returned
+  int64_t runs;
+  int64_t sideExits;
+} JitCode;
+
+bool compileJit(ObjFunction *function);
+JitStatus runJit(ObjFunction *function, CallFrame *frame);
+void freeJit(JitCode *jit);
+
+// Slow paths the generated code calls for anything it doesn't do inline. They
+// live in vm.c next to the interpreter cases they mirror. frame->ip points
+// just past the instruction, as it would in the interpreter, and operand is
+// the instruction's one-byte operand, if it has one
+typedef JitStatus (*JitHelper)(CallFrame *frame, int operand);
+
+JitStatus jitGetGlobal(CallFrame *frame, int operand);
+JitStatus jitDefineGlobal(CallFrame *frame, int operand);
+JitStatus jitSetGlobal(CallFrame *frame, int operand);
+JitStatus jitGetUpvalue(CallFrame *frame, int operand);
+JitStatus jitSetUpvalue(CallFrame *frame, int operand);
+JitStatus jitEqual(CallFrame *frame, int operand);
+JitStatus jitAdd(CallFrame *frame, int operand);
+JitStatus jitNumbersExpected(CallFrame *frame, int operand);
+JitStatus jitNot(CallFrame *frame, int operand);
+JitStatus jitNegate(CallFrame *frame, int operand);
+JitStatus jitPrint(CallFrame *frame, int operand);
+JitStatus jitCall(CallFrame *frame, int operand);
+JitStatus jitCloseUpvalue(CallFrame *frame, int operand);
+JitStatus jitReturn(CallFrame *frame, int operand);
+
+#endif
@@ -1,9 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "aot.h"
+#include "compiler.h"
+#include "image.h"
+#include "module.h"
+#include "profiler.h"
 #include "vm.h"
 
+// Filled in when running with --stats
+static bool showStats = false;
+static TableStats globalStats;
+static TableStats stringStats;
+
+static void printStats() {
+  if (showStats) {
+    printTableStats("globals", &vm.globals);
+    printTableStats("strings", &vm.strings);
+  }
+}
+
 static void repl() {
   char line[1024];
   for (;;) {
@@ -45,26 +63,159 @@ static char *readFile(const char *path) {
   return buffer;
 }
 
+// Set by --image and --save-image
+static const char *imagePath = NULL;
+static const char *saveImagePath = NULL;
+
 static void runFile(const char *path) {
   char *source = readFile(path);
-  InterpretResult result = interpret(source);
+  InterpretResult result = interpretFile(path, source);
   free(source);
+  printStats();
+  stopProfiler();
 
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
   if (result == INTERPRET_RUNTIME_ERROR)
     exit(70);
+
+  if (saveImagePath != NULL && !saveImage(saveImagePath))
+    exit(74);
+}
+
+// Compiles the script without running it. With --stats, this is how we measure
+// the compiler: it reports how much it got through per second
+static void compileFile(const char *path) {
+  char *source = readFile(path);
+  clock_t start = clock();
+  ObjFunction *script = compile(source);
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  if (showStats) {
+    // Guard against a clock too coarse to see a small script compile
+    double rate = seconds > 0 ? 1 / seconds : 0;
+    fprintf(stderr, "compiled %d bytes of source in %.3f ms\n",
+            (int)strlen(source), seconds * 1000);
+    fprintf(stderr, "  %d tokens, %.0f per second\n", compileStats.tokens,
+            compileStats.tokens * rate);
+    fprintf(stderr, "  %d bytes of code, %.0f per second\n",
+            compileStats.bytes, compileStats.bytes * rate);
+    fprintf(stderr, "  %d constants, %.0f per second\n",
+            compileStats.constants, compileStats.constants * rate);
+    fprintf(stderr, "  %d functions\n", compileStats.functions);
+    fprintf(stderr, "  %d instructions removed by the peephole pass\n",
+            compileStats.removed);
+    printStats();
+  }
+
+  free(source);
+  if (script == NULL)
+    exit(65);
+}
+
+// Compiles the script and writes it out as a C program instead of running it
+static void emitFile(const char *path, const char *outPath) {
+  char *source = readFile(path);
+  // Compiled under the path the program will load it by, so its imports
+  // resolve the same way in both
+  char *resolved = resolveImport(NULL, path, (int)strlen(path));
+  ObjFunction *script = compileModule(source, resolved, false);
+  if (script == NULL)
+    exit(65);
+
+  FILE *out = fopen(outPath, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+    exit(74);
+  }
+  emitC(script, resolved, source, out);
+  fclose(out);
+  free(resolved);
+  free(source);
 }
 
 int main(int argc, const char *argv[]) {
   initVM();
 
-  if (argc == 1) {
+  // --registers also compiles functions for the register VM and runs them on
+  // it wherever it can. --no-jit keeps everything in the interpreter. -O0
+  // turns off the peephole pass, which -O1, the default, runs.
+  // --emit-c writes the script out as C instead of running it and
+  // --compile-only just compiles it. --stats reports how the global and string
+  // tables were used on exit, and how fast the compiler was.
+  // --sample=<hz>[,<path>] profiles the script, see profiler.h. --image starts from a heap image
+  // instead of an empty VM and --save-image writes one out once the script has
+  // run, see image.h
+  int arg = 1;
+  long sampleHz = 0;
+  const char *profilePath = NULL;
+  bool badOption = false;
+  bool compileOnly = false;
+  const char *emitPath = NULL;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (strcmp(argv[arg], "--registers") == 0) {
+      vm.useRegisters = true;
+    } else if (strcmp(argv[arg], "-O0") == 0 || strcmp(argv[arg], "-O1") == 0) {
+      vm.optimizeLevel = argv[arg][2] - '0';
+    } else if (strcmp(argv[arg], "--no-jit") == 0) {
+      vm.useJit = false;
+    } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc) {
+      emitPath = argv[++arg];
+    } else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc) {
+      imagePath = argv[++arg];
+    } else if (strcmp(argv[arg], "--save-image") == 0 && arg + 1 < argc) {
+      saveImagePath = argv[++arg];
+    } else if (strcmp(argv[arg], "--compile-only") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[arg], "--stats") == 0) {
+      showStats = true;
+      vm.globals.stats = &globalStats;
+      vm.strings.stats = &stringStats;
+    } else if (strncmp(argv[arg], "--sample=", 9) == 0) {
+      char *end;
+      sampleHz = strtol(argv[arg] + 9, &end, 10);
+      if (*end == ',' && end[1] != '\0') {
+        profilePath = end + 1;
+        end += strlen(end);
+      }
+      badOption |= *end != '\0' || sampleHz <= 0 || sampleHz > 1000000;
+    } else {
+      badOption = true;
+    }
+  }
+
+  // Only a script that runs can be saved, and only something that runs needs
+  // an image
+  bool runs = emitPath == NULL && !compileOnly;
+  badOption |= saveImagePath != NULL && (!runs || arg != argc - 1);
+  badOption |= imagePath != NULL && !runs;
+  if (!badOption && imagePath != NULL && !loadImage(imagePath))
+    exit(74);
+
+  // Only running a script can be profiled
+  if (!badOption && sampleHz > 0 && emitPath == NULL && !compileOnly &&
+      !startProfiler((int)sampleHz, profilePath)) {
+    fprintf(stderr, "Could not start the profiler.\n");
+  }
+
+  if (!badOption && emitPath != NULL && arg == argc - 1) {
+    emitFile(argv[arg], emitPath);
+  } else if (!badOption && compileOnly && arg == argc - 1) {
+    compileFile(argv[arg]);
+  } else if (!badOption && runs && !showStats && arg == argc) {
+    // --compile-only and --stats are about a script, so without one they're
+    // a mistake rather than a request for the REPL
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+    stopProfiler();
+  } else if (!badOption && emitPath == NULL && arg == argc - 1) {
+    runFile(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
+    fprintf(stderr, "Usage: clox [-O0|-O1] [--registers] [--no-jit] "
+                    "[--sample=hz[,path]]\n"
+                    "            [--image in.img] [--save-image out.img] "
+                    "[[--stats] path]\n"
+                    "       clox [-O0|-O1] --compile-only [--stats] path\n"
+                    "       clox [-O0|-O1] --emit-c out.c path\n");
     exit(64);
   }
 
@@ -1,9 +1,43 @@
 #include <stdlib.h>
 
+#include "compiler.h"
+#include "fiber.h"
+#include "image.h"
+#include "jit.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#include "debug.h"
+#endif
+
+// After a collection, the next one runs once the heap has grown to this many
+// times the size of what survived
+#define GC_HEAP_GROW_FACTOR 2
+
+THREAD_LOCAL Heap *privateHeap = NULL;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if (privateHeap != NULL) {
+    privateHeap->bytesAllocated += newSize - oldSize;
+  } else {
+    vm.bytesAllocated += newSize - oldSize;
+  }
+
+  // Every allocation goes through here, which makes it the one place we need
+  // to check whether it's time to collect
+  if (newSize > oldSize && privateHeap == NULL) {
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+
+    if (vm.bytesAllocated > vm.nextGC) {
+      collectGarbage();
+    }
+  }
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -15,21 +49,324 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+// Makes the heap's objects the VM's, so the collector takes care of them from
+// here on. Whatever refers to them has to be made reachable before the next
+// collection
+void adoptHeap(Heap *heap) {
+  if (heap->objects != NULL) {
+    Obj *last = heap->objects;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = vm.objects;
+    vm.objects = heap->objects;
+  }
+
+  vm.bytesAllocated += heap->bytesAllocated;
+  heap->objects = NULL;
+  heap->bytesAllocated = 0;
+}
+
+// Marking an object colors it gray: we know it is reachable but haven't yet
+// traced the references it holds. Gray objects wait on a worklist that is
+// kept outside of the managed heap so growing it can't trigger a collection
+
+void markObject(Obj *object) {
+  if (object == NULL)
+    return;
+  if (object->isMarked)
+    return;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  object->isMarked = true;
+
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    vm.grayStack =
+        (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+    if (vm.grayStack == NULL)
+      exit(1);
+  }
+
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+// Numbers, Booleans and nil live inline in the Value and need no marking
+void markValue(Value value) {
+  if (IS_OBJ(value))
+    markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
+}
+
+// Everything a fiber's stack keeps alive: the values on it, the closures its
+// frames are running and the upvalues still pointing into it
+static void markStack(Value *stack, Value *stackTop, CallFrame *frames,
+                      int frameCount, ObjUpvalue *openUpvalues) {
+  for (Value *slot = stack; slot < stackTop; slot++) {
+    markValue(*slot);
+  }
+
+  for (int i = 0; i < frameCount; i++) {
+    markObject((Obj *)frames[i].closure);
+  }
+
+  for (ObjUpvalue *upvalue = openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    markObject((Obj *)upvalue);
+  }
+}
+
+// Tracing an object's references turns it black: it is marked and everything
+// it points to is at least gray
+static void blackenObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void *)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    markValue(bound->receiver);
+    markObject((Obj *)bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    markObject((Obj *)klass->name);
+    markTable(&klass->methods);
+    markObject((Obj *)klass->initializer);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    markObject((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      markObject((Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FIBER: {
+    ObjFiber *fiber = (ObjFiber *)object;
+    markValue(fiber->callee);
+    markValue(fiber->result);
+    markObject((Obj *)fiber->next);
+    markObject((Obj *)fiber->waiters);
+
+    // The running fiber's stack is marked from the VM. Its own copies of
+    // stackTop and the rest are stale
+    if (fiber != vm.fiber) {
+      markStack(fiber->stack, fiber->stackTop, fiber->frames,
+                fiber->frameCount, fiber->openUpvalues);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    markObject((Obj *)function->name);
+    markArray(&function->chunk.constants);
+
+    // A cached class or method must stay alive as long as the cache does, or
+    // a new object allocated at the same address could produce a false hit
+    for (int i = 0; i < function->chunk.cacheCount; i++) {
+      InlineCache *cache = &function->chunk.caches[i];
+      markObject((Obj *)cache->klass);
+      markObject((Obj *)cache->method);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    markObject((Obj *)instance->klass);
+    markObject((Obj *)instance->shape);
+    for (int i = 0; i < instance->shape->fieldCount; i++) {
+      markValue(instance->fields[i]);
+    }
+    break;
+  }
+  case OBJ_LIST:
+    markArray(&((ObjList *)object)->items);
+    break;
+  case OBJ_MAP:
+    markValueTable(&((ObjMap *)object)->table);
+    break;
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    markTable(&shape->slots);
+    markTable(&shape->transitions);
+    break;
+  }
+  case OBJ_UPVALUE:
+    markValue(((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
 // We need to free the Object itself and also the memory owned and allocated by
 // specific object types
 //
 // For ex. we need to free the character array before we free the ObjString
 static void freeObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void *)object, object->type);
+#endif
+
   switch (object->type) {
+  case OBJ_BOUND_METHOD:
+    FREE(ObjBoundMethod, object);
+    break;
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    freeTable(&klass->methods);
+    FREE(ObjClass, object);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+    FREE(ObjClosure, object);
+    break;
+  }
+  case OBJ_FIBER:
+    freeFiberMemory((ObjFiber *)object);
+    FREE(ObjFiber, object);
+    break;
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    freeChunk(&function->chunk);
+    if (function->registers != NULL)
+      freeRegChunk(function->registers);
+    if (function->jit != NULL)
+      freeJit(function->jit);
+    FREE(ObjFunction, object);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    FREE(ObjInstance, object);
+    break;
+  }
+  case OBJ_LIST:
+    freeValueArray(&((ObjList *)object)->items);
+    FREE(ObjList, object);
+    break;
+  case OBJ_MAP:
+    freeValueTable(&((ObjMap *)object)->table);
+    FREE(ObjMap, object);
+    break;
+  case OBJ_NATIVE:
+    FREE(ObjNative, object);
+    break;
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    freeTable(&shape->slots);
+    freeTable(&shape->transitions);
+    FREE(ObjShape, object);
+    break;
+  }
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, string->chars, string->length);
+    FREE_ARRAY(char, string->chars, string->length + 1);
     FREE(ObjString, object);
     break;
   }
+  case OBJ_UPVALUE:
+    FREE(ObjUpvalue, object);
+    break;
+  }
+}
+
+static void markRoots() {
+  markStack(vm.stack, vm.stackTop, vm.frames, vm.frameCount,
+            vm.openUpvalues);
+  markObject((Obj *)vm.fiber);
+  markFiberRoots();
+
+  markTable(&vm.globals);
+  markTable(&vm.modules);
+  markCompilerRoots();
+  markImageRoots();
+  markObject((Obj *)vm.initString);
+
+  // Shapes are shared by every instance and cached all over the bytecode, so
+  // the whole tree is kept alive from the root
+  markObject((Obj *)vm.rootShape);
+}
+
+static void traceReferences() {
+  while (vm.grayCount > 0) {
+    Obj *object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
   }
 }
 
+// Walk the list of every object and free the ones that weren't marked,
+// clearing the mark on survivors for the next cycle
+static void sweep() {
+  Obj *previous = NULL;
+  Obj *object = vm.objects;
+  while (object != NULL) {
+    if (object->isMarked) {
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+    } else {
+      // The profiler's samples may point into its code
+      if (object->type == OBJ_FUNCTION)
+        drainSamples();
+
+      Obj *unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        vm.objects = object;
+      }
+
+      freeObject(unreached);
+    }
+  }
+}
+
+// A simple stop-the-world, tri-color mark-sweep collector
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  markRoots();
+  traceReferences();
+
+  // The intern table holds its strings weakly: drop the ones nothing else
+  // refers to before they get freed, so it never has dangling keys
+  tableRemoveWhite(&vm.strings);
+  sweep();
+
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
 // Walk a linked list and free its nodes
 void freeObjects() {
   Obj *object = vm.objects;
@@ -38,4 +375,6 @@ void freeObjects() {
     freeObject(object);
     object = next;
   }
+
+  free(vm.grayStack);
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "table.h"
 
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -18,7 +19,24 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Where a compiler running on a thread of its own puts what it allocates,
+// strings interned included. Nothing in it is known to the VM, and there's no
+// collecting while it's in use. adoptHeap() hands the objects over once the
+// compiler is done
+typedef struct {
+  Obj *objects;
+  Table strings;
+  size_t bytesAllocated;
+} Heap;
+
+// The current thread's heap, or NULL for the VM's own
+extern THREAD_LOCAL Heap *privateHeap;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void adoptHeap(Heap *heap);
+void markObject(Obj *object);
+void markValue(Value value);
+void collectGarbage();
 void freeObjects();
 
 #endif // !clox_memory_h
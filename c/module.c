@@ -0,0 +1,314 @@
+// For realpath() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+#include "scanner.h"
+
+#ifdef CLOX_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+  char *path;
+  char *source;
+  // Everything but the script that was run
+  bool imported;
+  // NULL until it's compiled, and if it doesn't compile
+  ObjFunction *function;
+  // Holds everything compiling the module allocated until it's linked
+  Heap heap;
+} Module;
+
+typedef struct {
+  Module *modules;
+  int count;
+  int capacity;
+
+  // The first module no thread has started compiling yet
+  int next;
+#ifdef CLOX_THREADS
+  pthread_mutex_t lock;
+#endif
+} ModuleList;
+
+// Reads a whole file, or returns NULL if it can't. A missing module is only an
+// error once something actually imports it
+static char *readSource(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char *buffer = (char *)malloc(fileSize + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  buffer[bytesRead] = '\0';
+
+  fclose(file);
+  return buffer;
+}
+
+// Turns the path in an import into the one the module is known by: relative to
+// the directory of the importing file, and then canonical, so that every way
+// of naming the same file leads to the same module. A file that doesn't exist
+// keeps the joined path, for the error message. The caller frees the result
+char *resolveImport(const char *importer, const char *path, int length) {
+  int directoryLength = 0;
+  if (importer != NULL && (length == 0 || path[0] != '/')) {
+    const char *slash = strrchr(importer, '/');
+    if (slash != NULL)
+      directoryLength = (int)(slash - importer) + 1;
+  }
+
+  char *joined = (char *)malloc(directoryLength + length + 1);
+  if (directoryLength > 0)
+    memcpy(joined, importer, directoryLength);
+  memcpy(joined + directoryLength, path, length);
+  joined[directoryLength + length] = '\0';
+
+#ifdef CLOX_THREADS
+  char *canonical = realpath(joined, NULL);
+  if (canonical != NULL) {
+    free(joined);
+    return canonical;
+  }
+#endif
+  return joined;
+}
+
+static int findModule(ModuleList *list, const char *path) {
+  for (int i = 0; i < list->count; i++) {
+    if (strcmp(list->modules[i].path, path) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Takes ownership of path and source
+static void addModule(ModuleList *list, char *path, char *source) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->modules =
+        GROW_ARRAY(Module, list->modules, oldCapacity, list->capacity);
+  }
+
+  // The script that was run always comes first
+  Module *module = &list->modules[list->count];
+  module->imported = list->count > 0;
+  list->count++;
+  module->path = path;
+  module->source = source;
+  module->function = NULL;
+  module->heap.objects = NULL;
+  module->heap.bytesAllocated = 0;
+}
+
+// The quick dependency scan: an import keyword followed by a string is all we
+// look for, without parsing anything. Each module found is added to the list,
+// where it gets scanned in turn
+static void scanImports(ModuleList *list, int index) {
+  initScanner(list->modules[index].source);
+
+  TokenType previous = TOKEN_EOF;
+  for (;;) {
+    Token token = scanToken();
+    if (token.type == TOKEN_EOF)
+      break;
+
+    if (previous == TOKEN_IMPORT && token.type == TOKEN_STRING) {
+      char *path = resolveImport(list->modules[index].path, token.start + 1,
+                                 token.length - 2);
+      char *source = NULL;
+      if (findModule(list, path) == -1 && (source = readSource(path)) != NULL) {
+        addModule(list, path, source);
+      } else {
+        free(path);
+      }
+    }
+    previous = token.type;
+  }
+}
+
+static void compileOnHeap(Module *module) {
+  Heap heap;
+  heap.objects = NULL;
+  initTable(&heap.strings);
+  heap.bytesAllocated = 0;
+
+  privateHeap = &heap;
+  module->function =
+      compileModule(module->source, module->path, module->imported);
+  // Every string worth keeping is referred to by the compiled code
+  freeTable(&heap.strings);
+  privateHeap = NULL;
+
+  module->heap = heap;
+}
+
+#ifdef CLOX_THREADS
+// Each of the pool's threads keeps taking the next module until there are
+// none left
+static void *compileModules(void *arg) {
+  ModuleList *list = (ModuleList *)arg;
+  for (;;) {
+    pthread_mutex_lock(&list->lock);
+    int index = list->next++;
+    pthread_mutex_unlock(&list->lock);
+
+    if (index >= list->count)
+      return NULL;
+    compileOnHeap(&list->modules[index]);
+  }
+}
+#endif
+
+static void compileAll(ModuleList *list) {
+#ifdef CLOX_THREADS
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threadCount = list->count;
+  if (cores > 0 && threadCount > cores)
+    threadCount = (int)cores;
+  if (threadCount > MAX_COMPILE_THREADS)
+    threadCount = MAX_COMPILE_THREADS;
+
+  list->next = 0;
+  pthread_mutex_init(&list->lock, NULL);
+
+  // This thread is one of the workers. If a thread can't be started, the rest
+  // just have more to do
+  pthread_t threads[MAX_COMPILE_THREADS];
+  int started = 0;
+  for (int i = 1; i < threadCount; i++) {
+    if (pthread_create(&threads[started], NULL, compileModules, list) == 0) {
+      started++;
+    }
+  }
+  compileModules(list);
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&list->lock);
+#else
+  for (int i = 0; i < list->count; i++) {
+    compileOnHeap(&list->modules[i]);
+  }
+#endif
+}
+
+// Strings are compared by identity, so a string a module interned on its own
+// heap has to be swapped for the VM's copy wherever the module's code refers
+// to it. Nested functions get the same treatment
+static void internFunction(ObjFunction *function) {
+  if (function->name != NULL) {
+    function->name = internString(function->name);
+  }
+
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value value = constants->values[i];
+    if (IS_STRING(value)) {
+      constants->values[i] = OBJ_VAL(internString(AS_STRING(value)));
+    } else if (IS_FUNCTION(value)) {
+      internFunction(AS_FUNCTION(value));
+    }
+  }
+}
+
+// Hands a compiled module over to the VM and registers it under its path
+static void linkModule(Module *module, bool isMain) {
+  adoptHeap(&module->heap);
+  if (module->function == NULL)
+    return;
+
+  push(OBJ_VAL(module->function));
+  internFunction(module->function);
+
+  ObjString *path = copyString(module->path, (int)strlen(module->path));
+  push(OBJ_VAL(path));
+  // The main script is already running by the time anything can import it. A
+  // module that's been registered already, by a heap image, has run
+  Value registered;
+  if (isMain || !tableGet(&vm.modules, path, &registered))
+    tableSet(&vm.modules, path,
+             isMain ? BOOL_VAL(true) : OBJ_VAL(module->function));
+  pop();
+  pop();
+}
+
+ObjFunction *loadProgram(const char *path, const char *source) {
+  ModuleList list;
+  list.modules = NULL;
+  list.count = 0;
+  list.capacity = 0;
+
+  size_t length = strlen(source);
+  char *mainSource = (char *)malloc(length + 1);
+  memcpy(mainSource, source, length + 1);
+  addModule(&list, resolveImport(NULL, path, (int)strlen(path)), mainSource);
+  for (int i = 0; i < list.count; i++) {
+    scanImports(&list, i);
+  }
+
+  // A program without imports is compiled right on the VM's heap, like always
+  if (list.count == 1) {
+    list.modules[0].function =
+        compileModule(list.modules[0].source, list.modules[0].path, false);
+  } else {
+    compileAll(&list);
+  }
+
+  // Linking a module allocates, which can set off a collection, and nothing
+  // refers to the main script yet
+  ObjFunction *script = list.modules[0].function;
+  if (script != NULL)
+    push(OBJ_VAL(script));
+
+  bool hadError = false;
+  for (int i = 0; i < list.count; i++) {
+    linkModule(&list.modules[i], i == 0);
+    hadError |= list.modules[i].function == NULL;
+    free(list.modules[i].path);
+    free(list.modules[i].source);
+  }
+  FREE_ARRAY(Module, list.modules, list.capacity);
+
+  if (script != NULL)
+    pop();
+  return hadError ? NULL : script;
+}
+
+InterpretResult interpretFile(const char *path, const char *source) {
+  ObjFunction *script = loadProgram(path, source);
+  if (script == NULL)
+    return INTERPRET_COMPILE_ERROR;
+
+  return runScript(script);
+}
+
+// Compiles the module at path on the VM's own heap, for an import nobody saw
+// coming when the program started. NULL if there's no such file or it doesn't
+// compile
+ObjFunction *loadModule(const char *path) {
+  char *source = readSource(path);
+  if (source == NULL)
+    return NULL;
+
+  ObjFunction *function = compileModule(source, path, true);
+  free(source);
+  return function;
+}
@@ -0,0 +1,34 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "object.h"
+#include "vm.h"
+
+// Modules are compiled on a pool of threads, where there are POSIX threads to
+// use. Everywhere else they're compiled one after another
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_THREADS
+#endif
+
+// Most threads the compiler will use, however many cores there are
+#define MAX_COMPILE_THREADS 16
+
+// "import "path";" runs the Lox file at path, relative to the importing file,
+// the first time it's reached. A module has no namespace of its own: it runs
+// in the global scope like the rest of the program.
+//
+// Running a file starts with a quick scan of its tokens for imports, and then
+// the imports' imports, to find every module the program could need. Those are
+// compiled in parallel, each on its own private heap, and then linked into the
+// VM before anything runs.
+
+// Compiles the program in the file at path and every module it imports, and
+// links them into the VM. Returns the main script, ready for runScript(), or
+// NULL if anything didn't compile. Nothing else refers to the script yet, so
+// the caller has to keep it safe from the collector
+ObjFunction *loadProgram(const char *path, const char *source);
+InterpretResult interpretFile(const char *path, const char *source);
+ObjFunction *loadModule(const char *path);
+char *resolveImport(const char *importer, const char *path, int length);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "fiber.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -13,38 +14,229 @@
 static Obj *allocateObject(size_t size, ObjType type) {
   Obj *object = (Obj *)reallocate(NULL, 0, size);
   object->type = type;
+  object->isMarked = false;
 
   // Insert the newly allocated object at the head of the tracked objects linked
-  // list in VM
-  object->next = vm.objects;
-  vm.objects = object;
+  // list in VM, or in the heap of the compiler running on this thread
+  Obj **objects = privateHeap != NULL ? &privateHeap->objects : &vm.objects;
+  object->next = *objects;
+  *objects = object;
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void *)object, size, type);
+#endif
+
   return object;
 }
 
+ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
+  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjClass *newClass(ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  klass->initializer = NULL;
+  klass->fieldCapacity = 0;
+  initTable(&klass->methods);
+  return klass;
+}
+
+ObjClosure *newClosure(ObjFunction *function) {
+  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    upvalues[i] = NULL;
+  }
+
+  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  closure->function = function;
+  closure->upvalues = upvalues;
+  closure->upvalueCount = function->upvalueCount;
+  return closure;
+}
+
+ObjFiber *newFiber(Value callee) {
+  ObjFiber *fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+  fiber->callee = callee;
+  fiber->result = NIL_VAL;
+  fiber->state = FIBER_READY;
+  fiber->next = NULL;
+  fiber->waiters = NULL;
+  fiber->wakeAt = 0;
+  fiber->openUpvalues = NULL;
+  allocateFiberMemory(fiber);
+  return fiber;
+}
+
+ObjFunction *newFunction() {
+  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+  function->arity = 0;
+  function->upvalueCount = 0;
+  function->registers = NULL;
+  function->jit = NULL;
+  function->aot = NULL;
+  function->hotness = 0;
+  function->name = NULL;
+  initChunk(&function->chunk);
+  return function;
+}
+
+ObjInstance *newInstance(ObjClass *klass) {
+  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = vm.rootShape;
+  instance->fieldCapacity = 0;
+  instance->fields = NULL;
+
+  if (klass->fieldCapacity > 0) {
+    push(OBJ_VAL(instance));
+    instance->fields = ALLOCATE(Value, klass->fieldCapacity);
+    instance->fieldCapacity = klass->fieldCapacity;
+    pop();
+  }
+
+  return instance;
+}
+
+ObjList *newList() {
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+ObjMap *newMap() {
+  ObjMap *map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  initValueTable(&map->table);
+  return map;
+}
+
+ObjNative *newNative(NativeFn function, int arity) {
+  ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+  native->function = function;
+  native->arity = arity;
+  return native;
+}
+
+ObjShape *newShape() {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->fieldCount = 0;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+  return shape;
+}
+
+// Returns the index of the field, or -1 if instances with this shape don't
+// have it
+int shapeSlot(ObjShape *shape, ObjString *name) {
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot))
+    return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+// The shape an instance moves to when it gets a new field
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next))
+    return (ObjShape *)AS_OBJ(next);
+
+  ObjShape *child = newShape();
+  push(OBJ_VAL(child));
+  tableAddAll(&shape->slots, &child->slots);
+  tableSet(&child->slots, name, NUMBER_VAL((double)shape->fieldCount));
+  child->fieldCount = shape->fieldCount + 1;
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+  return child;
+}
+
+// Moves the instance to a shape with more fields, growing its field array if
+// needed. The caller stores the new field's value right after
+void instanceSetShape(ObjInstance *instance, ObjShape *shape) {
+  if (shape->fieldCount > instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity < shape->fieldCount)
+      capacity = shape->fieldCount;
+
+    instance->fields =
+        GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+
+    if (instance->klass->fieldCapacity < capacity)
+      instance->klass->fieldCapacity = capacity;
+  }
+
+  // Until the caller stores into it, the new field must hold something the
+  // collector can look at
+  for (int i = instance->shape->fieldCount; i < shape->fieldCount; i++) {
+    instance->fields[i] = NIL_VAL;
+  }
+
+  instance->shape = shape;
+}
+
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
   string->length = length;
   string->chars = chars;
   string->hash = hash;
 
-  // Automatically intern new unique strings
+  // Automatically intern new unique strings. A private heap is never
+  // collected, so there's nothing to protect the string from there
+  if (privateHeap != NULL) {
+    tableSet(&privateHeap->strings, string, NIL_VAL);
+    return string;
+  }
+
+  push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
+  pop();
   return string;
 }
 
-// Implementation of FNV-1a
+// Gives a string from a private heap the VM's identity for its contents: the
+// VM's own interned copy if it has one, otherwise this string, interned now
+ObjString *internString(ObjString *string) {
+  ObjString *interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
+  if (interned != NULL)
+    return interned;
+
+  push(OBJ_VAL(string));
+  tableSet(&vm.strings, string, NIL_VAL);
+  pop();
+  return string;
+}
+
+// Where strings are interned: on a private heap, its own table
+static Table *internTable() {
+  return privateHeap != NULL ? &privateHeap->strings : &vm.strings;
+}
+
+// Implementation of FNV-1a, seeded per process. FNV's low bits only ever
+// depend on the low bits of what came before, and they're the ones that pick a
+// bucket, so the hash finishes by folding its high bits and the rest of the
+// seed down into them
 static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
+  uint32_t hash = 2166136261u ^ (uint32_t)hashSeed;
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t)key[i];
     hash *= 16777619;
   }
+  hash ^= (uint32_t)(hashSeed >> 32);
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
   return hash;
 }
 
 ObjString *takeString(char *chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(internTable(), chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
@@ -54,7 +246,7 @@ ObjString *takeString(char *chars, int length) {
 
 ObjString *copyString(const char *chars, int length) {
   uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString *interned = tableFindString(internTable(), chars, length, hash);
 
   if (interned != NULL)
     return interned;
@@ -67,10 +259,118 @@ ObjString *copyString(const char *chars, int length) {
   return allocateString(heapChars, length, hash);
 }
 
+ObjUpvalue *newUpvalue(Value *slot) {
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+  upvalue->closed = NIL_VAL;
+  upvalue->location = slot;
+  upvalue->next = NULL;
+  return upvalue;
+}
+
+// Anonymous functions have no name. Neither does the top-level script, but
+// that is never visible to user code
+static void printFunction(ObjFunction *function) {
+  if (function->name == NULL) {
+    printf("<fn>");
+    return;
+  }
+  printf("<fn %s>", function->name->chars);
+}
+
+// The lists and maps we're in the middle of printing. One that contains itself
+// prints as [...] or {...} where it comes around again, and so does anything
+// nested deeper than this, so printing never runs out of C stack
+#define MAX_PRINT_DEPTH 64
+static Obj *printing[MAX_PRINT_DEPTH];
+static int printingCount = 0;
+
+// False if container should be abbreviated. Otherwise the caller prints it
+// and then calls leaveContainer()
+static bool enterContainer(Obj *container) {
+  if (printingCount == MAX_PRINT_DEPTH)
+    return false;
+  for (int i = 0; i < printingCount; i++) {
+    if (printing[i] == container)
+      return false;
+  }
+  printing[printingCount++] = container;
+  return true;
+}
+
+static void leaveContainer() { printingCount--; }
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+  case OBJ_BOUND_METHOD:
+    printFunction(AS_BOUND_METHOD(value)->method->function);
+    break;
+  case OBJ_CLASS:
+    printf("%s", AS_CLASS(value)->name->chars);
+    break;
+  case OBJ_CLOSURE:
+    printFunction(AS_CLOSURE(value)->function);
+    break;
+  case OBJ_FIBER:
+    printf("<fiber>");
+    break;
+  case OBJ_FUNCTION:
+    printFunction(AS_FUNCTION(value));
+    break;
+  case OBJ_INSTANCE:
+    printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+    break;
+  case OBJ_LIST: {
+    if (!enterContainer(AS_OBJ(value))) {
+      printf("[...]");
+      break;
+    }
+    ValueArray *items = &AS_LIST(value)->items;
+    printf("[");
+    for (int i = 0; i < items->count; i++) {
+      if (i > 0)
+        printf(", ");
+      printValue(items->values[i]);
+    }
+    printf("]");
+    leaveContainer();
+    break;
+  }
+  case OBJ_MAP: {
+    if (!enterContainer(AS_OBJ(value))) {
+      printf("{...}");
+      break;
+    }
+    // Entries come out in bucket order, which is only the same from one run
+    // to the next when CLOX_HASH_SEED is set, like keys()
+    ValueTable *table = &AS_MAP(value)->table;
+    bool first = true;
+    printf("{");
+    for (int i = 0; i < table->capacity; i++) {
+      ValueEntry *entry = &table->entries[i];
+      if (IS_OBJ(entry->key) && AS_OBJ(entry->key) == NULL)
+        continue;
+      if (!first)
+        printf(", ");
+      first = false;
+      printValue(entry->key);
+      printf(": ");
+      printValue(entry->value);
+    }
+    printf("}");
+    leaveContainer();
+    break;
+  }
+  case OBJ_NATIVE:
+    printf("<native fn>");
+    break;
+  case OBJ_SHAPE:
+    printf("<shape %d>", ((ObjShape *)AS_OBJ(value))->fieldCount);
+    break;
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
     break;
+  case OBJ_UPVALUE:
+    printf("upvalue");
+    break;
   }
 }
@@ -1,22 +1,56 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include "chunk.h"
 #include "common.h"
+#include "register.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
 typedef enum {
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
+  OBJ_CLOSURE,
+  OBJ_FIBER,
+  OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_LIST,
+  OBJ_MAP,
+  OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
+  OBJ_UPVALUE,
 } ObjType;
 
 struct Obj {
   ObjType type;
+  // Set by the collector's mark phase for objects that are still reachable
+  bool isMarked;
   struct Obj *next;
 };
 
@@ -57,8 +91,182 @@ struct ObjString {
   uint32_t hash;
 };
 
+// Code for a function compiled ahead of time to C, see aot.h. It runs a frame
+// the way JIT-compiled code does and returns a JitStatus
+struct CallFrame;
+typedef int (*AotFunction)(struct CallFrame *frame);
+
+// Each function has its own chunk of bytecode. The top level of a script is
+// compiled into an implicit function too, so everything runs inside one
+typedef struct ObjFunction {
+  Obj obj;
+  int arity;
+  int upvalueCount;
+  Chunk chunk;
+  // The same code translated for the register VM, or NULL if it isn't in use
+  // or the function does something the translation doesn't support
+  RegChunk *registers;
+  // Machine code for the function once it's hot, and how many times it has
+  // been called or looped in the interpreter so far. -1 means it couldn't be
+  // compiled, so don't try again
+  struct JitCode *jit;
+  int hotness;
+  AotFunction aot;
+  ObjString *name;
+} ObjFunction;
+
+// A native function gets a pointer straight into the VM's stack, at the first
+// of its arguments, and how many there are. Nothing is copied or boxed, and
+// the return value replaces the callee and arguments on the stack
+typedef Value (*NativeFn)(int argCount, Value *args);
+
+typedef struct {
+  Obj obj;
+  NativeFn function;
+  // Number of arguments the VM checks for before calling, or -1 to let the
+  // function deal with any number itself
+  int arity;
+} ObjNative;
+
+// Runtime representation of a captured variable. While the variable is still
+// on the stack, location points at its stack slot. When the variable goes out
+// of scope it is "closed": the value moves into closed and location is
+// repointed at it, so closures keep working without knowing the difference
+typedef struct ObjUpvalue {
+  Obj obj;
+  Value *location;
+  Value closed;
+  // Open upvalues are kept in a list sorted by stack slot so we can find and
+  // close them quickly
+  struct ObjUpvalue *next;
+} ObjUpvalue;
+
+// Wraps a function with the upvalues it captured when the function
+// declaration was executed
+typedef struct ObjClosure {
+  Obj obj;
+  ObjFunction *function;
+  ObjUpvalue **upvalues;
+  int upvalueCount;
+} ObjClosure;
+
+/*
+ * A shape (or "hidden class") describes the layout of an instance's fields:
+ * which names it has and which index in the instance's field array each one
+ * lives at.
+ *
+ * Shapes form a tree rooted at vm.rootShape. Adding a field to an instance
+ * moves it along a transition to a child shape, and transitions are cached, so
+ * every instance that gets the same fields assigned in the same order ends up
+ * sharing a single ObjShape. That's what lets a property access site cache
+ * "for this shape the field is at index n" and skip the hash lookup next time.
+ */
+typedef struct ObjShape {
+  Obj obj;
+  // Field name -> index in the instance's fields array
+  Table slots;
+  // Field name -> the shape an instance moves to when it gains that field
+  Table transitions;
+  // Number of fields an instance with this shape has
+  int fieldCount;
+} ObjShape;
+
+typedef struct ObjClass {
+  Obj obj;
+  ObjString *name;
+  Table methods;
+  // Looked up once when "init" is defined rather than on every construction
+  ObjClosure *initializer;
+  // The most fields any instance of this class has grown to so far. New
+  // instances allocate that many up front so they usually never reallocate
+  int fieldCapacity;
+} ObjClass;
+
+// Fields live in a flat array laid out by the instance's shape instead of a
+// per-instance hash table
+typedef struct {
+  Obj obj;
+  ObjClass *klass;
+  ObjShape *shape;
+  int fieldCapacity;
+  Value *fields;
+} ObjInstance;
+
+// Lox's one collection type: a growable array of values, indexed from zero
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+// A hash table from any values to any values. Strings are equal by content
+// and other objects by identity, like ==
+typedef struct {
+  Obj obj;
+  ValueTable table;
+} ObjMap;
+
+typedef enum {
+  // In the queue of fibers waiting for their turn
+  FIBER_READY,
+  FIBER_RUNNING,
+  // Parked until something wakes it: I/O, a timer or another fiber finishing
+  FIBER_WAITING,
+  FIBER_DONE
+} FiberState;
+
+// A lightweight thread of Lox code, see fiber.h. Each fiber has a value stack
+// and call frames of its own. While a fiber runs, the VM works on them
+// directly and keeps stackTop, frameCount and openUpvalues to itself. They're
+// copied back here when the fiber is switched out
+typedef struct ObjFiber {
+  Obj obj;
+  // What the fiber calls when it starts, or nil for the main fiber
+  Value callee;
+  // The callee's return value once the fiber is done
+  Value result;
+  FiberState state;
+  // The next fiber in whichever queue this one is in
+  struct ObjFiber *next;
+  // Fibers waiting for this one to finish
+  struct ObjFiber *waiters;
+  // When a sleeping fiber wakes up, on the monotonic clock
+  double wakeAt;
+
+  struct CallFrame *frames;
+  int frameCount;
+  Value *stack;
+  Value *stackTop;
+  ObjUpvalue *openUpvalues;
+
+  // The stacks and saved machine context, owned by fiber.c
+  void *memory;
+} ObjFiber;
+
+// A method closure together with the receiver it was accessed on, so "this"
+// is still bound when it eventually gets called
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure *method;
+} ObjBoundMethod;
+
+ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
+ObjClass *newClass(ObjString *name);
+ObjClosure *newClosure(ObjFunction *function);
+ObjFiber *newFiber(Value callee);
+ObjFunction *newFunction();
+ObjInstance *newInstance(ObjClass *klass);
+ObjList *newList();
+ObjMap *newMap();
+ObjNative *newNative(NativeFn function, int arity);
+ObjShape *newShape();
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+void instanceSetShape(ObjInstance *instance, ObjShape *shape);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *internString(ObjString *string);
+ObjUpvalue *newUpvalue(Value *slot);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+// Where the jump instruction at offset lands
+static int jumpTarget(Chunk *chunk, int offset) {
+  int distance = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  if (chunk->code[offset] == OP_LOOP)
+    return offset + 3 - distance;
+  return offset + 3 + distance;
+}
+
+static bool isJump(uint8_t instruction) {
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE ||
+         instruction == OP_LOOP;
+}
+
+// Instructions that only push something, and can't fail doing it
+static bool isPurePush(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The instruction that reads back what the one given stores
+static int reloadOf(uint8_t instruction) {
+  switch (instruction) {
+  case OP_SET_LOCAL:
+    return OP_GET_LOCAL;
+  case OP_SET_GLOBAL:
+    return OP_GET_GLOBAL;
+  case OP_SET_UPVALUE:
+    return OP_GET_UPVALUE;
+  default:
+    return -1;
+  }
+}
+
+// Whether two variable instructions name the same variable. Globals are named
+// by a constant, and the same name may have been added more than once
+static bool sameVariable(Chunk *chunk, int a, int b) {
+  uint8_t slotA = chunk->code[a + 1];
+  uint8_t slotB = chunk->code[b + 1];
+  if (chunk->code[a] != OP_SET_GLOBAL)
+    return slotA == slotB;
+  return valuesEqual(chunk->constants.values[slotA],
+                     chunk->constants.values[slotB]);
+}
+
+// How many instructions the pattern starting at offset spans, or 0 if none
+// does. All of them are dropped, unless keepFirst is set. Only the first
+// instruction may be a jump target: a jump into the middle of a pattern would
+// expect a stack it no longer leaves. None of them drop a jump
+static int match(Chunk *chunk, int offset, const bool *isTarget,
+                 bool *keepFirst) {
+  uint8_t *code = chunk->code;
+  int next = offset + instructionLength(chunk, offset);
+  if (next >= chunk->count || isTarget[next])
+    return 0;
+
+  // A value pushed only to be popped again, as in "nil;"
+  if (isPurePush(code[offset]) && code[next] == OP_POP)
+    return 2;
+
+  int third = next + instructionLength(chunk, next);
+  if (third >= chunk->count || isTarget[third])
+    return 0;
+
+  // "x = 1; print x;" stores x, pops it, and then loads it straight back. The
+  // store leaves the value on the stack, so the pop and load can both go
+  if (reloadOf(code[offset]) == code[third] && code[next] == OP_POP &&
+      sameVariable(chunk, offset, third)) {
+    *keepFirst = true;
+    return 3;
+  }
+
+  // "!!x" isn't x, but an if or while that pops the condition on both paths
+  // only cares whether it's truthy
+  if (code[offset] == OP_NOT && code[next] == OP_NOT &&
+      code[third] == OP_JUMP_IF_FALSE && third + 3 < chunk->count &&
+      code[third + 3] == OP_POP &&
+      code[jumpTarget(chunk, third)] == OP_POP) {
+    return 2;
+  }
+
+  return 0;
+}
+
+int optimizeChunk(Chunk *chunk) {
+  if (chunk->count == 0)
+    return 0;
+
+  bool *isTarget = ALLOCATE(bool, chunk->count + 1);
+  memset(isTarget, 0, sizeof(bool) * (chunk->count + 1));
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (isJump(chunk->code[offset]))
+      isTarget[jumpTarget(chunk, offset)] = true;
+  }
+
+  // The optimized code is written to a chunk of its own, which keeps its line
+  // table in step. newOffsets maps each old offset to where it went, or where
+  // the code after it went if it was dropped
+  Chunk optimized;
+  initChunk(&optimized);
+  reserveChunk(&optimized, chunk->count);
+  int *newOffsets = ALLOCATE(int, chunk->count + 1);
+  int removed = 0;
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    bool keepFirst = false;
+    int span = match(chunk, offset, isTarget, &keepFirst);
+    if (span == 0) {
+      span = 1;
+      keepFirst = true;
+    }
+
+    for (int i = 0; i < span; i++) {
+      int length = instructionLength(chunk, offset);
+      newOffsets[offset] = optimized.count;
+      if (i == 0 && keepFirst) {
+        writeBytes(&optimized, &chunk->code[offset], length,
+                   getLine(chunk, offset));
+      } else {
+        removed++;
+      }
+      offset += length;
+    }
+  }
+  newOffsets[chunk->count] = optimized.count;
+
+  // Now that everything has moved, point the jumps at where their targets went
+  for (int old = 0; old < chunk->count;
+       old += instructionLength(chunk, old)) {
+    if (!isJump(chunk->code[old]))
+      continue;
+
+    int from = newOffsets[old];
+    int to = newOffsets[jumpTarget(chunk, old)];
+    int distance = chunk->code[old] == OP_LOOP ? from + 3 - to : to - from - 3;
+    optimized.code[from + 1] = (distance >> 8) & 0xff;
+    optimized.code[from + 2] = distance & 0xff;
+  }
+
+  FREE_ARRAY(int, newOffsets, chunk->count + 1);
+  FREE_ARRAY(bool, isTarget, chunk->count + 1);
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  chunk->code = optimized.code;
+  chunk->count = optimized.count;
+  chunk->capacity = optimized.capacity;
+  chunk->lines = optimized.lines;
+  chunk->lineCount = optimized.lineCount;
+  chunk->lineCapacity = optimized.lineCapacity;
+  return removed;
+}
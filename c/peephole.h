@@ -0,0 +1,12 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// A pass over a function's finished bytecode that drops the instructions a
+// single-pass compiler can't tell are wasted, because it only sees one
+// statement at a time. Jumps are retargeted and the line table follows the
+// code. Returns how many instructions were removed
+int optimizeChunk(Chunk *chunk);
+
+#endif
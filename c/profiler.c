@@ -0,0 +1,282 @@
+// For sigaction() and setitimer() under -std=c99. g++ defines it for us
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+#ifdef CLOX_PROFILER
+#include <signal.h>
+#include <sys/time.h>
+
+// The handler is the only writer and drainSamples() the only reader, and both
+// run on the main thread, so the buffer needs no locks. The handler fills
+// words from head on and then moves head past them; the reader works up to
+// the head it saw and then moves tail. Both only ever grow, the index into the
+// buffer is their value modulo its size
+static uintptr_t *samples = NULL;
+static volatile size_t sampleHead = 0;
+static volatile size_t sampleTail = 0;
+
+// Samples that found the buffer full, and ones that landed on a compiler
+// thread. Those can be on any thread, and losing the odd increment is fine
+static volatile int droppedSamples = 0;
+static volatile int compileSamples = 0;
+
+// Every distinct stack seen so far and how often, in an open-addressed hash
+// table. It's only touched outside the handler, but while the collector may
+// be running, so it lives outside the managed heap
+typedef struct {
+  char *stack;
+  uint32_t hash;
+  int count;
+} FoldedStack;
+
+static const char *profilePath = NULL;
+
+static FoldedStack *stacks = NULL;
+static int stackCount = 0;
+static int stackCapacity = 0;
+
+static void takeSample(int signal) {
+  // Compiling in parallel uses private heaps, and there are no frames to see
+  if (privateHeap != NULL) {
+    compileSamples++;
+    return;
+  }
+
+  size_t head = sampleHead;
+  int depth = vm.frameCount;
+  if (head + depth + 1 - sampleTail > SAMPLE_BUFFER_SIZE) {
+    droppedSamples++;
+    return;
+  }
+
+  samples[head % SAMPLE_BUFFER_SIZE] = (uintptr_t)depth;
+  for (int i = 0; i < depth; i++) {
+    samples[(head + 1 + i) % SAMPLE_BUFFER_SIZE] = (uintptr_t)vm.frames[i].ip;
+  }
+  sampleHead = head + depth + 1;
+}
+
+bool startProfiler(int hz, const char *path) {
+  profilePath = path != NULL ? path : PROFILE_PATH;
+  samples = (uintptr_t *)malloc(sizeof(uintptr_t) * SAMPLE_BUFFER_SIZE);
+  if (samples == NULL)
+    return false;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = takeSample;
+  // So a sample doesn't make a blocking read or waitpid() fail
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) == -1)
+    return false;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static uint32_t hashStack(const char *stack, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)stack[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static void countStack(const char *stack, int length, int count) {
+  if (stackCount + 1 > stackCapacity * 3 / 4) {
+    int oldCapacity = stackCapacity;
+    FoldedStack *oldStacks = stacks;
+    stackCapacity = GROW_CAPACITY(oldCapacity);
+    stacks = (FoldedStack *)calloc(stackCapacity, sizeof(FoldedStack));
+    if (stacks == NULL)
+      exit(1);
+
+    for (int i = 0; i < oldCapacity; i++) {
+      if (oldStacks[i].stack == NULL)
+        continue;
+      uint32_t index = oldStacks[i].hash & (stackCapacity - 1);
+      while (stacks[index].stack != NULL) {
+        index = (index + 1) & (stackCapacity - 1);
+      }
+      stacks[index] = oldStacks[i];
+    }
+    free(oldStacks);
+  }
+
+  uint32_t hash = hashStack(stack, length);
+  uint32_t index = hash & (stackCapacity - 1);
+  for (;;) {
+    FoldedStack *entry = &stacks[index];
+    if (entry->stack == NULL) {
+      entry->stack = (char *)malloc(length + 1);
+      if (entry->stack == NULL)
+        exit(1);
+      memcpy(entry->stack, stack, length);
+      entry->stack[length] = '\0';
+      entry->hash = hash;
+      entry->count = count;
+      stackCount++;
+      return;
+    }
+
+    if (entry->hash == hash && strcmp(entry->stack, stack) == 0) {
+      entry->count += count;
+      return;
+    }
+    index = (index + 1) & (stackCapacity - 1);
+  }
+}
+
+static int compareCode(const void *a, const void *b) {
+  uintptr_t codeA = (uintptr_t)(*(ObjFunction *const *)a)->chunk.code;
+  uintptr_t codeB = (uintptr_t)(*(ObjFunction *const *)b)->chunk.code;
+  return codeA < codeB ? -1 : codeA > codeB;
+}
+
+// The function whose bytecode ip is in, by binary search through every
+// function sorted by where its code is
+static ObjFunction *findFunction(ObjFunction **functions, int count,
+                                 uintptr_t ip) {
+  int low = 0;
+  int high = count - 1;
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    Chunk *chunk = &functions[middle]->chunk;
+    uintptr_t start = (uintptr_t)chunk->code;
+    if (ip < start) {
+      high = middle - 1;
+    } else if (ip > start + chunk->count) {
+      low = middle + 1;
+    } else {
+      return functions[middle];
+    }
+  }
+  return NULL;
+}
+
+// Turns the samples taken since last time into folded stacks. No function may
+// be freed between taking a sample and this, so the collector calls it before
+// it frees one
+void drainSamples() {
+  if (samples == NULL)
+    return;
+  size_t head = sampleHead;
+  size_t tail = sampleTail;
+  if (head == tail)
+    return;
+
+  // Every function on the heap, so each ip can be looked up
+  int functionCount = 0;
+  for (Obj *object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_FUNCTION)
+      functionCount++;
+  }
+  ObjFunction **functions =
+      (ObjFunction **)malloc(sizeof(ObjFunction *) * (functionCount + 1));
+  if (functions == NULL)
+    exit(1);
+  functionCount = 0;
+  for (Obj *object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJ_FUNCTION &&
+        ((ObjFunction *)object)->chunk.code != NULL) {
+      functions[functionCount++] = (ObjFunction *)object;
+    }
+  }
+  qsort(functions, functionCount, sizeof(ObjFunction *), compareCode);
+
+  char stack[4096];
+  while (tail != head) {
+    int depth = (int)samples[tail % SAMPLE_BUFFER_SIZE];
+    int length = 0;
+    if (depth == 0) {
+      length = snprintf(stack, sizeof(stack), "[compile]");
+    }
+
+    for (int i = 0; i < depth; i++) {
+      uintptr_t ip = samples[(tail + 1 + i) % SAMPLE_BUFFER_SIZE];
+      ObjFunction *function = findFunction(functions, functionCount, ip);
+
+      // Room for the longest frame we write, and a frame that was only half
+      // pushed when the sample was taken isn't one
+      if (length > (int)sizeof(stack) - 64 || function == NULL)
+        break;
+
+      int offset = (int)(ip - (uintptr_t)function->chunk.code) - 1;
+      int line = getLine(&function->chunk, offset < 0 ? 0 : offset);
+      const char *name =
+          function->name != NULL ? function->name->chars : "script";
+      length += snprintf(stack + length, sizeof(stack) - length, "%s%.40s:%d",
+                         i > 0 ? ";" : "", name, line);
+    }
+
+    if (length > 0)
+      countStack(stack, length, 1);
+    tail += depth + 1;
+  }
+  sampleTail = tail;
+
+  free(functions);
+}
+
+// Stops sampling and writes out everything that was sampled
+void stopProfiler() {
+  if (samples == NULL)
+    return;
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_DFL);
+
+  drainSamples();
+  if (compileSamples > 0) {
+    char compile[] = "[compile]";
+    countStack(compile, (int)strlen(compile), compileSamples);
+  }
+
+  FILE *out = fopen(profilePath, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", profilePath);
+  } else {
+    for (int i = 0; i < stackCapacity; i++) {
+      if (stacks[i].stack != NULL)
+        fprintf(out, "%s %d\n", stacks[i].stack, stacks[i].count);
+    }
+    fclose(out);
+  }
+
+  if (droppedSamples > 0) {
+    fprintf(stderr, "Dropped %d samples, the buffer was full.\n",
+            droppedSamples);
+  }
+
+  for (int i = 0; i < stackCapacity; i++) {
+    free(stacks[i].stack);
+  }
+  free(stacks);
+  stacks = NULL;
+  stackCount = 0;
+  stackCapacity = 0;
+  free(samples);
+  samples = NULL;
+}
+#else
+bool startProfiler(int hz, const char *path) { return false; }
+void stopProfiler() {}
+void drainSamples() {}
+#endif
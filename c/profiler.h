@@ -0,0 +1,43 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+
+// "clox --sample=<hz>[,<path>] script.lox" runs the script with a sampling
+// profiler: a SIGPROF timer interrupts it hz times per second of CPU time, and
+// each interruption records where every frame of the running fiber is. At exit
+// the samples are written to path, or PROFILE_PATH in the current directory if
+// there isn't one, as folded stacks, one line per distinct stack with how many
+// samples saw it,
+//
+//   script:14;fib:3;fib:5 57
+//
+// which is what flamegraph.pl and most other flame graph tools read. A frame is
+// the function's name and the line it's on. Time spent compiling before the
+// script starts is [compile].
+//
+// The signal handler only copies each frame's ip into a ring buffer. Mapping
+// ips to functions and lines needs the heap, and a half-pushed frame can hold
+// a stale pointer, so that waits until a collection is about to free a
+// function, or for exit. Code running on the register VM or as machine code only keeps
+// frame->ip up to date at calls, so those frames show the line of their last
+// call.
+//
+// Sampling uses setitimer(), so it's there wherever POSIX signals are.
+#if defined(__unix__) || defined(__APPLE__)
+#define CLOX_PROFILER
+#endif
+
+// Overwritten by every profiled run that doesn't name a path of its own
+#define PROFILE_PATH "clox.folded"
+
+// How many words the ring buffer holds. A sample takes one plus one for each
+// frame
+#define SAMPLE_BUFFER_SIZE (1 << 20)
+
+// Samples go to path when the profiler stops, PROFILE_PATH if it's NULL
+bool startProfiler(int hz, const char *path);
+void stopProfiler();
+void drainSamples();
+
+#endif
@@ -0,0 +1,546 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "register.h"
+
+/*
+ * Translates a function's stack bytecode into register instructions.
+ *
+ * The stack VM already gives every value a fixed home: at any point in the
+ * code the stack has a known depth, and the value at depth n lives in slot n
+ * of the frame's window. So stack position n simply becomes register n.
+ *
+ * What makes the register form cheaper is that we don't eagerly copy things
+ * into their stack position. While walking the code we keep a "virtual stack"
+ * describing what each position would hold: the value is already in its own
+ * register, or it's a copy of some local's register, or it's a constant.
+ * Instructions that consume operands read them from wherever they really are,
+ * so "a + 1" compiles to one ROP_ADD that reads a's register and a constant.
+ * Only at jumps, jump targets and calls do we flush the virtual stack into
+ * real registers, so that every path agrees on where things are.
+ *
+ * Functions that use anything beyond plain variables, arithmetic, control
+ * flow and calls (closures, properties, classes) are left to the stack VM, and
+ * so are functions with tail calls, since a register call always nests.
+ */
+
+typedef enum {
+  OPERAND_REGISTER, // Already in its own register.
+  OPERAND_LOCAL,    // A copy of the local variable in register index.
+  OPERAND_CONSTANT, // Constant index.
+} OperandType;
+
+typedef struct {
+  OperandType type;
+  int index;
+} Operand;
+
+typedef struct {
+  ObjFunction *function;
+  RegChunk *chunk;
+
+  Operand stack[UINT8_COUNT];
+  int depth;
+  int maxDepth;
+  bool failed;
+
+  // Offset in the stack code of the instruction being translated
+  int offset;
+
+  // For every offset in the stack code: whether something jumps there and,
+  // once we've passed it, the register instruction it starts at
+  bool *isTarget;
+  int *labels;
+
+  // The stack depth before each instruction, or -1 if it can't be reached,
+  // and whether the previous instruction falls through to the current one
+  int *depths;
+  bool fallsThrough;
+
+  // Forward jumps whose target isn't translated yet
+  int *jumps;
+  int *jumpTargets;
+  int jumpCount;
+
+  // Constant indexes for nil, true and false, added to the pool on demand
+  int literals[3];
+} Translator;
+
+// Length of each supported instruction, or 0 for ones we can't translate
+static int translatableLength(uint8_t instruction) {
+  switch (instruction) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_PRINT:
+  case OP_RETURN:
+    return 1;
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_CALL:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    return 3;
+  case OP_CONSTANT_LONG:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+// How many values the instruction leaves on the stack minus how many it takes
+static int stackEffect(uint8_t *code) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_RETURN:
+    return -1;
+  case OP_CALL:
+    return -code[1];
+  default:
+    return 0;
+  }
+}
+
+// Walks every path through the code to find the stack depth before each
+// instruction. The compiler guarantees all paths into an instruction agree,
+// which is what lets a stack position stand for a fixed register. Returns
+// false if that somehow doesn't hold
+static bool computeDepths(Translator *t, Chunk *code) {
+  int *pending = ALLOCATE(int, code->count);
+  int pendingCount = 0;
+  bool consistent = true;
+
+  t->depths[0] = t->function->arity + 1;
+  pending[pendingCount++] = 0;
+
+  while (pendingCount > 0 && consistent) {
+    int offset = pending[--pendingCount];
+    uint8_t *instruction = &code->code[offset];
+    int after = t->depths[offset] + stackEffect(instruction);
+
+    int successors[2];
+    int successorCount = 0;
+    switch (instruction[0]) {
+    case OP_RETURN:
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE: {
+      int distance = instruction[1] << 8 | instruction[2];
+      successors[successorCount++] = instruction[0] == OP_LOOP
+                                         ? offset + 3 - distance
+                                         : offset + 3 + distance;
+      if (instruction[0] == OP_JUMP_IF_FALSE)
+        successors[successorCount++] = offset + 3;
+      break;
+    }
+    default:
+      successors[successorCount++] =
+          offset + translatableLength(instruction[0]);
+      break;
+    }
+
+    for (int i = 0; i < successorCount; i++) {
+      int next = successors[i];
+      if (next >= code->count || after < 0 || after > UINT8_COUNT) {
+        consistent = false;
+      } else if (t->depths[next] == -1) {
+        t->depths[next] = after;
+        pending[pendingCount++] = next;
+      } else if (t->depths[next] != after) {
+        consistent = false;
+      }
+    }
+  }
+
+  FREE_ARRAY(int, pending, code->count);
+  return consistent;
+}
+
+static void emit(Translator *t, RegOpCode op, int a, int b, int c) {
+  RegChunk *chunk = t->chunk;
+  if (chunk->capacity < chunk->count + 1) {
+    int oldCapacity = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(oldCapacity);
+    chunk->code = GROW_ARRAY(RegInstruction, chunk->code, oldCapacity,
+                             chunk->capacity);
+    chunk->sourceOffsets =
+        GROW_ARRAY(int, chunk->sourceOffsets, oldCapacity, chunk->capacity);
+  }
+
+  // Jump targets are stored in a 16-bit operand
+  if (chunk->count > UINT16_MAX) {
+    t->failed = true;
+    return;
+  }
+
+  RegInstruction *instruction = &chunk->code[chunk->count];
+  instruction->op = (uint8_t)op;
+  instruction->a = (uint8_t)a;
+  instruction->b = (uint16_t)b;
+  instruction->c = (uint16_t)c;
+  chunk->sourceOffsets[chunk->count] = t->offset;
+  chunk->count++;
+}
+
+// The RK operand for whatever is at the given stack position
+static int rk(Translator *t, int position) {
+  Operand *operand = &t->stack[position];
+  switch (operand->type) {
+  case OPERAND_REGISTER:
+    return position;
+  case OPERAND_LOCAL:
+    return operand->index;
+  case OPERAND_CONSTANT:
+    return RK_CONSTANT | operand->index;
+  }
+
+  return position; // Unreachable.
+}
+
+static int constant(Translator *t, int index) {
+  if (index >= RK_CONSTANT)
+    t->failed = true;
+  return index;
+}
+
+static void push(Translator *t, OperandType type, int index) {
+  if (t->depth == UINT8_COUNT) {
+    t->failed = true;
+    return;
+  }
+
+  t->stack[t->depth].type = type;
+  t->stack[t->depth].index = index;
+  t->depth++;
+  if (t->depth > t->maxDepth)
+    t->maxDepth = t->depth;
+}
+
+// Makes sure the value at position is actually stored in its register
+static void materialize(Translator *t, int position) {
+  if (t->stack[position].type == OPERAND_REGISTER)
+    return;
+
+  emit(t, ROP_MOVE, position, rk(t, position), 0);
+  t->stack[position].type = OPERAND_REGISTER;
+}
+
+static void materializeAll(Translator *t) {
+  for (int i = 0; i < t->depth; i++) {
+    materialize(t, i);
+  }
+}
+
+static int literal(Translator *t, int which, Value value) {
+  if (t->literals[which] == -1) {
+    t->literals[which] = addConstant(&t->function->chunk, value);
+  }
+  return t->literals[which];
+}
+
+static void binary(Translator *t, RegOpCode op) {
+  int left = t->depth - 2;
+  emit(t, op, left, rk(t, left), rk(t, left + 1));
+  t->depth -= 2;
+  push(t, OPERAND_REGISTER, 0);
+}
+
+static void unary(Translator *t, RegOpCode op) {
+  int operand = t->depth - 1;
+  emit(t, op, operand, rk(t, operand), 0);
+  t->depth--;
+  push(t, OPERAND_REGISTER, 0);
+}
+
+static void jump(Translator *t, RegOpCode op, int condition, int target) {
+  materializeAll(t);
+
+  if (t->labels[target] != -1) {
+    emit(t, op, 0, condition, t->labels[target]);
+    return;
+  }
+
+  t->jumps[t->jumpCount] = t->chunk->count;
+  t->jumpTargets[t->jumpCount] = target;
+  t->jumpCount++;
+  emit(t, op, 0, condition, 0);
+}
+
+static void translateInstruction(Translator *t, uint8_t *code) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+    push(t, OPERAND_CONSTANT, code[1]);
+    break;
+  case OP_CONSTANT_LONG:
+    push(t, OPERAND_CONSTANT,
+         constant(t, code[1] | code[2] << 8 | code[3] << 16));
+    break;
+  case OP_NIL:
+    push(t, OPERAND_CONSTANT, constant(t, literal(t, 0, NIL_VAL)));
+    break;
+  case OP_TRUE:
+    push(t, OPERAND_CONSTANT, constant(t, literal(t, 1, BOOL_VAL(true))));
+    break;
+  case OP_FALSE:
+    push(t, OPERAND_CONSTANT, constant(t, literal(t, 2, BOOL_VAL(false))));
+    break;
+  case OP_POP:
+    t->depth--;
+    break;
+  case OP_GET_LOCAL:
+    materialize(t, code[1]);
+    push(t, OPERAND_LOCAL, code[1]);
+    break;
+  case OP_SET_LOCAL: {
+    int slot = code[1];
+    int value = t->depth - 1;
+
+    // Anything still pointing at the local's old value needs its own copy
+    // before we overwrite it
+    for (int i = 0; i < value; i++) {
+      if (t->stack[i].type == OPERAND_LOCAL && t->stack[i].index == slot) {
+        materialize(t, i);
+      }
+    }
+
+    emit(t, ROP_MOVE, slot, rk(t, value), 0);
+    t->stack[slot].type = OPERAND_REGISTER;
+    break;
+  }
+  case OP_GET_GLOBAL:
+    emit(t, ROP_GET_GLOBAL, t->depth, code[1], 0);
+    push(t, OPERAND_REGISTER, 0);
+    break;
+  case OP_DEFINE_GLOBAL:
+    emit(t, ROP_DEFINE_GLOBAL, 0, code[1], rk(t, t->depth - 1));
+    t->depth--;
+    break;
+  case OP_SET_GLOBAL:
+    emit(t, ROP_SET_GLOBAL, 0, code[1], rk(t, t->depth - 1));
+    break;
+  case OP_EQUAL:
+    binary(t, ROP_EQUAL);
+    break;
+  case OP_GREATER:
+    binary(t, ROP_GREATER);
+    break;
+  case OP_LESS:
+    binary(t, ROP_LESS);
+    break;
+  case OP_ADD:
+    binary(t, ROP_ADD);
+    break;
+  case OP_SUBTRACT:
+    binary(t, ROP_SUBTRACT);
+    break;
+  case OP_MULTIPLY:
+    binary(t, ROP_MULTIPLY);
+    break;
+  case OP_DIVIDE:
+    binary(t, ROP_DIVIDE);
+    break;
+  case OP_NOT:
+    unary(t, ROP_NOT);
+    break;
+  case OP_NEGATE:
+    unary(t, ROP_NEGATE);
+    break;
+  case OP_PRINT:
+    emit(t, ROP_PRINT, 0, rk(t, t->depth - 1), 0);
+    t->depth--;
+    break;
+  case OP_JUMP:
+    jump(t, ROP_JUMP, 0, t->offset + 3 + (code[1] << 8 | code[2]));
+    break;
+  case OP_JUMP_IF_FALSE:
+    // The condition stays on the stack, the compiler pops it on both paths
+    jump(t, ROP_JUMP_IF_FALSE, t->depth - 1,
+         t->offset + 3 + (code[1] << 8 | code[2]));
+    break;
+  case OP_LOOP:
+    jump(t, ROP_JUMP, 0, t->offset + 3 - (code[1] << 8 | code[2]));
+    break;
+  case OP_CALL: {
+    // The callee and arguments must really be in consecutive registers,
+    // since that's the window the callee's frame will use
+    int argCount = code[1];
+    int base = t->depth - argCount - 1;
+    for (int i = base; i < t->depth; i++) {
+      materialize(t, i);
+    }
+
+    emit(t, ROP_CALL, base, argCount, 0);
+    t->depth = base;
+    push(t, OPERAND_REGISTER, 0);
+    break;
+  }
+  case OP_RETURN:
+    emit(t, ROP_RETURN, 0, rk(t, t->depth - 1), 0);
+    t->depth--;
+    break;
+  }
+}
+
+void freeRegChunk(RegChunk *chunk) {
+  FREE_ARRAY(RegInstruction, chunk->code, chunk->capacity);
+  FREE_ARRAY(int, chunk->sourceOffsets, chunk->capacity);
+  FREE(RegChunk, chunk);
+}
+
+// Fills in function->registers if every instruction in the function can be
+// translated. Returns whether it could
+bool compileRegisters(ObjFunction *function) {
+  Chunk *code = &function->chunk;
+
+  // First find out whether we can handle the function at all, and where the
+  // jumps land
+  Translator t;
+  t.function = function;
+  t.isTarget = ALLOCATE(bool, code->count);
+  for (int i = 0; i < code->count; i++) {
+    t.isTarget[i] = false;
+  }
+
+  bool supported = true;
+  int jumpCount = 0;
+  for (int offset = 0; offset < code->count;) {
+    uint8_t instruction = code->code[offset];
+    int length = translatableLength(instruction);
+    if (length == 0) {
+      supported = false;
+      break;
+    }
+
+    if (length == 3) {
+      int distance = code->code[offset + 1] << 8 | code->code[offset + 2];
+      int target = instruction == OP_LOOP ? offset + 3 - distance
+                                          : offset + 3 + distance;
+      if (target >= code->count) {
+        supported = false;
+        break;
+      }
+      t.isTarget[target] = true;
+      jumpCount++;
+    }
+
+    offset += length;
+  }
+
+  if (!supported) {
+    FREE_ARRAY(bool, t.isTarget, code->count);
+    return false;
+  }
+
+  RegChunk *chunk = ALLOCATE(RegChunk, 1);
+  chunk->count = 0;
+  chunk->capacity = 0;
+  chunk->code = NULL;
+  chunk->sourceOffsets = NULL;
+  chunk->frameSize = 0;
+
+  t.chunk = chunk;
+  t.labels = ALLOCATE(int, code->count);
+  t.depths = ALLOCATE(int, code->count);
+  for (int i = 0; i < code->count; i++) {
+    t.labels[i] = -1;
+    t.depths[i] = -1;
+  }
+  t.fallsThrough = true;
+  t.jumps = ALLOCATE(int, jumpCount);
+  t.jumpTargets = ALLOCATE(int, jumpCount);
+  t.jumpCount = 0;
+  t.literals[0] = t.literals[1] = t.literals[2] = -1;
+
+  // On entry the window holds the callee and the arguments
+  t.depth = 0;
+  t.maxDepth = 0;
+  for (int i = 0; i <= function->arity; i++) {
+    push(&t, OPERAND_REGISTER, 0);
+  }
+  t.failed = !computeDepths(&t, code);
+
+  for (int offset = 0; offset < code->count && !t.failed;) {
+    t.offset = offset;
+    uint8_t instruction = code->code[offset];
+    int length = translatableLength(instruction);
+
+    // Dead code, like whatever follows a return
+    if (t.depths[offset] == -1) {
+      t.fallsThrough = false;
+      offset += length;
+      continue;
+    }
+
+    if (t.isTarget[offset]) {
+      if (t.fallsThrough)
+        materializeAll(&t);
+
+      // Everything a jump leaves on the stack is in its register already
+      t.depth = t.depths[offset];
+      for (int i = 0; i < t.depth; i++) {
+        t.stack[i].type = OPERAND_REGISTER;
+      }
+      t.labels[offset] = chunk->count;
+    }
+
+    translateInstruction(&t, &code->code[offset]);
+    t.fallsThrough = instruction != OP_JUMP && instruction != OP_LOOP &&
+                     instruction != OP_RETURN;
+    offset += length;
+  }
+
+  for (int i = 0; i < t.jumpCount; i++) {
+    chunk->code[t.jumps[i]].c = (uint16_t)t.labels[t.jumpTargets[i]];
+  }
+  chunk->frameSize = t.maxDepth;
+
+  FREE_ARRAY(bool, t.isTarget, code->count);
+  FREE_ARRAY(int, t.labels, code->count);
+  FREE_ARRAY(int, t.depths, code->count);
+  FREE_ARRAY(int, t.jumps, jumpCount);
+  FREE_ARRAY(int, t.jumpTargets, jumpCount);
+
+  if (t.failed) {
+    freeRegChunk(chunk);
+    return false;
+  }
+
+  function->registers = chunk;
+  return true;
+}
@@ -0,0 +1,60 @@
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "common.h"
+
+// Register-based instructions. Every stack slot in a function's frame window
+// is a register, and operands name registers directly instead of implicitly
+// popping and pushing the stack, so "a = b + c" between locals is a single
+// ROP_ADD instead of three pushes, an add and a store.
+typedef enum {
+  ROP_MOVE,          // R(a) = RK(b)
+  ROP_GET_GLOBAL,    // R(a) = globals[K(b)]
+  ROP_SET_GLOBAL,    // globals[K(b)] = RK(c), which must already exist
+  ROP_DEFINE_GLOBAL, // globals[K(b)] = RK(c)
+  ROP_EQUAL,         // R(a) = RK(b) == RK(c)
+  ROP_GREATER,       // R(a) = RK(b) > RK(c)
+  ROP_LESS,          // R(a) = RK(b) < RK(c)
+  ROP_ADD,           // R(a) = RK(b) + RK(c)
+  ROP_SUBTRACT,      // R(a) = RK(b) - RK(c)
+  ROP_MULTIPLY,      // R(a) = RK(b) * RK(c)
+  ROP_DIVIDE,        // R(a) = RK(b) / RK(c)
+  ROP_NOT,           // R(a) = !RK(b)
+  ROP_NEGATE,        // R(a) = -RK(b)
+  ROP_PRINT,         // print RK(b)
+  ROP_JUMP,          // pc = c
+  ROP_JUMP_IF_FALSE, // if RK(b) is falsey, pc = c
+  ROP_CALL,          // R(a) = R(a)(R(a + 1) ... R(a + b))
+  ROP_RETURN,        // return RK(b)
+} RegOpCode;
+
+// Operands b and c are "RK" operands: a register number, or a constant index
+// when RK_CONSTANT is set
+#define RK_CONSTANT 0x8000
+#define IS_RK_CONSTANT(operand) (((operand) & RK_CONSTANT) != 0)
+#define RK_INDEX(operand) ((operand) & ~RK_CONSTANT)
+
+typedef struct {
+  uint8_t op;
+  uint8_t a;
+  uint16_t b;
+  uint16_t c;
+} RegInstruction;
+
+typedef struct {
+  int count;
+  int capacity;
+  RegInstruction *code;
+  // Offset of the stack instruction each register instruction came from, for
+  // line numbers in runtime errors
+  int *sourceOffsets;
+  // Number of registers the function uses, including its parameters
+  int frameSize;
+} RegChunk;
+
+struct ObjFunction;
+
+bool compileRegisters(struct ObjFunction *function);
+void freeRegChunk(RegChunk *chunk);
+
+#endif
@@ -10,7 +10,7 @@ typedef struct {
   int line;
 } Scanner;
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
 void initScanner(const char *source) {
   scanner.start = source;
@@ -90,6 +90,7 @@ static void skipWhitespace() {
       } else {
         return;
       }
+      break;
     default:
       return;
     }
@@ -127,7 +128,15 @@ static TokenType identifierType() {
     }
     break;
   case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'f':
+        return checkKeyword(2, 0, "", TOKEN_IF);
+      case 'm':
+        return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+      }
+    }
+    break;
   case 'n':
     return checkKeyword(1, 2, "il", TOKEN_NIL);
   case 'o':
@@ -220,6 +229,10 @@ Token scanToken() {
     return makeToken(TOKEN_LEFT_BRACE);
   case '}':
     return makeToken(TOKEN_RIGHT_BRACE);
+  case '[':
+    return makeToken(TOKEN_LEFT_BRACKET);
+  case ']':
+    return makeToken(TOKEN_RIGHT_BRACKET);
   case ';':
     return makeToken(TOKEN_SEMICOLON);
   case ',':
@@ -7,6 +7,8 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -35,6 +37,7 @@ typedef enum {
   TOKEN_FOR,
   TOKEN_FUN,
   TOKEN_IF,
+  TOKEN_IMPORT,
   TOKEN_NIL,
   TOKEN_OR,
   TOKEN_PRINT,
@@ -1,35 +1,137 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
+uint64_t hashSeed = 0;
+
+// Set when CLOX_HASH_SEED chose the seed, and the run should be repeatable
+static bool fixedSeed = false;
+
+// The finishing step of splitmix64, which spreads every bit of its input over
+// every bit of the result
+static uint64_t mix64(uint64_t bits) {
+  bits ^= bits >> 30;
+  bits *= 0xbf58476d1ce4e5b9ull;
+  bits ^= bits >> 27;
+  bits *= 0x94d049bb133111ebull;
+  bits ^= bits >> 31;
+  return bits;
+}
+
+void seedHashes() {
+  const char *fixed = getenv("CLOX_HASH_SEED");
+  if (fixed != NULL) {
+    hashSeed = strtoull(fixed, NULL, 10);
+    fixedSeed = true;
+    return;
+  }
+
+  uint64_t seed = 0;
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (random != NULL) {
+    if (fread(&seed, sizeof(seed), 1, random) != 1)
+      seed = 0;
+    fclose(random);
+  }
+
+  // Without a source of randomness, the time and where the stack and code
+  // ended up are at least hard to guess from outside
+  if (seed == 0) {
+    seed = (uint64_t)time(NULL) ^ (uint64_t)clock() << 32 ^
+           (uint64_t)(uintptr_t)&seed ^ (uint64_t)(uintptr_t)seedHashes;
+  }
+  hashSeed = mix64(seed);
+}
+
+// A fresh hash key for the table at the given address, different from the one
+// it had before. Nothing is shared between tables, so tables private to a
+// compiler thread can be rekeyed without any locking. The address moves from
+// run to run, so with a fixed seed it's left out, and every table starts with
+// the same key
+static uint32_t newHashKey(const void *table, uint32_t oldKey) {
+  uint64_t address = fixedSeed ? 0 : (uint64_t)(uintptr_t)table;
+  uint64_t bits = mix64(hashSeed ^ address ^
+                        ((uint64_t)oldKey << 32 | oldKey));
+  // 0 would mean the table isn't keyed
+  return (uint32_t)bits | 1;
+}
+
+// The bucket a key's probe sequence starts at. A keyed table runs the hash
+// through murmur3's finishing mix with its key first, so keys that pile up in
+// the same few buckets of one table are spread out in another
+static uint32_t bucketFor(uint32_t hash, uint32_t hashKey, int capacity) {
+  if (hashKey != 0) {
+    hash ^= hashKey;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+  }
+  return hash % capacity;
+}
+
 void initTable(Table *table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->hashKey = 0;
+  table->rekeyedAt = 0;
+  table->stats = NULL;
+}
+
+// For a table that holds keys from outside the program, which might have been
+// chosen to collide. A keyed table costs a few more instructions per lookup
+void tableUseKeyedHash(Table *table) {
+  table->hashKey = newHashKey(table, table->hashKey);
 }
 
 void freeTable(Table *table) {
   FREE_ARRAY(Entry, table->entries, table->capacity);
-  initTable(table);
+  table->count = 0;
+  table->tombstones = 0;
+  table->capacity = 0;
+  table->entries = NULL;
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
+static void recordProbe(TableStats *stats, int length) {
+  if (stats == NULL)
+    return;
+
+  stats->lookups++;
+  if (length > stats->longestProbe)
+    stats->longestProbe = length;
+
+  int bucket = 0;
+  while (bucket < TABLE_PROBE_BUCKETS - 1 && length >= 1 << bucket) {
+    bucket++;
+  }
+  stats->probes[bucket]++;
+}
+
+// Says how far it probed past the key's own bucket in *probe
+static Entry *findEntry(Entry *entries, int capacity, uint32_t hashKey,
+                        ObjString *key, int *probe) {
   // Map the key's hash code to an index within the array's bounds using modulo
   // This gives us a bucket index where we'll be able to find or place the entry
-  uint32_t index = key->hash % capacity;
+  uint32_t index = bucketFor(key->hash, hashKey, capacity);
   Entry *tombstone = NULL;
 
-  for (;;) {
+  for (int length = 0;; length++) {
     Entry *entry = &entries[index];
     // Exit the loop when we either find an empty bucket or a bucket with the
     // same key as the one we're looking for
     if (entry->key == NULL) {
       if (IS_NIL(entry->value)) {
         // Empty entry.
+        *probe = length;
         return tombstone != NULL ? tombstone : entry;
       } else {
         // We found a tombstone.
@@ -38,6 +140,7 @@ static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
       }
     } else if (entry->key == key) {
       // We found the key.
+      *probe = length;
       return entry;
     }
 
@@ -48,11 +151,19 @@ static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
   }
 }
 
+static Entry *lookUp(Table *table, ObjString *key, int *probe) {
+  Entry *entry = findEntry(table->entries, table->capacity, table->hashKey,
+                           key, probe);
+  recordProbe(table->stats, *probe);
+  return entry;
+}
+
 bool tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0)
     return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  int probe;
+  Entry *entry = lookUp(table, key, &probe);
   if (entry->key == NULL)
     return false;
 
@@ -60,7 +171,20 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
   return true;
 }
 
-static void adjustCapacity(Table *table, int capacity) {
+// Rebuilds the table with the given capacity and hash key. The table keeps its
+// old key until its entries have moved, since allocating the new array can set
+// off a collection that deletes from the old one
+static void adjustCapacity(Table *table, int capacity, uint32_t hashKey) {
+  if (table->stats != NULL) {
+    if (capacity > table->capacity) {
+      table->stats->grows++;
+    } else if (capacity < table->capacity) {
+      table->stats->shrinks++;
+    } else {
+      table->stats->rehashes++;
+    }
+  }
+
   Entry *entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
@@ -69,14 +193,16 @@ static void adjustCapacity(Table *table, int capacity) {
 
   // When the array size changes, entries may end up in different buckets with
   // different collisions. We rebuild the table from scratch by re-inserting
-  // every entry into the new empty array
+  // every entry into the new empty array. Tombstones are left behind
   table->count = 0;
+  table->tombstones = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
     if (entry->key == NULL)
       continue;
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
+    int probe;
+    Entry *dest = findEntry(entries, capacity, hashKey, entry->key, &probe);
     dest->key = entry->key;
     dest->value = entry->value;
     table->count++;
@@ -85,36 +211,60 @@ static void adjustCapacity(Table *table, int capacity) {
   FREE_ARRAY(Entry, table->entries, table->capacity);
   table->entries = entries;
   table->capacity = capacity;
+  table->hashKey = hashKey;
 }
 
 // Add given key/value pair to the given hash table
 bool tableSet(Table *table, ObjString *key, Value value) {
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+    // If tombstones are at least half of what fills the table, throwing them
+    // away makes enough room without growing it
+    int live = table->count - table->tombstones;
+    int capacity = live + 1 > table->capacity * TABLE_MAX_LOAD / 2
+                       ? GROW_CAPACITY(table->capacity)
+                       : table->capacity;
+    adjustCapacity(table, capacity, table->hashKey);
   }
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  int probe;
+  Entry *entry = lookUp(table, key, &probe);
   bool isNewKey = entry->key == NULL;
 
   // If an entry for that key is already present, the new value overwrites the
   // old value
   //
   // We increment the count during insertion only if the new entry goes into an
-  // entirely empty bucket
-  if (isNewKey && IS_NIL(entry->value))
+  // entirely empty bucket. Filling a tombstone just makes it a live entry again
+  if (isNewKey && IS_NIL(entry->value)) {
     table->count++;
+  } else if (isNewKey) {
+    table->tombstones--;
+  }
 
   entry->key = key;
   entry->value = value;
+
+  // Clustering alone almost never makes a probe this long at our load factor,
+  // so either the keys were picked to collide, or they happen to under this
+  // table's key. Either way a new key spreads them out again. A table only
+  // gets one new key per size, so keys whose whole hashes collide can't make
+  // us rehash over and over
+  if (probe > TABLE_MAX_PROBE && table->rekeyedAt != table->capacity) {
+    table->rekeyedAt = table->capacity;
+    if (table->stats != NULL)
+      table->stats->rekeys++;
+    adjustCapacity(table, table->capacity, newHashKey(table, table->hashKey));
+  }
   return isNewKey;
 }
 
-bool tableDelete(Table *table, ObjString *key) {
+// Replaces the key's entry with a tombstone, without ever resizing the table
+static bool deleteEntry(Table *table, ObjString *key) {
   if (table->count == 0)
     return false;
 
   // Find the entry
-  Entry *entry = findEntry(table->entries, table->capacity, key);
+  int probe;
+  Entry *entry = lookUp(table, key, &probe);
   if (entry->key == NULL)
     return false;
 
@@ -129,6 +279,24 @@ bool tableDelete(Table *table, ObjString *key) {
 
   entry->key = NULL;
   entry->value = BOOL_VAL(true);
+  table->tombstones++;
+  return true;
+}
+
+bool tableDelete(Table *table, ObjString *key) {
+  if (!deleteEntry(table, key))
+    return false;
+
+  // Tombstones are only cleared out when the array is rebuilt, and until then
+  // every probe sequence running through them gets longer. A table that keeps
+  // having keys added and removed would slowly fill up with them
+  int live = table->count - table->tombstones;
+  if (table->capacity > TABLE_MIN_CAPACITY &&
+      live < table->capacity * TABLE_MIN_LOAD) {
+    adjustCapacity(table, table->capacity / 2, table->hashKey);
+  } else if (table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES) {
+    adjustCapacity(table, table->capacity, table->hashKey);
+  }
   return true;
 }
 
@@ -147,13 +315,15 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
   if (table->count == 0)
     return NULL;
 
-  uint32_t index = hash % table->capacity;
-  for (;;) {
+  uint32_t index = bucketFor(hash, table->hashKey, table->capacity);
+  for (int probe = 0;; probe++) {
     Entry *entry = &table->entries[index];
     if (entry->key == NULL) {
       // Stop if we find a non-tombstone entry.
-      if (IS_NIL(entry->value))
+      if (IS_NIL(entry->value)) {
+        recordProbe(table->stats, probe);
         return NULL;
+      }
     } else if (entry->key->length == length && entry->key->hash == hash &&
                memcmp(entry->key->chars, chars, length) == 0) {
       // If there is a hash collision, we do an actual character-by-character
@@ -163,9 +333,219 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
       // at different addresses in memory must have different contents.
       //
       // We found it
+      recordProbe(table->stats, probe);
       return entry->key;
     }
 
     index = (index + 1) % table->capacity;
   }
 }
+
+// Remove every entry whose key is about to be swept. Used for the string
+// intern table, which must not keep strings alive on its own. This runs in the
+// middle of a collection, where we can't allocate a new array, so the
+// tombstones stay until the next tableSet() finds the table full
+void tableRemoveWhite(Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL && !entry->key->obj.isMarked) {
+      deleteEntry(table, entry->key);
+    }
+  }
+}
+
+void markTable(Table *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    markObject((Obj *)entry->key);
+    markValue(entry->value);
+  }
+}
+
+void printTableStats(const char *name, Table *table) {
+  TableStats *stats = table->stats;
+  fprintf(stderr, "%s: %d entries, %d tombstones, capacity %d\n", name,
+          table->count - table->tombstones, table->tombstones,
+          table->capacity);
+  if (stats == NULL)
+    return;
+
+  fprintf(stderr, "  %d grows, %d shrinks, %d rehashes, %d new keys\n",
+          stats->grows, stats->shrinks, stats->rehashes, stats->rekeys);
+  fprintf(stderr, "  %lld lookups, longest probe %d\n",
+          (long long)stats->lookups, stats->longestProbe);
+  for (int bucket = 0; bucket < TABLE_PROBE_BUCKETS; bucket++) {
+    if (stats->probes[bucket] == 0)
+      continue;
+
+    int low = bucket == 0 ? 0 : 1 << (bucket - 1);
+    int high = (1 << bucket) - 1;
+    if (bucket == TABLE_PROBE_BUCKETS - 1) {
+      fprintf(stderr, "  probe %d+: %lld\n", low,
+              (long long)stats->probes[bucket]);
+    } else if (low == high) {
+      fprintf(stderr, "  probe %d: %lld\n", low,
+              (long long)stats->probes[bucket]);
+    } else {
+      fprintf(stderr, "  probe %d-%d: %lld\n", low, high,
+              (long long)stats->probes[bucket]);
+    }
+  }
+}
+
+#define NO_KEY OBJ_VAL(NULL)
+#define HAS_KEY(entry) (!IS_OBJ((entry)->key) || AS_OBJ((entry)->key) != NULL)
+
+void initValueTable(ValueTable *table) {
+  table->count = 0;
+  table->tombstones = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+  table->hashKey = newHashKey(table, 0);
+  table->rekeyedAt = 0;
+}
+
+void freeValueTable(ValueTable *table) {
+  FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+  initValueTable(table);
+}
+
+// Works like findEntry(), with tombstones marked the same way
+static ValueEntry *findValueEntry(ValueEntry *entries, int capacity,
+                                  uint32_t hashKey, Value key, int *probe) {
+  uint32_t index = bucketFor(hashValue(key), hashKey, capacity);
+  ValueEntry *tombstone = NULL;
+
+  for (int length = 0;; length++) {
+    ValueEntry *entry = &entries[index];
+    *probe = length;
+    if (!HAS_KEY(entry)) {
+      if (IS_NIL(entry->value))
+        return tombstone != NULL ? tombstone : entry;
+      if (tombstone == NULL)
+        tombstone = entry;
+    } else if (valuesEqual(entry->key, key)) {
+      return entry;
+    }
+
+    index = (index + 1) % capacity;
+  }
+}
+
+bool valueTableGet(ValueTable *table, Value key, Value *value) {
+  if (table->count == 0)
+    return false;
+
+  int probe;
+  ValueEntry *entry = findValueEntry(table->entries, table->capacity,
+                                     table->hashKey, key, &probe);
+  if (!HAS_KEY(entry))
+    return false;
+
+  *value = entry->value;
+  return true;
+}
+
+static void adjustValueCapacity(ValueTable *table, int capacity,
+                                uint32_t hashKey) {
+  ValueEntry *entries = ALLOCATE(ValueEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NO_KEY;
+    entries[i].value = NIL_VAL;
+  }
+
+  table->count = 0;
+  table->tombstones = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    if (!HAS_KEY(entry))
+      continue;
+
+    int probe;
+    ValueEntry *dest =
+        findValueEntry(entries, capacity, hashKey, entry->key, &probe);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+  table->hashKey = hashKey;
+}
+
+bool valueTableSet(ValueTable *table, Value key, Value value) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int live = table->count - table->tombstones;
+    int capacity = live + 1 > table->capacity * TABLE_MAX_LOAD / 2
+                       ? GROW_CAPACITY(table->capacity)
+                       : table->capacity;
+    adjustValueCapacity(table, capacity, table->hashKey);
+  }
+
+  int probe;
+  ValueEntry *entry = findValueEntry(table->entries, table->capacity,
+                                     table->hashKey, key, &probe);
+  bool isNewKey = !HAS_KEY(entry);
+  if (isNewKey && IS_NIL(entry->value)) {
+    table->count++;
+  } else if (isNewKey) {
+    table->tombstones--;
+  }
+
+  entry->key = key;
+  entry->value = value;
+
+  // The same cap on probe lengths as tableSet()
+  if (probe > TABLE_MAX_PROBE && table->rekeyedAt != table->capacity) {
+    table->rekeyedAt = table->capacity;
+    adjustValueCapacity(table, table->capacity,
+                        newHashKey(table, table->hashKey));
+  }
+  return isNewKey;
+}
+
+bool valueTableDelete(ValueTable *table, Value key) {
+  if (table->count == 0)
+    return false;
+
+  int probe;
+  ValueEntry *entry = findValueEntry(table->entries, table->capacity,
+                                     table->hashKey, key, &probe);
+  if (!HAS_KEY(entry))
+    return false;
+
+  entry->key = NO_KEY;
+  entry->value = BOOL_VAL(true);
+  table->tombstones++;
+
+  // The same shrinking and clearing out of tombstones as tableDelete()
+  int live = table->count - table->tombstones;
+  if (table->capacity > TABLE_MIN_CAPACITY &&
+      live < table->capacity * TABLE_MIN_LOAD) {
+    adjustValueCapacity(table, table->capacity / 2, table->hashKey);
+  } else if (table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES) {
+    adjustValueCapacity(table, table->capacity, table->hashKey);
+  }
+  return true;
+}
+
+// Makes room for count entries up front, so filling the table never has to
+// rebuild it. count can't be more than TABLE_MAX_RESERVE
+void valueTableReserve(ValueTable *table, int count) {
+  int capacity = TABLE_MIN_CAPACITY;
+  while (capacity < TABLE_MAX_CAPACITY && count > capacity * TABLE_MAX_LOAD) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  if (capacity > table->capacity)
+    adjustValueCapacity(table, capacity, table->hashKey);
+}
+
+void markValueTable(ValueTable *table) {
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    markValue(entry->key);
+    markValue(entry->value);
+  }
+}
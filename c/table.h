@@ -5,6 +5,25 @@
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+// Below this load a table gives half its array back, down to
+// TABLE_MIN_CAPACITY. Once tombstones take up more than TABLE_MAX_TOMBSTONES of
+// the array, it's rehashed in place to get rid of them
+#define TABLE_MIN_LOAD 0.125
+#define TABLE_MAX_TOMBSTONES 0.25
+#define TABLE_MIN_CAPACITY 8
+// Capacities are powers of two that fit in an int. That caps how many entries
+// a map can make room for up front at TABLE_MAX_RESERVE
+#define TABLE_MAX_CAPACITY (1 << 30)
+#define TABLE_MAX_RESERVE ((int)(TABLE_MAX_CAPACITY * TABLE_MAX_LOAD))
+
+// An insert that has to probe further than this past the key's own bucket
+// rehashes the table with a new key, see tableUseKeyedHash(). That happens at
+// most once for each size the table grows to
+#define TABLE_MAX_PROBE 256
+
+// Probe lengths are counted in power-of-two buckets: 0, 1, 2-3, 4-7, ... and
+// everything from 64 up in the last one
+#define TABLE_PROBE_BUCKETS 8
 
 typedef struct {
   ObjString *key;
@@ -25,13 +44,68 @@ typedef struct {
 //
 // Cache-Friendly -> Walking the array directly in memory keeps the CPU cache
 // lines full
+//
+// count includes tombstones, since they take up buckets and lengthen probe
+// sequences just like live entries do. tombstones says how many of them there
+// are
+//
+// hashKey is 0 for an ordinary table, where a key's hash picks its bucket
+// directly. A keyed table mixes its hashKey into the hash first. rekeyedAt is
+// the capacity the table last got a new hashKey at
 typedef struct {
   int count;
+  int tombstones;
   int capacity;
   Entry *entries;
+  uint32_t hashKey;
+  int rekeyedAt;
+  // Where to record what happens to the table, or NULL to not bother
+  struct TableStats *stats;
 } Table;
 
+// How a table has been used: how far each lookup had to probe past the key's
+// own bucket, and how often the entry array was replaced
+typedef struct TableStats {
+  int64_t lookups;
+  int64_t probes[TABLE_PROBE_BUCKETS];
+  int longestProbe;
+  int grows;
+  int shrinks;
+  int rehashes;
+  int rekeys;
+} TableStats;
+
+// The same kind of table, keyed by any value rather than only strings, for
+// Lox's maps. A bucket without a key holds the NULL object, so that nil can
+// be a key too. Maps hold whatever a script puts in them, so these tables are
+// always keyed
+typedef struct {
+  Value key;
+  Value value;
+} ValueEntry;
+
+typedef struct {
+  int count;
+  int tombstones;
+  int capacity;
+  ValueEntry *entries;
+  uint32_t hashKey;
+  int rekeyedAt;
+} ValueTable;
+
+// Every hash in the process is seeded with this: strings' hashes, and those of
+// numbers and objects as map keys. It's random, so which keys collide differs
+// from run to run and can't be worked out ahead of time, unless the
+// CLOX_HASH_SEED environment variable fixes it for a reproducible run. That
+// goes for the order a map's entries print and keys() lists them in too: it
+// changes between runs unless the seed is fixed. Other objects than strings
+// hash by address, so maps keyed by them never have a repeatable order
+extern uint64_t hashSeed;
+
+void seedHashes();
+
 void initTable(Table *table);
+void tableUseKeyedHash(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableSet(Table *table, ObjString *key, Value value);
@@ -39,5 +113,16 @@ bool tableDelete(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length,
                            uint32_t hash);
+void tableRemoveWhite(Table *table);
+void markTable(Table *table);
+void printTableStats(const char *name, Table *table);
+
+void initValueTable(ValueTable *table);
+void freeValueTable(ValueTable *table);
+bool valueTableGet(ValueTable *table, Value key, Value *value);
+bool valueTableSet(ValueTable *table, Value key, Value value);
+bool valueTableDelete(ValueTable *table, Value key);
+void valueTableReserve(ValueTable *table, int count);
+void markValueTable(ValueTable *table);
 
 #endif
@@ -28,6 +28,39 @@ void freeValueArray(ValueArray *array) {
   initValueArray(array);
 }
 
+// Spreads the bits of a double or a pointer over the hash. Both tend to have
+// all their low bits zero, and tables pick a bucket by them
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// The hash of a value as a map key, consistent with valuesEqual(): strings by
+// their contents, other objects by identity
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return AS_BOOL(value) ? 1231 : 1237;
+  case VAL_NIL:
+    return 0;
+  case VAL_NUMBER: {
+    // -0 and 0 are equal, so they have to hash the same
+    double number = AS_NUMBER(value) + 0.0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashBits(bits ^ hashSeed);
+  }
+  case VAL_OBJ:
+    if (IS_STRING(value))
+      return AS_STRING(value)->hash;
+    return hashBits((uint64_t)(uintptr_t)AS_OBJ(value) ^ hashSeed);
+  default:
+    return 0; // Unreachable.
+  }
+}
+
 void printValue(Value value) {
   switch (value.type) {
   case VAL_BOOL:
@@ -1,19 +1,56 @@
+// For clock_gettime() under -std=c99
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "fiber.h"
+#include "jit.h"
 #include "memory.h"
+#include "module.h"
+#include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
 VM vm;
 
-static void resetStack() { vm.stackTop = vm.stack; }
+// A runtime error ends the program, every fiber included
+static void resetStack() {
+  vm.stackTop = vm.stack;
+  vm.frameCount = 0;
+  vm.openUpvalues = NULL;
+  resetFibers();
+}
+
+// Prints the message and a stack trace of the running fiber
+static void reportError(const char *format, va_list args) {
+  vfprintf(stderr, format, args);
+  fputs("\n", stderr);
+
+  // Print a stack trace, innermost call first
+  for (int i = vm.frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm.frames[i];
+    ObjFunction *function = frame->closure->function;
+    size_t instruction = frame->ip - function->chunk.code - 1;
+    int line = getLine(&function->chunk, (int)instruction);
+    fprintf(stderr, "[line %d] in ", line);
+    // Fibers other than the main one start in a function, not the script
+    if (i == 0 && function->name == NULL) {
+      fprintf(stderr, "script\n");
+    } else if (function->name == NULL) {
+      fprintf(stderr, "<fn>\n");
+    } else {
+      fprintf(stderr, "%s()\n", function->name->chars);
+    }
+  }
+}
 
 // Variadic Function
 //
@@ -21,26 +58,197 @@ static void resetStack() { vm.stackTop = vm.stack; }
 static void runtimeError(const char *format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  reportError(format, args);
   va_end(args);
-  fputs("\n", stderr);
 
-  size_t instruction = vm.ip - vm.chunk->code - 1;
-  int line = getLine(vm.chunk, (int)instruction);
-  fprintf(stderr, "[line %d] in script\n", line);
   resetStack();
 }
 
+// How a native raises a runtime error: it calls this and returns any value.
+// The stack is left alone until the native has returned
+void nativeError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(format, args);
+  va_end(args);
+
+  vm.nativeFailed = true;
+}
+
+// Processor time used by the program, in seconds
+static Value clockNative(int argCount, Value *args) {
+  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+// Nanoseconds from the monotonic clock. Only differences between two readings
+// mean anything, but unlike clock() it has real nanosecond resolution and
+// counts wall time, including time spent blocked
+static Value nanotimeNative(int argCount, Value *args) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return NUMBER_VAL((double)now.tv_sec * 1e9 + (double)now.tv_nsec);
+}
+
+// Adds a value to the end of a list, in amortized constant time
+static Value appendNative(int argCount, Value *args) {
+  if (!IS_LIST(args[0])) {
+    nativeError("Can only append to a list.");
+    return NIL_VAL;
+  }
+
+  writeValueArray(&AS_LIST(args[0])->items, args[1]);
+  return NIL_VAL;
+}
+
+static Value lengthNative(int argCount, Value *args) {
+  if (IS_MAP(args[0])) {
+    ValueTable *table = &AS_MAP(args[0])->table;
+    return NUMBER_VAL((double)(table->count - table->tombstones));
+  }
+  if (!IS_LIST(args[0])) {
+    nativeError("Can only get the length of a list or map.");
+    return NIL_VAL;
+  }
+
+  return NUMBER_VAL((double)AS_LIST(args[0])->items.count);
+}
+
+// A new, empty map. Given how many entries it's going to get, it makes room
+// for them all up front
+static Value mapNative(int argCount, Value *args) {
+  if (argCount > 1) {
+    nativeError("Expected 0 or 1 arguments but got %d.", argCount);
+    return NIL_VAL;
+  }
+  // Written so that NaN fails it too
+  if (argCount == 1 && (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0))) {
+    nativeError("Map size must be a non-negative number.");
+    return NIL_VAL;
+  }
+  if (argCount == 1 && AS_NUMBER(args[0]) > TABLE_MAX_RESERVE) {
+    nativeError("Map size can't be more than %d.", TABLE_MAX_RESERVE);
+    return NIL_VAL;
+  }
+
+  ObjMap *map = newMap();
+  if (argCount == 1) {
+    push(OBJ_VAL(map));
+    valueTableReserve(&map->table, (int)AS_NUMBER(args[0]));
+    pop();
+  }
+  return OBJ_VAL(map);
+}
+
+static Value containsNative(int argCount, Value *args) {
+  if (!IS_MAP(args[0])) {
+    nativeError("Can only look up keys in a map.");
+    return NIL_VAL;
+  }
+
+  Value value;
+  return BOOL_VAL(valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+}
+
+// Removes the key from the map, and says whether it was there
+static Value deleteNative(int argCount, Value *args) {
+  if (!IS_MAP(args[0])) {
+    nativeError("Can only delete keys from a map.");
+    return NIL_VAL;
+  }
+
+  return BOOL_VAL(valueTableDelete(&AS_MAP(args[0])->table, args[1]));
+}
+
+// A list of the map's keys, in no particular order. It's how a script walks
+// over a map
+static Value keysNative(int argCount, Value *args) {
+  if (!IS_MAP(args[0])) {
+    nativeError("Can only get the keys of a map.");
+    return NIL_VAL;
+  }
+
+  // In bucket order, which depends on the hash seed, so it differs from run to
+  // run unless CLOX_HASH_SEED is set. See table.h
+  ValueTable *table = &AS_MAP(args[0])->table;
+  ObjList *list = newList();
+  push(OBJ_VAL(list));
+  int count = table->count - table->tombstones;
+  list->items.values = ALLOCATE(Value, count);
+  list->items.capacity = count;
+  for (int i = 0; i < table->capacity; i++) {
+    ValueEntry *entry = &table->entries[i];
+    if (!IS_OBJ(entry->key) || AS_OBJ(entry->key) != NULL) {
+      list->items.values[list->items.count++] = entry->key;
+    }
+  }
+  pop();
+  return OBJ_VAL(list);
+}
+
+void defineNative(const char *name, NativeFn function, int arity) {
+  // Both objects are kept on the stack until they're safely in the table
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  push(OBJ_VAL(newNative(function, arity)));
+  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  pop();
+  pop();
+}
+
 void initVM() {
+  vm.frames = NULL;
+  vm.stack = NULL;
+  vm.fiber = NULL;
   resetStack();
   vm.objects = NULL;
+  vm.bytesAllocated = 0;
+  vm.nextGC = 1024 * 1024;
+
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+  vm.useRegisters = false;
+  vm.useJit = true;
+  vm.optimizeLevel = 1;
+  vm.nativeFailed = false;
+
+  // Before the first string is hashed
+  seedHashes();
   initTable(&vm.globals);
   initTable(&vm.strings);
+  initTable(&vm.modules);
+  // Every string the program makes ends up in here, including the ones read
+  // from files and other programs
+  tableUseKeyedHash(&vm.strings);
+
+  // Clear these first, since allocating can kick off a collection that looks
+  // at them
+  vm.initString = NULL;
+  vm.rootShape = NULL;
+
+  // The script runs on the main fiber, which has to exist before anything is
+  // pushed. This also defines the natives that work with fibers
+  initFibers();
+
+  vm.initString = copyString("init", 4);
+  vm.rootShape = newShape();
+
+  defineNative("clock", clockNative, 0);
+  defineNative("nanotime", nanotimeNative, 0);
+  defineNative("append", appendNative, 2);
+  defineNative("length", lengthNative, 1);
+  defineNative("map", mapNative, -1);
+  defineNative("contains", containsNative, 2);
+  defineNative("delete", deleteNative, 2);
+  defineNative("keys", keysNative, 1);
 }
 
 void freeVM() {
   freeTable(&vm.globals);
   freeTable(&vm.strings);
+  freeTable(&vm.modules);
+  vm.initString = NULL;
+  vm.rootShape = NULL;
+  freeFibers();
   freeObjects();
 }
 
@@ -61,14 +269,255 @@ Value pop() {
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
+// Pushes a new frame for the closure. The callee and its arguments are
+// already on the stack, and that's where the frame's slot window starts
+static bool call(ObjClosure *closure, int argCount) {
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.", closure->function->arity,
+                 argCount);
+    return false;
+  }
+
+  if (vm.frameCount == FRAMES_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount++];
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  frame->slots = vm.stackTop - argCount - 1;
+  return true;
+}
+
+// Checks that list can be indexed with index, and if so where the element is
+static Value *listElement(Value list, Value index) {
+  if (!IS_LIST(list)) {
+    runtimeError("Only lists and maps can be indexed.");
+    return NULL;
+  }
+
+  if (!IS_NUMBER(index) || AS_NUMBER(index) != (int)AS_NUMBER(index)) {
+    runtimeError("List index must be an integer.");
+    return NULL;
+  }
+
+  ValueArray *items = &AS_LIST(list)->items;
+  int i = (int)AS_NUMBER(index);
+  if (i < 0 || i >= items->count) {
+    runtimeError("List index out of bounds.");
+    return NULL;
+  }
+  return &items->values[i];
+}
+
+static bool callNative(ObjNative *native, int argCount) {
+  if (native->arity != -1 && argCount != native->arity) {
+    runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+    return false;
+  }
+
+  Value result = native->function(argCount, vm.stackTop - argCount);
+  if (vm.nativeFailed) {
+    vm.nativeFailed = false;
+    resetStack();
+    return false;
+  }
+
+  vm.stackTop -= argCount + 1;
+  push(result);
+  return true;
+}
+
+static bool callValue(Value callee, int argCount) {
+  if (IS_OBJ(callee)) {
+    switch (OBJ_TYPE(callee)) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+      // Slot zero of a method's frame holds the receiver, "this"
+      vm.stackTop[-argCount - 1] = bound->receiver;
+      return call(bound->method, argCount);
+    }
+    case OBJ_CLASS: {
+      ObjClass *klass = AS_CLASS(callee);
+      vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+      if (klass->initializer != NULL) {
+        return call(klass->initializer, argCount);
+      } else if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return false;
+      }
+      return true;
+    }
+    case OBJ_CLOSURE:
+      return call(AS_CLOSURE(callee), argCount);
+    case OBJ_NATIVE:
+      return callNative(AS_NATIVE(callee), argCount);
+    default:
+      break; // Non-callable object type.
+    }
+  }
+
+  runtimeError("Can only call functions and classes.");
+  return false;
+}
+
+// Whether the site's cached lookup still applies to this instance. A cached
+// field only depends on the shape. A cached method also depends on the class,
+// since instances of different classes can share a shape
+static bool cacheHits(InlineCache *cache, ObjInstance *instance) {
+  return cache->shape == instance->shape &&
+         (cache->slot >= 0 || cache->klass == instance->klass);
+}
+
+// Slow path for property gets and invokes: look the name up among the fields
+// first, since they shadow methods, then the class's methods, and remember
+// what we found in the cache
+static bool lookUpProperty(InlineCache *cache, ObjInstance *instance,
+                           ObjString *name) {
+  int slot = shapeSlot(instance->shape, name);
+  if (slot >= 0) {
+    cache->shape = instance->shape;
+    cache->slot = slot;
+    cache->klass = NULL;
+    cache->method = NULL;
+    return true;
+  }
+
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  cache->shape = instance->shape;
+  cache->slot = -1;
+  cache->klass = instance->klass;
+  cache->method = AS_CLOSURE(method);
+  return true;
+}
+
+static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  return call(AS_CLOSURE(method), argCount);
+}
+
+// A fused property get and call. For the common case of calling a method we
+// skip creating the ObjBoundMethod entirely: the receiver is already sitting
+// in the slot where the method expects "this"
+static bool invoke(ObjString *name, int argCount, InlineCache *cache) {
+  Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
+
+  ObjInstance *instance = AS_INSTANCE(receiver);
+  if (!cacheHits(cache, instance) && !lookUpProperty(cache, instance, name))
+    return false;
+
+  if (cache->slot >= 0) {
+    // A field holding something callable
+    Value value = instance->fields[cache->slot];
+    vm.stackTop[-argCount - 1] = value;
+    return callValue(value, argCount);
+  }
+
+  return call(cache->method, argCount);
+}
+
+static bool bindMethod(ObjClass *klass, ObjString *name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjBoundMethod *bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+// Reuses an existing upvalue if some other closure already captured the same
+// slot, so that they all see each other's assignments
+static ObjUpvalue *captureUpvalue(Value *local) {
+  ObjUpvalue *prevUpvalue = NULL;
+  ObjUpvalue *upvalue = vm.openUpvalues;
+  while (upvalue != NULL && upvalue->location > local) {
+    prevUpvalue = upvalue;
+    upvalue = upvalue->next;
+  }
+
+  if (upvalue != NULL && upvalue->location == local) {
+    return upvalue;
+  }
+
+  ObjUpvalue *createdUpvalue = newUpvalue(local);
+  createdUpvalue->next = upvalue;
+
+  if (prevUpvalue == NULL) {
+    vm.openUpvalues = createdUpvalue;
+  } else {
+    prevUpvalue->next = createdUpvalue;
+  }
+
+  return createdUpvalue;
+}
+
+// Closes every open upvalue that points at last or any slot above it
+static void closeUpvalues(Value *last) {
+  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = vm.openUpvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    vm.openUpvalues = upvalue->next;
+  }
+}
+
+// Whether a tail call to closure can take over the caller's frame. Functions
+// with register code run on the register VM instead, and a wrong argument count
+// is left for call() to report
+static bool canReuseFrame(ObjClosure *closure, int argCount) {
+  return closure != NULL && closure->function->arity == argCount &&
+         closure->function->registers == NULL;
+}
+
+// Hands the frame over to closure: close anything that captured our locals,
+// then slide the callee and its arguments down over our slot window
+static void reuseFrame(CallFrame *frame, ObjClosure *closure, int argCount) {
+  closeUpvalues(frame->slots);
+  Value *args = vm.stackTop - argCount - 1;
+  memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+}
+
+static void defineMethod(ObjString *name) {
+  Value method = peek(0);
+  ObjClass *klass = AS_CLASS(peek(1));
+  tableSet(&klass->methods, name, method);
+  if (name == vm.initString)
+    klass->initializer = AS_CLOSURE(method);
+  pop();
+}
+
 // nil and false are falsey and every other value behaves like true
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 static void concatenate() {
-  ObjString *b = AS_STRING(pop());
-  ObjString *a = AS_STRING(pop());
+  // Leave the operands on the stack until the result exists so the collector
+  // can still see them
+  ObjString *b = AS_STRING(peek(0));
+  ObjString *a = AS_STRING(peek(1));
 
   int length = a->length + b->length;
   char *chars = ALLOCATE(char, length + 1);
@@ -77,16 +526,96 @@ static void concatenate() {
   chars[length] = '\0';
 
   ObjString *result = takeString(chars, length);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+static InterpretResult runRegisters();
+static InterpretResult runFrame(int exitDepth);
+
+// Counts another call or loop iteration of the frame's function and, once the
+// function is hot, runs the frame as machine code starting at frame->ip.
+// JIT_EXIT means the interpreter should carry on, which is also what we say
+// when there's no machine code to run
+static JitStatus tryJit(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+
+  // Code compiled ahead of time is used right away
+  if (function->aot != NULL)
+    return (JitStatus)function->aot(frame);
+
+  if (!vm.useJit || function->hotness < 0)
+    return JIT_EXIT;
+
+  if (function->jit == NULL) {
+    if (++function->hotness < JIT_THRESHOLD)
+      return JIT_EXIT;
+
+    if (!compileJit(function)) {
+      function->hotness = -1;
+      return JIT_EXIT;
+    }
+  }
+
+  JitCode *jit = function->jit;
+  jit->runs++;
+  JitStatus status = runJit(function, frame);
+
+  // The code can't be freed here, it may still be running further down the C
+  // stack. We just don't enter it again
+  if (status == JIT_EXIT && ++jit->sideExits >= JIT_MAX_SIDE_EXITS &&
+      jit->sideExits > jit->runs / 2) {
+    function->hotness = -1;
+  }
+
+  return status;
+}
+
+// Runs the stack bytecode of the frame on top until the frame count drops back
+// to exitDepth, leaving the returned value on top of the stack
+static InterpretResult run(int exitDepth) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+
+#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT()                                                           \
+  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT()                                                        \
+  (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_LONG_CONSTANT()                                                   \
-  (vm.chunk->constants.values[(uint32_t)(READ_BYTE() | READ_BYTE() << 8 |      \
-                                         READ_BYTE() << 16)])
+  (frame->ip += 3,                                                             \
+   frame->closure->function->chunk.constants                                   \
+       .values[(uint32_t)(frame->ip[-3] | frame->ip[-2] << 8 |                 \
+                          frame->ip[-1] << 16)])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+// Lets the JIT take over the current frame if it's hot. If the machine code
+// runs the frame to completion we continue with the caller, or leave
+#define TRY_JIT()                                                              \
+  do {                                                                         \
+    JitStatus status = tryJit(frame);                                          \
+    if (status == JIT_ERROR)                                                   \
+      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (status == JIT_RETURNED && vm.frameCount == exitDepth)                  \
+      return INTERPRET_OK;                                                     \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+  } while (false)
+
+// After a call, pick up the callee's frame. If the callee has register code it
+// runs on the register VM right away and we carry on once it has returned
+#define ENTER_FRAME()                                                          \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    if (frame->closure->function->registers != NULL) {                         \
+      InterpretResult result = runRegisters();                                 \
+      if (result != INTERPRET_OK)                                              \
+        return result;                                                         \
+      frame = &vm.frames[vm.frameCount - 1];                                   \
+    } else {                                                                   \
+      TRY_JIT();                                                               \
+    }                                                                          \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
@@ -107,7 +636,9 @@ static InterpretResult run() {
       printf(" ]");
     }
     printf("\n");
-    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    disassembleInstruction(
+        &frame->closure->function->chunk,
+        (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
     uint8_t instruction;
 
@@ -118,15 +649,11 @@ static InterpretResult run() {
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
       push(constant);
-      printValue(constant);
-      printf("\n");
       break;
     }
     case OP_CONSTANT_LONG: {
       Value longConstant = READ_LONG_CONSTANT();
       push(longConstant);
-      printValue(longConstant);
-      printf("\n");
       break;
     }
     case OP_NIL:
@@ -141,6 +668,17 @@ static InterpretResult run() {
     case OP_POP:
       pop();
       break;
+    case OP_GET_LOCAL: {
+      uint8_t slot = READ_BYTE();
+      push(frame->slots[slot]);
+      break;
+    }
+    case OP_SET_LOCAL: {
+      uint8_t slot = READ_BYTE();
+      // Assignment is an expression, so the value stays on the stack
+      frame->slots[slot] = peek(0);
+      break;
+    }
     case OP_GET_GLOBAL: {
       ObjString *name = READ_STRING();
       Value value;
@@ -169,6 +707,81 @@ static InterpretResult run() {
       }
       break;
     }
+    case OP_GET_UPVALUE: {
+      uint8_t slot = READ_BYTE();
+      push(*frame->closure->upvalues[slot]->location);
+      break;
+    }
+    case OP_SET_UPVALUE: {
+      uint8_t slot = READ_BYTE();
+      *frame->closure->upvalues[slot]->location = peek(0);
+      break;
+    }
+    case OP_GET_PROPERTY: {
+      if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+
+      if (!cacheHits(cache, instance) &&
+          !lookUpProperty(cache, instance, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      if (cache->slot >= 0) {
+        Value value = instance->fields[cache->slot];
+        pop(); // Instance.
+        push(value);
+      } else {
+        ObjBoundMethod *bound = newBoundMethod(peek(0), cache->method);
+        pop(); // Instance.
+        push(OBJ_VAL(bound));
+      }
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+
+      // Set sites cache the shape they last saw along with the shape the
+      // instance ends up with afterwards (the same one unless the field is
+      // new) and the field's index
+      if (cache->shape != instance->shape) {
+        ObjShape *before = instance->shape;
+        int slot = shapeSlot(before, name);
+        cache->shape = before;
+        cache->next = slot >= 0 ? before : shapeTransition(before, name);
+        cache->slot = slot >= 0 ? slot : before->fieldCount;
+      }
+
+      if (cache->next != instance->shape)
+        instanceSetShape(instance, cache->next);
+
+      instance->fields[cache->slot] = peek(0);
+      Value value = pop();
+      pop(); // Instance.
+      push(value);
+      break;
+    }
+    case OP_GET_SUPER: {
+      ObjString *name = READ_STRING();
+      ObjClass *superclass = AS_CLASS(pop());
+
+      if (!bindMethod(superclass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
     case OP_EQUAL: {
       Value b = pop();
       Value a = pop();
@@ -223,34 +836,651 @@ static InterpretResult run() {
       printf("\n");
       break;
     }
+    case OP_JUMP: {
+      uint16_t offset = READ_SHORT();
+      frame->ip += offset;
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      // The condition is left on the stack, the compiler emits the OP_POP
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(0)))
+        frame->ip += offset;
+      break;
+    }
+    case OP_LOOP: {
+      uint16_t offset = READ_SHORT();
+      frame->ip -= offset;
+      TRY_JIT();
+      break;
+    }
+    case OP_CALL: {
+      int argCount = READ_BYTE();
+      Value callee = peek(argCount);
+
+      // Fast path for the overwhelmingly common case, calling a closure with
+      // the right number of arguments: set up the frame right here. Anything
+      // else, including every error, goes through callValue()
+      if (IS_CLOSURE(callee) &&
+          AS_CLOSURE(callee)->function->arity == argCount &&
+          vm.frameCount < FRAMES_MAX) {
+        frame = &vm.frames[vm.frameCount++];
+        frame->closure = AS_CLOSURE(callee);
+        frame->ip = frame->closure->function->chunk.code;
+        frame->slots = vm.stackTop - argCount - 1;
+        ENTER_FRAME();
+        break;
+      }
+
+      // Natives don't need a frame at all
+      if (IS_NATIVE(callee)) {
+        if (!callNative(AS_NATIVE(callee), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        break;
+      }
+
+      if (!callValue(callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      break;
+    }
+    case OP_TAIL_CALL: {
+      int argCount = READ_BYTE();
+      Value callee = peek(argCount);
+
+      ObjClosure *closure = NULL;
+      if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+      } else if (IS_BOUND_METHOD(callee)) {
+        closure = AS_BOUND_METHOD(callee)->method;
+        vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+      }
+
+      // Classes, functions with register code and errors take the normal
+      // route. The OP_RETURN after this instruction then returns whatever the
+      // call produced
+      if (!canReuseFrame(closure, argCount)) {
+        if (!callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ENTER_FRAME();
+        break;
+      }
+
+      reuseFrame(frame, closure, argCount);
+      TRY_JIT();
+      break;
+    }
+    case OP_INVOKE: {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      break;
+    }
+    case OP_SUPER_INVOKE: {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(pop());
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      break;
+    }
+    case OP_TAIL_INVOKE: {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+
+      // Only a method can take over the frame. A field holding something
+      // callable, and every error, goes through invoke()
+      ObjClosure *closure = NULL;
+      Value receiver = peek(argCount);
+      if (IS_INSTANCE(receiver)) {
+        ObjInstance *instance = AS_INSTANCE(receiver);
+        if (!cacheHits(cache, instance) &&
+            !lookUpProperty(cache, instance, method)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (cache->slot < 0)
+          closure = cache->method;
+      }
+
+      if (!canReuseFrame(closure, argCount)) {
+        if (!invoke(method, argCount, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ENTER_FRAME();
+        break;
+      }
+
+      reuseFrame(frame, closure, argCount);
+      TRY_JIT();
+      break;
+    }
+    case OP_TAIL_SUPER_INVOKE: {
+      ObjString *method = READ_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(pop());
+
+      Value value;
+      ObjClosure *closure = NULL;
+      if (tableGet(&superclass->methods, method, &value))
+        closure = AS_CLOSURE(value);
+
+      if (!canReuseFrame(closure, argCount)) {
+        if (!invokeFromClass(superclass, method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ENTER_FRAME();
+        break;
+      }
+
+      reuseFrame(frame, closure, argCount);
+      TRY_JIT();
+      break;
+    }
+    case OP_CLOSURE: {
+      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+      ObjClosure *closure = newClosure(function);
+      push(OBJ_VAL(closure));
+
+      // Each upvalue is described by a pair of operands: whether it captures
+      // a local of the enclosing function, and that local's slot or the
+      // index of one of the enclosing function's own upvalues
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (isLocal) {
+          closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+      }
+      break;
+    }
+    case OP_CLOSE_UPVALUE:
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      break;
+    case OP_IMPORT: {
+      ObjString *path = READ_STRING();
+      Value module;
+      if (!tableGet(&vm.modules, path, &module)) {
+        // Modules are compiled before the program starts, but code typed into
+        // the REPL, or a file that didn't exist then, can still be imported
+        ObjFunction *function = loadModule(path->chars);
+        if (function == NULL) {
+          runtimeError("Could not import \"%s\".", path->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        module = OBJ_VAL(function);
+      }
+
+      // A module runs once. Marking it before it runs also stops an import
+      // cycle from going around again
+      if (!IS_FUNCTION(module)) {
+        push(NIL_VAL);
+        break;
+      }
+      push(module);
+      tableSet(&vm.modules, path, BOOL_VAL(true));
+
+      // The module's top-level code runs as a call, and its nil return value
+      // is what the compiler pops
+      ObjClosure *closure = newClosure(AS_FUNCTION(module));
+      vm.stackTop[-1] = OBJ_VAL(closure);
+      if (!call(closure, 0)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      break;
+    }
+    case OP_BUILD_LIST: {
+      // The elements stay on the stack, where the collector can see them,
+      // until they're all in the list
+      int count = READ_BYTE();
+      ObjList *list = newList();
+      push(OBJ_VAL(list));
+      if (count > 0) {
+        list->items.values = ALLOCATE(Value, count);
+        list->items.capacity = count;
+        memcpy(list->items.values, vm.stackTop - count - 1,
+               sizeof(Value) * count);
+        list->items.count = count;
+      }
+      vm.stackTop -= count + 1;
+      push(OBJ_VAL(list));
+      break;
+    }
+    case OP_INDEX_GET: {
+      Value value;
+      if (IS_MAP(peek(1))) {
+        // A key that isn't in the map reads as nil
+        if (!valueTableGet(&AS_MAP(peek(1))->table, peek(0), &value))
+          value = NIL_VAL;
+      } else {
+        Value *element = listElement(peek(1), peek(0));
+        if (element == NULL)
+          return INTERPRET_RUNTIME_ERROR;
+        value = *element;
+      }
+      vm.stackTop -= 2;
+      push(value);
+      break;
+    }
+    case OP_INDEX_SET: {
+      if (IS_MAP(peek(2))) {
+        // Everything stays on the stack in case the table grows
+        valueTableSet(&AS_MAP(peek(2))->table, peek(1), peek(0));
+      } else {
+        Value *element = listElement(peek(2), peek(1));
+        if (element == NULL)
+          return INTERPRET_RUNTIME_ERROR;
+        *element = peek(0);
+      }
+      vm.stackTop[-3] = vm.stackTop[-1];
+      vm.stackTop -= 2;
+      break;
+    }
     case OP_RETURN: {
-      // Exit interpreter
-      return INTERPRET_OK;
+      Value result = pop();
+      closeUpvalues(frame->slots);
+      vm.frameCount--;
+
+      // Discard the callee's whole slot window, then hand the result back
+      vm.stackTop = frame->slots;
+      push(result);
+
+      if (vm.frameCount == exitDepth) {
+        // Exit interpreter, or return to the register VM that called us
+        return INTERPRET_OK;
+      }
+
+      frame = &vm.frames[vm.frameCount - 1];
+      break;
+    }
+    case OP_CLASS:
+      push(OBJ_VAL(newClass(READ_STRING())));
+      break;
+    case OP_INHERIT: {
+      Value superclass = peek(1);
+      if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      // Copy-down inheritance: the subclass starts with all of the
+      // superclass's methods, then its own get layered on top
+      ObjClass *subclass = AS_CLASS(peek(0));
+      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      subclass->initializer = AS_CLASS(superclass)->initializer;
+      pop(); // Subclass.
+      break;
     }
+    case OP_METHOD:
+      defineMethod(READ_STRING());
+      break;
     }
   }
 
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_LONG_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef TRY_JIT
+#undef ENTER_FRAME
 #undef BINARY_OP
 }
 
-InterpretResult interpret(const char *source) {
-  Chunk chunk;
-  initChunk(&chunk);
+// The register VM's counterpart to run(). It executes the register code of the
+// frame on top until that frame returns. Every register lives in the frame's
+// window on vm.stack, so the collector sees them and stack-VM callees can use
+// the same stack above them
+static InterpretResult runRegisters() {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  ObjFunction *function = frame->closure->function;
+  RegChunk *chunk = function->registers;
+  Value *constants = function->chunk.constants.values;
+  Value *registers = frame->slots;
+  RegInstruction *pc = chunk->code;
 
-  if (!compile(source, &chunk)) {
-    freeChunk(&chunk);
-    return INTERPRET_COMPILE_ERROR;
+  // The arguments are already in place, the rest start out empty
+  for (Value *slot = vm.stackTop; slot < registers + chunk->frameSize; slot++) {
+    *slot = NIL_VAL;
+  }
+  vm.stackTop = registers + chunk->frameSize;
+
+#define RK(operand)                                                            \
+  (IS_RK_CONSTANT(operand) ? constants[RK_INDEX(operand)] : registers[operand])
+// Point the frame's ip at the stack instruction the current one came from,
+// which is what runtimeError() and stack traces go by
+#define SYNC_IP()                                                              \
+  (frame->ip =                                                                 \
+       function->chunk.code + chunk->sourceOffsets[pc - chunk->code - 1] + 1)
+#define REGISTER_ERROR(...)                                                    \
+  do {                                                                         \
+    SYNC_IP();                                                                 \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define REGISTER_BINARY_OP(valueType, op)                                      \
+  do {                                                                         \
+    Value b = RK(instruction->b);                                              \
+    Value c = RK(instruction->c);                                              \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                      \
+      REGISTER_ERROR("Operands must be numbers.");                             \
+    }                                                                          \
+    registers[instruction->a] = valueType(AS_NUMBER(b) op AS_NUMBER(c));       \
+  } while (false)
+
+  for (;;) {
+#ifdef DEBUG_TRACE_EXECUTION
+    printf("          ");
+    for (Value *slot = registers; slot < vm.stackTop; slot++) {
+      printf("[ ");
+      printValue(*slot);
+      printf(" ]");
+    }
+    printf("\n");
+    disassembleRegInstruction(function, (int)(pc - chunk->code));
+#endif
+    RegInstruction *instruction = pc++;
+
+    switch (instruction->op) {
+    case ROP_MOVE:
+      registers[instruction->a] = RK(instruction->b);
+      break;
+    case ROP_GET_GLOBAL: {
+      ObjString *name = AS_STRING(constants[instruction->b]);
+      if (!tableGet(&vm.globals, name, &registers[instruction->a])) {
+        REGISTER_ERROR("Undefined variable '%s'.", name->chars);
+      }
+      break;
+    }
+    case ROP_SET_GLOBAL: {
+      ObjString *name = AS_STRING(constants[instruction->b]);
+      if (tableSet(&vm.globals, name, RK(instruction->c))) {
+        tableDelete(&vm.globals, name);
+        REGISTER_ERROR("Undefined variable '%s'.", name->chars);
+      }
+      break;
+    }
+    case ROP_DEFINE_GLOBAL: {
+      ObjString *name = AS_STRING(constants[instruction->b]);
+      tableSet(&vm.globals, name, RK(instruction->c));
+      break;
+    }
+    case ROP_EQUAL:
+      registers[instruction->a] =
+          BOOL_VAL(valuesEqual(RK(instruction->b), RK(instruction->c)));
+      break;
+    case ROP_GREATER:
+      REGISTER_BINARY_OP(BOOL_VAL, >);
+      break;
+    case ROP_LESS:
+      REGISTER_BINARY_OP(BOOL_VAL, <);
+      break;
+    case ROP_ADD: {
+      Value b = RK(instruction->b);
+      Value c = RK(instruction->c);
+      if (IS_NUMBER(b) && IS_NUMBER(c)) {
+        registers[instruction->a] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+      } else if (IS_STRING(b) && IS_STRING(c)) {
+        push(b);
+        push(c);
+        concatenate();
+        registers[instruction->a] = pop();
+      } else {
+        REGISTER_ERROR("Operands must be two numbers or two strings.");
+      }
+      break;
+    }
+    case ROP_SUBTRACT:
+      REGISTER_BINARY_OP(NUMBER_VAL, -);
+      break;
+    case ROP_MULTIPLY:
+      REGISTER_BINARY_OP(NUMBER_VAL, *);
+      break;
+    case ROP_DIVIDE:
+      REGISTER_BINARY_OP(NUMBER_VAL, /);
+      break;
+    case ROP_NOT:
+      registers[instruction->a] = BOOL_VAL(isFalsey(RK(instruction->b)));
+      break;
+    case ROP_NEGATE: {
+      Value b = RK(instruction->b);
+      if (!IS_NUMBER(b)) {
+        REGISTER_ERROR("Operand must be a number.");
+      }
+      registers[instruction->a] = NUMBER_VAL(-AS_NUMBER(b));
+      break;
+    }
+    case ROP_PRINT:
+      printValue(RK(instruction->b));
+      printf("\n");
+      break;
+    case ROP_JUMP:
+      pc = chunk->code + instruction->c;
+      break;
+    case ROP_JUMP_IF_FALSE:
+      if (isFalsey(RK(instruction->b)))
+        pc = chunk->code + instruction->c;
+      break;
+    case ROP_CALL: {
+      // The callee and its arguments are in consecutive registers, so they
+      // already form the callee's slot window once stackTop is just past them
+      int argCount = instruction->b;
+      Value *callee = registers + instruction->a;
+      SYNC_IP();
+      vm.stackTop = callee + argCount + 1;
+
+      int frameCount = vm.frameCount;
+      if (!callValue(*callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      if (vm.frameCount > frameCount) {
+        InterpretResult result = runFrame(frameCount);
+        if (result != INTERPRET_OK)
+          return result;
+      }
+
+      // The result has replaced the callee
+      vm.stackTop = registers + chunk->frameSize;
+      break;
+    }
+    case ROP_RETURN: {
+      Value result = RK(instruction->b);
+      vm.frameCount--;
+      vm.stackTop = frame->slots;
+      push(result);
+      return INTERPRET_OK;
+    }
+    }
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+#undef RK
+#undef SYNC_IP
+#undef REGISTER_ERROR
+#undef REGISTER_BINARY_OP
+}
+
+// Runs the frame on top, which has just been pushed, until it returns: on the
+// register VM if it has register code, else as machine code if it's hot, else
+// in the interpreter
+static InterpretResult runFrame(int exitDepth) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  if (frame->closure->function->registers != NULL)
+    return runRegisters();
+
+  switch (tryJit(frame)) {
+  case JIT_RETURNED:
+    return INTERPRET_OK;
+  case JIT_ERROR:
+    return INTERPRET_RUNTIME_ERROR;
+  default:
+    return run(exitDepth);
+  }
+}
+
+// The JIT's slow paths. Each one does what the interpreter's case for the
+// instruction does
+JitStatus jitGetGlobal(CallFrame *frame, int operand) {
+  ObjString *name =
+      AS_STRING(frame->closure->function->chunk.constants.values[operand]);
+  Value value;
+  if (!tableGet(&vm.globals, name, &value)) {
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return JIT_ERROR;
+  }
+  push(value);
+  return JIT_CONTINUE;
+}
+
+JitStatus jitDefineGlobal(CallFrame *frame, int operand) {
+  ObjString *name =
+      AS_STRING(frame->closure->function->chunk.constants.values[operand]);
+  tableSet(&vm.globals, name, peek(0));
+  pop();
+  return JIT_CONTINUE;
+}
+
+JitStatus jitSetGlobal(CallFrame *frame, int operand) {
+  ObjString *name =
+      AS_STRING(frame->closure->function->chunk.constants.values[operand]);
+  if (tableSet(&vm.globals, name, peek(0))) {
+    tableDelete(&vm.globals, name);
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return JIT_ERROR;
+  }
+  return JIT_CONTINUE;
+}
+
+JitStatus jitGetUpvalue(CallFrame *frame, int operand) {
+  push(*frame->closure->upvalues[operand]->location);
+  return JIT_CONTINUE;
+}
+
+JitStatus jitSetUpvalue(CallFrame *frame, int operand) {
+  *frame->closure->upvalues[operand]->location = peek(0);
+  return JIT_CONTINUE;
+}
+
+JitStatus jitEqual(CallFrame *frame, int operand) {
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(valuesEqual(a, b)));
+  return JIT_CONTINUE;
+}
+
+// Only reached when the operands aren't both numbers
+JitStatus jitAdd(CallFrame *frame, int operand) {
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    concatenate();
+    return JIT_CONTINUE;
+  }
+
+  runtimeError("Operands must be two numbers or two strings.");
+  return JIT_ERROR;
+}
+
+// The slow path of the other arithmetic and comparison instructions, which is
+// always an error
+JitStatus jitNumbersExpected(CallFrame *frame, int operand) {
+  runtimeError("Operands must be numbers.");
+  return JIT_ERROR;
+}
+
+JitStatus jitNot(CallFrame *frame, int operand) {
+  push(BOOL_VAL(isFalsey(pop())));
+  return JIT_CONTINUE;
+}
+
+JitStatus jitNegate(CallFrame *frame, int operand) {
+  if (!IS_NUMBER(peek(0))) {
+    runtimeError("Operand must be a number.");
+    return JIT_ERROR;
+  }
+  push(NUMBER_VAL(-AS_NUMBER(pop())));
+  return JIT_CONTINUE;
+}
+
+JitStatus jitPrint(CallFrame *frame, int operand) {
+  printValue(pop());
+  printf("\n");
+  return JIT_CONTINUE;
+}
+
+// Runs the whole call before returning to the machine code, whatever the
+// callee runs on
+JitStatus jitCall(CallFrame *frame, int operand) {
+  int frameCount = vm.frameCount;
+  if (!callValue(peek(operand), operand))
+    return JIT_ERROR;
+
+  if (vm.frameCount > frameCount && runFrame(frameCount) != INTERPRET_OK)
+    return JIT_ERROR;
+  return JIT_CONTINUE;
+}
+
+JitStatus jitCloseUpvalue(CallFrame *frame, int operand) {
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+  return JIT_CONTINUE;
+}
+
+JitStatus jitReturn(CallFrame *frame, int operand) {
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  push(result);
+  return JIT_RETURNED;
+}
+
+InterpretResult interpret(const char *source) {
+  ObjFunction *function = compile(source);
+  if (function == NULL)
+    return INTERPRET_COMPILE_ERROR;
+
+  return runScript(function);
+}
+
+// Calls callee with no arguments on the running fiber, which has an empty
+// stack, and runs it until it returns. The result is left on the stack
+InterpretResult runFunction(Value callee) {
+  push(callee);
+  if (!callValue(callee, 0))
+    return INTERPRET_RUNTIME_ERROR;
+
+  // Natives and classes without an initializer are done already
+  if (vm.frameCount == 0)
+    return INTERPRET_OK;
+  return runFrame(0);
+}
+
+// Runs the function compile() returned for a script
+InterpretResult runScript(ObjFunction *function) {
+  // The top-level script runs as a call to an implicit function
+  push(OBJ_VAL(function));
+  ObjClosure *closure = newClosure(function);
+  pop();
+  push(OBJ_VAL(closure));
+  call(closure, 0);
 
-  InterpretResult result = run();
+  InterpretResult result = runFrame(0);
 
-  freeChunk(&chunk);
+  // Discard the script's (nil) return value
+  if (result == INTERPRET_OK)
+    pop();
   return result;
 }
@@ -2,25 +2,59 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+#define FRAMES_MAX 64
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+
+// A single ongoing function call. Each frame has its own instruction pointer
+// and a window onto the VM's value stack: slots points at the first slot the
+// function can use, which holds the callee itself, followed by its arguments
+// and then its locals. Arguments are never copied, the caller's pushed values
+// simply become the callee's first locals
+typedef struct CallFrame {
+  ObjClosure *closure;
+  uint8_t *ip;
+  Value *slots;
+} CallFrame;
 
 typedef struct {
-  Chunk *chunk;
+  // The running fiber's frames and value stack, see fiber.h
+  CallFrame *frames;
+  int frameCount;
 
-  // Location of the instruction being currently executed
-  // We use a C pointer pointing right into the middle of the bytecode array
-  // instead of an integer index bc it's faster to dereference a pointer than
-  // look up an element in an array by index
-  // Always points to the instruction about to be executed
-  uint8_t *ip;
-  Value stack[STACK_MAX];
+  Value *stack;
   Value *stackTop;
+  ObjFiber *fiber;
   Table globals;
   Table strings;
+  // Every module the program has, keyed by its path. The value is the
+  // module's compiled function until it's first imported, true from then on
+  Table modules;
+  ObjString *initString;
+  ObjUpvalue *openUpvalues;
+
+  // The empty shape every new instance starts out with
+  ObjShape *rootShape;
+
+  // Whether functions are also compiled for, and run on, the register VM
+  bool useRegisters;
+  // Whether hot functions get compiled to machine code
+  bool useJit;
+  // How much the compiler optimizes: 0 for not at all, 1 for the peephole
+  // pass
+  int optimizeLevel;
+  // Set by a native that failed, once it has reported the error
+  bool nativeFailed;
+
+  size_t bytesAllocated;
+  size_t nextGC;
   Obj *objects;
+  int grayCount;
+  int grayCapacity;
+  Obj **grayStack;
 } VM;
 
 typedef enum {
@@ -34,6 +68,10 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult runScript(ObjFunction *function);
+InterpretResult runFunction(Value callee);
+void defineNative(const char *name, NativeFn function, int arity);
+void nativeError(const char *format, ...);
 void push(Value value);
 Value pop();
 
@@ -13,7 +13,7 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
 
   @Override
   public String visitBinaryExpr(Expr.Binary expr) {
-    return parenthesize(expr.operator.lexeme, expr.left, expr.right);
+    return parenthesize(expr.operator.lexeme(), expr.left, expr.right);
   }
 
   @Override
@@ -30,22 +30,22 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
 
   @Override
   public String visitUnaryExpr(Expr.Unary expr) {
-    return parenthesize(expr.operator.lexeme, expr.right);
+    return parenthesize(expr.operator.lexeme(), expr.right);
   }
 
   @Override
   public String visitAssignExpr(Expr.Assign expr) {
-    return parenthesizeMore("=", expr.name.lexeme, expr.value);
+    return parenthesizeMore("=", expr.name.lexeme(), expr.value);
   }
 
   @Override
   public String visitVariableExpr(Expr.Variable expr) {
-    return expr.name.lexeme;
+    return expr.name.lexeme();
   }
 
   @Override
   public String visitLogicalExpr(Expr.Logical expr) {
-    return parenthesize(expr.operator.lexeme, expr.left, expr.right);
+    return parenthesize(expr.operator.lexeme(), expr.left, expr.right);
   }
 
   @Override
@@ -68,7 +68,7 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
     for (Token param : expr.parameters) {
       if (param != expr.parameters.get(0))
         builder.append(" ");
-      builder.append(param.lexeme);
+      builder.append(param.lexeme());
     }
 
     for (Stmt body : expr.body) {
@@ -104,7 +104,7 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
 
   @Override
   public String visitFunctionStmt(Stmt.Function stmt) {
-    funcionName = stmt.name.lexeme;
+    funcionName = stmt.name.lexeme();
     return stmt.function.accept(this);
   }
 
@@ -160,7 +160,7 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
   public String visitClassStmt(Stmt.Class stmt) {
     StringBuilder builder = new StringBuilder();
 
-    builder.append("(class " + stmt.name.lexeme);
+    builder.append("(class " + stmt.name.lexeme());
     for (Stmt.Function method : stmt.methods) {
       builder.append(method.accept(this));
     }
@@ -180,7 +180,7 @@ class AstPrinter implements Expr.Visitor<String>, Stmt.Visitor<String> {
       } else if (part instanceof Stmt) {
         builder.append(((Stmt) part).accept(this));
       } else if (part instanceof Token) {
-        builder.append(((Token) part).lexeme);
+        builder.append(((Token) part).lexeme());
       } else {
         builder.append(part);
       }
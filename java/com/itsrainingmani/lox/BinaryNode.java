@@ -0,0 +1,199 @@
+package com.itsrainingmani.lox;
+
+/*
+What a Binary expression does with its operands, specialized to the types it
+has seen them have.
+
+A Binary starts out without a node. The first time it's evaluated, the
+interpreter picks one for the operator and the operands it got: adding two
+numbers gets a node that only adds doubles, adding two strings one that only
+concatenates. From then on that node is all the interpreter runs, with no
+switch on the operator.
+
+A specialized node still checks that its guess holds. When it doesn't, it
+rewrites the expression to the generic node for the operator, which handles
+every type and reports the runtime errors, and lets that node finish. Nodes
+never go back, so a site that sees mixed types rewrites itself once at most.
+*/
+abstract class BinaryNode {
+  abstract Object execute(Expr.Binary expr, Object left, Object right);
+
+  // The node for an expression that has just been evaluated for the first time
+  static BinaryNode specialize(Token operator, Object left, Object right) {
+    boolean numbers = left instanceof Double && right instanceof Double;
+    switch (operator.type) {
+      case GREATER:
+        return numbers ? GREATER_NUMBERS : GENERIC;
+      case GREATER_EQUAL:
+        return numbers ? GREATER_EQUAL_NUMBERS : GENERIC;
+      case LESS:
+        return numbers ? LESS_NUMBERS : GENERIC;
+      case LESS_EQUAL:
+        return numbers ? LESS_EQUAL_NUMBERS : GENERIC;
+      case BANG_EQUAL:
+        return NOT_EQUAL;
+      case EQUAL_EQUAL:
+        return EQUAL;
+      case MINUS:
+        return numbers ? SUBTRACT_NUMBERS : GENERIC;
+      case PLUS:
+        if (numbers)
+          return ADD_NUMBERS;
+        if (left instanceof String && right instanceof String)
+          return ADD_STRINGS;
+        return GENERIC;
+      case SLASH:
+        return numbers ? DIVIDE_NUMBERS : GENERIC;
+      case STAR:
+        return numbers ? MULTIPLY_NUMBERS : GENERIC;
+      default:
+        return GENERIC;
+    }
+  }
+
+  // A node for operands that are both numbers
+  private abstract static class Numbers extends BinaryNode {
+    abstract Object apply(double left, double right);
+
+    @Override
+    final Object execute(Expr.Binary expr, Object left, Object right) {
+      if (left instanceof Double && right instanceof Double) {
+        return apply((double) left, (double) right);
+      }
+
+      expr.node = GENERIC;
+      return GENERIC.execute(expr, left, right);
+    }
+  }
+
+  static final BinaryNode ADD_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left + right;
+    }
+  };
+
+  static final BinaryNode SUBTRACT_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left - right;
+    }
+  };
+
+  static final BinaryNode MULTIPLY_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left * right;
+    }
+  };
+
+  static final BinaryNode DIVIDE_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left / right;
+    }
+  };
+
+  static final BinaryNode GREATER_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left > right;
+    }
+  };
+
+  static final BinaryNode GREATER_EQUAL_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left >= right;
+    }
+  };
+
+  static final BinaryNode LESS_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left < right;
+    }
+  };
+
+  static final BinaryNode LESS_EQUAL_NUMBERS = new Numbers() {
+    @Override
+    Object apply(double left, double right) {
+      return left <= right;
+    }
+  };
+
+  static final BinaryNode ADD_STRINGS = new BinaryNode() {
+    @Override
+    Object execute(Expr.Binary expr, Object left, Object right) {
+      if (left instanceof String && right instanceof String) {
+        return (String) left + (String) right;
+      }
+
+      expr.node = GENERIC;
+      return GENERIC.execute(expr, left, right);
+    }
+  };
+
+  // Equality works on any two values, so there's nothing to guess
+  static final BinaryNode EQUAL = new BinaryNode() {
+    @Override
+    Object execute(Expr.Binary expr, Object left, Object right) {
+      return Interpreter.isEqual(left, right);
+    }
+  };
+
+  static final BinaryNode NOT_EQUAL = new BinaryNode() {
+    @Override
+    Object execute(Expr.Binary expr, Object left, Object right) {
+      return !Interpreter.isEqual(left, right);
+    }
+  };
+
+  // Every operator on every type, with the type checks
+  static final BinaryNode GENERIC = new BinaryNode() {
+    @Override
+    Object execute(Expr.Binary expr, Object left, Object right) {
+      Token operator = expr.operator;
+      switch (operator.type) {
+        case GREATER:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left > (double) right;
+        case GREATER_EQUAL:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left >= (double) right;
+        case LESS:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left < (double) right;
+        case LESS_EQUAL:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left <= (double) right;
+        case BANG_EQUAL:
+          return !Interpreter.isEqual(left, right);
+        case EQUAL_EQUAL:
+          return Interpreter.isEqual(left, right);
+        case MINUS:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left - (double) right;
+        case PLUS:
+          if (left instanceof Double && right instanceof Double) {
+            return (double) left + (double) right;
+          }
+
+          if (left instanceof String && right instanceof String) {
+            return (String) left + (String) right;
+          }
+
+          throw new RuntimeError(operator, "Operands must be two numbers or two strings.");
+        case SLASH:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left / (double) right;
+        case STAR:
+          Interpreter.checkNumberOperands(operator, left, right);
+          return (double) left * (double) right;
+        default:
+          // Unreachable
+          return null;
+      }
+    }
+  };
+}
@@ -0,0 +1,758 @@
+package com.itsrainingmani.lox;
+
+import java.lang.invoke.MethodHandle;
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.MethodType;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.IdentityHashMap;
+import java.util.List;
+import java.util.Map;
+
+/*
+The tier above the Interpreter and the ClosureCompiler. Once a function has
+been called often enough, LoxFunction hands its body to this class, which
+translates it into JVM bytecode. HotSpot then sees one plain Java method per
+hot Lox function, which it can profile, inline into and compile to machine code
+like any other, instead of a tree of nodes or lambdas it has to see through.
+
+Each function becomes a hidden class, written by ClassWriter and defined with
+Lookup.defineHiddenClass(), holding a single static method:
+
+  static Object run(Interpreter interpreter, Environment environment,
+                    Object[] constants)
+
+The environment is the one LoxFunction.call() sets up with the parameters, and
+the method returns what the function returns. Control flow (if, while, break,
+return, and, or) turns into real jumps. A block's environment lives in a JVM
+local, so a variable in any of the function's own scopes is read straight out
+of the environment that holds it, without walking the chain. Everything else -
+arithmetic with its type checks, calls, property access - calls one of the
+small static helpers at the bottom of this class, which HotSpot inlines.
+
+Values that can't go in a class file - boxed literals, tokens for error
+messages, AST nodes with inline caches - are kept in the constants array, which
+is bound into the method handle.
+
+Class declarations aren't supported, so a function with one in its body just
+keeps running the way it did before.
+*/
+final class BytecodeCompiler implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
+
+  // On with --jit. Off by default until the test suite has been run through
+  // it with a threshold of 1, so every function that can be compiled is
+  static boolean enabled = false;
+
+  // How many calls make a function hot. The same as clox's JIT, unless
+  // overridden with -Djlox.jitThreshold=n
+  static final int THRESHOLD = Integer.getInteger("jlox.jitThreshold", 1000);
+
+  // A compiled function body
+  static final class Body {
+    private final MethodHandle handle;
+
+    private Body(MethodHandle handle) {
+      this.handle = handle;
+    }
+
+    Object run(Interpreter interpreter, Environment environment) {
+      try {
+        return (Object) handle.invokeExact(interpreter, environment);
+      } catch (RuntimeException | Error error) {
+        throw error;
+      } catch (Throwable throwable) {
+        // The generated code doesn't throw checked exceptions
+        throw new IllegalStateException(throwable);
+      }
+    }
+  }
+
+  // Thrown for anything in a body that can't be compiled
+  private static final class Unsupported extends RuntimeException {
+    Unsupported() {
+      super(null, null, false, false);
+    }
+  }
+
+  private static final String PACKAGE = "com/itsrainingmani/lox/";
+  private static final String SELF = PACKAGE + "BytecodeCompiler";
+  private static final String ENVIRONMENT = PACKAGE + "Environment";
+  private static final String INTERPRETER = PACKAGE + "Interpreter";
+  private static final String INSTANCE = PACKAGE + "LoxInstance";
+  private static final String TOKEN = PACKAGE + "Token";
+
+  private static final String OBJECT_D = "Ljava/lang/Object;";
+  private static final String ENVIRONMENT_D = "L" + ENVIRONMENT + ";";
+  private static final String INTERPRETER_D = "L" + INTERPRETER + ";";
+  private static final String INSTANCE_D = "L" + INSTANCE + ";";
+  private static final String FUNCTION_D = "L" + PACKAGE + "LoxFunction;";
+  private static final String TOKEN_D = "L" + TOKEN + ";";
+  private static final String GET_D = "L" + PACKAGE + "Expr$Get;";
+  private static final String SET_D = "L" + PACKAGE + "Expr$Set;";
+  private static final String FUNCTION_EXPR_D = "L" + PACKAGE + "Expr$Function;";
+  private static final String FUNCTION_STMT_D = "L" + PACKAGE + "Stmt$Function;";
+
+  private static final MethodType RUN_TYPE =
+      MethodType.methodType(Object.class, Interpreter.class, Environment.class, Object[].class);
+
+  // The run() method's arguments, as locals
+  private static final int INTERPRETER_LOCAL = 0;
+  private static final int ENVIRONMENT_LOCAL = 1;
+  private static final int CONSTANTS_LOCAL = 2;
+
+  private final ClassWriter.Method code;
+  private final List<Object> constants = new ArrayList<>();
+  private final Map<Object, Integer> constantIndexes = new IdentityHashMap<>();
+
+  // The local holding the environment of each scope inside the function that
+  // the code is currently in, innermost last. The first is the function's own
+  private final List<Integer> scopes = new ArrayList<>();
+  private int nextLocal = CONSTANTS_LOCAL + 1;
+
+  // Where a break in each loop the code is currently in jumps to
+  private final List<ClassWriter.Label> loopExits = new ArrayList<>();
+
+  private BytecodeCompiler(ClassWriter writer) {
+    code = writer.method(ClassWriter.ACC_STATIC, "run", RUN_TYPE.toMethodDescriptorString());
+    scopes.add(ENVIRONMENT_LOCAL);
+  }
+
+  // Compiles the function's body, or returns null if it can't be
+  static Body compile(Expr.Function function) {
+    try {
+      ClassWriter writer = new ClassWriter(PACKAGE + "LoxCode", "java/lang/Object");
+      BytecodeCompiler compiler = new BytecodeCompiler(writer);
+      for (Stmt statement : function.body) {
+        compiler.compile(statement);
+      }
+
+      // Falling off the end returns nil
+      compiler.code.op(ClassWriter.ACONST_NULL, 1);
+      compiler.code.op(ClassWriter.ARETURN, -1);
+
+      MethodHandles.Lookup lookup = MethodHandles.lookup().defineHiddenClass(writer.toByteArray(), true);
+      MethodHandle handle = lookup.findStatic(lookup.lookupClass(), "run", RUN_TYPE);
+      Object[] constants = compiler.constants.toArray();
+      return new Body(MethodHandles.insertArguments(handle, 2, new Object[] { constants }));
+    } catch (Unsupported | IllegalArgumentException | ReflectiveOperationException | LinkageError error) {
+      return null;
+    }
+  }
+
+  private void compile(Stmt stmt) {
+    stmt.accept(this);
+  }
+
+  private void compile(Expr expr) {
+    expr.accept(this);
+  }
+
+  // Pushes a value from the constants array, cast to className unless that's
+  // null
+  private void loadConstant(Object value, String className) {
+    Integer index = constantIndexes.get(value);
+    if (index == null) {
+      index = constants.size();
+      constants.add(value);
+      constantIndexes.put(value, index);
+    }
+
+    code.local(ClassWriter.ALOAD, CONSTANTS_LOCAL);
+    code.pushInt(index);
+    code.op(ClassWriter.AALOAD, -1);
+    if (className != null)
+      code.type(ClassWriter.CHECKCAST, className);
+  }
+
+  // Pushes the environment depth hops out. Scopes inside the function are in
+  // locals; past those, the chain is walked from the function's own
+  private void loadEnvironment(int depth) {
+    int inner = scopes.size() - 1;
+    if (depth <= inner) {
+      code.local(ClassWriter.ALOAD, scopes.get(inner - depth));
+      return;
+    }
+
+    code.local(ClassWriter.ALOAD, ENVIRONMENT_LOCAL);
+    code.pushInt(depth - inner);
+    code.invoke(ClassWriter.INVOKEVIRTUAL, ENVIRONMENT, "ancestor", "(I)" + ENVIRONMENT_D);
+  }
+
+  private void loadGlobals() {
+    code.local(ClassWriter.ALOAD, INTERPRETER_LOCAL);
+    code.field(ClassWriter.GETFIELD, INTERPRETER, "globals", ENVIRONMENT_D);
+  }
+
+  private void callHelper(String name, String descriptor) {
+    code.invoke(ClassWriter.INVOKESTATIC, SELF, name, descriptor);
+  }
+
+  // A local for the compiler's own use, free again after releaseLocal()
+  private int newLocal() {
+    return nextLocal++;
+  }
+
+  private void releaseLocal() {
+    nextLocal--;
+  }
+
+  // Leaves the arguments on the stack in a new Object[]
+  private void compileArguments(List<Expr> arguments) {
+    code.pushInt(arguments.size());
+    code.type(ClassWriter.ANEWARRAY, "java/lang/Object");
+    for (int i = 0; i < arguments.size(); i++) {
+      code.op(ClassWriter.DUP, 1);
+      code.pushInt(i);
+      compile(arguments.get(i));
+      code.op(ClassWriter.AASTORE, -3);
+    }
+  }
+
+  // Jumps to ifFalse unless the condition is truthy. Comparisons go straight
+  // to a jump without boxing a Boolean in between
+  private void compileCondition(Expr condition, ClassWriter.Label ifFalse) {
+    while (condition instanceof Expr.Grouping) {
+      condition = ((Expr.Grouping) condition).expression;
+    }
+
+    if (condition instanceof Expr.Logical && ((Expr.Logical) condition).operator.type == TokenType.AND) {
+      compileCondition(((Expr.Logical) condition).left, ifFalse);
+      compileCondition(((Expr.Logical) condition).right, ifFalse);
+      return;
+    }
+
+    if (condition instanceof Expr.Binary) {
+      Expr.Binary binary = (Expr.Binary) condition;
+      String test = comparison(binary.operator.type);
+      if (test != null) {
+        compile(binary.left);
+        compile(binary.right);
+        loadConstant(binary.operator, TOKEN);
+        callHelper(test, "(" + OBJECT_D + OBJECT_D + TOKEN_D + ")Z");
+        code.jump(ClassWriter.IFEQ, ifFalse);
+        return;
+      }
+    }
+
+    compile(condition);
+    code.invoke(ClassWriter.INVOKESTATIC, INTERPRETER, "isTruthy", "(" + OBJECT_D + ")Z");
+    code.jump(ClassWriter.IFEQ, ifFalse);
+  }
+
+  // The helper that tests a comparison, or null if the operator isn't one
+  private static String comparison(TokenType operator) {
+    switch (operator) {
+      case GREATER:
+        return "isGreater";
+      case GREATER_EQUAL:
+        return "isGreaterEqual";
+      case LESS:
+        return "isLess";
+      case LESS_EQUAL:
+        return "isLessEqual";
+      default:
+        return null;
+    }
+  }
+
+  @Override
+  public Void visitLiteralExpr(Expr.Literal expr) {
+    if (expr.value == null) {
+      code.op(ClassWriter.ACONST_NULL, 1);
+    } else {
+      loadConstant(expr.value, null);
+    }
+    return null;
+  }
+
+  @Override
+  public Void visitLogicalExpr(Expr.Logical expr) {
+    // The left operand is the result if it decides the answer on its own,
+    // otherwise it's dropped for the right one
+    ClassWriter.Label end = new ClassWriter.Label();
+    compile(expr.left);
+    code.op(ClassWriter.DUP, 1);
+    code.invoke(ClassWriter.INVOKESTATIC, INTERPRETER, "isTruthy", "(" + OBJECT_D + ")Z");
+    code.jump(expr.operator.type == TokenType.OR ? ClassWriter.IFNE : ClassWriter.IFEQ, end);
+    code.op(ClassWriter.POP, -1);
+    compile(expr.right);
+    code.place(end);
+    return null;
+  }
+
+  @Override
+  public Void visitGroupingExpr(Expr.Grouping expr) {
+    compile(expr.expression);
+    return null;
+  }
+
+  @Override
+  public Void visitUnaryExpr(Expr.Unary expr) {
+    compile(expr.right);
+    if (expr.operator.type == TokenType.BANG) {
+      callHelper("not", "(" + OBJECT_D + ")" + OBJECT_D);
+    } else {
+      loadConstant(expr.operator, TOKEN);
+      callHelper("negate", "(" + OBJECT_D + TOKEN_D + ")" + OBJECT_D);
+    }
+    return null;
+  }
+
+  @Override
+  public Void visitBinaryExpr(Expr.Binary expr) {
+    String helper;
+    switch (expr.operator.type) {
+      case GREATER:
+        helper = "greater";
+        break;
+      case GREATER_EQUAL:
+        helper = "greaterEqual";
+        break;
+      case LESS:
+        helper = "less";
+        break;
+      case LESS_EQUAL:
+        helper = "lessEqual";
+        break;
+      case BANG_EQUAL:
+        helper = "notEqual";
+        break;
+      case EQUAL_EQUAL:
+        helper = "equal";
+        break;
+      case MINUS:
+        helper = "subtract";
+        break;
+      case PLUS:
+        helper = "add";
+        break;
+      case SLASH:
+        helper = "divide";
+        break;
+      case STAR:
+        helper = "multiply";
+        break;
+      default:
+        throw new Unsupported();
+    }
+
+    compile(expr.left);
+    compile(expr.right);
+    loadConstant(expr.operator, TOKEN);
+    callHelper(helper, "(" + OBJECT_D + OBJECT_D + TOKEN_D + ")" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitCallExpr(Expr.Call expr) {
+    if (!(expr.callee instanceof Expr.Get)) {
+      code.local(ClassWriter.ALOAD, INTERPRETER_LOCAL);
+      compile(expr.callee);
+      compileArguments(expr.arguments);
+      loadConstant(expr.paren, TOKEN);
+      callHelper("call", "(" + INTERPRETER_D + OBJECT_D + "[" + OBJECT_D + TOKEN_D + ")" + OBJECT_D);
+      return null;
+    }
+
+    // Method calls skip building a bound method, same as in the Interpreter.
+    // The instance, the method and, if there's no method, the field being
+    // called are all found before any argument is evaluated
+    Expr.Get get = (Expr.Get) expr.callee;
+    int instance = newLocal();
+    int method = newLocal();
+    int field = newLocal();
+
+    compile(get.object);
+    loadConstant(get, PACKAGE + "Expr$Get");
+    callHelper("instance", "(" + OBJECT_D + GET_D + ")" + INSTANCE_D);
+    code.local(ClassWriter.ASTORE, instance);
+
+    code.local(ClassWriter.ALOAD, instance);
+    loadConstant(get, PACKAGE + "Expr$Get");
+    code.invoke(ClassWriter.INVOKEVIRTUAL, INSTANCE, "method", "(" + GET_D + ")" + FUNCTION_D);
+    code.local(ClassWriter.ASTORE, method);
+
+    code.local(ClassWriter.ALOAD, instance);
+    code.local(ClassWriter.ALOAD, method);
+    loadConstant(get, PACKAGE + "Expr$Get");
+    callHelper("field", "(" + INSTANCE_D + FUNCTION_D + GET_D + ")" + OBJECT_D);
+    code.local(ClassWriter.ASTORE, field);
+
+    code.local(ClassWriter.ALOAD, INTERPRETER_LOCAL);
+    code.local(ClassWriter.ALOAD, instance);
+    code.local(ClassWriter.ALOAD, method);
+    code.local(ClassWriter.ALOAD, field);
+    compileArguments(expr.arguments);
+    loadConstant(expr.paren, TOKEN);
+    callHelper("invoke", "(" + INTERPRETER_D + INSTANCE_D + FUNCTION_D + OBJECT_D + "[" + OBJECT_D
+        + TOKEN_D + ")" + OBJECT_D);
+
+    releaseLocal();
+    releaseLocal();
+    releaseLocal();
+    return null;
+  }
+
+  @Override
+  public Void visitGetExpr(Expr.Get expr) {
+    compile(expr.object);
+    loadConstant(expr, PACKAGE + "Expr$Get");
+    callHelper("getProperty", "(" + OBJECT_D + GET_D + ")" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitSetExpr(Expr.Set expr) {
+    // The object is checked before the value is evaluated
+    compile(expr.object);
+    loadConstant(expr, PACKAGE + "Expr$Set");
+    callHelper("setTarget", "(" + OBJECT_D + SET_D + ")" + INSTANCE_D);
+    compile(expr.value);
+    loadConstant(expr, PACKAGE + "Expr$Set");
+    callHelper("setProperty", "(" + INSTANCE_D + OBJECT_D + SET_D + ")" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitSuperExpr(Expr.Super expr) {
+    loadEnvironment(expr.depth);
+    loadEnvironment(expr.depth - 1);
+    loadConstant(expr.method, TOKEN);
+    callHelper("superMethod", "(" + ENVIRONMENT_D + ENVIRONMENT_D + TOKEN_D + ")" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitThisExpr(Expr.This expr) {
+    loadEnvironment(expr.depth);
+    code.pushInt(0);
+    code.pushInt(0);
+    code.invoke(ClassWriter.INVOKEVIRTUAL, ENVIRONMENT, "getAt", "(II)" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitVariableExpr(Expr.Variable expr) {
+    if (expr.depth == -1) {
+      loadGlobals();
+      loadConstant(expr.name, TOKEN);
+      code.pushInt(expr.slot);
+      code.invoke(ClassWriter.INVOKEVIRTUAL, ENVIRONMENT, "get", "(" + TOKEN_D + "I)" + OBJECT_D);
+      return null;
+    }
+
+    loadEnvironment(expr.depth);
+    code.pushInt(0);
+    code.pushInt(expr.slot);
+    code.invoke(ClassWriter.INVOKEVIRTUAL, ENVIRONMENT, "getAt", "(II)" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitAssignExpr(Expr.Assign expr) {
+    compile(expr.value);
+    if (expr.depth == -1) {
+      loadGlobals();
+      loadConstant(expr.name, TOKEN);
+      code.pushInt(expr.slot);
+      callHelper("assignGlobal", "(" + OBJECT_D + ENVIRONMENT_D + TOKEN_D + "I)" + OBJECT_D);
+      return null;
+    }
+
+    loadEnvironment(expr.depth);
+    code.pushInt(expr.slot);
+    callHelper("assignLocal", "(" + OBJECT_D + ENVIRONMENT_D + "I)" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitFunctionExpr(Expr.Function expr) {
+    loadEnvironment(0);
+    loadConstant(expr, PACKAGE + "Expr$Function");
+    callHelper("function", "(" + ENVIRONMENT_D + FUNCTION_EXPR_D + ")" + OBJECT_D);
+    return null;
+  }
+
+  @Override
+  public Void visitExpressionStmt(Stmt.Expression stmt) {
+    compile(stmt.expression);
+    code.op(ClassWriter.POP, -1);
+    return null;
+  }
+
+  @Override
+  public Void visitFunctionStmt(Stmt.Function stmt) {
+    loadEnvironment(0);
+    code.pushInt(stmt.slot);
+    loadConstant(stmt, PACKAGE + "Stmt$Function");
+    callHelper("defineFunction", "(" + ENVIRONMENT_D + "I" + FUNCTION_STMT_D + ")V");
+    return null;
+  }
+
+  @Override
+  public Void visitPrintStmt(Stmt.Print stmt) {
+    compile(stmt.expression);
+    callHelper("print", "(" + OBJECT_D + ")V");
+    return null;
+  }
+
+  @Override
+  public Void visitReturnStmt(Stmt.Return stmt) {
+    if (stmt.value == null) {
+      code.op(ClassWriter.ACONST_NULL, 1);
+    } else {
+      compile(stmt.value);
+    }
+    code.op(ClassWriter.ARETURN, -1);
+    return null;
+  }
+
+  @Override
+  public Void visitVarStmt(Stmt.Var stmt) {
+    if (stmt.initializer == null) {
+      code.op(ClassWriter.ACONST_NULL, 1);
+    } else {
+      compile(stmt.initializer);
+    }
+    loadEnvironment(0);
+    code.pushInt(stmt.slot);
+    callHelper("define", "(" + OBJECT_D + ENVIRONMENT_D + "I)V");
+    return null;
+  }
+
+  @Override
+  public Void visitWhileStmt(Stmt.While stmt) {
+    ClassWriter.Label start = new ClassWriter.Label();
+    ClassWriter.Label exit = new ClassWriter.Label();
+
+    code.place(start);
+    compileCondition(stmt.condition, exit);
+    loopExits.add(exit);
+    compile(stmt.body);
+    loopExits.remove(loopExits.size() - 1);
+    code.jump(ClassWriter.GOTO, start);
+    code.place(exit);
+    return null;
+  }
+
+  @Override
+  public Void visitBreakStmt(Stmt.Break stmt) {
+    code.jump(ClassWriter.GOTO, loopExits.get(loopExits.size() - 1));
+    return null;
+  }
+
+  @Override
+  public Void visitBlockStmt(Stmt.Block stmt) {
+    int local = newLocal();
+    code.type(ClassWriter.NEW, ENVIRONMENT);
+    code.op(ClassWriter.DUP, 1);
+    loadEnvironment(0);
+    code.pushInt(stmt.slots);
+    code.invoke(ClassWriter.INVOKESPECIAL, ENVIRONMENT, "<init>", "(" + ENVIRONMENT_D + "I)V");
+    code.local(ClassWriter.ASTORE, local);
+
+    scopes.add(local);
+    for (Stmt statement : stmt.statements) {
+      compile(statement);
+    }
+    scopes.remove(scopes.size() - 1);
+    releaseLocal();
+    return null;
+  }
+
+  @Override
+  public Void visitClassStmt(Stmt.Class stmt) {
+    throw new Unsupported();
+  }
+
+  @Override
+  public Void visitIfStmt(Stmt.If stmt) {
+    ClassWriter.Label elseBranch = new ClassWriter.Label();
+    compileCondition(stmt.condition, elseBranch);
+    compile(stmt.thenBranch);
+
+    if (stmt.elseBranch == null) {
+      code.place(elseBranch);
+      return null;
+    }
+
+    ClassWriter.Label end = new ClassWriter.Label();
+    code.jump(ClassWriter.GOTO, end);
+    code.place(elseBranch);
+    compile(stmt.elseBranch);
+    code.place(end);
+    return null;
+  }
+
+  // The helpers the generated code calls. They do what the Interpreter's visit
+  // methods do once the operands have been evaluated
+
+  static boolean isGreater(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left > (double) right;
+  }
+
+  static boolean isGreaterEqual(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left >= (double) right;
+  }
+
+  static boolean isLess(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left < (double) right;
+  }
+
+  static boolean isLessEqual(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left <= (double) right;
+  }
+
+  static Object greater(Object left, Object right, Token operator) {
+    return isGreater(left, right, operator);
+  }
+
+  static Object greaterEqual(Object left, Object right, Token operator) {
+    return isGreaterEqual(left, right, operator);
+  }
+
+  static Object less(Object left, Object right, Token operator) {
+    return isLess(left, right, operator);
+  }
+
+  static Object lessEqual(Object left, Object right, Token operator) {
+    return isLessEqual(left, right, operator);
+  }
+
+  static Object equal(Object left, Object right, Token operator) {
+    return Interpreter.isEqual(left, right);
+  }
+
+  static Object notEqual(Object left, Object right, Token operator) {
+    return !Interpreter.isEqual(left, right);
+  }
+
+  static Object subtract(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left - (double) right;
+  }
+
+  static Object add(Object left, Object right, Token operator) {
+    if (left instanceof Double && right instanceof Double) {
+      return (double) left + (double) right;
+    }
+
+    if (left instanceof String && right instanceof String) {
+      return (String) left + (String) right;
+    }
+
+    throw new RuntimeError(operator, "Operands must be two numbers or two strings.");
+  }
+
+  static Object divide(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left / (double) right;
+  }
+
+  static Object multiply(Object left, Object right, Token operator) {
+    Interpreter.checkNumberOperands(operator, left, right);
+    return (double) left * (double) right;
+  }
+
+  static Object not(Object value) {
+    return !Interpreter.isTruthy(value);
+  }
+
+  static Object negate(Object value, Token operator) {
+    Interpreter.checkNumberOperand(operator, value);
+    return -(double) value;
+  }
+
+  static Object call(Interpreter interpreter, Object callee, Object[] arguments, Token paren) {
+    return interpreter.call(callee, Arrays.asList(arguments), paren);
+  }
+
+  static LoxInstance instance(Object object, Expr.Get get) {
+    if (!(object instanceof LoxInstance)) {
+      throw new RuntimeError(get.name, "Only instances have properties.");
+    }
+    return (LoxInstance) object;
+  }
+
+  // The value of the field being called, when there's no method to call
+  static Object field(LoxInstance instance, LoxFunction method, Expr.Get get) {
+    return method == null ? instance.get(get) : null;
+  }
+
+  static Object invoke(Interpreter interpreter, LoxInstance instance, LoxFunction method, Object field,
+      Object[] arguments, Token paren) {
+    List<Object> values = Arrays.asList(arguments);
+    if (method == null) {
+      return interpreter.call(field, values, paren);
+    }
+
+    Interpreter.checkArity(method, values, paren);
+    return method.callMethod(interpreter, instance, values);
+  }
+
+  static Object getProperty(Object object, Expr.Get get) {
+    if (object instanceof LoxInstance) {
+      return ((LoxInstance) object).get(get);
+    }
+
+    throw new RuntimeError(get.name, "Only instances have properties.");
+  }
+
+  static LoxInstance setTarget(Object object, Expr.Set set) {
+    if (!(object instanceof LoxInstance)) {
+      throw new RuntimeError(set.name, "Only instances have fields.");
+    }
+    return (LoxInstance) object;
+  }
+
+  static Object setProperty(LoxInstance instance, Object value, Expr.Set set) {
+    instance.set(set, value);
+    return value;
+  }
+
+  static Object superMethod(Environment superclassScope, Environment thisScope, Token method) {
+    LoxClass superclass = (LoxClass) superclassScope.getAt(0, 0);
+    LoxInstance object = (LoxInstance) thisScope.getAt(0, 0);
+
+    LoxFunction function = superclass.findMethod(method.lexeme());
+    if (function == null) {
+      throw new RuntimeError(method, "Undefined property '" + method.lexeme() + "'.");
+    }
+    return function.bind(object);
+  }
+
+  static Object assignGlobal(Object value, Environment globals, Token name, int slot) {
+    globals.assign(name, slot, value);
+    return value;
+  }
+
+  static Object assignLocal(Object value, Environment environment, int slot) {
+    environment.assignAt(0, slot, value);
+    return value;
+  }
+
+  // A function made here runs its body the same way the one it's nested in
+  // used to: with the ClosureCompiler's code under --compile, which left it on
+  // the declaration, and by walking the tree otherwise
+  static Object function(Environment environment, Expr.Function declaration) {
+    return new LoxFunction(null, declaration, environment, false, declaration.closureBody);
+  }
+
+  static void defineFunction(Environment environment, int slot, Stmt.Function stmt) {
+    Expr.Function declaration = stmt.function;
+    environment.define(slot,
+        new LoxFunction(stmt.name.lexeme(), declaration, environment, false, declaration.closureBody));
+  }
+
+  static void define(Object value, Environment environment, int slot) {
+    environment.define(slot, value);
+  }
+
+  static void print(Object value) {
+    System.out.println(Interpreter.stringify(value));
+  }
+}
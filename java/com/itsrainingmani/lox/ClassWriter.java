@@ -0,0 +1,373 @@
+package com.itsrainingmani.lox;
+
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/*
+Just enough of the JVM class file format to write the classes that
+BytecodeCompiler generates: a final class with static methods and nothing else.
+No fields, no constructors, no attributes besides Code.
+
+Class files are written as version 49 (Java 5). From version 50 on, every
+method with a branch has to carry a StackMapTable giving the type of each
+local and stack slot at every jump target. For version 49 classes the JVM
+still works those out for itself while verifying, which leaves this writer
+only having to count how deep the operand stack gets.
+
+Anything that doesn't fit the format - a method over 64K, a jump further than
+32K - throws an IllegalArgumentException, and the caller gives up on the class.
+*/
+final class ClassWriter {
+
+  // The opcodes BytecodeCompiler uses
+  static final int ACONST_NULL = 0x01;
+  static final int ICONST_0 = 0x03;
+  static final int BIPUSH = 0x10;
+  static final int SIPUSH = 0x11;
+  static final int LDC_W = 0x13;
+  static final int ALOAD = 0x19;
+  static final int AALOAD = 0x32;
+  static final int ASTORE = 0x3a;
+  static final int AASTORE = 0x53;
+  static final int POP = 0x57;
+  static final int DUP = 0x59;
+  static final int IFEQ = 0x99;
+  static final int IFNE = 0x9a;
+  static final int GOTO = 0xa7;
+  static final int ARETURN = 0xb0;
+  static final int GETSTATIC = 0xb2;
+  static final int GETFIELD = 0xb4;
+  static final int INVOKEVIRTUAL = 0xb6;
+  static final int INVOKESPECIAL = 0xb7;
+  static final int INVOKESTATIC = 0xb8;
+  static final int NEW = 0xbb;
+  static final int ANEWARRAY = 0xbd;
+  static final int CHECKCAST = 0xc0;
+  static final int IFNULL = 0xc6;
+  static final int WIDE = 0xc4;
+
+  static final int ACC_STATIC = 0x0008;
+  static final int ACC_FINAL = 0x0010;
+  static final int ACC_SUPER = 0x0020;
+
+  private static final int CONSTANT_UTF8 = 1;
+  private static final int CONSTANT_INTEGER = 3;
+  private static final int CONSTANT_CLASS = 7;
+  private static final int CONSTANT_FIELDREF = 9;
+  private static final int CONSTANT_METHODREF = 10;
+  private static final int CONSTANT_NAME_AND_TYPE = 12;
+
+  // A growable array of big-endian bytes, which is how everything in a class
+  // file is laid out
+  private static final class Bytes {
+    byte[] data = new byte[256];
+    int length = 0;
+
+    void u1(int value) {
+      if (length == data.length)
+        data = Arrays.copyOf(data, length * 2);
+      data[length++] = (byte) value;
+    }
+
+    void u2(int value) {
+      u1(value >> 8);
+      u1(value);
+    }
+
+    void u4(int value) {
+      u2(value >> 16);
+      u2(value);
+    }
+
+    void put(byte[] bytes, int count) {
+      for (int i = 0; i < count; i++) {
+        u1(bytes[i]);
+      }
+    }
+  }
+
+  // The constant pool, written out as entries are added. Each entry is added
+  // once and looked up again by its tag and contents after that
+  private final Bytes pool = new Bytes();
+  private final Map<String, Integer> poolIndexes = new HashMap<>();
+  private int poolCount = 1;
+
+  private final int thisClass;
+  private final int superClass;
+  private final int codeName;
+  private final List<Method> methods = new ArrayList<>();
+
+  // Names are internal ones, with slashes: "java/lang/Object"
+  ClassWriter(String name, String superName) {
+    thisClass = classRef(name);
+    superClass = classRef(superName);
+    codeName = utf8("Code");
+  }
+
+  // Identifiers and descriptors are plain ASCII, where UTF-8 and the class
+  // file's "modified" UTF-8 agree
+  private int utf8(String value) {
+    String key = CONSTANT_UTF8 + ":" + value;
+    Integer index = poolIndexes.get(key);
+    if (index != null)
+      return index;
+
+    byte[] bytes = value.getBytes(StandardCharsets.UTF_8);
+    pool.u1(CONSTANT_UTF8);
+    pool.u2(bytes.length);
+    pool.put(bytes, bytes.length);
+    return addEntry(key);
+  }
+
+  private int integer(int value) {
+    String key = CONSTANT_INTEGER + ":" + value;
+    Integer index = poolIndexes.get(key);
+    if (index != null)
+      return index;
+
+    pool.u1(CONSTANT_INTEGER);
+    pool.u4(value);
+    return addEntry(key);
+  }
+
+  private int classRef(String name) {
+    return reference(CONSTANT_CLASS, utf8(name), -1);
+  }
+
+  private int nameAndType(String name, String descriptor) {
+    return reference(CONSTANT_NAME_AND_TYPE, utf8(name), utf8(descriptor));
+  }
+
+  private int memberRef(int tag, String owner, String name, String descriptor) {
+    return reference(tag, classRef(owner), nameAndType(name, descriptor));
+  }
+
+  // An entry made of one or two indexes of other entries. second is -1 for one
+  private int reference(int tag, int first, int second) {
+    String key = tag + ":" + first + ":" + second;
+    Integer index = poolIndexes.get(key);
+    if (index != null)
+      return index;
+
+    pool.u1(tag);
+    pool.u2(first);
+    if (second != -1)
+      pool.u2(second);
+    return addEntry(key);
+  }
+
+  private int addEntry(String key) {
+    if (poolCount > 0xffff)
+      throw new IllegalArgumentException("Too many constants in one class.");
+
+    poolIndexes.put(key, poolCount);
+    return poolCount++;
+  }
+
+  Method method(int access, String name, String descriptor) {
+    Method method = new Method(access, utf8(name), utf8(descriptor), argumentSlots(descriptor));
+    methods.add(method);
+    return method;
+  }
+
+  byte[] toByteArray() {
+    Bytes out = new Bytes();
+    out.u4(0xcafebabe);
+    out.u2(0); // Minor version
+    out.u2(49); // Major version: Java 5
+
+    out.u2(poolCount);
+    out.put(pool.data, pool.length);
+
+    out.u2(ACC_FINAL | ACC_SUPER);
+    out.u2(thisClass);
+    out.u2(superClass);
+    out.u2(0); // Interfaces
+    out.u2(0); // Fields
+
+    out.u2(methods.size());
+    for (Method method : methods) {
+      method.write(out);
+    }
+
+    out.u2(0); // Attributes
+    return Arrays.copyOf(out.data, out.length);
+  }
+
+  // How many local variable slots the arguments in a method descriptor like
+  // "(Ljava/lang/Object;I)V" take up. Longs and doubles take two
+  private static int argumentSlots(String descriptor) {
+    int slots = 0;
+    int i = 1;
+    while (descriptor.charAt(i) != ')') {
+      int start = i;
+      while (descriptor.charAt(i) == '[') {
+        i++;
+      }
+
+      char c = descriptor.charAt(i);
+      slots += i == start && (c == 'J' || c == 'D') ? 2 : 1;
+      if (c == 'L') {
+        i = descriptor.indexOf(';', i);
+      }
+      i++;
+    }
+
+    return slots;
+  }
+
+  // How many slots of the operand stack a method's return value takes
+  private static int returnSlots(String descriptor) {
+    char c = descriptor.charAt(descriptor.indexOf(')') + 1);
+    if (c == 'V')
+      return 0;
+    return c == 'J' || c == 'D' ? 2 : 1;
+  }
+
+  // A position in a method's code that jumps can go to. A label can be jumped
+  // to before it's placed; the jump's offset gets filled in when it is
+  static final class Label {
+    private int offset = -1;
+    // Where each jump to this label that's waiting to be patched starts
+    private final List<Integer> jumps = new ArrayList<>();
+  }
+
+  // The code of one method. Each instruction is written with the change it
+  // makes to the depth of the operand stack, so the method's max_stack comes
+  // out at the end. Straight-line tracking is enough because the compiler
+  // only ever jumps between points where the stack is the same depth
+  final class Method {
+    private final int access;
+    private final int name;
+    private final int descriptor;
+
+    private final Bytes code = new Bytes();
+    private int stack = 0;
+    private int maxStack = 0;
+    private int maxLocals;
+
+    private Method(int access, int name, int descriptor, int argumentSlots) {
+      this.access = access;
+      this.name = name;
+      this.descriptor = descriptor;
+      this.maxLocals = argumentSlots;
+    }
+
+    private void adjustStack(int change) {
+      stack += change;
+      maxStack = Math.max(maxStack, stack);
+    }
+
+    // An instruction with no operands
+    void op(int opcode, int stackChange) {
+      code.u1(opcode);
+      adjustStack(stackChange);
+    }
+
+    void pushInt(int value) {
+      if (value >= -1 && value <= 5) {
+        code.u1(ICONST_0 + value);
+      } else if (value >= Byte.MIN_VALUE && value <= Byte.MAX_VALUE) {
+        code.u1(BIPUSH);
+        code.u1(value);
+      } else if (value >= Short.MIN_VALUE && value <= Short.MAX_VALUE) {
+        code.u1(SIPUSH);
+        code.u2(value);
+      } else {
+        code.u1(LDC_W);
+        code.u2(integer(value));
+      }
+      adjustStack(1);
+    }
+
+    // ALOAD or ASTORE
+    void local(int opcode, int index) {
+      if (index > 0xff) {
+        code.u1(WIDE);
+        code.u1(opcode);
+        code.u2(index);
+      } else {
+        code.u1(opcode);
+        code.u1(index);
+      }
+      maxLocals = Math.max(maxLocals, index + 1);
+      adjustStack(opcode == ALOAD ? 1 : -1);
+    }
+
+    // NEW, ANEWARRAY or CHECKCAST
+    void type(int opcode, String className) {
+      code.u1(opcode);
+      code.u2(classRef(className));
+      adjustStack(opcode == NEW ? 1 : 0);
+    }
+
+    // GETSTATIC or GETFIELD, for a field that isn't a long or double
+    void field(int opcode, String owner, String name, String descriptor) {
+      code.u1(opcode);
+      code.u2(memberRef(CONSTANT_FIELDREF, owner, name, descriptor));
+      adjustStack(opcode == GETSTATIC ? 1 : 0);
+    }
+
+    // INVOKEVIRTUAL, INVOKESPECIAL or INVOKESTATIC
+    void invoke(int opcode, String owner, String name, String descriptor) {
+      code.u1(opcode);
+      code.u2(memberRef(CONSTANT_METHODREF, owner, name, descriptor));
+      int receiver = opcode == INVOKESTATIC ? 0 : 1;
+      adjustStack(returnSlots(descriptor) - argumentSlots(descriptor) - receiver);
+    }
+
+    // IFEQ, IFNE, IFNULL or GOTO
+    void jump(int opcode, Label target) {
+      int start = code.length;
+      code.u1(opcode);
+      code.u2(0);
+      adjustStack(opcode == GOTO ? 0 : -1);
+
+      if (target.offset >= 0) {
+        patch(start, target.offset);
+      } else {
+        target.jumps.add(start);
+      }
+    }
+
+    void place(Label label) {
+      label.offset = code.length;
+      for (int start : label.jumps) {
+        patch(start, label.offset);
+      }
+      label.jumps.clear();
+    }
+
+    private void patch(int start, int target) {
+      int offset = target - start;
+      if (offset < Short.MIN_VALUE || offset > Short.MAX_VALUE)
+        throw new IllegalArgumentException("Jump too large.");
+
+      code.data[start + 1] = (byte) (offset >> 8);
+      code.data[start + 2] = (byte) offset;
+    }
+
+    private void write(Bytes out) {
+      if (code.length > 0xffff)
+        throw new IllegalArgumentException("Method too large.");
+
+      out.u2(access);
+      out.u2(name);
+      out.u2(descriptor);
+      out.u2(1); // Attributes: just Code
+
+      out.u2(codeName);
+      out.u4(12 + code.length); // Everything after this in the attribute
+      out.u2(maxStack);
+      out.u2(maxLocals);
+      out.u4(code.length);
+      out.put(code.data, code.length);
+      out.u2(0); // Exception handlers
+      out.u2(0); // Attributes
+    }
+  }
+}
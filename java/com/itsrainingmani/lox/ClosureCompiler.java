@@ -0,0 +1,555 @@
+package com.itsrainingmani.lox;
+
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+/*
+An alternative backend to the tree-walking Interpreter.
+
+Instead of visiting the tree every time a node is evaluated, we visit each
+resolved Expr and Stmt exactly once, up front, and turn it into a Java lambda.
+Everything that can be decided statically gets baked into that lambda as a
+captured variable - which operator to apply, a literal's value, the (depth,
+slot) the resolver picked for a variable, and the already compiled lambdas for
+the node's children. Running the program is then just calling lambdas with the
+current environment as an argument. No double dispatch through accept() and no
+switching on token types is left at runtime.
+
+It shares the globals, the resolver's global slots and all of the runtime
+objects (LoxFunction, LoxClass, LoxInstance) with the Interpreter, so the two
+can be swapped freely with the --compile flag.
+*/
+class ClosureCompiler implements Expr.Visitor<ClosureCompiler.Code>, Stmt.Visitor<ClosureCompiler.Exec> {
+
+  // A compiled expression
+  interface Code {
+    Object run(Environment environment);
+  }
+
+  // A compiled statement. Like the Interpreter's visit methods, it reports
+  // how it completed instead of throwing for break and return
+  interface Exec {
+    Completion run(Environment environment);
+  }
+
+  private final Interpreter interpreter;
+  private final Environment globals;
+
+  ClosureCompiler(Interpreter interpreter) {
+    this.interpreter = interpreter;
+    this.globals = interpreter.globals;
+  }
+
+  void interpret(List<Stmt> statements) {
+    // Compile the whole program before running any of it
+    Exec[] program = compile(statements);
+
+    try {
+      for (Exec statement : program) {
+        statement.run(globals);
+      }
+    } catch (RuntimeError error) {
+      Lox.runtimeError(error);
+    }
+  }
+
+  String interpret(Expr expression) {
+    Code code = compile(expression);
+
+    try {
+      return Interpreter.stringify(code.run(globals));
+    } catch (RuntimeError error) {
+      Lox.runtimeError(error);
+      return null;
+    }
+  }
+
+  private Code compile(Expr expr) {
+    return expr.accept(this);
+  }
+
+  private Exec compile(Stmt stmt) {
+    return stmt.accept(this);
+  }
+
+  private Exec[] compile(List<Stmt> statements) {
+    Exec[] compiled = new Exec[statements.size()];
+    for (int i = 0; i < compiled.length; i++) {
+      compiled[i] = compile(statements.get(i));
+    }
+
+    return compiled;
+  }
+
+  // A function body runs directly in the environment that LoxFunction.call()
+  // sets up for its parameters, so unlike a block it doesn't make its own.
+  // The body is also kept on the declaration, for when a function made from it
+  // is created by code the BytecodeCompiler compiled
+  private Exec compileBody(Expr.Function function) {
+    Exec[] statements = compile(function.body);
+    Exec body = environment -> {
+      for (Exec statement : statements) {
+        Completion completion = statement.run(environment);
+        if (completion != Completion.NORMAL)
+          return completion;
+      }
+      return Completion.NORMAL;
+    };
+    function.closureBody = body;
+    return body;
+  }
+
+  @Override
+  public Code visitLiteralExpr(Expr.Literal expr) {
+    Object value = expr.value;
+    return environment -> value;
+  }
+
+  @Override
+  public Code visitLogicalExpr(Expr.Logical expr) {
+    Code left = compile(expr.left);
+    Code right = compile(expr.right);
+
+    if (expr.operator.type == TokenType.OR) {
+      return environment -> {
+        Object value = left.run(environment);
+        return Interpreter.isTruthy(value) ? value : right.run(environment);
+      };
+    }
+
+    return environment -> {
+      Object value = left.run(environment);
+      return !Interpreter.isTruthy(value) ? value : right.run(environment);
+    };
+  }
+
+  @Override
+  public Code visitGroupingExpr(Expr.Grouping expr) {
+    // Groupings only exist for the parser. There's nothing left to run
+    return compile(expr.expression);
+  }
+
+  @Override
+  public Code visitUnaryExpr(Expr.Unary expr) {
+    Code right = compile(expr.right);
+    Token operator = expr.operator;
+
+    switch (operator.type) {
+      case BANG:
+        return environment -> !Interpreter.isTruthy(right.run(environment));
+      case MINUS:
+        return environment -> {
+          Object value = right.run(environment);
+          Interpreter.checkNumberOperand(operator, value);
+          return -(double) value;
+        };
+    }
+
+    // Unreachable
+    return null;
+  }
+
+  @Override
+  public Code visitBinaryExpr(Expr.Binary expr) {
+    Code left = compile(expr.left);
+    Code right = compile(expr.right);
+    Token operator = expr.operator;
+
+    switch (operator.type) {
+      case GREATER:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a > (double) b;
+        };
+      case GREATER_EQUAL:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a >= (double) b;
+        };
+      case LESS:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a < (double) b;
+        };
+      case LESS_EQUAL:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a <= (double) b;
+        };
+      case BANG_EQUAL:
+        return environment -> !Interpreter.isEqual(left.run(environment), right.run(environment));
+      case EQUAL_EQUAL:
+        return environment -> Interpreter.isEqual(left.run(environment), right.run(environment));
+      case MINUS:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a - (double) b;
+        };
+      case PLUS:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          if (a instanceof Double && b instanceof Double) {
+            return (double) a + (double) b;
+          }
+
+          if (a instanceof String && b instanceof String) {
+            return (String) a + (String) b;
+          }
+
+          throw new RuntimeError(operator, "Operands must be two numbers or two strings.");
+        };
+      case SLASH:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a / (double) b;
+        };
+      case STAR:
+        return environment -> {
+          Object a = left.run(environment);
+          Object b = right.run(environment);
+          Interpreter.checkNumberOperands(operator, a, b);
+          return (double) a * (double) b;
+        };
+    }
+
+    // Unreachable
+    return null;
+  }
+
+  private static List<Object> runArguments(Code[] arguments, Environment environment) {
+    List<Object> values = new ArrayList<>(arguments.length);
+    for (Code argument : arguments) {
+      values.add(argument.run(environment));
+    }
+
+    return values;
+  }
+
+  @Override
+  public Code visitCallExpr(Expr.Call expr) {
+    Token paren = expr.paren;
+
+    Code[] arguments = new Code[expr.arguments.size()];
+    for (int i = 0; i < arguments.length; i++) {
+      arguments[i] = compile(expr.arguments.get(i));
+    }
+
+    // Method calls skip building a bound method, same as in the Interpreter
+    if (expr.callee instanceof Expr.Get) {
+      Expr.Get get = (Expr.Get) expr.callee;
+      Code object = compile(get.object);
+
+      return environment -> {
+        Object target = object.run(environment);
+        if (!(target instanceof LoxInstance)) {
+          throw new RuntimeError(get.name, "Only instances have properties.");
+        }
+
+        LoxInstance instance = (LoxInstance) target;
+        LoxFunction method = instance.method(get);
+        if (method == null) {
+          Object field = instance.get(get);
+          return interpreter.call(field, runArguments(arguments, environment), paren);
+        }
+
+        List<Object> values = runArguments(arguments, environment);
+        Interpreter.checkArity(method, values, paren);
+        return method.callMethod(interpreter, instance, values);
+      };
+    }
+
+    Code callee = compile(expr.callee);
+    return environment -> {
+      Object target = callee.run(environment);
+      return interpreter.call(target, runArguments(arguments, environment), paren);
+    };
+  }
+
+  @Override
+  public Code visitGetExpr(Expr.Get expr) {
+    Code object = compile(expr.object);
+    Token name = expr.name;
+
+    return environment -> {
+      Object instance = object.run(environment);
+      if (instance instanceof LoxInstance) {
+        return ((LoxInstance) instance).get(expr);
+      }
+
+      throw new RuntimeError(name, "Only instances have properties.");
+    };
+  }
+
+  @Override
+  public Code visitSetExpr(Expr.Set expr) {
+    Code object = compile(expr.object);
+    Code value = compile(expr.value);
+    Token name = expr.name;
+
+    return environment -> {
+      Object instance = object.run(environment);
+
+      if (!(instance instanceof LoxInstance)) {
+        throw new RuntimeError(name, "Only instances have fields.");
+      }
+
+      Object result = value.run(environment);
+      ((LoxInstance) instance).set(expr, result);
+      return result;
+    };
+  }
+
+  @Override
+  public Code visitSuperExpr(Expr.Super expr) {
+    int distance = expr.depth;
+    Token method = expr.method;
+
+    return environment -> {
+      LoxClass superclass = (LoxClass) environment.getAt(distance, 0);
+      LoxInstance object = (LoxInstance) environment.getAt(distance - 1, 0);
+
+      LoxFunction function = superclass.findMethod(method.lexeme());
+      if (function == null) {
+        throw new RuntimeError(method, "Undefined property '" + method.lexeme() + "'.");
+      }
+      return function.bind(object);
+    };
+  }
+
+  @Override
+  public Code visitThisExpr(Expr.This expr) {
+    int distance = expr.depth;
+    return environment -> environment.getAt(distance, 0);
+  }
+
+  @Override
+  public Code visitVariableExpr(Expr.Variable expr) {
+    Token name = expr.name;
+    int distance = expr.depth;
+    int slot = expr.slot;
+
+    if (distance == -1) {
+      return environment -> globals.get(name, slot);
+    }
+
+    return environment -> environment.getAt(distance, slot);
+  }
+
+  @Override
+  public Code visitAssignExpr(Expr.Assign expr) {
+    Code value = compile(expr.value);
+    Token name = expr.name;
+    int distance = expr.depth;
+    int slot = expr.slot;
+
+    if (distance == -1) {
+      return environment -> {
+        Object result = value.run(environment);
+        globals.assign(name, slot, result);
+        return result;
+      };
+    }
+
+    return environment -> {
+      Object result = value.run(environment);
+      environment.assignAt(distance, slot, result);
+      return result;
+    };
+  }
+
+  @Override
+  public Code visitFunctionExpr(Expr.Function expr) {
+    Exec body = compileBody(expr);
+    return environment -> new LoxFunction(null, expr, environment, false, body);
+  }
+
+  @Override
+  public Exec visitExpressionStmt(Stmt.Expression stmt) {
+    Code expression = compile(stmt.expression);
+    return environment -> {
+      expression.run(environment);
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitFunctionStmt(Stmt.Function stmt) {
+    String name = stmt.name.lexeme();
+    Expr.Function declaration = stmt.function;
+    Exec body = compileBody(declaration);
+    int slot = stmt.slot;
+
+    return environment -> {
+      environment.define(slot, new LoxFunction(name, declaration, environment, false, body));
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitPrintStmt(Stmt.Print stmt) {
+    Code expression = compile(stmt.expression);
+    return environment -> {
+      System.out.println(Interpreter.stringify(expression.run(environment)));
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitReturnStmt(Stmt.Return stmt) {
+    if (stmt.value == null) {
+      return environment -> {
+        interpreter.returnValue = null;
+        return Completion.RETURN;
+      };
+    }
+
+    Code value = compile(stmt.value);
+    return environment -> {
+      interpreter.returnValue = value.run(environment);
+      return Completion.RETURN;
+    };
+  }
+
+  @Override
+  public Exec visitVarStmt(Stmt.Var stmt) {
+    int slot = stmt.slot;
+
+    if (stmt.initializer == null) {
+      return environment -> {
+        environment.define(slot, null);
+        return Completion.NORMAL;
+      };
+    }
+
+    Code initializer = compile(stmt.initializer);
+    return environment -> {
+      environment.define(slot, initializer.run(environment));
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitWhileStmt(Stmt.While stmt) {
+    Code condition = compile(stmt.condition);
+    Exec body = compile(stmt.body);
+
+    return environment -> {
+      while (Interpreter.isTruthy(condition.run(environment))) {
+        Completion completion = body.run(environment);
+        if (completion == Completion.BREAK)
+          break;
+        if (completion == Completion.RETURN)
+          return completion;
+      }
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitBreakStmt(Stmt.Break stmt) {
+    return environment -> Completion.BREAK;
+  }
+
+  @Override
+  public Exec visitBlockStmt(Stmt.Block stmt) {
+    Exec[] statements = compile(stmt.statements);
+    int slots = stmt.slots;
+
+    return environment -> {
+      Environment inner = new Environment(environment, slots);
+      for (Exec statement : statements) {
+        Completion completion = statement.run(inner);
+        if (completion != Completion.NORMAL)
+          return completion;
+      }
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitClassStmt(Stmt.Class stmt) {
+    Code superclassCode = stmt.superclass == null ? null : compile(stmt.superclass);
+    Token superclassName = stmt.superclass == null ? null : stmt.superclass.name;
+    String name = stmt.name.lexeme();
+    int slot = stmt.slot;
+
+    int count = stmt.methods.size();
+    String[] methodNames = new String[count];
+    Expr.Function[] declarations = new Expr.Function[count];
+    Exec[] bodies = new Exec[count];
+    for (int i = 0; i < count; i++) {
+      Stmt.Function method = stmt.methods.get(i);
+      methodNames[i] = method.name.lexeme();
+      declarations[i] = method.function;
+      bodies[i] = compileBody(method.function);
+    }
+
+    return environment -> {
+      Object superclass = null;
+      if (superclassCode != null) {
+        superclass = superclassCode.run(environment);
+        if (!(superclass instanceof LoxClass)) {
+          throw new RuntimeError(superclassName, "Superclass must be a class.");
+        }
+      }
+
+      environment.define(slot, null);
+
+      // Methods of a subclass close over an extra environment holding "super"
+      Environment methodClosure = environment;
+      if (superclass != null) {
+        methodClosure = new Environment(environment, 1);
+        methodClosure.define(0, superclass);
+      }
+
+      Map<String, LoxFunction> methods = new HashMap<>();
+      for (int i = 0; i < count; i++) {
+        LoxFunction function = new LoxFunction(methodNames[i], declarations[i], methodClosure,
+            methodNames[i].equals("init"), bodies[i]);
+        methods.put(methodNames[i], function);
+      }
+
+      environment.define(slot, new LoxClass(name, (LoxClass) superclass, methods));
+      return Completion.NORMAL;
+    };
+  }
+
+  @Override
+  public Exec visitIfStmt(Stmt.If stmt) {
+    Code condition = compile(stmt.condition);
+    Exec thenBranch = compile(stmt.thenBranch);
+
+    if (stmt.elseBranch == null) {
+      return environment -> {
+        if (Interpreter.isTruthy(condition.run(environment))) {
+          return thenBranch.run(environment);
+        }
+        return Completion.NORMAL;
+      };
+    }
+
+    Exec elseBranch = compile(stmt.elseBranch);
+    return environment -> {
+      if (Interpreter.isTruthy(condition.run(environment))) {
+        return thenBranch.run(environment);
+      } else {
+        return elseBranch.run(environment);
+      }
+    };
+  }
+}
@@ -0,0 +1,11 @@
+package com.itsrainingmani.lox;
+
+// How a statement finished executing. Statements hand this back up through
+// the tree instead of throwing, so that return and break are just ordinary
+// values on the way out of executeBlock() and loops. A RETURN's value is kept
+// in Interpreter.returnValue, which means a return never allocates
+enum Completion {
+  NORMAL,
+  BREAK,
+  RETURN
+}
@@ -1,27 +1,41 @@
 package com.itsrainingmani.lox;
 
-import java.util.HashMap;
-import java.util.Map;
+import java.util.Arrays;
 
 class Environment {
 
+  // Global slots are handed out by the resolver as soon as it sees a name, so
+  // a slot can exist before the declaration that fills it has run. Reading one
+  // in that state is an "Undefined variable" error
+  static final Object UNDEFINED = new Object();
+
   // Each environment has a reference to the environment of the immediately
-  // enclosing scope. When we look up a variable, we walk that chain from
-  // innermost out until we find the variable. Starting at the inner scope
-  // is how we make local variables shadow outer ones
+  // enclosing scope. The resolver has already worked out how many hops away
+  // and at which index every local lives, so lookups just walk that many links
+  // and index straight into the array. No names are involved at runtime
   final Environment enclosing;
-  private final Map<String, Object> values = new HashMap<>();
+  private Object[] values;
 
+  // The global environment. It grows as new global names get resolved
   Environment() {
     enclosing = null;
+    values = new Object[8];
+    Arrays.fill(values, UNDEFINED);
   }
 
-  Environment(Environment enclosing) {
+  Environment(Environment enclosing, int size) {
     this.enclosing = enclosing;
+    this.values = new Object[size];
   }
 
-  void define(String name, Object value) {
-    values.put(name, value);
+  void define(int slot, Object value) {
+    if (slot >= values.length) {
+      int oldLength = values.length;
+      values = Arrays.copyOf(values, Math.max(slot + 1, oldLength * 2));
+      Arrays.fill(values, oldLength, values.length, UNDEFINED);
+    }
+
+    values[slot] = value;
   }
 
   Environment ancestor(int distance) {
@@ -33,40 +47,32 @@ class Environment {
     return environment;
   }
 
-  Object getAt(int distance, String name) {
-    return ancestor(distance).values.get(name);
+  Object getAt(int distance, int slot) {
+    return ancestor(distance).values[slot];
   }
 
-  Object get(Token name) {
-    if (values.containsKey(name.lexeme)) {
-      return values.get(name.lexeme);
-    }
+  void assignAt(int distance, int slot, Object value) {
+    ancestor(distance).values[slot] = value;
+  }
 
-    // Probably faster to iteratively walk this chain
-    // but we're going recursive here for now
-    if (enclosing != null)
-      return enclosing.get(name);
+  // Checked access for globals, since those can be referenced before (or
+  // without ever) being defined
+  Object get(Token name, int slot) {
+    if (slot < values.length && values[slot] != UNDEFINED) {
+      return values[slot];
+    }
 
-    throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
+    throw new RuntimeError(name, "Undefined variable '" + name.lexeme() + "'.");
   }
 
   // Key difference between assignment and definition is that assignment is not
   // allowed to create a new variable
-  void assign(Token name, Object value) {
-    if (values.containsKey(name.lexeme)) {
-      values.put(name.lexeme, value);
+  void assign(Token name, int slot, Object value) {
+    if (slot < values.length && values[slot] != UNDEFINED) {
+      values[slot] = value;
       return;
     }
 
-    if (enclosing != null) {
-      enclosing.assign(name, value);
-      return;
-    }
-
-    throw new RuntimeError(name, "Undefined variable '" + name.lexeme + "'.");
-  }
-
-  void assignAt(int distance, Token name, Object value) {
-    ancestor(distance).values.put(name.lexeme, value);
+    throw new RuntimeError(name, "Undefined variable '" + name.lexeme() + "'.");
   }
 }
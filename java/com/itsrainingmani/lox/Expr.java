@@ -33,6 +33,8 @@ abstract class Expr {
 
     final Token name;
     final Expr value;
+    int depth;
+    int slot;
   }
   static class Binary extends Expr {
     Binary(Expr left, Token operator, Expr right) {
@@ -49,6 +51,7 @@ abstract class Expr {
     final Expr left;
     final Token operator;
     final Expr right;
+    BinaryNode node;
   }
   static class Call extends Expr {
     Call(Expr callee, Token paren, List<Expr> arguments) {
@@ -79,6 +82,10 @@ abstract class Expr {
 
     final Expr object;
     final Token name;
+    Shape shape;
+    int slot;
+    LoxClass klass;
+    LoxFunction method;
   }
   static class Grouping extends Expr {
     Grouping(Expr expression) {
@@ -135,6 +142,9 @@ abstract class Expr {
     final Expr object;
     final Token name;
     final Expr value;
+    Shape shape;
+    Shape next;
+    int slot;
   }
   static class Super extends Expr {
     Super(Token keyword, Token method) {
@@ -149,6 +159,7 @@ abstract class Expr {
 
     final Token keyword;
     final Token method;
+    int depth;
   }
   static class This extends Expr {
     This(Token keyword) {
@@ -161,6 +172,7 @@ abstract class Expr {
     }
 
     final Token keyword;
+    int depth;
   }
   static class Unary extends Expr {
     Unary(Token operator, Expr right) {
@@ -187,6 +199,8 @@ abstract class Expr {
     }
 
     final Token name;
+    int depth;
+    int slot;
   }
   static class Function extends Expr {
     Function(List<Token> parameters, List<Stmt> body) {
@@ -201,6 +215,10 @@ abstract class Expr {
 
     final List<Token> parameters;
     final List<Stmt> body;
+    int slots;
+    ClosureCompiler.Exec closureBody;
+    int calls;
+    BytecodeCompiler.Body compiled;
   }
 
   abstract <R> R accept(Visitor<R> visitor);
@@ -5,14 +5,23 @@ import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
 
-class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
+class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Completion> {
 
   final Environment globals = new Environment(); // holds fixed reference to the outermost global environment
   private Environment environment = globals; // changes as we enter and exit local scopes. tracks current env
-  private final Map<Expr, Integer> locals = new HashMap<>();
+
+  // Every global name gets a fixed index into the globals environment. It
+  // lives here rather than in the Resolver so that it survives across REPL
+  // lines
+  private final Map<String, Integer> globalSlots = new HashMap<>();
+
+  // The value of the return statement that is currently unwinding. A return
+  // statement stores its value here and then completes with
+  // Completion.RETURN, and the enclosing function call picks it up
+  Object returnValue = null;
 
   Interpreter() {
-    globals.define("clock", new LoxCallable() {
+    globals.define(globalSlot("clock"), new LoxCallable() {
       @Override
       public int arity() {
         return 0;
@@ -38,9 +47,6 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
    * doing its own work
    */
 
-  private static class BreakException extends RuntimeException {
-  }
-
   void interpret(List<Stmt> statmenets) {
     try {
       for (Stmt statement : statmenets) {
@@ -61,8 +67,14 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     }
   }
 
-  void resolve(Expr expr, int depth) {
-    locals.put(expr, depth);
+  int globalSlot(String name) {
+    Integer slot = globalSlots.get(name);
+    if (slot == null) {
+      slot = globalSlots.size();
+      globalSlots.put(name, slot);
+    }
+
+    return slot;
   }
 
   @Override
@@ -110,7 +122,7 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     return null;
   }
 
-  private void checkNumberOperand(Token operator, Object operand) {
+  static void checkNumberOperand(Token operator, Object operand) {
     if (operand instanceof Double)
       return;
     throw new RuntimeError(operator, "Operand must be a number.");
@@ -121,76 +133,75 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     Object left = evaluate(expr.left);
     Object right = evaluate(expr.right);
 
-    switch (expr.operator.type) {
-      case GREATER:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left > (double) right;
-      case GREATER_EQUAL:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left >= (double) right;
-      case LESS:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left < (double) right;
-      case LESS_EQUAL:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left <= (double) right;
-      case BANG_EQUAL:
-        return !isEqual(left, right);
-      case EQUAL_EQUAL:
-        return isEqual(left, right);
-      case MINUS:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left - (double) right;
-      case PLUS:
-        if (left instanceof Double && right instanceof Double) {
-          return (double) left + (double) right;
-        }
-
-        if (left instanceof String && right instanceof String) {
-          return (String) left + (String) right;
-        }
-
-        throw new RuntimeError(expr.operator, "Operands must be two numbers or two strings.");
-      case SLASH:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left / (double) right;
-      case STAR:
-        checkNumberOperands(expr.operator, left, right);
-        return (double) left * (double) right;
+    // The node specializes itself to the operands it sees, see BinaryNode
+    BinaryNode node = expr.node;
+    if (node == null) {
+      node = BinaryNode.specialize(expr.operator, left, right);
+      expr.node = node;
     }
-
-    // Unreachable
-    return null;
+    return node.execute(expr, left, right);
   }
 
   @Override
   public Object visitCallExpr(Expr.Call expr) {
+    // A method call like obj.method() invokes the method directly with "this"
+    // bound, instead of first building a bound method object for the Get and
+    // then calling that
+    if (expr.callee instanceof Expr.Get) {
+      Expr.Get get = (Expr.Get) expr.callee;
+      Object object = evaluate(get.object);
+      if (!(object instanceof LoxInstance)) {
+        throw new RuntimeError(get.name, "Only instances have properties.");
+      }
+
+      LoxInstance instance = (LoxInstance) object;
+      LoxFunction method = instance.method(get);
+      if (method == null) {
+        Object field = instance.get(get);
+        return call(field, evaluateArguments(expr.arguments), expr.paren);
+      }
+
+      List<Object> arguments = evaluateArguments(expr.arguments);
+      checkArity(method, arguments, expr.paren);
+      return method.callMethod(this, instance, arguments);
+    }
+
     Object callee = evaluate(expr.callee);
+    return call(callee, evaluateArguments(expr.arguments), expr.paren);
+  }
 
+  private List<Object> evaluateArguments(List<Expr> expressions) {
     List<Object> arguments = new ArrayList<>();
 
-    for (Expr argument : expr.arguments) {
+    for (Expr argument : expressions) {
       arguments.add(evaluate(argument));
     }
 
+    return arguments;
+  }
+
+  Object call(Object callee, List<Object> arguments, Token paren) {
     if (!(callee instanceof LoxCallable)) {
-      throw new RuntimeError(expr.paren, "Can only call functions and classes.");
+      throw new RuntimeError(paren, "Can only call functions and classes.");
     }
 
     LoxCallable function = (LoxCallable) callee;
+    checkArity(function, arguments, paren);
+    return function.call(this, arguments);
+  }
+
+  static void checkArity(LoxCallable function, List<Object> arguments, Token paren) {
     if (arguments.size() != function.arity()) {
-      throw new RuntimeError(expr.paren,
+      throw new RuntimeError(paren,
           "Expected " + function.arity() + " arguments but got " + arguments.size() + ".");
     }
-
-    return function.call(this, arguments);
   }
 
   @Override
   public Object visitGetExpr(Expr.Get expr) {
     Object object = evaluate(expr.object);
     if (object instanceof LoxInstance) {
-      return ((LoxInstance) object).get(expr.name);
+      return ((LoxInstance) object).get(expr);
     }
 
     throw new RuntimeError(expr.name, "Only instances have properties.");
@@ -205,33 +216,34 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     }
 
     Object value = evaluate(expr.value);
-    ((LoxInstance) object).set(expr.name, value);
+    ((LoxInstance) object).set(expr, value);
     return value;
   }
 
   @Override
   public Object visitSuperExpr(Expr.Super expr) {
-    int distance = locals.get(expr);
-    LoxClass superclass = (LoxClass) environment.getAt(distance, "super");
+    int distance = expr.depth;
+    LoxClass superclass = (LoxClass) environment.getAt(distance, 0);
 
     // The env where "this" is bound is always right inside the env where we store
     // "super"
-    LoxInstance object = (LoxInstance) environment.getAt(distance - 1, "this");
+    LoxInstance object = (LoxInstance) environment.getAt(distance - 1, 0);
 
-    LoxFunction method = superclass.findMethod(expr.method.lexeme);
+    LoxFunction method = superclass.findMethod(expr.method.lexeme());
 
     if (method == null) {
-      throw new RuntimeError(expr.method, "Undefined property '" + expr.method.lexeme + "'.");
+      throw new RuntimeError(expr.method, "Undefined property '" + expr.method.lexeme() + "'.");
     }
     return method.bind(object);
   }
 
   @Override
   public Object visitThisExpr(Expr.This expr) {
-    return lookUpVariable(expr.keyword, expr);
+    // "this" is the only slot in the environment that bind() creates
+    return environment.getAt(expr.depth, 0);
   }
 
-  private void checkNumberOperands(Token operator, Object left, Object right) {
+  static void checkNumberOperands(Token operator, Object left, Object right) {
     if (left instanceof Double && right instanceof Double)
       return;
     throw new RuntimeError(operator, "Operands must be numbers.");
@@ -243,8 +255,8 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     return expr.accept(this);
   }
 
-  private void execute(Stmt stmt) {
-    stmt.accept(this);
+  private Completion execute(Stmt stmt) {
+    return stmt.accept(this);
   }
 
   // This method executes a list of statements in the context of a given
@@ -252,20 +264,27 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
   // Up till now, the environment field in Interpreter always pointed to the
   // global
   // env. But now it represents the current environment
-  void executeBlock(List<Stmt> statements, Environment environment) {
+  //
+  // As soon as a statement completes abruptly (break or return) we stop and
+  // hand that completion up to whoever is waiting for it
+  Completion executeBlock(List<Stmt> statements, Environment environment) {
     Environment previous = this.environment;
     try {
       this.environment = environment;
 
       for (Stmt statement : statements) {
-        execute(statement);
+        Completion completion = execute(statement);
+        if (completion != Completion.NORMAL)
+          return completion;
       }
+
+      return Completion.NORMAL;
     } finally {
       this.environment = previous;
     }
   }
 
-  private boolean isTruthy(Object object) {
+  static boolean isTruthy(Object object) {
     /*
      * Truthiness in Lox
      * Most dynamically typed languages take the universe of values
@@ -285,7 +304,7 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     return true;
   }
 
-  private boolean isEqual(Object a, Object b) {
+  static boolean isEqual(Object a, Object b) {
     // Lox doesn't do implicit conversions
     if (a == null && b == null)
       return true;
@@ -295,7 +314,7 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     return a.equals(b);
   }
 
-  private String stringify(Object object) {
+  static String stringify(Object object) {
     if (object == null)
       return "nil";
 
@@ -312,22 +331,22 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
   }
 
   @Override
-  public Void visitExpressionStmt(Stmt.Expression stmt) {
-    // unlike expressions, statmenets produce no values. so the return type
-    // of the visit methods is Void, not Object
+  public Completion visitExpressionStmt(Stmt.Expression stmt) {
+    // unlike expressions, statmenets produce no values. the visit methods
+    // only report how the statement completed
     evaluate(stmt.expression);
-    return null;
+    return Completion.NORMAL;
   }
 
   @Override
-  public Void visitFunctionStmt(Stmt.Function stmt) {
-    String fnName = stmt.name.lexeme;
+  public Completion visitFunctionStmt(Stmt.Function stmt) {
+    String fnName = stmt.name.lexeme();
 
     // This is the environment that is active when the function
     // is declared. Not when it's called. It represents the lexical scope
     // surrounding the function declaration
-    environment.define(stmt.name.lexeme, new LoxFunction(fnName, stmt.function, environment, false));
-    return null;
+    environment.define(stmt.slot, new LoxFunction(fnName, stmt.function, environment, false));
+    return Completion.NORMAL;
   }
 
   @Override
@@ -336,59 +355,62 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
   }
 
   @Override
-  public Void visitPrintStmt(Stmt.Print stmt) {
+  public Completion visitPrintStmt(Stmt.Print stmt) {
     Object value = evaluate(stmt.expression);
     System.out.println(stringify(value));
-    return null;
+    return Completion.NORMAL;
   }
 
   @Override
-  public Void visitReturnStmt(Stmt.Return stmt) {
+  public Completion visitReturnStmt(Stmt.Return stmt) {
     Object value = null;
     if (stmt.value != null)
       value = evaluate(stmt.value);
 
-    throw new Return(value);
+    returnValue = value;
+    return Completion.RETURN;
   }
 
   @Override
-  public Void visitVarStmt(Stmt.Var stmt) {
+  public Completion visitVarStmt(Stmt.Var stmt) {
     Object value = null;
     if (stmt.initializer != null) {
       value = evaluate(stmt.initializer);
     }
 
-    environment.define(stmt.name.lexeme, value);
-    return null;
+    environment.define(stmt.slot, value);
+    return Completion.NORMAL;
   }
 
   @Override
-  public Void visitWhileStmt(Stmt.While stmt) {
-    try {
-      while (isTruthy(evaluate(stmt.condition))) {
-        execute(stmt.body);
-      }
-    } catch (BreakException ex) {
+  public Completion visitWhileStmt(Stmt.While stmt) {
+    while (isTruthy(evaluate(stmt.condition))) {
+      Completion completion = execute(stmt.body);
+      if (completion == Completion.BREAK)
+        break;
+      if (completion == Completion.RETURN)
+        return completion;
     }
-    return null;
+    return Completion.NORMAL;
   }
 
   @Override
-  public Void visitBreakStmt(Stmt.Break stmt) {
-    throw new BreakException();
+  public Completion visitBreakStmt(Stmt.Break stmt) {
+    return Completion.BREAK;
   }
 
   @Override
   public Object visitVariableExpr(Expr.Variable expr) {
-    return lookUpVariable(expr.name, expr);
+    return lookUpVariable(expr.name, expr.depth, expr.slot);
   }
 
-  private Object lookUpVariable(Token name, Expr expr) {
-    Integer distance = locals.get(expr);
-    if (distance != null) {
-      return environment.getAt(distance, name.lexeme);
+  // A depth of -1 means the resolver didn't find the variable in any local
+  // scope, so the slot indexes the globals instead
+  private Object lookUpVariable(Token name, int depth, int slot) {
+    if (depth != -1) {
+      return environment.getAt(depth, slot);
     } else {
-      return globals.get(name);
+      return globals.get(name, slot);
     }
   }
 
@@ -397,24 +419,22 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
     Object value = evaluate(expr.value);
     // environment.assign(expr.name, value);
 
-    Integer distance = locals.get(expr);
-    if (distance != null) {
-      environment.assignAt(distance, expr.name, value);
+    if (expr.depth != -1) {
+      environment.assignAt(expr.depth, expr.slot, value);
     } else {
-      globals.assign(expr.name, value);
+      globals.assign(expr.name, expr.slot, value);
     }
 
     return value;
   }
 
   @Override
-  public Void visitBlockStmt(Stmt.Block stmt) {
-    executeBlock(stmt.statements, new Environment(environment));
-    return null;
+  public Completion visitBlockStmt(Stmt.Block stmt) {
+    return executeBlock(stmt.statements, new Environment(environment, stmt.slots));
   }
 
   @Override
-  public Void visitClassStmt(Stmt.Class stmt) {
+  public Completion visitClassStmt(Stmt.Class stmt) {
     Object superclass = null;
     if (stmt.superclass != null) {
       superclass = evaluate(stmt.superclass);
@@ -423,39 +443,39 @@ class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
       }
     }
 
-    environment.define(stmt.name.lexeme, null);
+    environment.define(stmt.slot, null);
 
     // When we evaluate a subclass defn, we create a new env
     if (stmt.superclass != null) {
-      environment = new Environment(environment);
-      environment.define("super", superclass);
+      environment = new Environment(environment, 1);
+      environment.define(0, superclass);
     }
 
     Map<String, LoxFunction> methods = new HashMap<>();
     for (Stmt.Function method : stmt.methods) {
-      LoxFunction function = new LoxFunction(method.name.lexeme, method.function, environment,
-          method.name.lexeme.equals("init"));
-      methods.put(method.name.lexeme, function);
+      LoxFunction function = new LoxFunction(method.name.lexeme(), method.function, environment,
+          method.name.lexeme().equals("init"));
+      methods.put(method.name.lexeme(), function);
     }
 
-    LoxClass klass = new LoxClass(stmt.name.lexeme, (LoxClass) superclass, methods);
+    LoxClass klass = new LoxClass(stmt.name.lexeme(), (LoxClass) superclass, methods);
 
     if (superclass != null) {
       environment = environment.enclosing;
     }
 
-    environment.assign(stmt.name, klass);
-    return null;
+    environment.define(stmt.slot, klass);
+    return Completion.NORMAL;
   }
 
   @Override
-  public Void visitIfStmt(Stmt.If stmt) {
+  public Completion visitIfStmt(Stmt.If stmt) {
     if (isTruthy(evaluate(stmt.condition))) {
-      execute(stmt.thenBranch);
+      return execute(stmt.thenBranch);
     } else if (stmt.elseBranch != null) {
-      execute(stmt.elseBranch);
+      return execute(stmt.elseBranch);
     }
 
-    return null;
+    return Completion.NORMAL;
   }
 }
@@ -3,32 +3,79 @@ package com.itsrainingmani.lox;
 import java.io.BufferedReader;
 import java.io.IOException;
 import java.io.InputStreamReader;
+import java.nio.charset.CharacterCodingException;
 import java.nio.charset.Charset;
 import java.nio.file.Files;
+import java.nio.file.Path;
 import java.nio.file.Paths;
+import java.util.ArrayList;
 import java.util.List;
 
 public class Lox {
   // Static field so that successive calls to run() inside a REPL
   // reuse the same interpreter (global vars)
   private static final Interpreter interpreter = new Interpreter();
+
+  // Set by --compile to run programs through the closure compiler instead of
+  // walking the tree
+  private static ClosureCompiler compiler = null;
+
+  // Set by --snapshot to save the program there instead of running it
+  private static String snapshotPath = null;
+
   static boolean hadError = false;
   static boolean hadRuntimeError = false;
 
   public static void main(String[] args) throws IOException {
-    if (args.length > 1) {
-      System.out.println("Usage: jlox [script]");
+    List<String> paths = new ArrayList<>();
+    for (int i = 0; i < args.length; i++) {
+      String arg = args[i];
+      if (arg.equals("--compile")) {
+        compiler = new ClosureCompiler(interpreter);
+      } else if (arg.equals("--jit")) {
+        BytecodeCompiler.enabled = true;
+      } else if (arg.equals("--snapshot") && i + 1 < args.length) {
+        snapshotPath = args[++i];
+      } else {
+        paths.add(arg);
+      }
+    }
+
+    if (paths.size() > 1 || (snapshotPath != null && paths.isEmpty())) {
+      System.out.println("Usage: jlox [--compile] [--jit] [--snapshot out.jlx] [script]");
       System.exit(64);
-    } else if (args.length == 1) {
-      runFile(args[0]);
+    } else if (paths.size() == 1) {
+      runFile(paths.get(0));
     } else {
       runPrompt();
     }
   }
 
   private static void runFile(String path) throws IOException {
-    byte[] bytes = Files.readAllBytes(Paths.get(path));
-    run(new String(bytes, Charset.defaultCharset()));
+    Path file = Paths.get(path);
+    if (Snapshot.isSnapshot(file)) {
+      // There's no source left in a snapshot to make another one from
+      if (snapshotPath != null) {
+        System.err.println("\"" + path + "\" is already a snapshot.");
+        System.exit(64);
+      }
+      runSnapshot(Files.readAllBytes(file));
+    } else {
+      // Unlike new String(bytes), this lets the String keep the array it read
+      // into when the script is plain ASCII, instead of copying it. It also
+      // refuses bytes the charset can't decode, which new String() quietly
+      // replaced
+      String source;
+      try {
+        source = Files.readString(file, Charset.defaultCharset());
+      } catch (CharacterCodingException error) {
+        System.err.println("\"" + path + "\" is not valid " +
+            Charset.defaultCharset() + " text.");
+        System.exit(65);
+        return;
+      }
+      run(source);
+    }
 
     // Indicate an error in the exit code
     if (hadError)
@@ -46,20 +93,33 @@ public class Lox {
       hadError = false;
 
       System.out.println("> ");
-      Scanner scanner = new Scanner(reader.readLine());
-      List<Token> tokens = scanner.scanTokens();
-
-      Parser parser = new Parser(tokens);
+      Parser parser = new Parser(new Scanner(reader.readLine()));
       Object syntax = parser.parseRepl();
 
       // Ignore it if there was a syntax error
       if (hadError)
         continue;
 
+      // Variables have to be resolved to their slots before anything can run,
+      // even for a single expression
+      Resolver resolver = new Resolver(interpreter);
       if (syntax instanceof List) {
-        interpreter.interpret((List<Stmt>) syntax);
+        resolver.resolve((List<Stmt>) syntax);
       } else if (syntax instanceof Expr) {
-        String result = interpreter.interpret((Expr) syntax);
+        resolver.resolve((Expr) syntax);
+      }
+
+      if (hadError)
+        continue;
+
+      if (syntax instanceof List) {
+        if (compiler != null) {
+          compiler.interpret((List<Stmt>) syntax);
+        } else {
+          interpreter.interpret((List<Stmt>) syntax);
+        }
+      } else if (syntax instanceof Expr) {
+        String result = compiler != null ? compiler.interpret((Expr) syntax) : interpreter.interpret((Expr) syntax);
         if (result != null) {
           System.out.println("= " + result);
         }
@@ -67,11 +127,23 @@ public class Lox {
     }
   }
 
-  private static void run(String source) {
-    Scanner scanner = new Scanner(source);
-    List<Token> tokens = scanner.scanTokens();
+  // A snapshot has already been parsed and resolved, so it goes straight to
+  // running
+  private static void runSnapshot(byte[] bytes) {
+    List<Stmt> statements;
+    try {
+      statements = Snapshot.load(bytes, interpreter);
+    } catch (IOException error) {
+      System.err.println("Could not load snapshot: " + error.getMessage());
+      hadError = true;
+      return;
+    }
+
+    execute(statements);
+  }
 
-    Parser parser = new Parser(tokens);
+  private static void run(String source) {
+    Parser parser = new Parser(new Scanner(source));
     List<Stmt> statements = parser.parse();
 
     // Stop if there was a syntax error
@@ -89,7 +161,25 @@ public class Lox {
     // System.out.println(new AstPrinter().print(statement));
     // }
 
-    interpreter.interpret(statements);
+    if (snapshotPath != null) {
+      try {
+        Files.write(Paths.get(snapshotPath), Snapshot.save(statements));
+      } catch (IOException error) {
+        System.err.println("Could not write snapshot \"" + snapshotPath + "\".");
+        hadError = true;
+      }
+      return;
+    }
+
+    execute(statements);
+  }
+
+  private static void execute(List<Stmt> statements) {
+    if (compiler != null) {
+      compiler.interpret(statements);
+    } else {
+      interpreter.interpret(statements);
+    }
   }
 
   static void error(int line, String message) {
@@ -105,7 +195,7 @@ public class Lox {
     if (token.type == TokenType.EOF) {
       report(token.line, " at end", message);
     } else {
-      report(token.line, " at '" + token.lexeme + "'", message);
+      report(token.line, " at '" + token.lexeme() + "'", message);
     }
   }
 
@@ -47,7 +47,7 @@ class LoxClass implements LoxCallable {
     LoxInstance instance = new LoxInstance(this);
     LoxFunction initializer = findMethod("init");
     if (initializer != null) {
-      initializer.bind(instance).call(interpreter, arguments);
+      initializer.callMethod(interpreter, instance, arguments);
     }
     return instance;
   }
@@ -10,46 +10,96 @@ class LoxFunction implements LoxCallable {
 
   private final boolean isInitializer;
 
+  // The function's body as compiled by ClosureCompiler, or null when running
+  // under the tree-walking Interpreter
+  private final ClosureCompiler.Exec body;
+
   LoxFunction(String name, Expr.Function declaration, Environment closure, boolean isInitializer) {
+    this(name, declaration, closure, isInitializer, null);
+  }
+
+  LoxFunction(String name, Expr.Function declaration, Environment closure, boolean isInitializer,
+      ClosureCompiler.Exec body) {
     this.name = name;
     this.closure = closure;
     this.declaration = declaration;
     this.isInitializer = isInitializer;
+    this.body = body;
   }
 
   LoxFunction bind(LoxInstance instance) {
-    Environment environment = new Environment(closure);
-    environment.define("this", instance);
-    return new LoxFunction(name, declaration, environment, isInitializer);
+    Environment environment = new Environment(closure, 1);
+    environment.define(0, instance);
+    return new LoxFunction(name, declaration, environment, isInitializer, body);
   }
 
   @Override
   public Object call(Interpreter interpreter, List<Object> arguments) {
+    return call(interpreter, closure, arguments);
+  }
+
+  // Calls the function as a method on instance. This is the same as
+  // bind(instance).call(...) but without allocating the bound LoxFunction
+  Object callMethod(Interpreter interpreter, LoxInstance instance, List<Object> arguments) {
+    Environment bound = new Environment(closure, 1);
+    bound.define(0, instance);
+    return call(interpreter, bound, arguments);
+  }
+
+  private Object call(Interpreter interpreter, Environment closure, List<Object> arguments) {
 
     // This creates an environment chain that goes from the function's body
     // out through the environments where the function is declared.
-    // all the way out to the global scope
-    Environment environment = new Environment(closure);
+    // all the way out to the global scope. Parameters take the first slots of
+    // the function's scope, in order, followed by the body's own locals
+    Environment environment = new Environment(closure, declaration.slots);
     for (int i = 0; i < declaration.parameters.size(); i++) {
-      environment.define(declaration.parameters.get(i).lexeme, arguments.get(i));
+      environment.define(i, arguments.get(i));
     }
 
-    try {
-      interpreter.executeBlock(declaration.body, environment);
-    } catch (Return returnValue) {
-      // If we are initialized and execute a return statement
-      // instead of returning the value (which will always be nil)
-      // we return this
-      if (isInitializer)
-        return closure.getAt(0, "this");
-      return returnValue.value;
+    BytecodeCompiler.Body compiled = hotBody();
+    if (compiled != null) {
+      Object value = compiled.run(interpreter, environment);
+      return isInitializer ? closure.getAt(0, 0) : value;
     }
 
+    Completion completion;
+    if (body != null) {
+      completion = body.run(environment);
+    } else {
+      completion = interpreter.executeBlock(declaration.body, environment);
+    }
+
+    // If we are an initializer, we return this even when the body executed a
+    // return statement (which can only ever return nil)
     if (isInitializer)
-      return closure.getAt(0, "this");
+      return closure.getAt(0, 0);
+
+    if (completion == Completion.RETURN) {
+      Object value = interpreter.returnValue;
+      interpreter.returnValue = null;
+      return value;
+    }
     return null;
   }
 
+  // Counts the call and, once the function is hot, compiles its body to JVM
+  // bytecode. The count and the code belong to the declaration, so every
+  // closure and bound method made from it shares them. A count of -1 means
+  // the body couldn't be compiled, so don't try again
+  private BytecodeCompiler.Body hotBody() {
+    Expr.Function function = declaration;
+    if (function.compiled != null || function.calls < 0 || !BytecodeCompiler.enabled)
+      return function.compiled;
+
+    if (++function.calls >= BytecodeCompiler.THRESHOLD) {
+      function.compiled = BytecodeCompiler.compile(function);
+      if (function.compiled == null)
+        function.calls = -1;
+    }
+    return function.compiled;
+  }
+
   @Override
   public int arity() {
     return declaration.parameters.size();
@@ -1,30 +1,89 @@
 package com.itsrainingmani.lox;
 
-import java.util.HashMap;
-import java.util.Map;
+import java.util.Arrays;
 
 class LoxInstance {
+  private static final Object[] NO_FIELDS = new Object[0];
+
   private LoxClass klass;
-  private final Map<String, Object> fields = new HashMap<>();
+
+  // Field values, laid out as described by the shape
+  private Shape shape = Shape.ROOT;
+  private Object[] fields = NO_FIELDS;
 
   LoxInstance(LoxClass klass) {
     this.klass = klass;
   }
 
-  Object get(Token name) {
-    if (fields.containsKey(name.lexeme)) {
-      return fields.get(name.lexeme);
+  // Each Get node caches what it found the last time it ran: a field index
+  // for a given shape or, if the shape has no such field, the method found on
+  // a given class. The cache is monomorphic. A miss just overwrites it.
+  private boolean hits(Expr.Get site) {
+    return site.shape == shape && (site.slot >= 0 || site.klass == klass);
+  }
+
+  private void lookUp(Expr.Get site) {
+    int slot = shape.slot(site.name.lexeme());
+    if (slot >= 0) {
+      site.shape = shape;
+      site.slot = slot;
+      site.klass = null;
+      site.method = null;
+      return;
     }
 
-    LoxFunction method = klass.findMethod(name.lexeme);
-    if (method != null)
-      return method.bind(this);
+    LoxFunction method = klass.findMethod(site.name.lexeme());
+    if (method == null) {
+      throw new RuntimeError(site.name, "Undefined property '" + site.name.lexeme() + "'.");
+    }
+
+    site.shape = shape;
+    site.slot = -1;
+    site.klass = klass;
+    site.method = method;
+  }
+
+  Object get(Expr.Get site) {
+    if (!hits(site))
+      lookUp(site);
 
-    throw new RuntimeError(name, "Undefined property '" + name.lexeme + "'.");
+    if (site.slot >= 0)
+      return fields[site.slot];
+    return site.method.bind(this);
   }
 
-  void set(Token name, Object value) {
-    fields.put(name.lexeme, value);
+  // Used for calls of the form obj.name(...). Returns the unbound method so
+  // the caller can invoke it with callMethod() without allocating a bound
+  // LoxFunction, or null if name is a field, which shadows any method
+  LoxFunction method(Expr.Get site) {
+    if (!hits(site))
+      lookUp(site);
+
+    return site.slot >= 0 ? null : site.method;
+  }
+
+  // Set nodes cache the shape they last saw along with the shape the instance
+  // ends up with afterwards (the same one unless the field is new) and the
+  // field's index
+  void set(Expr.Set site, Object value) {
+    if (site.shape != shape) {
+      Shape before = shape;
+      int slot = shape.slot(site.name.lexeme());
+      Shape after = slot >= 0 ? shape : shape.add(site.name.lexeme());
+
+      site.shape = before;
+      site.next = after;
+      site.slot = slot >= 0 ? slot : before.size;
+    }
+
+    if (site.next != shape) {
+      if (site.slot >= fields.length) {
+        fields = Arrays.copyOf(fields, Math.max(4, fields.length * 2));
+      }
+      shape = site.next;
+    }
+
+    fields[site.slot] = value;
   }
 
   @Override
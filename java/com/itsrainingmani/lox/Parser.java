@@ -67,8 +67,13 @@ class Parser {
   private boolean allowExpression;
   private boolean foundExpression = false;
 
-  private final List<Token> tokens;
-  private int current = 0;
+  // The parser pulls tokens from the scanner as it goes and only ever looks at
+  // a window of three of them: the one just consumed, the one being looked at,
+  // and one more of lookahead
+  private final Scanner scanner;
+  private Token previous = null;
+  private Token current;
+  private Token next;
 
   // should be a syntax error to use "break" outside a loop
   // we can do this by maintaining a field in the parser that
@@ -78,8 +83,10 @@ class Parser {
   private static class ParseError extends RuntimeException {
   }
 
-  Parser(List<Token> tokens) {
-    this.tokens = tokens;
+  Parser(Scanner scanner) {
+    this.scanner = scanner;
+    this.current = scanner.nextToken();
+    this.next = current.type == EOF ? current : scanner.nextToken();
   }
 
   Object parseRepl() {
@@ -548,16 +555,21 @@ class Parser {
   private boolean checkNext(TokenType tokenType) {
     if (isAtEnd())
       return false;
-    if (tokens.get(current + 1).type == EOF)
+    if (next.type == EOF)
       return false;
-    return tokens.get(current + 1).type == tokenType;
+    return next.type == tokenType;
   }
 
   // The advance() method consumes the current token and returns it, similar to
   // how our scanner’s corresponding method crawled through characters.
   private Token advance() {
-    if (!isAtEnd())
-      current++;
+    if (!isAtEnd()) {
+      previous = current;
+      current = next;
+      // Once we hit the end, keep handing out the same EOF token
+      if (next.type != EOF)
+        next = scanner.nextToken();
+    }
     return previous();
   }
 
@@ -566,11 +578,11 @@ class Parser {
   }
 
   private Token peek() {
-    return tokens.get(current);
+    return current;
   }
 
   private Token previous() {
-    return tokens.get(current - 1);
+    return previous;
   }
 
   private ParseError error(Token token, String message) {
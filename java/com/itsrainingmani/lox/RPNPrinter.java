@@ -8,7 +8,7 @@ class RPNPrinter implements Expr.Visitor<String> {
 
   @Override
   public String visitBinaryExpr(Expr.Binary expr) {
-    return expr.left.accept(this) + " " + expr.right.accept(this) + " " + expr.operator.lexeme;
+    return expr.left.accept(this) + " " + expr.right.accept(this) + " " + expr.operator.lexeme();
   }
 
   @Override
@@ -23,7 +23,7 @@ class RPNPrinter implements Expr.Visitor<String> {
 
   @Override
   public String visitUnaryExpr(Expr.Unary expr) {
-    String operator = expr.operator.lexeme;
+    String operator = expr.operator.lexeme();
     if (expr.operator.type == TokenType.MINUS) {
       // Can't use same symbol for unary and binary
       operator = "~";
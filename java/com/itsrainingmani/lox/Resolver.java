@@ -20,7 +20,7 @@ in an if stmt are visited. Logic operators are not short-circuited)
 
 class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
   private final Interpreter interpreter;
-  private final Stack<Map<String, Boolean>> scopes = new Stack<>();
+  private final Stack<Map<String, Local>> scopes = new Stack<>();
 
   // We can track whether or not the code we are currently visiting
   // is inside a function declaration
@@ -47,6 +47,20 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     SUBCLASS
   }
 
+  // A local variable's position in its scope's environment array. Slots are
+  // handed out in declaration order, which is also the order the interpreter
+  // defines them in
+  private static class Local {
+    final int slot;
+
+    // Whether or not we have finished resolving the variable's initializer
+    boolean defined = false;
+
+    Local(int slot) {
+      this.slot = slot;
+    }
+  }
+
   void resolve(List<Stmt> statements) {
     for (Stmt statement : statements) {
       resolve(statement);
@@ -57,7 +71,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
   public Void visitBlockStmt(Stmt.Block stmt) {
     beginScope();
     resolve(stmt.statements);
-    endScope();
+    stmt.slots = endScope();
     return null;
   }
 
@@ -66,10 +80,10 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     ClassType enclosingClass = currentClass;
     currentClass = ClassType.CLASS;
 
-    declare(stmt.name);
+    stmt.slot = declare(stmt.name);
     define(stmt.name);
 
-    if (stmt.superclass != null && stmt.name.lexeme.equals(stmt.superclass.name.lexeme)) {
+    if (stmt.superclass != null && stmt.name.lexeme().equals(stmt.superclass.name.lexeme())) {
       Lox.error(stmt.superclass.name, "A class can't inherit from itself.");
     }
 
@@ -80,18 +94,18 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     if (stmt.superclass != null) {
       beginScope();
-      scopes.peek().put("super", true);
+      declare("super");
     }
 
     // Whenever a this expr is envountered (atleast inside a method)
     // it will resolve to a "local" variable defined in an implicit scope
     // just outside of the block for the method body
     beginScope();
-    scopes.peek().put("this", false);
+    declare("this");
 
     for (Stmt.Function method : stmt.methods) {
       FunctionType declaration = FunctionType.METHOD;
-      if (method.name.lexeme.equals("init")) {
+      if (method.name.lexeme().equals("init")) {
         declaration = FunctionType.INITIALIZER;
       }
       resolveFunction(method.function, declaration);
@@ -113,7 +127,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
   @Override
   public Void visitFunctionStmt(Stmt.Function stmt) {
-    declare(stmt.name);
+    stmt.slot = declare(stmt.name);
     define(stmt.name);
 
     // Since we've implemented anonymous functions, we need to resolve the
@@ -159,7 +173,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
   @Override
   public Void visitVarStmt(Stmt.Var stmt) {
-    declare(stmt.name);
+    stmt.slot = declare(stmt.name);
     if (stmt.initializer != null) {
       resolve(stmt.initializer);
     }
@@ -177,7 +191,8 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
   @Override
   public Void visitAssignExpr(Expr.Assign expr) {
     resolve(expr.value);
-    resolveLocal(expr, expr.name, false);
+    expr.depth = resolveDepth(expr.name.lexeme());
+    expr.slot = resolveSlot(expr.name.lexeme(), expr.depth);
     return null;
   }
 
@@ -220,7 +235,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
       Lox.error(expr.keyword, "Can't use 'super' in a class with no superclass.");
     }
 
-    resolveLocal(expr, expr.keyword, false);
+    expr.depth = resolveDepth("super");
     return null;
   }
 
@@ -230,7 +245,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
       Lox.error(expr.keyword, "Can't use 'this' outside of a class.");
       return null;
     }
-    resolveLocal(expr, expr.keyword, false);
+    expr.depth = resolveDepth("this");
     return null;
   }
 
@@ -266,12 +281,13 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
   @Override
   public Void visitVariableExpr(Expr.Variable expr) {
-    if (!scopes.isEmpty() && scopes.peek().containsKey(expr.name.lexeme)
-        && scopes.peek().get(expr.name.lexeme) == Boolean.FALSE) {
+    if (!scopes.isEmpty() && scopes.peek().containsKey(expr.name.lexeme())
+        && !scopes.peek().get(expr.name.lexeme()).defined) {
       Lox.error(expr.name, "Can't read local variable in its own initializer.");
     }
 
-    resolveLocal(expr, expr.name, true);
+    expr.depth = resolveDepth(expr.name.lexeme());
+    expr.slot = resolveSlot(expr.name.lexeme(), expr.depth);
     return null;
   }
 
@@ -279,7 +295,7 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     stmt.accept(this);
   }
 
-  private void resolve(Expr expr) {
+  void resolve(Expr expr) {
     expr.accept(this);
   }
 
@@ -293,36 +309,41 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
       define(param);
     }
     resolve(function.body);
-    endScope();
+    function.slots = endScope();
     currentFunction = enclosingFunction;
   }
 
   private void beginScope() {
-    scopes.push(new HashMap<String, Boolean>());
+    scopes.push(new HashMap<String, Local>());
   }
 
-  private void endScope() {
-    scopes.pop();
+  // Returns how many slots the environment for this scope needs
+  private int endScope() {
+    return scopes.pop().size();
   }
 
   // Declaration adds the variable to the innermost scope
   // so that it shadows any outer one and we know that the
-  // variable exists
-  private void declare(Token name) {
+  // variable exists. Returns the slot the variable will live in, which is an
+  // index into the globals if there is no enclosing scope
+  private int declare(Token name) {
     if (scopes.isEmpty())
-      return;
+      return interpreter.globalSlot(name.lexeme());
 
-    // We mark the variable as "not ready yet" by binding
-    // its name to false in the scope map.
-    // The value associated with a key in the scope map
-    // represents whether or not we have finished resolving
-    // that variable's initializer
-    Map<String, Boolean> scope = scopes.peek();
-    if (scope.containsKey(name.lexeme)) {
+    Map<String, Local> scope = scopes.peek();
+    if (scope.containsKey(name.lexeme())) {
       Lox.error(name, "Already a variable with this name in this scope.");
     }
 
-    scope.put(name.lexeme, false);
+    return declare(name.lexeme());
+  }
+
+  // We mark the variable as "not ready yet" until define() is called
+  private int declare(String name) {
+    Map<String, Local> scope = scopes.peek();
+    Local local = new Local(scope.size());
+    scope.put(name, local);
+    return local.slot;
   }
 
   private void define(Token name) {
@@ -330,20 +351,28 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
       return;
 
     // we mark the variable as fully initialized and available for use
-    scopes.peek().put(name.lexeme, true);
+    scopes.peek().get(name.lexeme()).defined = true;
   }
 
   // We start at the innermost scope and work outwards, looking in each map
-  // for a matching name. If we find the variable, we resolve it, passing in
-  // the number o scopes between the current innermost scope and the scope
-  // where the variable was found
-  private void resolveLocal(Expr expr, Token name, boolean isRead) {
+  // for a matching name. If we find the variable, we return the number of
+  // scopes between the current innermost scope and the scope where the
+  // variable was found. Otherwise it has to be a global and we return -1
+  private int resolveDepth(String name) {
     for (int i = scopes.size() - 1; i >= 0; i--) {
-      if (scopes.get(i).containsKey(name.lexeme)) {
-        interpreter.resolve(expr, scopes.size() - 1 - i);
-        return;
+      if (scopes.get(i).containsKey(name)) {
+        return scopes.size() - 1 - i;
       }
     }
+
+    return -1;
+  }
+
+  private int resolveSlot(String name, int depth) {
+    if (depth == -1)
+      return interpreter.globalSlot(name);
+
+    return scopes.get(scopes.size() - 1 - depth).get(name).slot;
   }
 
 }
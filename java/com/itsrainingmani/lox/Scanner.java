@@ -1,58 +1,41 @@
 package com.itsrainingmani.lox;
 
-import java.util.ArrayList;
-import java.util.HashMap;
-import java.util.List;
-import java.util.Map;
-
 import static com.itsrainingmani.lox.TokenType.*;
 
 class Scanner {
   private final String source;
-  private final List<Token> tokens = new ArrayList<>();
   private int start = 0;
   private int current = 0;
   private int line = 1;
 
-  private static final Map<String, TokenType> keywords;
-
-  static {
-    keywords = new HashMap<>();
-    keywords.put("and", AND);
-    keywords.put("class", CLASS);
-    keywords.put("else", ELSE);
-    keywords.put("false", FALSE);
-    keywords.put("for", FOR);
-    keywords.put("fun", FUN);
-    keywords.put("if", IF);
-    keywords.put("nil", NIL);
-    keywords.put("or", OR);
-    keywords.put("print", PRINT);
-    keywords.put("return", RETURN);
-    keywords.put("super", SUPER);
-    keywords.put("this", THIS);
-    keywords.put("true", TRUE);
-    keywords.put("var", VAR);
-    keywords.put("while", WHILE);
-    keywords.put("break", BREAK);
-  }
+  // The token most recently produced by scanToken(), waiting to be handed out
+  // by nextToken()
+  private Token scanned = null;
 
   Scanner(String source) {
     this.source = source;
   }
 
-  // The scanner works its way through the source code, adding tokens until it
-  // runs out of characters. Then it appends one final “end of file” token. That
-  // isn’t strictly needed, but it makes our parser a little cleaner.
-  List<Token> scanTokens() {
+  // Tokens are scanned on demand, one at a time, as the parser asks for them,
+  // so we never hold the whole token list in memory and parsing can start
+  // right away. Once it runs out of characters the scanner keeps returning an
+  // “end of file” token. That isn’t strictly needed, but it makes our parser a
+  // little cleaner.
+  Token nextToken() {
     while (!isAtEnd()) {
       // We are at the beginning of the next lexeme
       start = current;
       scanToken();
+
+      // Whitespace and comments don't produce a token, so keep going
+      if (scanned != null) {
+        Token token = scanned;
+        scanned = null;
+        return token;
+      }
     }
 
-    tokens.add(new Token(EOF, "", null, line));
-    return tokens;
+    return new Token(EOF, source, current, 0, null, line);
   }
 
   private void scanToken() {
@@ -175,14 +158,71 @@ class Scanner {
     while (isAlphaNumeric(peek()))
       advance();
 
-    // addToken(IDENTIFIER);
-    String text = source.substring(start, current);
-    TokenType type = keywords.get(text);
+    addToken(identifierType());
+  }
 
-    if (type == null)
-      type = IDENTIFIER;
+  // Checks for keywords directly against the source, a character at a time,
+  // so we don't have to build a String just to look it up in a map
+  private TokenType identifierType() {
+    switch (source.charAt(start)) {
+      case 'a':
+        return checkKeyword(1, "nd", AND);
+      case 'b':
+        return checkKeyword(1, "reak", BREAK);
+      case 'c':
+        return checkKeyword(1, "lass", CLASS);
+      case 'e':
+        return checkKeyword(1, "lse", ELSE);
+      case 'f':
+        if (current - start > 1) {
+          switch (source.charAt(start + 1)) {
+            case 'a':
+              return checkKeyword(2, "lse", FALSE);
+            case 'o':
+              return checkKeyword(2, "r", FOR);
+            case 'u':
+              return checkKeyword(2, "n", FUN);
+          }
+        }
+        break;
+      case 'i':
+        return checkKeyword(1, "f", IF);
+      case 'n':
+        return checkKeyword(1, "il", NIL);
+      case 'o':
+        return checkKeyword(1, "r", OR);
+      case 'p':
+        return checkKeyword(1, "rint", PRINT);
+      case 'r':
+        return checkKeyword(1, "eturn", RETURN);
+      case 's':
+        return checkKeyword(1, "uper", SUPER);
+      case 't':
+        if (current - start > 1) {
+          switch (source.charAt(start + 1)) {
+            case 'h':
+              return checkKeyword(2, "is", THIS);
+            case 'r':
+              return checkKeyword(2, "ue", TRUE);
+          }
+        }
+        break;
+      case 'v':
+        return checkKeyword(1, "ar", VAR);
+      case 'w':
+        return checkKeyword(1, "hile", WHILE);
+    }
+
+    return IDENTIFIER;
+  }
+
+  private TokenType checkKeyword(int offset, String rest, TokenType type) {
+    if (current - start == offset + rest.length()
+        && source.regionMatches(start + offset, rest, 0, rest.length())) {
+      return type;
+    }
 
-    addToken(type);
+    return IDENTIFIER;
   }
 
   private void block() {
@@ -256,7 +296,6 @@ class Scanner {
   }
 
   private void addToken(TokenType type, Object literal) {
-    String text = source.substring(start, current);
-    tokens.add(new Token(type, text, literal, line));
+    scanned = new Token(type, source, start, current - start, literal, line);
   }
 }
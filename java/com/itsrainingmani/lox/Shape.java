@@ -0,0 +1,53 @@
+package com.itsrainingmani.lox;
+
+import java.util.HashMap;
+import java.util.Map;
+
+/*
+A shape (or "hidden class") describes the layout of an instance's fields: which
+names it has and which index in the instance's field array each one lives at.
+
+Shapes form a tree rooted at ROOT. Adding a field to an instance moves it along
+a transition to a child shape, and transitions are cached, so every instance
+that gets the same fields assigned in the same order ends up sharing a single
+Shape object. That's what lets a property access site cache "for this shape the
+field is at index n" and skip the name lookup entirely next time around.
+*/
+class Shape {
+  static final Shape ROOT = new Shape();
+
+  private final Map<String, Integer> slots;
+  private final Map<String, Shape> transitions = new HashMap<>();
+
+  // Number of fields an instance with this shape has
+  final int size;
+
+  private Shape() {
+    this.slots = new HashMap<>();
+    this.size = 0;
+  }
+
+  private Shape(Shape parent, String name) {
+    this.slots = new HashMap<>(parent.slots);
+    this.slots.put(name, parent.size);
+    this.size = parent.size + 1;
+  }
+
+  // Returns the index of the field, or -1 if instances with this shape don't
+  // have it
+  int slot(String name) {
+    Integer slot = slots.get(name);
+    return slot == null ? -1 : slot;
+  }
+
+  // The shape an instance moves to when it gets a new field
+  Shape add(String name) {
+    Shape next = transitions.get(name);
+    if (next == null) {
+      next = new Shape(this, name);
+      transitions.put(name, next);
+    }
+
+    return next;
+  }
+}
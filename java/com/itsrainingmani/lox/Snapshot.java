@@ -0,0 +1,767 @@
+package com.itsrainingmani.lox;
+
+import java.io.ByteArrayInputStream;
+import java.io.ByteArrayOutputStream;
+import java.io.DataInputStream;
+import java.io.DataOutputStream;
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.InputStream;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.util.ArrayList;
+import java.util.LinkedHashMap;
+import java.util.List;
+import java.util.Map;
+
+/*
+A program that has already been scanned, parsed and resolved, saved to a file
+with --snapshot so a later run can skip straight to interpreting it.
+
+The file holds the tree with everything the resolver filled in: the depth and
+slot of each variable and how many slots each scope needs. Every string in it
+(lexemes and string literals) is written once in a table up front, and nodes
+refer to strings by index. Numbers that are almost always small - indexes,
+slots, depths, line numbers - are written as variable-length integers.
+
+Global slots are the one thing that can't be saved as they are, since they
+belong to the interpreter and the one loading the snapshot may have handed
+them out differently. A global is saved by name only and gets its slot from
+the interpreter again on load, just as the resolver would have asked for it.
+
+A snapshot starts with a NUL byte, which no source file does, so Lox can tell
+the two apart.
+*/
+final class Snapshot {
+
+  private static final int MAGIC = 0x004a4c58; // "\0JLX"
+  private static final int VERSION = 1;
+
+  // Tags for each kind of node. 0 is a missing one, like an if without an else
+  private static final int NONE = 0;
+
+  private static final int ASSIGN = 1;
+  private static final int BINARY = 2;
+  private static final int CALL = 3;
+  private static final int GET = 4;
+  private static final int GROUPING = 5;
+  private static final int LITERAL = 6;
+  private static final int LOGICAL = 7;
+  private static final int SET = 8;
+  private static final int SUPER = 9;
+  private static final int THIS = 10;
+  private static final int UNARY = 11;
+  private static final int VARIABLE = 12;
+  private static final int FUNCTION_EXPR = 13;
+
+  private static final int BLOCK = 1;
+  private static final int CLASS = 2;
+  private static final int BREAK = 3;
+  private static final int EXPRESSION = 4;
+  private static final int FUNCTION = 5;
+  private static final int IF = 6;
+  private static final int PRINT = 7;
+  private static final int RETURN = 8;
+  private static final int VAR = 9;
+  private static final int WHILE = 10;
+
+  // Literal values
+  private static final int NIL = 0;
+  private static final int FALSE = 1;
+  private static final int TRUE = 2;
+  private static final int NUMBER = 3;
+  private static final int STRING = 4;
+
+  static boolean isSnapshot(byte[] bytes) {
+    return bytes.length >= 4 && bytes[0] == 0 && bytes[1] == 'J' && bytes[2] == 'L' && bytes[3] == 'X';
+  }
+
+  // Only reads as far as the magic number, so a script can then be read
+  // straight into a String
+  static boolean isSnapshot(Path path) throws IOException {
+    try (InputStream in = Files.newInputStream(path)) {
+      return isSnapshot(in.readNBytes(4));
+    }
+  }
+
+  static byte[] save(List<Stmt> statements) {
+    return new Writer().writeProgram(statements);
+  }
+
+  // Throws an IOException if the bytes aren't a snapshot this version of
+  // jlox can read
+  static List<Stmt> load(byte[] bytes, Interpreter interpreter) throws IOException {
+    try {
+      return new Reader(bytes, interpreter).readProgram();
+    } catch (EOFException error) {
+      // The file ends partway through a node
+      throw new IOException("Corrupt snapshot.");
+    }
+  }
+
+  private static final class Writer implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
+    private final ByteArrayOutputStream bytes = new ByteArrayOutputStream();
+    private final DataOutputStream out = new DataOutputStream(bytes);
+    private final Map<String, Integer> strings = new LinkedHashMap<>();
+
+    // Whether declarations are at the top level, where their slots are globals
+    private boolean global = true;
+
+    byte[] writeProgram(List<Stmt> statements) {
+      try {
+        writeStatements(statements);
+
+        ByteArrayOutputStream file = new ByteArrayOutputStream();
+        DataOutputStream header = new DataOutputStream(file);
+        header.writeInt(MAGIC);
+        writeInt(header, VERSION);
+        writeInt(header, strings.size());
+        for (String string : strings.keySet()) {
+          byte[] utf8 = string.getBytes(StandardCharsets.UTF_8);
+          writeInt(header, utf8.length);
+          header.write(utf8);
+        }
+
+        out.flush();
+        bytes.writeTo(file);
+        return file.toByteArray();
+      } catch (IOException error) {
+        // Only ever writing to memory
+        throw new IllegalStateException(error);
+      }
+    }
+
+    private void write(int value) {
+      try {
+        writeInt(out, value);
+      } catch (IOException error) {
+        throw new IllegalStateException(error);
+      }
+    }
+
+    private void writeString(String string) {
+      Integer index = strings.get(string);
+      if (index == null) {
+        index = strings.size();
+        strings.put(string, index);
+      }
+      write(index);
+    }
+
+    private void writeToken(Token token) {
+      write(token.type.ordinal());
+      writeString(token.lexeme());
+      write(token.line);
+    }
+
+    private void writeExpr(Expr expr) {
+      if (expr == null) {
+        write(NONE);
+      } else {
+        expr.accept(this);
+      }
+    }
+
+    private void writeStmt(Stmt stmt) {
+      if (stmt == null) {
+        write(NONE);
+      } else {
+        stmt.accept(this);
+      }
+    }
+
+    private void writeExprs(List<Expr> exprs) {
+      write(exprs.size());
+      for (Expr expr : exprs) {
+        writeExpr(expr);
+      }
+    }
+
+    private void writeStatements(List<Stmt> statements) {
+      write(statements.size());
+      for (Stmt statement : statements) {
+        writeStmt(statement);
+      }
+    }
+
+    // Where a variable is, with depth -1 for a global written as 0
+    private void writeVariable(int depth, int slot) {
+      write(depth + 1);
+      if (depth != -1)
+        write(slot);
+    }
+
+    private void writeDeclaration(int slot) {
+      if (!global)
+        write(slot);
+    }
+
+    @Override
+    public Void visitAssignExpr(Expr.Assign expr) {
+      write(ASSIGN);
+      writeToken(expr.name);
+      writeExpr(expr.value);
+      writeVariable(expr.depth, expr.slot);
+      return null;
+    }
+
+    @Override
+    public Void visitBinaryExpr(Expr.Binary expr) {
+      write(BINARY);
+      writeExpr(expr.left);
+      writeToken(expr.operator);
+      writeExpr(expr.right);
+      return null;
+    }
+
+    @Override
+    public Void visitCallExpr(Expr.Call expr) {
+      write(CALL);
+      writeExpr(expr.callee);
+      writeToken(expr.paren);
+      writeExprs(expr.arguments);
+      return null;
+    }
+
+    @Override
+    public Void visitGetExpr(Expr.Get expr) {
+      write(GET);
+      writeExpr(expr.object);
+      writeToken(expr.name);
+      return null;
+    }
+
+    @Override
+    public Void visitGroupingExpr(Expr.Grouping expr) {
+      write(GROUPING);
+      writeExpr(expr.expression);
+      return null;
+    }
+
+    @Override
+    public Void visitLiteralExpr(Expr.Literal expr) {
+      write(LITERAL);
+      Object value = expr.value;
+      if (value == null) {
+        write(NIL);
+      } else if (value instanceof Boolean) {
+        write((boolean) value ? TRUE : FALSE);
+      } else if (value instanceof Double) {
+        write(NUMBER);
+        try {
+          out.writeDouble((double) value);
+        } catch (IOException error) {
+          throw new IllegalStateException(error);
+        }
+      } else {
+        write(STRING);
+        writeString((String) value);
+      }
+      return null;
+    }
+
+    @Override
+    public Void visitLogicalExpr(Expr.Logical expr) {
+      write(LOGICAL);
+      writeExpr(expr.left);
+      writeToken(expr.operator);
+      writeExpr(expr.right);
+      return null;
+    }
+
+    @Override
+    public Void visitSetExpr(Expr.Set expr) {
+      write(SET);
+      writeExpr(expr.object);
+      writeToken(expr.name);
+      writeExpr(expr.value);
+      return null;
+    }
+
+    @Override
+    public Void visitSuperExpr(Expr.Super expr) {
+      write(SUPER);
+      writeToken(expr.keyword);
+      writeToken(expr.method);
+      write(expr.depth);
+      return null;
+    }
+
+    @Override
+    public Void visitThisExpr(Expr.This expr) {
+      write(THIS);
+      writeToken(expr.keyword);
+      write(expr.depth);
+      return null;
+    }
+
+    @Override
+    public Void visitUnaryExpr(Expr.Unary expr) {
+      write(UNARY);
+      writeToken(expr.operator);
+      writeExpr(expr.right);
+      return null;
+    }
+
+    @Override
+    public Void visitVariableExpr(Expr.Variable expr) {
+      write(VARIABLE);
+      writeToken(expr.name);
+      writeVariable(expr.depth, expr.slot);
+      return null;
+    }
+
+    @Override
+    public Void visitFunctionExpr(Expr.Function expr) {
+      write(FUNCTION_EXPR);
+      writeFunction(expr);
+      return null;
+    }
+
+    private void writeFunction(Expr.Function function) {
+      write(function.parameters.size());
+      for (Token parameter : function.parameters) {
+        writeToken(parameter);
+      }
+
+      boolean enclosing = global;
+      global = false;
+      writeStatements(function.body);
+      global = enclosing;
+      write(function.slots);
+    }
+
+    @Override
+    public Void visitBlockStmt(Stmt.Block stmt) {
+      write(BLOCK);
+      boolean enclosing = global;
+      global = false;
+      writeStatements(stmt.statements);
+      global = enclosing;
+      write(stmt.slots);
+      return null;
+    }
+
+    @Override
+    public Void visitClassStmt(Stmt.Class stmt) {
+      write(CLASS);
+      writeToken(stmt.name);
+      writeExpr(stmt.superclass);
+
+      boolean enclosing = global;
+      global = false;
+      write(stmt.methods.size());
+      for (Stmt.Function method : stmt.methods) {
+        writeToken(method.name);
+        writeFunction(method.function);
+        write(method.slot);
+      }
+      global = enclosing;
+
+      writeDeclaration(stmt.slot);
+      return null;
+    }
+
+    @Override
+    public Void visitBreakStmt(Stmt.Break stmt) {
+      write(BREAK);
+      return null;
+    }
+
+    @Override
+    public Void visitExpressionStmt(Stmt.Expression stmt) {
+      write(EXPRESSION);
+      writeExpr(stmt.expression);
+      return null;
+    }
+
+    @Override
+    public Void visitFunctionStmt(Stmt.Function stmt) {
+      write(FUNCTION);
+      writeToken(stmt.name);
+      writeFunction(stmt.function);
+      writeDeclaration(stmt.slot);
+      return null;
+    }
+
+    @Override
+    public Void visitIfStmt(Stmt.If stmt) {
+      write(IF);
+      writeExpr(stmt.condition);
+      writeStmt(stmt.thenBranch);
+      writeStmt(stmt.elseBranch);
+      return null;
+    }
+
+    @Override
+    public Void visitPrintStmt(Stmt.Print stmt) {
+      write(PRINT);
+      writeExpr(stmt.expression);
+      return null;
+    }
+
+    @Override
+    public Void visitReturnStmt(Stmt.Return stmt) {
+      write(RETURN);
+      writeToken(stmt.keyword);
+      writeExpr(stmt.value);
+      return null;
+    }
+
+    @Override
+    public Void visitVarStmt(Stmt.Var stmt) {
+      write(VAR);
+      writeToken(stmt.name);
+      writeExpr(stmt.initializer);
+      writeDeclaration(stmt.slot);
+      return null;
+    }
+
+    @Override
+    public Void visitWhileStmt(Stmt.While stmt) {
+      write(WHILE);
+      writeExpr(stmt.condition);
+      writeStmt(stmt.body);
+      return null;
+    }
+  }
+
+  // Reads the tree back in the same order the Writer wrote it. Nothing read
+  // is trusted: a node missing where one is required, an operator its node
+  // can't have, or a variable outside the scopes around it all mean the file
+  // is corrupt, rather than a crash once the program runs
+  private static final class Reader {
+    private final DataInputStream in;
+    private final Interpreter interpreter;
+    private String[] strings;
+
+    // For each scope we're inside, innermost last, how many slots it needs for
+    // the variables read so far. Functions and blocks only say how many they
+    // have after their bodies, so that's when the check happens. Empty at the
+    // top level, where declarations are globals
+    private final List<Integer> scopes = new ArrayList<>();
+
+    Reader(byte[] bytes, Interpreter interpreter) {
+      this.in = new DataInputStream(new ByteArrayInputStream(bytes));
+      this.interpreter = interpreter;
+    }
+
+    List<Stmt> readProgram() throws IOException {
+      if (in.readInt() != MAGIC || readInt(in) != VERSION) {
+        throw new IOException("Not a snapshot for this version of jlox.");
+      }
+
+      strings = new String[readLength()];
+      for (int i = 0; i < strings.length; i++) {
+        byte[] utf8 = new byte[readLength()];
+        in.readFully(utf8);
+        strings[i] = new String(utf8, StandardCharsets.UTF_8);
+      }
+
+      return readStatements();
+    }
+
+    private int read() throws IOException {
+      return readInt(in);
+    }
+
+    // A count of things that follow. Each takes at least a byte, so a count
+    // bigger than what's left can only come from a corrupt file, and would
+    // otherwise have us allocate for it before finding out
+    private int readLength() throws IOException {
+      int length = read();
+      if (length > in.available())
+        throw new IOException("Corrupt snapshot.");
+      return length;
+    }
+
+    private String readString() throws IOException {
+      int index = read();
+      if (index >= strings.length)
+        throw new IOException("Corrupt snapshot.");
+      return strings[index];
+    }
+
+    private Token readToken() throws IOException {
+      int type = read();
+      if (type >= TokenType.values().length)
+        throw new IOException("Corrupt snapshot.");
+      return new Token(TokenType.values()[type], readString(), null, read());
+    }
+
+    // A token the interpreter switches on, which has to be one it handles
+    private Token readOperator(TokenType... types) throws IOException {
+      Token token = readToken();
+      for (TokenType type : types) {
+        if (token.type == type)
+          return token;
+      }
+      throw new IOException("Corrupt snapshot.");
+    }
+
+    private void beginScope() {
+      scopes.add(0);
+    }
+
+    private void endScope(int slots) throws IOException {
+      if (scopes.remove(scopes.size() - 1) > slots)
+        throw new IOException("Corrupt snapshot.");
+    }
+
+    // Records that the scope depth levels out has to have the slot
+    private void useSlot(int depth, int slot) throws IOException {
+      if (depth >= scopes.size())
+        throw new IOException("Corrupt snapshot.");
+      int scope = scopes.size() - 1 - depth;
+      scopes.set(scope, Math.max(scopes.get(scope), slot + 1));
+    }
+
+    // Where a variable is, as written by writeVariable(). A global's slot
+    // comes from the interpreter
+    private int readSlot(Token name, int depth) throws IOException {
+      if (depth == -1)
+        return interpreter.globalSlot(name.lexeme());
+      int slot = read();
+      useSlot(depth, slot);
+      return slot;
+    }
+
+    private List<Stmt> readStatements() throws IOException {
+      int count = readLength();
+      List<Stmt> statements = new ArrayList<>(count);
+      for (int i = 0; i < count; i++) {
+        statements.add(readStmt());
+      }
+      return statements;
+    }
+
+    private List<Expr> readExprs() throws IOException {
+      int count = readLength();
+      List<Expr> exprs = new ArrayList<>(count);
+      for (int i = 0; i < count; i++) {
+        exprs.add(readExpr());
+      }
+      return exprs;
+    }
+
+    private int readDeclaration(Token name) throws IOException {
+      if (scopes.isEmpty())
+        return interpreter.globalSlot(name.lexeme());
+      int slot = read();
+      useSlot(0, slot);
+      return slot;
+    }
+
+    private Expr.Function readFunction() throws IOException {
+      int arity = readLength();
+      List<Token> parameters = new ArrayList<>(arity);
+      for (int i = 0; i < arity; i++) {
+        parameters.add(readToken());
+      }
+
+      // The parameters are the first slots of the function's scope
+      beginScope();
+      if (arity > 0)
+        useSlot(0, arity - 1);
+      Expr.Function function = new Expr.Function(parameters, readStatements());
+      function.slots = read();
+      endScope(function.slots);
+      return function;
+    }
+
+    // For the places a node can be left out: a class without a superclass,
+    // an if without an else, a bare return, and a var without an initializer
+    private Expr readOptionalExpr() throws IOException {
+      return readExpr(true);
+    }
+
+    private Stmt readOptionalStmt() throws IOException {
+      return readStmt(true);
+    }
+
+    private Expr readExpr() throws IOException {
+      return readExpr(false);
+    }
+
+    private Stmt readStmt() throws IOException {
+      return readStmt(false);
+    }
+
+    private Expr readExpr(boolean optional) throws IOException {
+      int tag = read();
+      switch (tag) {
+        case NONE:
+          if (!optional)
+            throw new IOException("Corrupt snapshot.");
+          return null;
+        case ASSIGN: {
+          Token name = readToken();
+          Expr.Assign assign = new Expr.Assign(name, readExpr());
+          assign.depth = read() - 1;
+          assign.slot = readSlot(name, assign.depth);
+          return assign;
+        }
+        case BINARY:
+          return new Expr.Binary(readExpr(),
+              readOperator(TokenType.BANG_EQUAL, TokenType.EQUAL_EQUAL,
+                  TokenType.GREATER, TokenType.GREATER_EQUAL, TokenType.LESS,
+                  TokenType.LESS_EQUAL, TokenType.MINUS, TokenType.PLUS,
+                  TokenType.SLASH, TokenType.STAR),
+              readExpr());
+        case CALL:
+          return new Expr.Call(readExpr(), readToken(), readExprs());
+        case GET:
+          return new Expr.Get(readExpr(), readToken());
+        case GROUPING:
+          return new Expr.Grouping(readExpr());
+        case LITERAL:
+          return new Expr.Literal(readValue());
+        case LOGICAL:
+          return new Expr.Logical(readExpr(),
+              readOperator(TokenType.AND, TokenType.OR), readExpr());
+        case SET:
+          return new Expr.Set(readExpr(), readToken(), readExpr());
+        case SUPER: {
+          // "super" is the only slot of its scope, and "this" is the only one
+          // of the scope just inside it
+          Expr.Super expr = new Expr.Super(readToken(), readToken());
+          expr.depth = read();
+          if (expr.depth == 0)
+            throw new IOException("Corrupt snapshot.");
+          useSlot(expr.depth, 0);
+          useSlot(expr.depth - 1, 0);
+          return expr;
+        }
+        case THIS: {
+          Expr.This expr = new Expr.This(readToken());
+          expr.depth = read();
+          useSlot(expr.depth, 0);
+          return expr;
+        }
+        case UNARY:
+          return new Expr.Unary(
+              readOperator(TokenType.BANG, TokenType.MINUS), readExpr());
+        case VARIABLE: {
+          Expr.Variable variable = new Expr.Variable(readToken());
+          variable.depth = read() - 1;
+          variable.slot = readSlot(variable.name, variable.depth);
+          return variable;
+        }
+        case FUNCTION_EXPR:
+          return readFunction();
+        default:
+          throw new IOException("Corrupt snapshot.");
+      }
+    }
+
+    private Object readValue() throws IOException {
+      switch (read()) {
+        case NIL:
+          return null;
+        case FALSE:
+          return false;
+        case TRUE:
+          return true;
+        case NUMBER:
+          return in.readDouble();
+        case STRING:
+          return readString();
+        default:
+          throw new IOException("Corrupt snapshot.");
+      }
+    }
+
+    private Stmt readStmt(boolean optional) throws IOException {
+      int tag = read();
+      switch (tag) {
+        case NONE:
+          if (!optional)
+            throw new IOException("Corrupt snapshot.");
+          return null;
+        case BLOCK: {
+          beginScope();
+          Stmt.Block block = new Stmt.Block(readStatements());
+          block.slots = read();
+          endScope(block.slots);
+          return block;
+        }
+        case CLASS: {
+          Token name = readToken();
+          Expr superclass = readOptionalExpr();
+          if (superclass != null && !(superclass instanceof Expr.Variable))
+            throw new IOException("Corrupt snapshot.");
+
+          // The methods are inside a scope holding "super", if there's a
+          // superclass, and one inside that holding "this"
+          if (superclass != null)
+            beginScope();
+          beginScope();
+          int count = readLength();
+          List<Stmt.Function> methods = new ArrayList<>(count);
+          for (int i = 0; i < count; i++) {
+            Stmt.Function method = new Stmt.Function(readToken(), readFunction());
+            method.slot = read();
+            methods.add(method);
+          }
+          endScope(1);
+          if (superclass != null)
+            endScope(1);
+
+          Stmt.Class klass = new Stmt.Class(name, (Expr.Variable) superclass, methods);
+          klass.slot = readDeclaration(name);
+          return klass;
+        }
+        case BREAK:
+          return new Stmt.Break();
+        case EXPRESSION:
+          return new Stmt.Expression(readExpr());
+        case FUNCTION: {
+          Stmt.Function function = new Stmt.Function(readToken(), readFunction());
+          function.slot = readDeclaration(function.name);
+          return function;
+        }
+        case IF:
+          return new Stmt.If(readExpr(), readStmt(), readOptionalStmt());
+        case PRINT:
+          return new Stmt.Print(readExpr());
+        case RETURN:
+          return new Stmt.Return(readToken(), readOptionalExpr());
+        case VAR: {
+          Stmt.Var var = new Stmt.Var(readToken(), readOptionalExpr());
+          var.slot = readDeclaration(var.name);
+          return var;
+        }
+        case WHILE:
+          return new Stmt.While(readExpr(), readStmt());
+        default:
+          throw new IOException("Corrupt snapshot.");
+      }
+    }
+  }
+
+  // Unsigned LEB128: seven bits at a time, low ones first, with the top bit
+  // set on every byte but the last
+  private static void writeInt(DataOutputStream out, int value) throws IOException {
+    while ((value & ~0x7f) != 0) {
+      out.writeByte((value & 0x7f) | 0x80);
+      value >>>= 7;
+    }
+    out.writeByte(value);
+  }
+
+  // Nothing written is ever negative, so a fifth byte can only hold the three
+  // bits left below the sign bit. Anything more means the file is corrupt
+  private static int readInt(DataInputStream in) throws IOException {
+    int value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+      int b = in.readUnsignedByte();
+      if (shift == 28 && b > 0x07)
+        break;
+      value |= (b & 0x7f) << shift;
+      if ((b & 0x80) == 0)
+        return value;
+    }
+    throw new IOException("Corrupt snapshot.");
+  }
+}
@@ -28,6 +28,7 @@ abstract class Stmt {
     }
 
     final List<Stmt> statements;
+    int slots;
   }
   static class Class extends Stmt {
     Class(Token name, Expr.Variable superclass, List<Stmt.Function> methods) {
@@ -44,6 +45,7 @@ abstract class Stmt {
     final Token name;
     final Expr.Variable superclass;
     final List<Stmt.Function> methods;
+    int slot;
   }
   static class Break extends Stmt {
     Break() {
@@ -80,6 +82,7 @@ abstract class Stmt {
 
     final Token name;
     final Expr.Function function;
+    int slot;
   }
   static class If extends Stmt {
     If(Expr condition, Stmt thenBranch, Stmt elseBranch) {
@@ -136,6 +139,7 @@ abstract class Stmt {
 
     final Token name;
     final Expr initializer;
+    int slot;
   }
   static class While extends Stmt {
     While(Expr condition, Stmt body) {
@@ -2,18 +2,42 @@ package com.itsrainingmani.lox;
 
 class Token {
   final TokenType type;
-  final String lexeme;
   final Object literal;
   final int line;
 
-  Token(TokenType type, String lexeme, Object literal, int line) {
+  // Rather than copying every lexeme into its own String, a token just points
+  // at its slice of the source. Most tokens (punctuation, keywords) never need
+  // their text at all, and the ones that do (identifiers, mostly) only pay for
+  // the substring the first time lexeme() is called
+  private final String source;
+  private final int start;
+  private final int length;
+  private String lexeme;
+
+  Token(TokenType type, String source, int start, int length, Object literal, int line) {
     this.type = type;
-    this.lexeme = lexeme;
+    this.source = source;
+    this.start = start;
+    this.length = length;
     this.literal = literal;
     this.line = line;
   }
 
+  // For tokens that don't come from a source string
+  Token(TokenType type, String lexeme, Object literal, int line) {
+    this(type, lexeme, 0, lexeme.length(), literal, line);
+    this.lexeme = lexeme;
+  }
+
+  String lexeme() {
+    if (lexeme == null) {
+      lexeme = source.substring(start, start + length);
+    }
+
+    return lexeme;
+  }
+
   public String toString() {
-    return type + " " + lexeme + " " + literal;
+    return type + " " + lexeme() + " " + literal;
   }
 }
@@ -14,32 +14,36 @@ public class GenerateAst {
 
     String outputDir = args[0];
     defineAst(outputDir, "Expr", Arrays.asList(
-        "Assign   : Token name, Expr value",
-        "Binary   : Expr left, Token operator, Expr right",
+        "Assign   : Token name, Expr value | int depth, int slot",
+        "Binary   : Expr left, Token operator, Expr right | BinaryNode node",
         "Call     : Expr callee, Token paren, List<Expr> arguments",
-        "Get      : Expr object, Token name",
+        "Get      : Expr object, Token name" +
+            " | Shape shape, int slot, LoxClass klass, LoxFunction method",
         "Grouping : Expr expression",
         "Literal  : Object value",
         "Logical  : Expr left, Token operator, Expr right",
-        "Set      : Expr object, Token name, Expr value",
-        "Super    : Token keyword, Token method",
-        "This     : Token keyword",
+        "Set      : Expr object, Token name, Expr value" +
+            " | Shape shape, Shape next, int slot",
+        "Super    : Token keyword, Token method | int depth",
+        "This     : Token keyword | int depth",
         "Unary    : Token operator, Expr right",
-        "Variable : Token name",
-        "Function : List<Token> parameters, List<Stmt> body"));
+        "Variable : Token name | int depth, int slot",
+        "Function : List<Token> parameters, List<Stmt> body" +
+            " | int slots, ClosureCompiler.Exec closureBody, int calls," +
+            " BytecodeCompiler.Body compiled"));
 
     defineAst(outputDir, "Stmt", Arrays.asList(
-        "Block  : List<Stmt> statements",
+        "Block  : List<Stmt> statements | int slots",
         "Class      : Token name, Expr.Variable superclass," +
-            " List<Stmt.Function> methods",
+            " List<Stmt.Function> methods | int slot",
         "Break      : ",
         "Expression : Expr expression",
-        "Function   : Token name, Expr.Function function",
+        "Function   : Token name, Expr.Function function | int slot",
         "If         : Expr condition, Stmt thenBranch," +
             " Stmt elseBranch",
         "Print      : Expr expression",
         "Return     : Token keyword, Expr value",
-        "Var        : Token name, Expr initializer",
+        "Var        : Token name, Expr initializer | int slot",
         "While      : Expr condition, Stmt body"));
   }
 
@@ -60,9 +64,15 @@ public class GenerateAst {
     // The AST classes
     for (String type : types) {
       String className = type.split(":")[0].trim();
-      String fields = type.split(":")[1].trim();
 
-      defineType(writer, baseName, className, fields);
+      // Anything after a '|' is filled in after parsing, either by the
+      // resolver or by the interpreter's inline caches, so it stays out of the
+      // constructor and isn't final
+      String[] parts = type.split(":")[1].split("\\|");
+      String fields = parts[0].trim();
+      String resolved = parts.length > 1 ? parts[1].trim() : "";
+
+      defineType(writer, baseName, className, fields, resolved);
     }
 
     // The base accept() method
@@ -89,7 +99,8 @@ public class GenerateAst {
   }
 
   private static void defineType(
-      PrintWriter writer, String baseName, String className, String fieldList) {
+      PrintWriter writer, String baseName, String className, String fieldList,
+      String resolvedList) {
     writer.println("  static class " + className + " extends " + baseName + " {");
 
     // Constructor
@@ -125,6 +136,12 @@ public class GenerateAst {
       writer.println("    final " + field + ";");
     }
 
+    if (!resolvedList.isEmpty()) {
+      for (String field : resolvedList.split(", ")) {
+        writer.println("    " + field + ";");
+      }
+    }
+
     writer.println("  }");
   }
 }
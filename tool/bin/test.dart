@@ -437,10 +437,12 @@ void _defineTestSuites() {
     _cSuites.add(name);
   }
 
-  void java(String name, Map<String, String> tests) {
-    var dir = name == "jlox" ? "build/java" : "build/gen/$name";
+  void java(String name, Map<String, String> tests,
+      [List<String> flags = const [], List<String> jvmFlags = const []]) {
+    var dir = name.startsWith("jlox") ? "build/java" : "build/gen/$name";
     _allSuites[name] = Suite(name, "java", "java",
-        ["-cp", dir, "com.itsrainingmani.lox.Lox"], tests);
+        [...jvmFlags, "-cp", dir, "com.itsrainingmani.lox.Lox", ...flags],
+        tests);
     _javaSuites.add(name);
   }
 
@@ -467,6 +469,24 @@ void _defineTestSuites() {
     "test/limit/stack_overflow.lox": "skip",
   };
 
+  // Features only clox has.
+  var noJavaCloxOnlyFeatures = {
+    // No tail call elimination in jlox.
+    "test/function/tail_recursion.lox": "skip",
+
+    // No modules in jlox.
+    "test/import": "skip",
+
+    // No fibers in jlox.
+    "test/fiber": "skip",
+
+    // No lists in jlox.
+    "test/list": "skip",
+
+    // No maps in jlox.
+    "test/map": "skip",
+  };
+
   // No classes in Java yet.
   var noJavaClasses = {
     "test/assignment/to_this.lox": "skip",
@@ -591,12 +611,22 @@ void _defineTestSuites() {
     "test/super": "skip",
   };
 
-  java("jlox", {
+  var jloxTests = {
     "test": "pass",
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
-  });
+    ...noJavaCloxOnlyFeatures,
+  };
+
+  java("jlox", jloxTests);
+
+  // The same interpreter running programs through the closure compiler.
+  java("jlox_compile", jloxTests, ["--compile"]);
+
+  // And with every function compiled to JVM bytecode on its first call, so
+  // the whole suite runs through the JIT tier.
+  java("jlox_jit", jloxTests, ["--jit"], ["-Djlox.jitThreshold=1"]);
 
   java("chap04_scanning", {
     // No interpreter yet.
@@ -623,6 +653,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
     ...noJavaFunctions,
     ...noJavaResolution,
     ...noJavaClasses,
@@ -641,6 +672,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
     ...noJavaFunctions,
     ...noJavaResolution,
     ...noJavaClasses,
@@ -651,6 +683,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
     ...noJavaResolution,
     ...noJavaClasses,
   });
@@ -660,6 +693,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
     ...noJavaClasses,
   });
 
@@ -667,6 +701,7 @@ void _defineTestSuites() {
     "test": "pass",
     ...earlyChapters,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
     ...javaNaNEquality,
 
     // No inheritance.
@@ -684,6 +719,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noJavaCloxOnlyFeatures,
   });
 
   c("clox", {
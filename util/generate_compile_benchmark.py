@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# Writes a large, valid Lox script to stdout for measuring how fast clox
+# compiles. Nothing in it is meant to be run, only compiled:
+#
+#   python3 util/generate_compile_benchmark.py > build/compile.lox
+#   ./clox --compile-only --stats build/compile.lox
+#
+# The optional argument is how many functions to generate. The default makes a
+# script of a few megabytes.
+
+import random
+import sys
+
+functions = int(sys.argv[1]) if len(sys.argv) > 1 else 4000
+
+# Always the same script, so timings can be compared between builds
+random.seed(1)
+
+
+def number():
+  if random.random() < 0.5:
+    return str(random.randint(0, 100000))
+  return "%d.%d" % (random.randint(0, 1000), random.randint(0, 9999))
+
+
+def expression(names, depth=0):
+  if depth > 2 or random.random() < 0.3:
+    return random.choice(names) if random.random() < 0.5 else number()
+  op = random.choice(["+", "-", "*", "/", "<", ">", "=="])
+  return "(%s %s %s)" % (expression(names, depth + 1), op,
+                         expression(names, depth + 1))
+
+
+# A chunk holds at most 256 constants, and every function declared at the top
+# level would take up two of the script's. So the functions are declared inside
+# groups of a hundred, and the groups are what's global
+for i in range(functions):
+  if i % 100 == 0:
+    if i > 0:
+      print("}")
+      print()
+    print("fun group%d() {" % (i // 100))
+    print()
+
+  print("fun function%d(a, b) {" % i)
+  names = ["a", "b"]
+  for j in range(8):
+    name = "local%d" % j
+    print("  var %s = %s;" % (name, expression(names)))
+    names.append(name)
+
+  print("  for (var i = 0; i < %s; i = i + 1) {" % number())
+  print("    if (%s) {" % expression(names))
+  print("      local0 = local0 + %s;" % expression(names))
+  print("    } else {")
+  print("      print \"function%d: \" + \"%s\";" % (i, "x" * (i % 20)))
+  print("    }")
+  print("  }")
+
+  if i % 100 > 0:
+    print("  function%d(local1, %s);" % (i - 1, number()))
+  print("  return %s;" % expression(names))
+  print("}")
+  print()
+
+  if i % 10 == 0:
+    print("class Class%d {" % i)
+    print("  init(x) { this.x = x; }")
+    print("  get() { return this.x * %s; }" % number())
+    print("}")
+    print()
+
+if functions > 0:
+  print("}")
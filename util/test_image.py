@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Checks that clox refuses damaged heap images instead of running them:
+#
+#   python3 util/test_image.py build/cloxd
+#
+# Saves an image of a small script, makes sure it loads, then loads copies of
+# it with bytes flipped or cut off. Every damaged copy must be reported as
+# corrupt (exit code 74) and none may crash the interpreter.
+
+import os
+import subprocess
+import sys
+import tempfile
+
+SETUP = """
+class Base {
+  init(x) { this.x = x; }
+  get() { return this.x; }
+}
+class Derived < Base {
+  init(x) { super.init(x + 1); this.y = [x, "y"]; }
+  get() { return super.get() + this.y[0]; }
+}
+fun counter() {
+  var n = 0;
+  fun inc() { n = n + 1; return n; }
+  return inc;
+}
+var c = counter();
+c();
+var d = Derived(2);
+"""
+
+MAIN = """
+print c();
+print d.get();
+print d.y;
+"""
+
+EXPECTED = "2\n5\n[2, y]\n"
+
+# The magic number, version, fingerprint and checksum come first. Damage to
+# them is reported differently, so only the body is damaged here.
+HEADER_SIZE = 28
+
+clox = sys.argv[1]
+failures = 0
+
+
+def fail(message):
+  global failures
+  failures += 1
+  print("FAIL: " + message)
+
+
+def run(image_path, main_path):
+  return subprocess.run([clox, "--image", image_path, main_path],
+                        capture_output=True, text=True, timeout=10)
+
+
+with tempfile.TemporaryDirectory() as dir:
+  setup_path = os.path.join(dir, "setup.lox")
+  main_path = os.path.join(dir, "main.lox")
+  image_path = os.path.join(dir, "setup.img")
+  damaged_path = os.path.join(dir, "damaged.img")
+
+  with open(setup_path, "w") as file:
+    file.write(SETUP)
+  with open(main_path, "w") as file:
+    file.write(MAIN)
+
+  result = subprocess.run([clox, "--save-image", image_path, setup_path],
+                          capture_output=True, text=True)
+  if result.returncode != 0:
+    fail("could not save image: " + result.stderr)
+    sys.exit(1)
+
+  result = run(image_path, main_path)
+  if result.returncode != 0 or result.stdout != EXPECTED:
+    fail("image did not load: %r %r" % (result.stdout, result.stderr))
+
+  with open(image_path, "rb") as file:
+    image = file.read()
+
+  # Flip a bit in every byte of the body, then cut the body short at a spread
+  # of lengths.
+  damaged = []
+  for i in range(HEADER_SIZE, len(image)):
+    copy = bytearray(image)
+    copy[i] ^= 0x01
+    damaged.append(("flip byte %d" % i, bytes(copy)))
+  for length in range(HEADER_SIZE, len(image), max(1, len(image) // 16)):
+    damaged.append(("truncate to %d" % length, image[:length]))
+
+  for name, data in damaged:
+    with open(damaged_path, "wb") as file:
+      file.write(data)
+    result = run(damaged_path, main_path)
+    if result.returncode != 74 or "corrupt" not in result.stderr:
+      fail("%s: exit %d %r" % (name, result.returncode, result.stderr))
+
+  print("Checked %d damaged images." % len(damaged))
+
+if failures:
+  print("%d failed." % failures)
+  sys.exit(1)
+print("All passed.")